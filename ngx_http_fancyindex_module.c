@@ -21,6 +21,42 @@
 #include <ngx_http.h>
 #include <ngx_log.h>
 
+#include <fnmatch.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* FNM_CASEFOLD是GNU和BSD的扩展 */
+#ifndef FNM_CASEFOLD
+#define FNM_CASEFOLD  0
+#endif
+
+#if (NGX_HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
+#if (NGX_THREADS && NGX_LINUX)
+#include <sys/xattr.h>
+#endif
+
+#if (NGX_HAVE_IO_URING)
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+#if (NGX_HAVE_STRXFRM_L)
+#include <locale.h>
+#endif
+
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
+#if (NGX_HAVE_BROTLI_ENC)
+#include <brotli/encode.h>
+#endif
+
 #include "template.h"
 
 /* 编译器特定优化 */
@@ -30,6 +66,13 @@
 # define ngx_force_inline
 #endif /* __GNUC__ */
 
+/* 后台子请求从nginx 1.11.10开始支持 */
+#if defined(nginx_version) && (nginx_version >= 1011010)
+# define NGX_HTTP_FANCYINDEX_BACKGROUND  1
+#else
+# define NGX_HTTP_FANCYINDEX_BACKGROUND  0
+#endif
+
 
 /* 短格式星期几 */
 static const char *short_weekday[] = {
@@ -152,6 +195,80 @@ typedef struct {
     ngx_str_t local;   /* 本地页眉/页脚内容 */
 } ngx_fancyindex_headerfooter_conf_t;
 
+/*
+ * 页面模板：模板文件中以"<!-- var tNN -->"开始的各个片段。内置的模板由
+ * template.awk从template_zh.html生成，fancyindex_template在加载配置时读取。
+ */
+typedef struct {
+    ngx_str_t head1;           /* t01_head1 */
+    ngx_str_t head2;           /* t02_head2 */
+    ngx_str_t head3;           /* t03_head3 */
+    ngx_str_t body1;           /* t04_body1 */
+    ngx_str_t body2;           /* t05_body2 */
+    ngx_str_t list1;           /* t06_list1 */
+    ngx_str_t parentdir_entry; /* t_parentdir_entry */
+    ngx_str_t list2;           /* t07_list2 */
+    ngx_str_t render1;         /* t_render1 */
+    ngx_str_t render2;         /* t_render2 */
+    ngx_str_t foot1;           /* t08_foot1 */
+} ngx_http_fancyindex_template_t;
+
+static ngx_http_fancyindex_template_t  ngx_http_fancyindex_default_template = {
+    ngx_string(t01_head1),
+    ngx_string(t02_head2),
+    ngx_string(t03_head3),
+    ngx_string(t04_body1),
+    ngx_string(t05_body2),
+    ngx_string(t06_list1),
+    ngx_string(t_parentdir_entry),
+    ngx_string(t07_list2),
+    ngx_string(t_render1),
+    ngx_string(t_render2),
+    ngx_string(t08_foot1)
+};
+
+/* fancyindex_index定义的目录树索引 */
+typedef struct ngx_http_fancyindex_index_s  ngx_http_fancyindex_index_t;
+
+/*
+ * 行模板编译得到的程序：文本与占位符交替的指令序列。未设置
+ * fancyindex_row_template时编译内置的模板。合并配置时计算所有不依赖条目
+ * 的长度，生成列表时只需加上与文件名长度相关的部分。
+ */
+#define NGX_HTTP_FANCYINDEX_ROW_TEXT    0
+#define NGX_HTTP_FANCYINDEX_ROW_HREF    1   /* 转义的URL，目录带'/'和排序参数 */
+#define NGX_HTTP_FANCYINDEX_ROW_NAME    2   /* 转义的文件名，目录带'/' */
+#define NGX_HTTP_FANCYINDEX_ROW_SIZE    3
+#define NGX_HTTP_FANCYINDEX_ROW_MTIME   4
+#define NGX_HTTP_FANCYINDEX_ROW_TYPE    5
+#define NGX_HTTP_FANCYINDEX_ROW_SHA256  6
+/* 以下只用于内置的模板 */
+#define NGX_HTTP_FANCYINDEX_ROW_TITLE   7   /* 转义的文件名 */
+#define NGX_HTTP_FANCYINDEX_ROW_FILES   8   /* 目录的文件数，title属性 */
+
+typedef struct {
+    ngx_uint_t                    op;
+    ngx_str_t                     text;        /* NGX_HTTP_FANCYINDEX_ROW_TEXT */
+} ngx_http_fancyindex_row_op_t;
+
+/* fancyindex_row_template编译得到的程序 */
+typedef struct {
+    ngx_http_fancyindex_row_op_t *ops;
+    ngx_uint_t                    nops;
+    size_t                        len;         /* 每行固定的最大长度 */
+    ngx_uint_t                    nhref;       /* {href}出现的次数 */
+    ngx_uint_t                    nname;       /* {name}出现的次数 */
+    unsigned                      sha256:1;    /* 包含{sha256}，表格有该列 */
+} ngx_http_fancyindex_row_program_t;
+
+/* fancyindex_collation设置的排序规则 */
+typedef struct {
+    ngx_str_t  name;           /**< 区域设置的名称 */
+#if (NGX_HAVE_STRXFRM_L)
+    locale_t   locale;         /**< 只含LC_COLLATE的区域设置 */
+#endif
+} ngx_http_fancyindex_collation_t;
+
 /**
  * fancyindex模块的配置结构体。模块中定义的配置指令用于填充此结构体的成员。
  */
@@ -159,6 +276,7 @@ typedef struct {
     ngx_flag_t enable;         /**< 模块是否启用。 */
     ngx_uint_t default_sort;   /**< 默认排序标准。 */
     ngx_flag_t case_sensitive; /**< Case-sensitive name sorting */
+    ngx_http_fancyindex_collation_t *collation; /**< 名称的排序规则，无则为NULL */
     ngx_flag_t dirs_first;     /**< 排序时将目录分组在一起显示在前面 */
     ngx_flag_t localtime;      /**< 文件修改时间以本地时间显示 */
     ngx_flag_t exact_size;     /**< 文件大小始终以字节显示 */
@@ -166,12 +284,44 @@ typedef struct {
     ngx_flag_t show_path;      /**< 是否在标题后显示路径 + '</h1>' */
     ngx_flag_t hide_parent;    /**< 隐藏上级目录 */
     ngx_flag_t show_dot_files; /**< 显示以点开头的文件 */
+    ngx_flag_t server_timing;  /**< 输出Server-Timing响应头 */
 
     ngx_str_t  css_href;       /**< CSS样式表链接，无则为空 */
     ngx_str_t  time_format;    /**< 文件时间戳的格式 */
 
     ngx_array_t *ignore;       /**< 列表中要忽略的文件列表 */
 
+    ngx_shm_zone_t *cache_zone; /**< 目录列表缓存区，无则为NULL */
+    time_t     cache_valid;    /**< 缓存的目录列表的最长有效时间 */
+    time_t     cache_errors;   /**< 缓存打开目录失败的时间，0为不缓存 */
+    ngx_uint_t error_log_limit; /**< 每秒最多记录的打开目录错误，0为不限 */
+    ngx_flag_t scan_lock;      /**< 同一目录同时只由一个请求读取 */
+    ngx_msec_t scan_lock_timeout; /**< 等待其他请求读取目录的最长时间 */
+    ngx_uint_t max_scans;      /**< 同时读取目录的最多请求数，0为不限 */
+    ngx_uint_t scan_queue;     /**< 达到上限时最多排队等待的请求数 */
+    ngx_msec_t scan_queue_timeout; /**< 排队等待的最长时间 */
+    ngx_uint_t scan_slot;      /**< 共享内存中计数的位置 */
+    ngx_uint_t use_stale;      /**< 过期的列表在后台重新读取期间是否可用 */
+    ngx_uint_t precompress;    /**< 缓存的列表预先压缩的编码 */
+    ngx_uint_t slice;          /**< 每次事件循环最多处理的条目数，0为不限 */
+    ngx_uint_t max_entries;    /**< 列表中最多的条目数，0为不限 */
+    size_t     max_listing_memory; /**< 生成一个列表最多使用的内存，0为不限 */
+    ngx_http_fancyindex_index_t *index; /**< 目录树索引，无则为NULL */
+    ngx_uint_t download;       /**< "download"参数允许的归档格式 */
+    ngx_flag_t checksums;      /**< 显示文件的SHA-256 */
+    off_t      checksum_max_size; /**< 计算SHA-256的最大文件，0为不限 */
+    ngx_flag_t dir_sizes;      /**< 显示目录的递归大小 */
+    ngx_uint_t parallel_stat;  /**< 并行获取条目信息的任务数，0为不并行 */
+    ngx_uint_t stat_engine;    /**< 获取条目信息的方式 */
+    ngx_uint_t parallel_sort;  /**< 在线程池中排序的最少条目数，0为不并行 */
+    ngx_uint_t render;         /**< 在服务器还是浏览器中生成表格行 */
+    time_t     render_max_age; /**< 浏览器渲染时页面的缓存时间 */
+    ngx_str_t  render_attrs;   /**< 渲染脚本的data属性，合并配置时生成 */
+    ngx_str_t  render_etag;    /**< 浏览器渲染时页面的ETag */
+    ngx_str_t  row_template;   /**< 表格行的模板，空则为内置的格式 */
+    ngx_http_fancyindex_row_program_t *row_program; /**< 编译后的行模板 */
+    ngx_http_fancyindex_template_t *tpl; /**< 页面模板 */
+
     ngx_fancyindex_headerfooter_conf_t header;
     ngx_fancyindex_headerfooter_conf_t footer;
 } ngx_http_fancyindex_loc_conf_t;
@@ -188,6 +338,10 @@ typedef struct {
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC  4
 /* 按日期降序排序 */
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC  5
+/* 按版本号升序排序 */
+#define NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION    6
+/* 按版本号降序排序 */
+#define NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION_DESC  7
 
 /* 排序标准枚举配置 */
 static ngx_conf_enum_t ngx_http_fancyindex_sort_criteria[] = {
@@ -197,6 +351,52 @@ static ngx_conf_enum_t ngx_http_fancyindex_sort_criteria[] = {
     { ngx_string("name_desc"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC },
     { ngx_string("size_desc"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC },
     { ngx_string("date_desc"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC },
+    { ngx_string("version"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION },
+    { ngx_string("version_desc"),
+      NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION_DESC },
+    { ngx_null_string, 0 }
+};
+
+/* fancyindex_cache_use_stale的取值 */
+static ngx_conf_enum_t ngx_http_fancyindex_use_stale[] = {
+    { ngx_string("off"), 0 },
+    { ngx_string("updating"), 1 },
+    { ngx_null_string, 0 }
+};
+
+/* fancyindex_stat_engine的取值 */
+#define NGX_HTTP_FANCYINDEX_STAT_ENGINE_DEFAULT   0
+#define NGX_HTTP_FANCYINDEX_STAT_ENGINE_IO_URING  1
+
+static ngx_conf_enum_t ngx_http_fancyindex_stat_engines[] = {
+    { ngx_string("default"), NGX_HTTP_FANCYINDEX_STAT_ENGINE_DEFAULT },
+    { ngx_string("io_uring"), NGX_HTTP_FANCYINDEX_STAT_ENGINE_IO_URING },
+    { ngx_null_string, 0 }
+};
+
+/* fancyindex_render的取值 */
+#define NGX_HTTP_FANCYINDEX_RENDER_SERVER  0
+#define NGX_HTTP_FANCYINDEX_RENDER_CLIENT  1
+
+/* 预先压缩的编码 */
+#define NGX_HTTP_FANCYINDEX_PRECOMPRESS_OFF  0x0002
+#define NGX_HTTP_FANCYINDEX_GZIP             0x0004
+#define NGX_HTTP_FANCYINDEX_BROTLI           0x0008
+
+/*
+ * 压缩只在响应体第一次被请求时在线程池中进行一次，因此使用较高的压缩
+ * 级别。brotli的最高级别（10、11）对数MB的列表需要数秒，即使在线程池中
+ * 也会长时间占用线程。没有线程池时在worker进程中压缩，使用较低的级别。
+ */
+#define NGX_HTTP_FANCYINDEX_GZIP_LEVEL       9
+#define NGX_HTTP_FANCYINDEX_BROTLI_QUALITY   9
+#define NGX_HTTP_FANCYINDEX_GZIP_INLINE      6
+#define NGX_HTTP_FANCYINDEX_BROTLI_INLINE    5
+
+static ngx_conf_bitmask_t ngx_http_fancyindex_precompress_masks[] = {
+    { ngx_string("off"), NGX_HTTP_FANCYINDEX_PRECOMPRESS_OFF },
+    { ngx_string("gzip"), NGX_HTTP_FANCYINDEX_GZIP },
+    { ngx_string("brotli"), NGX_HTTP_FANCYINDEX_BROTLI },
     { ngx_null_string, 0 }
 };
 
@@ -231,6 +431,67 @@ headerfooter_kind(const ngx_str_t *value)
     return NGX_CONF_UNSET_UINT;
 }
 
+/* 读取配置中指定的文件的全部内容，内容以'\0'结尾 */
+static ngx_int_t
+ngx_http_fancyindex_read_file(ngx_conf_t *cf, ngx_str_t *name,
+        ngx_str_t *content)
+{
+    ssize_t          n;
+    ngx_file_t       file;
+    ngx_file_info_t  fi;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.log = cf->log;
+    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, 0, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "cannot open file \"%V\"", name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_close_file(file.fd);
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "cannot get info for file \"%V\"", name);
+        return NGX_ERROR;
+    }
+
+    content->len = ngx_file_size(&fi);
+    content->data = ngx_pcalloc(cf->pool, content->len + 1);
+    if (content->data == NULL) {
+        ngx_close_file(file.fd);
+        return NGX_ERROR;
+    }
+
+    n = content->len;
+    while (n > 0) {
+        ssize_t r = ngx_read_file(&file,
+                                  content->data + file.offset,
+                                  n,
+                                  file.offset);
+        if (r == NGX_ERROR) {
+            ngx_close_file(file.fd);
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               "cannot read file \"%V\"", name);
+            return NGX_ERROR;
+        }
+
+        /* 读取期间文件被截断 */
+        if (r == 0) {
+            content->len -= n;
+            break;
+        }
+
+        n -= r;
+    }
+
+    ngx_close_file(file.fd);
+
+    content->data[content->len] = '\0';
+    return NGX_OK;
+}
+
+
 /* 设置页眉/页脚配置 */
 static char*
 ngx_fancyindex_conf_set_headerfooter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
@@ -255,50 +516,11 @@ ngx_fancyindex_conf_set_headerfooter(ngx_conf_t *cf, ngx_command_t *cmd, void *c
         }
     }
 
-    if (kind == NGX_HTTP_FANCYINDEX_HEADERFOOTER_LOCAL) {
-        ngx_file_t file;
-        ngx_file_info_t fi;
-        ssize_t n;
-
-        ngx_memzero(&file, sizeof(ngx_file_t));
-        file.log = cf->log;
-        file.fd = ngx_open_file(item->path.data, NGX_FILE_RDONLY, 0, 0);
-        if (file.fd == NGX_INVALID_FILE) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
-                               "cannot open file \"%V\"", &values[1]);
-            return NGX_CONF_ERROR;
-        }
-
-        if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_close_file(file.fd);
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
-                               "cannot get info for file \"%V\"", &values[1]);
-            return NGX_CONF_ERROR;
-        }
-
-        item->local.len = ngx_file_size(&fi);
-        item->local.data = ngx_pcalloc(cf->pool, item->local.len + 1);
-        if (item->local.data == NULL) {
-            ngx_close_file(file.fd);
-            return NGX_CONF_ERROR;
-        }
-
-        n = item->local.len;
-        while (n > 0) {
-            ssize_t r = ngx_read_file(&file,
-                                      item->local.data + file.offset,
-                                      n,
-                                      file.offset);
-            if (r == NGX_ERROR) {
-                ngx_close_file(file.fd);
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
-                                   "cannot read file \"%V\"", &values[1]);
-                return NGX_CONF_ERROR;
-            }
-
-            n -= r;
-        }
-        item->local.data[item->local.len] = '\0';
+    if (kind == NGX_HTTP_FANCYINDEX_HEADERFOOTER_LOCAL
+        && ngx_http_fancyindex_read_file(cf, &values[1], &item->local)
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
     }
 
     return NGX_CONF_OK;
@@ -306,6 +528,31 @@ ngx_fancyindex_conf_set_headerfooter(ngx_conf_t *cf, ngx_command_t *cmd, void *c
 
 #define NGX_HTTP_FANCYINDEX_PREALLOCATE  50
 
+/* ngx_escape_json()从nginx 1.11.8开始提供 */
+#if defined(nginx_version) && (nginx_version >= 1011008)
+#define NGX_HTTP_FANCYINDEX_JSON  1
+#else
+#define NGX_HTTP_FANCYINDEX_JSON  0
+#endif
+
+/* 文件的SHA-256在线程池中计算，保存在扩展属性中 */
+#if (NGX_THREADS && NGX_LINUX)
+#define NGX_HTTP_FANCYINDEX_CHECKSUMS  1
+#else
+#define NGX_HTTP_FANCYINDEX_CHECKSUMS  0
+#endif
+
+/* 读完目录后再统一获取条目的信息，在线程池中或者通过io_uring */
+#if (NGX_THREADS || NGX_HAVE_IO_URING)
+#define NGX_HTTP_FANCYINDEX_STAT_BATCH  1
+#else
+#define NGX_HTTP_FANCYINDEX_STAT_BATCH  0
+#endif
+
+/* 列表被截断时在表格后显示的提示，参数为条目总数和列出的条目数 */
+#define NGX_HTTP_FANCYINDEX_TRUNCATED \
+    "<p class=\"truncated\">目录中共有 %ui 个条目，只列出了排序后的前 %ui 个。</p>" CRLF
+
 
 /**
  * 计算以NULL结尾的字符串长度。需要记住从sizeof结果中减去1，这有点麻烦。
@@ -335,6 +582,20 @@ ngx_fancyindex_conf_set_headerfooter(ngx_conf_t *cf, ngx_command_t *cmd, void *c
 #define ngx_has_flag(_where, _what) \
 	(((_where) & (_what)) == (_what))
 
+/**
+ * 当前时间（微秒）。ngx_current_msec只在事件循环中更新且精度为毫秒，
+ * 不适合测量单个请求内各阶段的耗时。
+ */
+static ngx_inline uint64_t
+ngx_fancyindex_usec(void)
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 
 
 
@@ -345,10 +606,559 @@ typedef struct {
     ngx_uint_t     escape;      /* URL转义字符数 */
     ngx_uint_t     escape_html; /* HTML转义字符数 */
     ngx_uint_t     dir;         /* 是否为目录 */
+    ngx_uint_t     invalid;     /* 文件名不是有效的UTF-8 */
     time_t         mtime;       /* 修改时间 */
     off_t          size;        /* 文件大小 */
+    ngx_str_t      key;         /* 排序键，只在排序的请求中有效 */
+    u_char        *sum;         /* SHA-256（32字节），未知时为NULL，只在
+                                   本请求中有效 */
 } ngx_http_fancyindex_entry_t;
 
+/* 目录条目的比较函数 */
+typedef int (*ngx_http_fancyindex_cmp_pt)(const void *one, const void *two);
+
+
+/* 列表生成各阶段的耗时（微秒），用于Server-Timing响应头 */
+typedef struct {
+    uint64_t       scan;        /* 读取目录（不含stat） */
+    uint64_t       stat;        /* 获取条目信息 */
+    uint64_t       sort;        /* 排序 */
+    uint64_t       render;      /* 生成HTML */
+} ngx_http_fancyindex_timing_t;
+
+
+/* 目录列表缓存的共享内存部分 */
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+    ngx_queue_t                   queue;       /* LRU队列，最近使用的在前 */
+    ngx_uint_t                    generation;  /* 每次加载配置时递增 */
+    ngx_rbtree_t                  sizes;       /* 目录的递归大小 */
+    ngx_rbtree_node_t             sizes_sentinel;
+    ngx_queue_t                   sizes_queue;
+    ngx_rbtree_t                  errors;      /* 不存在或无权访问的目录 */
+    ngx_rbtree_node_t             errors_sentinel;
+    ngx_queue_t                   errors_queue;
+    size_t                        errors_size; /* 这些节点占用的内存 */
+} ngx_http_fancyindex_cache_sh_t;
+
+
+/* 目录列表缓存，即fancyindex_cache_zone定义的共享内存区的数据 */
+typedef struct {
+    ngx_http_fancyindex_cache_sh_t *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_uint_t                      generation;
+    size_t                          errors_max; /* 错误节点最多占用的内存 */
+} ngx_http_fancyindex_cache_t;
+
+/* 错误节点最多占用缓存区的几分之一，不会挤掉缓存的列表 */
+#define NGX_HTTP_FANCYINDEX_ERRORS_SHARE  4
+
+
+/*
+ * 预先压缩的完整响应体。响应体还取决于URI（页眉中的标题）和排序参数，
+ * 因此以（URI，参数，编码）区分。压缩期间节点中是没有压缩数据的占位，
+ * 其他请求发送未压缩的响应体，不重复压缩。
+ */
+typedef struct ngx_http_fancyindex_cache_body_s
+    ngx_http_fancyindex_cache_body_t;
+
+struct ngx_http_fancyindex_cache_body_s {
+    ngx_http_fancyindex_cache_body_t *next;
+    ngx_uint_t                        encoding;
+    ngx_uint_t                        pending;     /* 正在压缩的占位 */
+    size_t                            uri_len;
+    size_t                            args_len;
+    size_t                            len;         /* 压缩后的长度 */
+    u_char                            data[1];     /* URI、参数、压缩数据 */
+};
+
+
+/*
+ * 与之前的列表相比被删除的条目。新的列表替换旧的列表时生成，并合并旧的
+ * 列表中仍未重新出现的条目，因此覆盖自since时的列表以来的所有删除。
+ */
+typedef struct {
+    time_t                        since;
+    ngx_uint_t                    nelts;
+    size_t                        len;
+    u_char                        names[1];    /* 以'\0'结尾的文件名 */
+} ngx_http_fancyindex_cache_tombstones_t;
+
+/* 合并旧的被删除条目时的数量上限，超过时只保留最近一次的删除 */
+#define NGX_HTTP_FANCYINDEX_TOMBSTONES  10000
+
+
+/* 缓存的排序顺序：按名称、大小、修改时间和版本号 */
+#define NGX_HTTP_FANCYINDEX_PERM_NAME   0
+#define NGX_HTTP_FANCYINDEX_PERM_SIZE   1
+#define NGX_HTTP_FANCYINDEX_PERM_MTIME  2
+#define NGX_HTTP_FANCYINDEX_PERM_VERSION    3
+#define NGX_HTTP_FANCYINDEX_PERMS       4
+
+/*
+ * 缓存节点。相同目录在不同location中的列表可能不同（忽略规则、点文件等），
+ * 因此节点以（路径，location配置）为键。
+ */
+typedef struct {
+    ngx_rbtree_node_t             node;        /* key为路径的CRC32 */
+    ngx_queue_t                   queue;
+    void                         *conf;        /* 所属location配置 */
+    ngx_uint_t                    generation;
+    time_t                        mtime;       /* 读取前目录的修改时间 */
+    time_t                        time;        /* 开始读取目录的时间 */
+    time_t                        expire;      /* 过期时间 */
+    time_t                        lock;        /* 读取锁的过期时间 */
+    ngx_uint_t                    count;       /* 正在使用该节点的请求数 */
+    ngx_uint_t                    nelts;
+    ngx_http_fancyindex_entry_t  *entries;     /* 按修改时间降序排列，
+                                                  文件名在同一块内存中 */
+    ngx_http_fancyindex_cache_body_t *bodies;  /* 预先压缩的响应体 */
+    ngx_http_fancyindex_cache_tombstones_t *tombstones;
+    uint32_t                     *perms[NGX_HTTP_FANCYINDEX_PERMS];
+                                               /* 各排序方式的顺序 */
+    unsigned                      perm_desc:NGX_HTTP_FANCYINDEX_PERMS;
+                                               /* 该顺序为降序 */
+    unsigned                      deleted:1;   /* 已失效，count为0时释放 */
+    unsigned                      updating:1;  /* 读取锁：某个请求正在读取 */
+    unsigned                      pending:1;   /* 只有读取锁，还没有列表 */
+    unsigned                      utf8:1;
+    size_t                        len;
+    u_char                        path[1];
+} ngx_http_fancyindex_cache_node_t;
+
+
+/*
+ * 目录的递归大小（fancyindex_dir_sizes）。与列表不同，节点只以路径为键：
+ * 统计包括目录树中的所有文件，不受location的过滤规则影响，也不跟随符号
+ * 链接。节点有自己的LRU队列，空间不足时先于列表被淘汰。
+ */
+typedef struct {
+    ngx_str_node_t                sn;
+    ngx_queue_t                   queue;
+    time_t                        mtime;       /* 统计时目录的修改时间 */
+    time_t                        expire;      /* 过期时间 */
+    time_t                        lock;        /* 统计任务的过期时间 */
+    off_t                         bytes;
+    uint64_t                      files;
+    unsigned                      known:1;     /* 已统计过至少一次 */
+    u_char                        path[1];
+} ngx_http_fancyindex_cache_size_t;
+
+
+/*
+ * 打开失败的目录（fancyindex_cache_errors）。目录不存在或无权访问与
+ * location无关，节点只以路径为键。
+ */
+typedef struct {
+    ngx_str_node_t                sn;
+    ngx_queue_t                   queue;
+    time_t                        expire;      /* 过期时间 */
+    ngx_uint_t                    status;      /* 404或403 */
+    size_t                        size;        /* 节点的大小 */
+    u_char                        path[1];
+} ngx_http_fancyindex_cache_error_t;
+
+
+/*
+ * fancyindex_max_concurrent_scans的计数，每条该指令一组，在它所在的配置及
+ * 继承它的location中共用。
+ */
+typedef struct {
+    ngx_atomic_t                  scans;       /* 正在读取的目录数 */
+    ngx_atomic_t                  queued;      /* 排队等待的请求数 */
+} ngx_http_fancyindex_scans_slot_t;
+
+#define NGX_HTTP_FANCYINDEX_SCAN_SLOTS  512
+
+/*
+ * 计数所在的共享内存区。重新加载配置时计数清零并递增generation，旧的
+ * 工作进程不再修改计数。
+ */
+typedef struct {
+    ngx_atomic_t                  generation;
+    ngx_http_fancyindex_scans_slot_t  slots[NGX_HTTP_FANCYINDEX_SCAN_SLOTS];
+} ngx_http_fancyindex_scans_sh_t;
+
+
+/* 请求结束时释放对缓存节点的引用 */
+typedef struct {
+    ngx_http_fancyindex_cache_t      *cache;
+    ngx_http_fancyindex_cache_node_t *node;
+    ngx_uint_t                        lock;    /* 该引用同时持有读取锁 */
+} ngx_http_fancyindex_cache_cleanup_t;
+
+
+/* 请求参数中过滤条目的条件 */
+typedef struct {
+    time_t                               since;      /* "since"参数 */
+    ngx_str_t                            query;      /* "q"参数，已解码并
+                                                        转为小写 */
+    ngx_uint_t                           recent;     /* "recent"参数 */
+    size_t                               prefix;     /* 通配符之前的长度 */
+    unsigned                             delta:1;    /* 有"since"参数 */
+    unsigned                             glob:1;     /* "q"参数包含通配符 */
+    unsigned                             exact:1;    /* 不含字母，大小写
+                                                        无关 */
+    unsigned                             search:1;   /* query来自"search"参数 */
+} ngx_http_fancyindex_filter_t;
+
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+/* 读完目录后统一获取信息的条目 */
+typedef struct ngx_http_fancyindex_stat_batch_s
+    ngx_http_fancyindex_stat_batch_t;
+#endif
+
+/* 分多次读取目录时保存的状态 */
+typedef struct {
+    ngx_dir_t                            dir;
+    u_char                              *filename;   /* 条目的完整路径 */
+    u_char                              *last;       /* filename中条目名称的位置 */
+    size_t                               allocated;  /* filename缓冲区的大小 */
+    ngx_uint_t                           utf8;
+    ngx_uint_t                           total;      /* 目录中要列出的条目数 */
+    time_t                               start;      /* 开始读取的时间 */
+    ngx_http_fancyindex_filter_t        *filter;     /* 读取时过滤，无则为NULL */
+
+    /* 设置了条目数或内存上限时按排序结果截断列表 */
+    ngx_http_fancyindex_cmp_pt           cmp;
+    size_t                               memory;     /* 已使用的内存 */
+    ngx_uint_t                           dirs_first;
+    u_char                              *key;        /* 新条目的排序键 */
+    size_t                               key_size;
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+    /*
+     * 设置了fancyindex_parallel_stat或者fancyindex_stat_engine io_uring时，
+     * 读完目录后再统一获取条目的信息
+     */
+    ngx_uint_t                           parallel;   /* 线程池任务数 */
+    ngx_uint_t                           uring;      /* 使用io_uring */
+    ngx_http_fancyindex_stat_batch_t    *batch;
+    ngx_event_t                         *wake;       /* 获取完成后投递 */
+    uint64_t                            *stat_time;  /* Server-Timing */
+#endif
+
+    unsigned                             opened:1;
+    unsigned                             truncated:1;
+    unsigned                             waiting:1;  /* 等待线程池 */
+} ngx_http_fancyindex_scan_t;
+
+
+/* 生成列表的阶段 */
+#define NGX_HTTP_FANCYINDEX_STATE_START   0
+#define NGX_HTTP_FANCYINDEX_STATE_SCAN    1
+#define NGX_HTTP_FANCYINDEX_STATE_SORT    2
+#define NGX_HTTP_FANCYINDEX_STATE_RENDER  3
+
+
+/* 深度优先读取目录树时的一层 */
+typedef struct {
+    ngx_dir_t                       dir;
+    size_t                          len;       /* 目录在路径中的长度 */
+} ngx_http_fancyindex_level_t;
+
+
+/* 归档格式，"download"参数 */
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR  1
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_ZIP  2
+
+/* fancyindex_download的取值 */
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_OFF  0x0002
+#define ngx_http_fancyindex_download_mask(format)  (0x0002 << (format))
+
+static ngx_conf_bitmask_t ngx_http_fancyindex_download_masks[] = {
+    { ngx_string("off"), NGX_HTTP_FANCYINDEX_DOWNLOAD_OFF },
+    { ngx_string("tar"),
+      ngx_http_fancyindex_download_mask(NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR) },
+    { ngx_string("zip"),
+      ngx_http_fancyindex_download_mask(NGX_HTTP_FANCYINDEX_DOWNLOAD_ZIP) },
+    { ngx_null_string, 0 }
+};
+
+/*
+ * 每次事件最多生成的条目数和同时发送中的文件数，以及zip在线程池中每次
+ * 最多读取的块数。这些限制使内存和文件描述符的使用与目录树的大小无关。
+ */
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_ENTRIES  64
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_FILES    16
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_CHUNKS   16
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_BUFFER   65536
+
+/* 目录树的最大深度，更深的目录只包含目录本身 */
+#define NGX_HTTP_FANCYINDEX_DOWNLOAD_DEPTH    64
+
+/* tar的填充和结尾 */
+static u_char  ngx_http_fancyindex_zeros[1024];
+
+
+/* 归档中的一个条目。头部、文件内容和填充全部发送后重用。 */
+typedef struct ngx_http_fancyindex_download_slot_s
+    ngx_http_fancyindex_download_slot_t;
+
+struct ngx_http_fancyindex_download_slot_s {
+    ngx_http_fancyindex_download_slot_t *next;
+    ngx_buf_t                       hdr;
+    ngx_buf_t                       data;      /* 文件内容，in_file */
+    ngx_buf_t                       pad;
+    ngx_file_t                      file;
+    ngx_chain_t                     cl[3];
+    ngx_file_info_t                 info;
+    u_char                         *mem;       /* 文件的路径和头部 */
+    size_t                          size;
+    uint32_t                        crc;
+};
+
+
+/* 正在生成的归档 */
+typedef struct {
+    ngx_uint_t                      format;
+    ngx_array_t                     levels;    /* 打开的目录 */
+    u_char                         *path;      /* 当前条目的完整路径 */
+    size_t                          allocated;
+    size_t                          prefix;    /* 归档中的名称在path中的位置 */
+    off_t                           offset;    /* 已生成的归档长度 */
+    ngx_uint_t                      nopen;     /* 发送中的文件数 */
+
+    ngx_http_fancyindex_download_slot_t  *busy;
+    ngx_http_fancyindex_download_slot_t **last_busy;
+    ngx_http_fancyindex_download_slot_t  *free;
+
+    /* zip：正在读取的文件，大小和CRC-32写在内容之后的数据描述符中 */
+    ngx_http_fancyindex_download_slot_t  *stream;
+    off_t                           stream_offset; /* 已读取的长度 */
+    off_t                           stream_local;  /* 本地文件头的偏移 */
+
+    /* zip：在线程池中读取的块，读取期间请求的r->aio为1 */
+#if (NGX_THREADS)
+    ngx_thread_task_t              *task;
+#endif
+    ngx_http_fancyindex_download_slot_t  *chunk[NGX_HTTP_FANCYINDEX_DOWNLOAD_CHUNKS];
+    ngx_uint_t                      nchunks;
+    ngx_uint_t                      nread;     /* 已读取的块数 */
+    ngx_err_t                       read_err;
+
+    /* zip：中央目录，超过缓冲区时写入临时文件 */
+    ngx_buf_t                      *cd;
+    ngx_file_t                      cd_file;
+    off_t                           cd_size;
+    uint64_t                        entries;
+
+    ngx_file_info_t                 info;      /* 下载的目录 */
+    unsigned                        started:1;
+    unsigned                        done:1;
+    unsigned                        reading:1; /* 已在线程池中读取 */
+    unsigned                        stream_eof:1; /* 文件已读完 */
+} ngx_http_fancyindex_download_t;
+
+
+
+/* 请求上下文 */
+typedef struct {
+    ngx_http_fancyindex_timing_t         timing;
+    ngx_http_fancyindex_cache_cleanup_t *cache_cln;  /* 对缓存节点的引用 */
+    ngx_event_t                          wait;       /* 等待读取锁 */
+    ngx_msec_t                           wait_start;
+    ngx_http_fancyindex_loc_conf_t      *refresh;    /* 后台重新读取 */
+    ngx_uint_t                           encoding;   /* 发送的压缩编码 */
+    ngx_http_fancyindex_cache_body_t    *body;       /* 缓存的压缩响应体 */
+
+    /* 分片生成列表时在两次调用之间保存的状态 */
+    ngx_uint_t                           state;
+    ngx_str_t                            path;
+    size_t                               allocated;
+    time_t                               mtime;
+    ngx_array_t                          entries;
+    ngx_http_fancyindex_scan_t           scan;
+    ngx_buf_t                           *b;
+    ngx_uint_t                           row;        /* 下一个要生成的行 */
+    const char                          *sort_url_args;
+
+    ngx_http_fancyindex_filter_t         filter;
+    time_t                               time;       /* 列表的读取时间 */
+    ngx_http_fancyindex_cache_tombstones_t *tombstones;
+    ngx_http_fancyindex_download_t      *archive;    /* "download" */
+    u_char                              *filename;   /* 条目的完整路径 */
+    size_t                               filename_size;
+    ngx_uint_t                           hashing;    /* SHA-256计算中的文件数 */
+    ngx_http_fancyindex_scans_sh_t      *scans_sh;   /* 读取目录的计数 */
+    ngx_http_fancyindex_scans_slot_t    *scans_slot;
+    ngx_atomic_uint_t                    scans_gen;
+    ngx_msec_t                           queue_start;
+
+    unsigned                             waiting:1;
+    unsigned                             scanning:1; /* 占用一个读取名额 */
+    unsigned                             queued:1;   /* 排队等待读取名额 */
+    unsigned                             vary:1;
+    unsigned                             yield:1;    /* 让出事件循环后继续 */
+    unsigned                             json:1;     /* "format=json" */
+    unsigned                             deleted:1;  /* 已知被删除的条目 */
+    unsigned                             recent:1;   /* 条目来自索引中的最近
+                                                        文件，已按时间排序 */
+    unsigned                             download:2; /* "download"，归档格式 */
+    unsigned                             sha256sum:1; /* "format=sha256sum" */
+    unsigned                             sorting:1;  /* 等待线程池中的排序 */
+    unsigned                             summing:1;  /* 等待读取SHA-256 */
+    unsigned                             sorted:1;   /* 条目已经排序 */
+} ngx_http_fancyindex_ctx_t;
+
+/* 等待其他请求读取同一目录时的轮询间隔（毫秒） */
+#define NGX_HTTP_FANCYINDEX_LOCK_WAIT  50
+
+
+#if (NGX_HAVE_INOTIFY)
+
+/*
+ * 每个worker进程监视它读取过的目录。目录中有任何变化时，所有缓存区中该目录
+ * 的节点都会失效，因此缓存命中时不需要任何系统调用。
+ */
+typedef struct {
+    ngx_rbtree_node_t             node;        /* key为inotify watch描述符 */
+    ngx_str_node_t                sn;          /* key为路径的CRC32 */
+    ngx_queue_t                   queue;
+} ngx_http_fancyindex_watch_t;
+
+#define NGX_HTTP_FANCYINDEX_MAX_WATCHES  8192
+
+#define NGX_HTTP_FANCYINDEX_WATCH_MASK \
+    (IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO \
+     |IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+static ngx_connection_t   *ngx_http_fancyindex_inotify;
+static ngx_rbtree_t        ngx_http_fancyindex_watch_wds;
+static ngx_rbtree_node_t   ngx_http_fancyindex_watch_wds_sentinel;
+static ngx_rbtree_t        ngx_http_fancyindex_watch_paths;
+static ngx_rbtree_node_t   ngx_http_fancyindex_watch_paths_sentinel;
+static ngx_queue_t         ngx_http_fancyindex_watch_queue;
+static ngx_uint_t          ngx_http_fancyindex_nwatches;
+
+#endif /* NGX_HAVE_INOTIFY */
+
+
+/* 模块的主配置 */
+typedef struct {
+    ngx_array_t                   indexes;     /* ngx_http_fancyindex_index_t * */
+#if (NGX_THREADS)
+    ngx_thread_pool_t            *thread_pool; /* 计算SHA-256、目录大小和
+                                                  压缩缓存的响应体 */
+#endif
+    ngx_flag_t                    uring;       /* 有location使用io_uring */
+    ngx_shm_zone_t               *scans_zone;  /* 读取目录的计数 */
+    ngx_uint_t                    nscans;      /* 已分配的计数组数 */
+} ngx_http_fancyindex_main_conf_t;
+
+
+#if (NGX_THREADS)
+
+/*
+ * fancyindex_index的索引文件。记录按相对于根目录的路径排序，比较时'/'小于
+ * 其他任何字节，因此一个目录的子树是紧随其后的连续记录。根目录本身是第一个
+ * 记录，路径为空。数值以本机字节序保存，索引文件不能在不同架构之间共享。
+ *
+ *    头部 | 记录 | 最近文件（uint32_t记录下标）| 路径字符串
+ */
+#define NGX_HTTP_FANCYINDEX_INDEX_MAGIC  0x31584946  /* "FIX1" */
+
+typedef struct {
+    uint32_t                      magic;
+    uint32_t                      top;         /* 每个目录保存的最近文件数 */
+    uint64_t                      nrecords;
+    uint64_t                      recent;      /* 最近文件数组的偏移 */
+    uint64_t                      strings;     /* 路径字符串的偏移 */
+    uint64_t                      size;        /* 文件大小，用于发现不完整的文件 */
+    int64_t                       time;        /* 开始建立索引的时间 */
+} ngx_http_fancyindex_index_header_t;
+
+#define NGX_HTTP_FANCYINDEX_INDEX_DIR   1
+#define NGX_HTTP_FANCYINDEX_INDEX_LINK  2
+
+typedef struct {
+    uint64_t                      path;        /* 在路径字符串中的偏移 */
+    uint32_t                      len;
+    uint32_t                      flags;
+    int64_t                       size;
+    int64_t                       mtime;
+    uint64_t                      end;         /* 目录：子树之后的第一个记录 */
+    uint64_t                      recent;      /* 目录：子树中最近修改的文件，
+                                                  按修改时间降序排列 */
+    uint64_t                      nrecent;
+} ngx_http_fancyindex_index_record_t;
+
+
+/*
+ * 目录树索引。相同索引文件的所有location共用一个对象，第一个worker进程
+ * 在线程池中遍历目录树并写入索引文件，所有worker进程映射该文件。之后
+ * 只重新读取inotify报告有变化的目录，与原有的索引合并后写入新的文件。
+ */
+struct ngx_http_fancyindex_index_s {
+    ngx_str_t                     root;        /* 不以'/'结尾，"/"为空串 */
+    ngx_str_t                     file;
+    ngx_msec_t                    interval;    /* 两次完整重建之间的最短间隔 */
+    ngx_uint_t                    top;
+    ngx_thread_pool_t            *thread_pool;
+
+    /* 以下为每个worker进程的状态 */
+    u_char                       *map;
+    size_t                        size;
+    ngx_file_uniq_t               uniq;
+    time_t                        mtime;
+
+    ngx_event_t                   timer;       /* 下一次更新 */
+    ngx_thread_task_t            *task;
+    ngx_connection_t             *inotify;
+    ngx_array_t                   changed;     /* 有变化的目录的监视描述符 */
+    ngx_rbtree_t                  watches;     /* 只在线程中使用 */
+    ngx_rbtree_node_t             watches_sentinel;
+    ngx_msec_t                    built;       /* 上一次完整重建完成的时间 */
+    unsigned                      building:1;
+    unsigned                      dirty:1;     /* 更新期间目录树发生了变化 */
+    unsigned                      full:1;      /* 需要完整重建 */
+};
+
+
+/* 索引中被监视的目录，key为inotify的监视描述符 */
+typedef struct {
+    ngx_rbtree_node_t             node;
+    ngx_str_t                     path;        /* 相对于根目录的路径 */
+} ngx_http_fancyindex_index_watch_t;
+
+
+/* 在线程中更新索引时使用的参数和结果 */
+typedef struct {
+    ngx_http_fancyindex_index_t  *index;
+    ngx_fd_t                      inotify;     /* 添加监视的描述符，无则为-1 */
+    ngx_array_t                   changed;     /* 与index->changed交换 */
+    ngx_uint_t                    nrecords;
+    ngx_uint_t                    rescanned;   /* 重新读取的目录数 */
+    ngx_int_t                     rc;
+    unsigned                      full:1;
+    unsigned                      unwatched:1; /* 有的目录无法监视 */
+} ngx_http_fancyindex_index_task_t;
+
+
+/* 重建时内存中的记录 */
+typedef struct {
+    u_char                       *path;
+    size_t                        len;
+    ngx_uint_t                    flags;
+    off_t                         size;
+    time_t                        mtime;
+    ngx_uint_t                    end;
+    ngx_uint_t                    recent;
+    ngx_uint_t                    nrecent;
+} ngx_http_fancyindex_index_entry_t;
+
+
+/* 目录树变化后至少等待的时间（毫秒），合并短时间内的多次变化 */
+#define NGX_HTTP_FANCYINDEX_INDEX_DELAY  1000
+
+/* 一次更新最多重新读取的目录数，更多时完整重建 */
+#define NGX_HTTP_FANCYINDEX_INDEX_CHANGES  4096
+
+#endif /* NGX_THREADS */
+
 
 
 /* 按名称降序比较目录条目 */
@@ -373,6 +1183,18 @@ static int ngx_libc_cdecl
 /* 按修改时间升序比较目录条目 */
 static int ngx_libc_cdecl
     ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two);
+/* 按版本号升序比较目录条目 */
+static int ngx_libc_cdecl
+    ngx_http_fancyindex_cmp_entries_version_asc(const void *one, const void *two);
+/* 按版本号降序比较目录条目 */
+static int ngx_libc_cdecl
+    ngx_http_fancyindex_cmp_entries_version_desc(const void *one, const void *two);
+/* 按fancyindex_collation的排序规则升序比较名称 */
+static int ngx_libc_cdecl
+    ngx_http_fancyindex_cmp_entries_collate_asc(const void *one, const void *two);
+/* 按fancyindex_collation的排序规则降序比较名称 */
+static int ngx_libc_cdecl
+    ngx_http_fancyindex_cmp_entries_collate_desc(const void *one, const void *two);
 
 /* 处理目录索引错误 */
 static ngx_int_t ngx_http_fancyindex_error(ngx_http_request_t *r,
@@ -388,6 +1210,15 @@ static void *ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
 
+/* 生成并发送目录列表 */
+static ngx_int_t ngx_http_fancyindex_send(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx);
+
+/* 在后台重新读取过期的目录列表 */
+static ngx_int_t ngx_http_fancyindex_cache_refresh(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_http_fancyindex_cache_node_t *cn);
+
 /* 设置忽略文件配置 */
 static char *ngx_http_fancyindex_ignore(ngx_conf_t    *cf,
                                         ngx_command_t *cmd,
@@ -397,13 +1228,79 @@ static char *ngx_http_fancyindex_ignore(ngx_conf_t    *cf,
 static uintptr_t
     ngx_fancyindex_escape_filename(u_char *dst, u_char*src, size_t size);
 
+/* 定义目录列表缓存区 */
+static char *ngx_http_fancyindex_cache_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 设置location使用的目录列表缓存区 */
+static char *ngx_http_fancyindex_cache(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 初始化目录列表缓存区 */
+static ngx_int_t ngx_http_fancyindex_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+/* 设置location使用的目录树索引 */
+static char *ngx_http_fancyindex_index(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 限制同时读取目录的请求数 */
+static char *ngx_http_fancyindex_max_scans(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 初始化读取目录的计数 */
+static ngx_int_t ngx_http_fancyindex_scans_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+/* 设置"download"参数允许的归档格式 */
+static char *ngx_http_fancyindex_download_formats(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 启用SHA-256列 */
+static char *ngx_http_fancyindex_checksums(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 启用目录的递归大小 */
+static char *ngx_http_fancyindex_dir_sizes(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 设置数值，不为0时需要线程池 */
+static char *ngx_http_fancyindex_thread_num(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 设置获取条目信息的方式 */
+static char *ngx_http_fancyindex_stat_engine(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 设置在服务器还是浏览器中生成表格行 */
+static char *ngx_http_fancyindex_render(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_fancyindex_render_init(ngx_conf_t *cf,
+    ngx_http_fancyindex_loc_conf_t *conf);
+
+/* 设置location使用的页面模板 */
+static char *ngx_http_fancyindex_template(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 设置名称的排序规则 */
+static char *ngx_http_fancyindex_collation(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+/* 创建主配置 */
+static void *ngx_http_fancyindex_create_main_conf(ngx_conf_t *cf);
+
+/* worker进程初始化与退出 */
+static ngx_int_t ngx_http_fancyindex_init_process(ngx_cycle_t *cycle);
+static void ngx_http_fancyindex_exit_process(ngx_cycle_t *cycle);
+
 /*
  * 这些函数每个处理器调用只使用一次。我们可以告诉GCC尽可能始终内联它们
  * （请参阅上面ngx_force_inline的定义）。
  */
 /* 创建页眉缓冲区 */
 static ngx_inline ngx_buf_t*
-    make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
+    make_header_buf(ngx_http_request_t *r, ngx_http_fancyindex_template_t *tpl,
+                    const ngx_str_t css_href)
     ngx_force_inline;
 
 
@@ -509,9 +1406,191 @@ static ngx_command_t  ngx_http_fancyindex_commands[] = {
       offsetof(ngx_http_fancyindex_loc_conf_t, hide_parent),
       NULL },
 
-    { ngx_string("fancyindex_time_format"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-      ngx_conf_set_str_slot,
+    { ngx_string("fancyindex_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_valid),
+      NULL },
+
+    { ngx_string("fancyindex_max_concurrent_scans"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_fancyindex_max_scans,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache_errors"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_errors),
+      NULL },
+
+    { ngx_string("fancyindex_error_log_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, error_log_limit),
+      NULL },
+
+    { ngx_string("fancyindex_cache_use_stale"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, use_stale),
+      &ngx_http_fancyindex_use_stale },
+
+    { ngx_string("fancyindex_cache_precompress"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, precompress),
+      &ngx_http_fancyindex_precompress_masks },
+
+    { ngx_string("fancyindex_scan_lock"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, scan_lock),
+      NULL },
+
+    { ngx_string("fancyindex_scan_lock_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, scan_lock_timeout),
+      NULL },
+
+    { ngx_string("fancyindex_slice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, slice),
+      NULL },
+
+    { ngx_string("fancyindex_max_entries"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, max_entries),
+      NULL },
+
+    { ngx_string("fancyindex_max_listing_memory"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, max_listing_memory),
+      NULL },
+
+    { ngx_string("fancyindex_index"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1234,
+      ngx_http_fancyindex_index,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_download"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_fancyindex_download_formats,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, download),
+      &ngx_http_fancyindex_download_masks },
+
+    { ngx_string("fancyindex_checksums"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_http_fancyindex_checksums,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, checksums),
+      NULL },
+
+    { ngx_string("fancyindex_checksum_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, checksum_max_size),
+      NULL },
+
+    { ngx_string("fancyindex_dir_sizes"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_http_fancyindex_dir_sizes,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, dir_sizes),
+      NULL },
+
+    { ngx_string("fancyindex_parallel_stat"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_thread_num,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, parallel_stat),
+      NULL },
+
+    { ngx_string("fancyindex_parallel_sort"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_thread_num,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, parallel_sort),
+      NULL },
+
+    { ngx_string("fancyindex_collation"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_collation,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_stat_engine"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_stat_engine,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, stat_engine),
+      &ngx_http_fancyindex_stat_engines },
+
+    { ngx_string("fancyindex_row_template"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, row_template),
+      NULL },
+
+    { ngx_string("fancyindex_template"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_template,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_render"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_render,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_server_timing"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, server_timing),
+      NULL },
+
+    { ngx_string("fancyindex_time_format"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_str_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_fancyindex_loc_conf_t, time_format),
       NULL },
@@ -524,7 +1603,7 @@ static ngx_http_module_t  ngx_http_fancyindex_module_ctx = {
     NULL,                                  /* preconfiguration */
     ngx_http_fancyindex_init,              /* 配置后初始化 */
 
-    NULL,                                  /* 创建主配置 */
+    ngx_http_fancyindex_create_main_conf,  /* 创建主配置 */
     NULL,                                  /* 初始化主配置 */
 
     NULL,                                  /* 创建服务器配置 */
@@ -542,10 +1621,10 @@ ngx_module_t  ngx_http_fancyindex_module = {
     NGX_HTTP_MODULE,                       /* 模块类型 */
     NULL,                                  /* 初始化master进程 */
     NULL,                                  /* 初始化模块 */
-    NULL,                                  /* 初始化进程 */
+    ngx_http_fancyindex_init_process,      /* 初始化进程 */
     NULL,                                  /* 初始化线程 */
     NULL,                                  /* 退出线程 */
-    NULL,                                  /* 退出进程 */
+    ngx_http_fancyindex_exit_process,      /* 退出进程 */
     NULL,                                  /* 退出master进程 */
     NGX_MODULE_V1_PADDING
 };
@@ -654,14 +1733,15 @@ ngx_fancyindex_escape_filename(u_char *dst, u_char *src, size_t size)
 
 /* 创建HTTP响应的头部缓冲区 */
 static ngx_inline ngx_buf_t*
-make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
+make_header_buf(ngx_http_request_t *r, ngx_http_fancyindex_template_t *tpl,
+        const ngx_str_t css_href)
 {
     ngx_buf_t *b;
     size_t blen = r->uri.len
-        + ngx_sizeof_ssz(t01_head1)
-        + ngx_sizeof_ssz(t02_head2)
-        + ngx_sizeof_ssz(t03_head3)
-        + ngx_sizeof_ssz(t04_body1)
+        + tpl->head1.len
+        + tpl->head2.len
+        + tpl->head3.len
+        + tpl->body1.len
         ;
 
     if (css_href.len) {
@@ -674,7 +1754,7 @@ make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
     if ((b = ngx_create_temp_buf(r->pool, blen)) == NULL)
         return NULL;
 
-    b->last = ngx_cpymem_ssz(b->last, t01_head1);
+    b->last = ngx_cpymem_str(b->last, tpl->head1);
 
     if (css_href.len) {
         b->last = ngx_cpymem_str(b->last, css_href_pre);
@@ -682,989 +1762,12129 @@ make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
         b->last = ngx_cpymem_str(b->last, css_href_post);
     }
 
-    b->last = ngx_cpymem_ssz(b->last, t02_head2);
+    b->last = ngx_cpymem_str(b->last, tpl->head2);
     b->last = ngx_cpymem_str(b->last, r->uri);
-    b->last = ngx_cpymem_ssz(b->last, t03_head3);
-    b->last = ngx_cpymem_ssz(b->last, t04_body1);
+    b->last = ngx_cpymem_str(b->last, tpl->head3);
+    b->last = ngx_cpymem_str(b->last, tpl->body1);
 
     return b;
 }
 
 
-/* 创建HTTP响应的内容缓冲区 */
-static ngx_inline ngx_int_t
-make_content_buf(
-        ngx_http_request_t *r, ngx_buf_t **pb,
-        ngx_http_fancyindex_loc_conf_t *alcf)
+/* 响应的字符集是否为UTF-8，决定文件名的显示宽度如何计算 */
+static ngx_inline ngx_uint_t
+ngx_http_fancyindex_is_utf8(ngx_http_request_t *r)
 {
-    ngx_http_fancyindex_entry_t *entry;
+    return r->headers_out.charset.len == 5
+        && ngx_strncasecmp(r->headers_out.charset.data,
+                           (u_char *) "utf-8", 5) == 0;
+}
 
-    int (*sort_cmp_func)(const void *, const void *);
-    const char  *sort_url_args = "";
 
-    off_t        length;
-    size_t       len, root, allocated, escape_html;
-    int64_t      multiplier;
-    u_char      *filename, *last;
-    ngx_tm_t     tm;
-    ngx_array_t  entries;
-    ngx_time_t  *tp;
-    ngx_uint_t   i, j;
-    ngx_str_t    path;
-    ngx_dir_t    dir;
-    ngx_buf_t   *b;
+/* 比较缓存键：先比较location配置，再比较路径 */
+static ngx_inline ngx_int_t
+ngx_http_fancyindex_cache_cmp(void *conf, u_char *path, size_t len,
+        ngx_http_fancyindex_cache_node_t *cn)
+{
+    if (conf != cn->conf)
+        return ((uintptr_t) conf < (uintptr_t) cn->conf) ? -1 : 1;
 
-    static const char    *sizes[]  = { "EiB", "PiB", "TiB", "GiB", "MiB", "KiB", "B" };
-    static const int64_t  exbibyte = 1024LL * 1024LL * 1024LL *
-                                     1024LL * 1024LL * 1024LL;
+    return ngx_memn2cmp(path, cn->path, len, cn->len);
+}
 
-    /*
-     * NGX_DIR_MASK_LEN 小于 NGX_HTTP_FANCYINDEX_PREALLOCATE
-     */
-    if ((last = ngx_http_map_uri_to_path(r, &path, &root,
-                    NGX_HTTP_FANCYINDEX_PREALLOCATE)) == NULL)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-    allocated = path.len;
-    path.len = last - path.data;
-	 if (path.len > 1) {
-        path.len--;
-    }
-    path.data[path.len] = '\0';
+static void
+ngx_http_fancyindex_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+        ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                **p;
+    ngx_http_fancyindex_cache_node_t  *cn;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http fancyindex: \"%s\"", path.data);
-
-    if (ngx_open_dir(&path, &dir) == NGX_ERROR) {
-        ngx_int_t rc, err = ngx_errno;
-        ngx_uint_t level;
-
-        /* 处理不同类型的目录打开错误 */
-        if (err == NGX_ENOENT || err == NGX_ENOTDIR || err == NGX_ENAMETOOLONG) {
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_NOT_FOUND;  /* 文件不存在或不是目录或名称太长 */
-        } else if (err == NGX_EACCES) {
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_FORBIDDEN;  /* 权限不足 */
+    cn = (ngx_http_fancyindex_cache_node_t *) node;
+
+    for ( ;; ) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
         } else {
-            level = NGX_LOG_CRIT;
-            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;  /* 其他内部错误 */
+            p = (ngx_http_fancyindex_cache_cmp(cn->conf, cn->path, cn->len,
+                        (ngx_http_fancyindex_cache_node_t *) temp) < 0)
+                ? &temp->left : &temp->right;
         }
 
-        ngx_log_error(level, r->connection->log, err,
-                ngx_open_dir_n " \"%s\" failed", path.data);
+        if (*p == sentinel)
+            break;
 
-        return rc;
+        temp = *p;
     }
 
-#if (NGX_SUPPRESS_WARN)
-    /* MSVC认为'entries'可能在未初始化的情况下被使用 */
-    ngx_memzero(&entries, sizeof(ngx_array_t));
-#endif /* NGX_SUPPRESS_WARN */
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbtree_red(node);
+}
 
 
-    if (ngx_array_init(&entries, r->pool, 40,
-                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
-        return ngx_http_fancyindex_error(r, &dir, &path);
+static ngx_http_fancyindex_cache_node_t *
+ngx_http_fancyindex_cache_lookup_locked(ngx_http_fancyindex_cache_t *cache,
+        void *conf, ngx_str_t *path, uint32_t hash)
+{
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_http_fancyindex_cache_node_t  *cn;
 
-    filename = path.data;
-    filename[path.len] = '/';
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
 
-    /* 读取目录条目及其相关信息。 */
-    for (;;) {
-        ngx_set_errno(0);
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
 
-        if (ngx_read_dir(&dir) == NGX_ERROR) {
-            ngx_int_t err = ngx_errno;
+        cn = (ngx_http_fancyindex_cache_node_t *) node;
+        rc = ngx_http_fancyindex_cache_cmp(conf, path->data, path->len, cn);
 
-            /* 如果不是因为没有更多文件而失败，则记录错误并返回 */
-            if (err != NGX_ENOMOREFILES) {
-                ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                        ngx_read_dir_n " \"%V\" failed", &path);
-                return ngx_http_fancyindex_error(r, &dir, &path);
-            }
-            break;
-        }
+        if (rc == 0)
+            return cn;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http fancyindex file: \"%s\"", ngx_de_name(&dir));
+        node = (rc < 0) ? node->left : node->right;
+    }
 
-        len = ngx_de_namelen(&dir);
+    return NULL;
+}
 
-        if (!alcf->show_dot_files && ngx_de_name(&dir)[0] == '.')
-            continue;
 
-        if (alcf->hide_symlinks && ngx_de_is_link (&dir))
+/*
+ * 使路径为path的所有节点过期，不论它们属于哪个location。节点在新的列表
+ * 存入缓存时被替换，或者在启用fancyindex_cache_use_stale时被重新读取。
+ */
+static void
+ngx_http_fancyindex_cache_expire_path_locked(ngx_rbtree_node_t *node,
+        ngx_rbtree_node_t *sentinel, u_char *path, size_t len, uint32_t hash)
+{
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    while (node != sentinel) {
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
             continue;
+        }
 
-#if NGX_PCRE
-        /* 使用PCRE正则表达式匹配忽略文件 */
-        {
-            ngx_str_t str;
-            str.len = len;
-            str.data = ngx_de_name(&dir);
+        cn = (ngx_http_fancyindex_cache_node_t *) node;
+        if (cn->len == len && ngx_memcmp(cn->path, path, len) == 0)
+            cn->expire = 0;
 
-            if (alcf->ignore && ngx_regex_exec_array(alcf->ignore, &str,
-                                                     r->connection->log)
-                != NGX_DECLINED)
-            {
-                continue;  /* 匹配到忽略模式，跳过当前文件 */
-            }
-        }
-#else /* !NGX_PCRE */
-        /* 不使用PCRE，进行简单字符串匹配 */
-        if (alcf->ignore) {
-            u_int match_found = 0;
-            ngx_str_t *s = alcf->ignore->elts;
-
-            for (i = 0; i < alcf->ignore->nelts; i++, s++) {
-                if (ngx_strcmp(ngx_de_name(&dir), s->data) == 0) {
-                    match_found = 1;
-                    break;
-                }
-            }
+        /* 键相同的节点按配置排序，可能位于任意一侧 */
+        ngx_http_fancyindex_cache_expire_path_locked(node->left, sentinel,
+                                                     path, len, hash);
+        node = node->right;
+    }
+}
 
-            if (match_found) {
-                continue;
-            }
-        }
-#endif /* NGX_PCRE */
 
-        /* 目录条目信息无效，需要获取详细信息 */
-        if (!dir.valid_info) {
-            /* 1字节用于'/'，1字节用于终止符'\0' */
-            if (path.len + 1 + len + 1 > allocated) {
-                allocated = path.len + 1 + len + 1
-                          + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+/* 使节点失效。仍有请求在使用的节点在最后一个请求结束时才释放。 */
+static void
+ngx_http_fancyindex_cache_delete_locked(ngx_http_fancyindex_cache_t *cache,
+        ngx_http_fancyindex_cache_node_t *cn)
+{
+    ngx_uint_t                         i;
+    ngx_http_fancyindex_cache_body_t  *body;
 
-                if ((filename = ngx_palloc(r->pool, allocated)) == NULL)
-                    return ngx_http_fancyindex_error(r, &dir, &path);
+    if (!cn->deleted) {
+        ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+        ngx_queue_remove(&cn->queue);
+        cn->deleted = 1;
+    }
 
-                last = ngx_cpystrn(filename, path.data, path.len + 1);
-                *last++ = '/';
-            }
+    if (cn->count)
+        return;
 
-            ngx_cpystrn(last, ngx_de_name(&dir), len + 1);
+    if (cn->entries)
+        ngx_slab_free_locked(cache->shpool, cn->entries);
 
-            /* 获取文件信息 */
-            if (ngx_de_info(filename, &dir) == NGX_FILE_ERROR) {
-                ngx_int_t err = ngx_errno;
+    if (cn->tombstones)
+        ngx_slab_free_locked(cache->shpool, cn->tombstones);
 
-                /* 如果不是文件不存在的错误，则记录并跳过 */
-                if (err != NGX_ENOENT) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
-                            ngx_de_info_n " \"%s\" failed", filename);
-                    continue;
-                }
+    for (i = 0; i < NGX_HTTP_FANCYINDEX_PERMS; i++) {
+        if (cn->perms[i])
+            ngx_slab_free_locked(cache->shpool, cn->perms[i]);
+    }
 
-                /* 尝试获取链接信息 */
-                if (ngx_de_link_info(filename, &dir) == NGX_FILE_ERROR) {
-                    ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                            ngx_de_link_info_n " \"%s\" failed", filename);
-                    return ngx_http_fancyindex_error(r, &dir, &path);
-                }
-            }
-        }
+    while (cn->bodies) {
+        body = cn->bodies;
+        cn->bodies = body->next;
+        ngx_slab_free_locked(cache->shpool, body);
+    }
+
+    ngx_slab_free_locked(cache->shpool, cn);
+}
+
+
+/*
+ * 从LRU队列尾部释放节点：force为0时只释放最多两个已过期的节点，
+ * 否则释放一个未被使用的节点。没有可释放的节点时返回NGX_DECLINED。
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_expire_locked(ngx_http_fancyindex_cache_t *cache,
+        ngx_uint_t force)
+{
+    time_t                             now;
+    ngx_uint_t                         n;
+    ngx_queue_t                       *q, *prev;
+    ngx_http_fancyindex_cache_node_t  *cn;
 
-        if ((entry = ngx_array_push(&entries)) == NULL)
-            return ngx_http_fancyindex_error(r, &dir, &path);
+    now = ngx_time();
+    n = 0;
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = prev)
+    {
+        prev = ngx_queue_prev(q);
+        cn = ngx_queue_data(q, ngx_http_fancyindex_cache_node_t, queue);
+
+        if (cn->count)
+            continue;
 
-        entry->name.len  = len;
-        entry->name.data = ngx_palloc(r->pool, len + 1);
-        if (entry->name.data == NULL)
-            return ngx_http_fancyindex_error(r, &dir, &path);
+        if (force) {
+            ngx_http_fancyindex_cache_delete_locked(cache, cn);
+            return NGX_OK;
+        }
 
-        ngx_cpystrn(entry->name.data, ngx_de_name(&dir), len + 1);
-        entry->escape = 2 * ngx_fancyindex_escape_filename(NULL,
-                                                           ngx_de_name(&dir),
-                                                           len);
-        entry->escape_html = ngx_escape_html(NULL,
-                                             entry->name.data,
-                                             entry->name.len);
+        if (cn->expire > now || n == 2)
+            break;
 
-        entry->dir     = ngx_de_is_dir(&dir);
-        entry->mtime   = ngx_de_mtime(&dir);
-        entry->size    = ngx_de_size(&dir);
-        entry->utf_len = (r->headers_out.charset.len == 5 &&
-                ngx_strncasecmp(r->headers_out.charset.data, (u_char*) "utf-8", 5) == 0)
-            ?  ngx_utf8_length(entry->name.data, entry->name.len)
-            : len;
+        ngx_http_fancyindex_cache_delete_locked(cache, cn);
+        n++;
     }
 
-    if (ngx_close_dir(&dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                ngx_close_dir_n " \"%s\" failed", &path);
+    return n ? NGX_OK : NGX_DECLINED;
+}
+
+
+static void *
+ngx_http_fancyindex_cache_alloc_locked(ngx_http_fancyindex_cache_t *cache,
+        size_t size)
+{
+    void  *p;
+
+    for ( ;; ) {
+        if ((p = ngx_slab_alloc_locked(cache->shpool, size)) != NULL)
+            return p;
+
+        if (ngx_http_fancyindex_cache_expire_locked(cache, 1) != NGX_OK)
+            return NULL;
     }
+}
 
-    /*
-     * 计算生成目录列表所需的缓冲区长度。
-     * 包括URI、HTML标签、文件名、修改时间等内容。
-     */
 
-    escape_html = ngx_escape_html(NULL, r->uri.data, r->uri.len);
-
-    if (alcf->show_path)
-        len = r->uri.len + escape_html
-          + ngx_sizeof_ssz(t05_body2)
-          + ngx_sizeof_ssz(t06_list1)
-          + ngx_sizeof_ssz(t_parentdir_entry)
-          + ngx_sizeof_ssz(t07_list2)
-          + ngx_fancyindex_timefmt_calc_size (&alcf->time_format) * entries.nelts
-          ;
-   else
-        len = r->uri.len + escape_html
-          + ngx_sizeof_ssz(t06_list1)
-          + ngx_sizeof_ssz(t_parentdir_entry)
-          + ngx_sizeof_ssz(t07_list2)
-          + ngx_fancyindex_timefmt_calc_size (&alcf->time_format) * entries.nelts
-          ;
+static void
+ngx_http_fancyindex_cache_size_delete_locked(ngx_http_fancyindex_cache_t *cache,
+        ngx_http_fancyindex_cache_size_t *cs)
+{
+    ngx_rbtree_delete(&cache->sh->sizes, &cs->sn.node);
+    ngx_queue_remove(&cs->queue);
+    ngx_slab_free_locked(cache->shpool, cs);
+}
 
-    /*
-     * 如果位于Web服务器根目录（URI = "/" --> 长度为1），
-     * 不显示"上级目录"链接。
-     */
-    if (r->uri.len == 1) {
-        len -= ngx_sizeof_ssz(t_parentdir_entry);
+
+/* 分配目录大小的节点，空间不足时先淘汰最久未使用的目录大小 */
+static ngx_http_fancyindex_cache_size_t *
+ngx_http_fancyindex_cache_size_alloc_locked(ngx_http_fancyindex_cache_t *cache,
+        size_t size)
+{
+    void         *p;
+    ngx_queue_t  *q;
+
+    for ( ;; ) {
+        if ((p = ngx_slab_alloc_locked(cache->shpool, size)) != NULL)
+            return p;
+
+        if (ngx_queue_empty(&cache->sh->sizes_queue)) {
+            if (ngx_http_fancyindex_cache_expire_locked(cache, 1) != NGX_OK)
+                return NULL;
+            continue;
+        }
+
+        q = ngx_queue_last(&cache->sh->sizes_queue);
+        ngx_http_fancyindex_cache_size_delete_locked(cache,
+                ngx_queue_data(q, ngx_http_fancyindex_cache_size_t, queue));
     }
+}
 
-    entry = entries.elts;
-    for (i = 0; i < entries.nelts; i++) {
-        /*
-         * 生成的表格行如下所示，多余的空白已被去除：
-         *
-         *   <tr>
-         *     <td><a href="U[?sort]">文件名</a></td>
-         *     <td>大小</td><td>日期</td>
-         *   </tr>
-         */
-       len += ngx_sizeof_ssz("<tr><td colspan=\"2\" class=\"link\"><a href=\"")
-            + entry[i].name.len + entry[i].escape /* Escaped URL */
-            + ngx_sizeof_ssz("?C=x&amp;O=y") /* URL排序参数 */
-            + ngx_sizeof_ssz("\" title=\"")
-            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
-            + ngx_sizeof_ssz("\">")
-            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
-            + ngx_sizeof_ssz("</a></td><td class=\"size\">")
-            + 20 /* 文件大小 */
-            + ngx_sizeof_ssz("</td><td class=\"date\">")    /* 日期前缀 */
-            + ngx_sizeof_ssz("</td></tr>\n") /* 日期后缀 */
-            + 2 /* 回车换行 */
-            ;
+
+/*
+ * 目录的内容改变后，该目录及其所有上级目录的递归大小都已过期。只标记
+ * 为过期而不删除，重新统计完成前仍显示原来的大小。
+ */
+static void
+ngx_http_fancyindex_cache_size_expire_locked(ngx_http_fancyindex_cache_t *cache,
+        u_char *path, size_t len)
+{
+    ngx_str_t        str;
+    ngx_str_node_t  *sn;
+
+    str.data = path;
+    str.len = len;
+
+    while (str.len) {
+        sn = ngx_str_rbtree_lookup(&cache->sh->sizes, &str,
+                                   ngx_crc32_long(str.data, str.len));
+        if (sn != NULL)
+            ((ngx_http_fancyindex_cache_size_t *) sn)->expire = 0;
+
+        while (str.len && str.data[str.len - 1] != '/')
+            str.len--;
+
+        if (str.len)
+            str.len--;
     }
+}
 
-    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-    /*
-     * 确定排序标准。URL参数格式如下：
-     *
-     *    C=x[&O=y]
-     *
-     * 其中x={M,S,N}表示排序依据(M:修改时间,S:大小,N:名称)，
-     * y={A,D}表示排序方向(A:升序,D:降序)
-     */
-    if ((r->args.len == 3 || (r->args.len == 7 && r->args.data[3] == '&')) &&
-        r->args.data[0] == 'C' && r->args.data[1] == '=')
-    {
-        /* 确定排序方向 */
-        ngx_int_t sort_descending = r->args.len == 7
-                                 && r->args.data[4] == 'O'
-                                 && r->args.data[5] == '='
-                                 && r->args.data[6] == 'D';
+static void
+ngx_http_fancyindex_cache_error_delete_locked(ngx_http_fancyindex_cache_t *cache,
+        ngx_http_fancyindex_cache_error_t *ce)
+{
+    cache->sh->errors_size -= ce->size;
+    ngx_rbtree_delete(&cache->sh->errors, &ce->sn.node);
+    ngx_queue_remove(&ce->queue);
+    ngx_slab_free_locked(cache->shpool, ce);
+}
 
-        /* 选择排序标准 */
-        switch (r->args.data[2]) {
-            case 'M': /* 按修改时间排序 */
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC)
-                        sort_url_args = "?C=M&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE)
-                        sort_url_args = "?C=M&amp;O=A";
-                }
-                break;
-            case 'S': /* 按大小排序 */
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC)
-                        sort_url_args = "?C=S&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
-                        if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE)
-                    sort_url_args = "?C=S&amp;O=A";
-                }
-                break;
-            case 'N': /* 按名称排序 */
-            default:
-                if (sort_descending) {
-		sort_cmp_func = alcf->case_sensitive
-                        ? ngx_http_fancyindex_cmp_entries_name_cs_desc
-                        : ngx_http_fancyindex_cmp_entries_name_ci_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC)
-                        sort_url_args = "?C=N&amp;O=D";
-                }
-                else {
-                sort_cmp_func = alcf->case_sensitive
-                        ? ngx_http_fancyindex_cmp_entries_name_cs_asc
-                        : ngx_http_fancyindex_cmp_entries_name_ci_asc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME)
-                        sort_url_args = "?C=N&amp;O=A";
-                }
-                break;
-        }
-    }
-    else {
-        switch (alcf->default_sort) {
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC:
-                sort_cmp_func = alcf->case_sensitive
-                    ? ngx_http_fancyindex_cmp_entries_name_cs_desc
-                    : ngx_http_fancyindex_cmp_entries_name_ci_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME:
-            default:
-                sort_cmp_func = alcf->case_sensitive
-                    ? ngx_http_fancyindex_cmp_entries_name_cs_asc
-                    : ngx_http_fancyindex_cmp_entries_name_ci_asc;
-                break;
-        }
+
+/* 目录最近打开失败时返回当时的状态码，否则返回NGX_DECLINED */
+static ngx_int_t
+ngx_http_fancyindex_cache_error_get(ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_str_t *path)
+{
+    ngx_int_t                           rc;
+    ngx_str_t                           str;
+    ngx_str_node_t                     *sn;
+    ngx_http_fancyindex_cache_t        *cache;
+    ngx_http_fancyindex_cache_error_t  *ce;
+
+    cache = alcf->cache_zone->data;
+    str.data = path->data;
+    str.len = path->len;
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&cache->sh->errors, &str,
+                               ngx_crc32_long(str.data, str.len));
+    if (sn != NULL) {
+        ce = (ngx_http_fancyindex_cache_error_t *) sn;
+
+        if (ce->expire > ngx_time())
+            rc = ce->status;
+        else
+            ngx_http_fancyindex_cache_error_delete_locked(cache, ce);
     }
 
-    /* 如有需要，对条目进行排序 */
-    if (entries.nelts > 1) {
-        if (alcf->dirs_first)
-        {
-            ngx_http_fancyindex_entry_t *l, *r;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            l = entry;
-            r = entry + entries.nelts - 1;
-            while (l < r)
-            {
-                while (l < r && l->dir)
-                    l++;
-                while (l < r && !r->dir)
-                    r--;
-                if (l < r) {
-                    /* 现在l指向文件而r指向目录 */
-                    ngx_http_fancyindex_entry_t tmp;
-                    tmp = *l;
-                    *l = *r;
-                    *r = tmp;
-                }
-            }
-            if (r->dir)
-                r++;
+    return rc;
+}
 
-            if (r > entry)
-                /* 对目录进行排序 */
-                ngx_qsort(entry, (size_t)(r - entry),
-                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
-            if (r < entry + entries.nelts)
-                /* 对文件进行排序 */
-                ngx_qsort(r, (size_t)(entry + entries.nelts - r),
-                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
-        } else {
-            ngx_qsort(entry, (size_t)entries.nelts,
-                    sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
-        }
-    }
 
-    /* 如有需要，显示路径 */
-    if (alcf->show_path){
-        b->last = last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
-        b->last = ngx_cpymem_ssz(b->last, t05_body2);
+/*
+ * 记录打开失败的目录。错误节点占用的内存超过上限或分配失败时淘汰最久
+ * 未使用的错误节点，不淘汰缓存的列表。
+ */
+static void
+ngx_http_fancyindex_cache_error_put(ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_str_t *path, ngx_int_t status)
+{
+    size_t                              size;
+    uint32_t                            hash;
+    ngx_str_t                           str;
+    ngx_queue_t                        *q;
+    ngx_str_node_t                     *sn;
+    ngx_http_fancyindex_cache_t        *cache;
+    ngx_http_fancyindex_cache_error_t  *ce;
+
+    cache = alcf->cache_zone->data;
+    str.data = path->data;
+    str.len = path->len;
+    hash = ngx_crc32_long(str.data, str.len);
+    size = offsetof(ngx_http_fancyindex_cache_error_t, path) + str.len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&cache->sh->errors, &str, hash);
+
+    if (sn != NULL) {
+        ce = (ngx_http_fancyindex_cache_error_t *) sn;
+        ngx_queue_remove(&ce->queue);
+        goto done;
     }
 
-    /* 打开<table>标签 */
-    b->last = ngx_cpymem_ssz(b->last, t06_list1);
+    for ( ;; ) {
+        ce = NULL;
 
-    tp = ngx_timeofday();
+        if (cache->sh->errors_size + size <= cache->errors_max) {
+            ce = ngx_slab_alloc_locked(cache->shpool, size);
+            if (ce != NULL)
+                break;
+        }
 
-    /* "上级目录"条目，如果显示则始终位于首位 */
-    if (r->uri.len > 1 && alcf->hide_parent == 0) {
-        b->last = ngx_cpymem_ssz(b->last,
-                                 "<tr>"
-                                 "<td colspan=\"2\" class=\"link\"><a href=\"../");
-        if (*sort_url_args) {
-            b->last = ngx_cpymem(b->last,
-                                 sort_url_args,
-                                 ngx_sizeof_ssz("?C=N&amp;O=A"));
+        if (ngx_queue_empty(&cache->sh->errors_queue)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
         }
-        b->last = ngx_cpymem_ssz(b->last,
-                                 "\">上级目录</a></td>"
-                                 "<td class=\"size\">-</td>"
-                                 "<td class=\"link\"><a href=\"/\" >返回首页</a>"
-                                 "</tr>"
-                                 CRLF);
+
+        q = ngx_queue_last(&cache->sh->errors_queue);
+        ngx_http_fancyindex_cache_error_delete_locked(cache,
+                ngx_queue_data(q, ngx_http_fancyindex_cache_error_t, queue));
     }
 
-    /* 目录和文件条目 */
-    for (i = 0; i < entries.nelts; i++) {
-        b->last = ngx_cpymem_ssz(b->last, "<tr><td colspan=\"2\" class=\"link\"><a href=\"");
+    ngx_memcpy(ce->path, str.data, str.len);
 
-        if (entry[i].escape) {
-            ngx_fancyindex_escape_filename(b->last,
-                                           entry[i].name.data,
-                                           entry[i].name.len);
+    ce->sn.node.key = hash;
+    ce->sn.str.len = str.len;
+    ce->sn.str.data = ce->path;
+    ce->size = size;
 
-            b->last += entry[i].name.len + entry[i].escape;
+    ngx_rbtree_insert(&cache->sh->errors, &ce->sn.node);
+    cache->sh->errors_size += size;
 
-        } else {
-            b->last = ngx_cpymem_str(b->last, entry[i].name);
-        }
+done:
 
-        if (entry[i].dir) {
-            *b->last++ = '/';
-            if (*sort_url_args) {
-                b->last = ngx_cpymem(b->last,
-                                     sort_url_args,
-                                     ngx_sizeof_ssz("?C=x&amp;O=y"));
-            }
-        }
+    ce->expire = ngx_time() + alcf->cache_errors;
+    ce->status = status;
+    ngx_queue_insert_head(&cache->sh->errors_queue, &ce->queue);
 
-        *b->last++ = '"';
-        b->last = ngx_cpymem_ssz(b->last, " title=\"");
-        b->last = (u_char *) ngx_escape_html(b->last, entry[i].name.data, entry[i].name.len);
-        *b->last++ = '"';
-        *b->last++ = '>';
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
 
-        len = entry[i].utf_len;
 
-        b->last = (u_char *) ngx_escape_html(b->last, entry[i].name.data, entry[i].name.len);
-        last = b->last - 3;
+static void
+ngx_http_fancyindex_cache_release_locked(
+        ngx_http_fancyindex_cache_cleanup_t *ccln)
+{
+    if (ccln->node == NULL)
+        return;
 
-	  if (entry[i].dir) {
-            *b->last++ = '/';
-            len++;
-        }
-        b->last = ngx_cpymem_ssz(b->last, "</a></td><td class=\"size\">");
-        if (alcf->exact_size) {
-            if (entry[i].dir) {
-                *b->last++ = '-';
-            } else {
-                b->last = ngx_sprintf(b->last, "%19O", entry[i].size);
-            }
+    ccln->node->count--;
+    /*
+     * 释放读取锁：读取成功时节点已被新的节点替换，读取失败时节点中
+     * 没有可用的列表，都应删除。
+     */
+    if (ccln->node->deleted || ccln->lock)
+        ngx_http_fancyindex_cache_delete_locked(ccln->cache, ccln->node);
 
-        } else {
-            if (entry[i].dir) {
-                *b->last++ = '-';
-            } else {
-                length = entry[i].size;
-                multiplier = exbibyte;
+    ccln->node = NULL;
+    ccln->lock = 0;
+}
 
-                for (j = 0; j < DIM(sizes) - 1 && length < multiplier; j++)
-                    multiplier /= 1024;
 
-                /* 如果以字节显示文件大小，则不显示小数 */
-                if (j == DIM(sizes) - 1)
-                    b->last = ngx_sprintf(b->last, "%O %s", length, sizes[j]);
-                else
-                    b->last = ngx_sprintf(b->last, "%.1f %s",
-                                          (float) length / multiplier, sizes[j]);
-            }
+static void
+ngx_http_fancyindex_cache_cleanup(void *data)
+{
+    ngx_http_fancyindex_cache_cleanup_t  *ccln = data;
+
+    if (ccln->node == NULL)
+        return;
+
+    ngx_shmtx_lock(&ccln->cache->shpool->mutex);
+    ngx_http_fancyindex_cache_release_locked(ccln);
+    ngx_shmtx_unlock(&ccln->cache->shpool->mutex);
+}
+
+
+/* 使所有缓存区中路径为path的节点失效，以及该路径和上级目录的大小 */
+static void
+ngx_http_fancyindex_cache_invalidate(ngx_cycle_t *cycle, u_char *path,
+        size_t len)
+{
+    uint32_t                           hash;
+    ngx_uint_t                         i;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_list_part_t                   *part;
+    ngx_http_fancyindex_cache_t       *cache;
+
+    hash = ngx_crc32_long(path, len);
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                break;
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
         }
 
-        ngx_gmtime(entry[i].mtime + tp->gmtoff * 60 * alcf->localtime, &tm);
-        b->last = ngx_cpymem_ssz(b->last, "</td><td class=\"date\">");
-        b->last = ngx_fancyindex_timefmt(b->last, &alcf->time_format, &tm);
-        b->last = ngx_cpymem_ssz(b->last, "</td></tr>");
+        if (shm_zone[i].init != ngx_http_fancyindex_cache_init_zone)
+            continue;
 
-        *b->last++ = CR;
-        *b->last++ = LF;
-    }
+        cache = shm_zone[i].data;
 
-    /* 输出表格底部 */
-    b->last = ngx_cpymem_ssz(b->last, t07_list2);
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    *pb = b;
-    return NGX_OK;
+        ngx_http_fancyindex_cache_expire_path_locked(cache->sh->rbtree.root,
+                                                     cache->sh->rbtree.sentinel,
+                                                     path, len, hash);
+        ngx_http_fancyindex_cache_size_expire_locked(cache, path, len);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
 }
 
 
+#if (NGX_HAVE_INOTIFY)
 
-static ngx_int_t
-ngx_http_fancyindex_handler(ngx_http_request_t *r)
+static ngx_http_fancyindex_watch_t *
+ngx_http_fancyindex_watch_find(ngx_str_t *path)
 {
-    ngx_http_request_t             *sr;
-    ngx_str_t                      *sr_uri;
-    ngx_str_t                       rel_uri;
-    ngx_int_t                       rc;
-    ngx_http_fancyindex_loc_conf_t *alcf;
-    ngx_chain_t                     out[3] = {
-        { NULL, NULL }, { NULL, NULL}, { NULL, NULL }};
+    ngx_str_node_t               *sn;
+    ngx_http_fancyindex_watch_t  *w;
 
+    if (ngx_http_fancyindex_inotify == NULL)
+        return NULL;
 
-    if (r->uri.data[r->uri.len - 1] != '/') {
-        return NGX_DECLINED;
+    sn = ngx_str_rbtree_lookup(&ngx_http_fancyindex_watch_paths, path,
+                               ngx_crc32_long(path->data, path->len));
+    if (sn == NULL)
+        return NULL;
+
+    w = (ngx_http_fancyindex_watch_t *)
+            ((u_char *) sn - offsetof(ngx_http_fancyindex_watch_t, sn));
+
+    ngx_queue_remove(&w->queue);
+    ngx_queue_insert_head(&ngx_http_fancyindex_watch_queue, &w->queue);
+
+    return w;
+}
+
+
+static ngx_http_fancyindex_watch_t *
+ngx_http_fancyindex_watch_find_wd(int wd)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = ngx_http_fancyindex_watch_wds.root;
+    sentinel = ngx_http_fancyindex_watch_wds.sentinel;
+
+    while (node != sentinel) {
+        if ((ngx_rbtree_key_t) wd == node->key)
+            return (ngx_http_fancyindex_watch_t *) node;
+
+        node = ((ngx_rbtree_key_t) wd < node->key) ? node->left : node->right;
     }
 
-    /* TODO: Windows平台支持 */
-#if defined(nginx_version) \
-    && ((nginx_version < 7066) \
-        || ((nginx_version > 8000) && (nginx_version < 8038)))
-    /* 检查URI中是否包含空字符 */
-    if (r->zero_in_uri) {
+    return NULL;
+}
+
+
+/*
+ * 停止监视目录，并使其缓存失效：不再被监视的目录无法保证缓存是最新的。
+ * 内核已经移除了监视（IN_IGNORED）时rm为0。
+ */
+static void
+ngx_http_fancyindex_watch_remove(ngx_http_fancyindex_watch_t *w, ngx_uint_t rm)
+{
+    ngx_http_fancyindex_cache_invalidate((ngx_cycle_t *) ngx_cycle,
+                                         w->sn.str.data, w->sn.str.len);
+
+    if (rm && inotify_rm_watch(ngx_http_fancyindex_inotify->fd,
+                               (int) w->node.key) == -1)
+    {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, ngx_errno,
+                      "inotify_rm_watch(\"%V\") failed", &w->sn.str);
+    }
+
+    ngx_rbtree_delete(&ngx_http_fancyindex_watch_wds, &w->node);
+    ngx_rbtree_delete(&ngx_http_fancyindex_watch_paths, &w->sn.node);
+    ngx_queue_remove(&w->queue);
+    ngx_http_fancyindex_nwatches--;
+
+    ngx_free(w);
+}
+
+
+/*
+ * 开始监视目录。必须在读取目录之前调用，这样读取期间发生的变化也会使
+ * 随后填充的缓存失效。无法监视时返回NGX_DECLINED。
+ */
+static ngx_int_t
+ngx_http_fancyindex_watch_add(ngx_str_t *path, ngx_log_t *log)
+{
+    int                           wd;
+    ngx_queue_t                  *q;
+    ngx_http_fancyindex_watch_t  *w;
+
+    if (ngx_http_fancyindex_inotify == NULL)
         return NGX_DECLINED;
+
+    if (ngx_http_fancyindex_watch_find(path) != NULL)
+        return NGX_OK;
+
+    if (ngx_http_fancyindex_nwatches >= NGX_HTTP_FANCYINDEX_MAX_WATCHES) {
+        q = ngx_queue_last(&ngx_http_fancyindex_watch_queue);
+        ngx_http_fancyindex_watch_remove(
+            ngx_queue_data(q, ngx_http_fancyindex_watch_t, queue), 1);
     }
-#endif
 
-    /* 只处理GET和HEAD请求 */
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    wd = inotify_add_watch(ngx_http_fancyindex_inotify->fd,
+                           (char *) path->data, NGX_HTTP_FANCYINDEX_WATCH_MASK);
+    if (wd == -1) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                      "inotify_add_watch(\"%V\") failed", path);
         return NGX_DECLINED;
     }
 
-    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    /*
+     * 通过符号链接等其他路径访问同一目录时，内核返回已有的描述符。
+     * 这种情况下新路径不被视为已监视，仍通过stat()确认缓存是否有效。
+     */
+    if (ngx_http_fancyindex_watch_find_wd(wd) != NULL)
+        return NGX_DECLINED;
 
-    /* 检查模块是否启用 */
-    if (!alcf->enable) {
+    w = ngx_alloc(sizeof(ngx_http_fancyindex_watch_t) + path->len, log);
+    if (w == NULL) {
+        (void) inotify_rm_watch(ngx_http_fancyindex_inotify->fd, wd);
         return NGX_DECLINED;
     }
 
-    if ((rc = make_content_buf(r, &out[0].buf, alcf)) != NGX_OK)
-        return rc;
+    w->node.key = (ngx_rbtree_key_t) wd;
+    w->sn.node.key = ngx_crc32_long(path->data, path->len);
+    w->sn.str.len = path->len;
+    w->sn.str.data = (u_char *) (w + 1);
+    ngx_memcpy(w->sn.str.data, path->data, path->len);
 
-    out[0].buf->last_in_chain = 1;
+    ngx_rbtree_insert(&ngx_http_fancyindex_watch_wds, &w->node);
+    ngx_rbtree_insert(&ngx_http_fancyindex_watch_paths, &w->sn.node);
+    ngx_queue_insert_head(&ngx_http_fancyindex_watch_queue, &w->queue);
+    ngx_http_fancyindex_nwatches++;
 
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/html");
-    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/html");
-    r->headers_out.content_type.data = (u_char *) "text/html";
+    return NGX_OK;
+}
 
-    rc = ngx_http_send_header(r);
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
-        return rc;
 
-    if (alcf->header.path.len > 0 && alcf->header.local.len == 0) {
-        /* 已配置URI，让Nginx通过子请求处理。 */
-        sr_uri = &alcf->header.path;
+static void
+ngx_http_fancyindex_inotify_handler(ngx_event_t *ev)
+{
+    ssize_t                       n;
+    u_char                       *p;
+    ngx_err_t                     err;
+    ngx_queue_t                  *q;
+    ngx_connection_t             *c;
+    struct inotify_event         *ie;
+    ngx_http_fancyindex_watch_t  *w;
+    union {
+        struct inotify_event      ie;
+        u_char                    buf[4096];
+    } u;
+
+    c = ev->data;
+
+    for ( ;; ) {
+        n = read(c->fd, u.buf, sizeof(u.buf));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR)
+                continue;
 
-        if (*sr_uri->data != '/') {
-            /* 相对路径 */
-            rel_uri.len  = r->uri.len + alcf->header.path.len;
-            rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
-            if (rel_uri.data == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "read() from inotify failed");
             }
-            ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
-                    alcf->header.path.data, alcf->header.path.len);
-            sr_uri = &rel_uri;
+            break;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: header subrequest \"%V\"", sr_uri);
+        if (n == 0)
+            break;
 
-        rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
-        if (rc == NGX_ERROR || rc == NGX_DONE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "http fancyindex: header subrequest for \"%V\" failed", sr_uri);
-            return rc;
-        }
+        for (p = u.buf; p < u.buf + n; p += sizeof(struct inotify_event) + ie->len) {
+            ie = (struct inotify_event *) p;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: header subrequest status = %i",
-                sr->headers_out.status);
-        /* ngx_http_subrequest returns NGX_OK(0), not NGX_HTTP_OK(200) */
-        if (sr->headers_out.status != NGX_OK) {
-            /*
-             * XXX: 如果我们收到404以外的状态码，是否应该在错误日志中记录消息？
-             */
-            goto add_builtin_header;
+            if (ie->mask & IN_Q_OVERFLOW) {
+                /* 丢失了事件，所有监视的目录都可能已经变化 */
+                ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                              "inotify queue overflow, "
+                              "dropping all cached listings");
+
+                while (!ngx_queue_empty(&ngx_http_fancyindex_watch_queue)) {
+                    q = ngx_queue_last(&ngx_http_fancyindex_watch_queue);
+                    ngx_http_fancyindex_watch_remove(
+                        ngx_queue_data(q, ngx_http_fancyindex_watch_t, queue), 1);
+                }
+                continue;
+            }
+
+            if ((w = ngx_http_fancyindex_watch_find_wd(ie->wd)) == NULL)
+                continue;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                           "http fancyindex: \"%V\" changed, mask:%xd",
+                           &w->sn.str, ie->mask);
+
+            ngx_http_fancyindex_watch_remove(w, !(ie->mask & IN_IGNORED));
         }
     }
-    else {
-add_builtin_header:
-        /* 在此之前创建空间 */
-        out[1].next = out[0].next;
-        out[1].buf  = out[0].buf;
-        /* 链接页眉缓冲区 */
-        out[0].next = &out[1];
-        if (alcf->header.local.len > 0) {
-            /* 页眉缓冲区为本地，创建指向数据的缓冲区。 */
-            out[0].buf = ngx_calloc_buf(r->pool);
-            if (out[0].buf == NULL)
-                return NGX_ERROR;
-            out[0].buf->memory = 1;
-            out[0].buf->pos = alcf->header.local.data;
-            out[0].buf->last = alcf->header.local.data + alcf->header.local.len;
-        } else {
-            /* 准备包含内置页眉内容的缓冲区。 */
-            out[0].buf = make_header_buf(r, alcf->css_href);
-        }
+
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "fancyindex: cannot handle inotify events");
     }
+}
 
-    /* 如果页脚已禁用，链接页脚缓冲区。 */
-    if (alcf->footer.path.len == 0 || alcf->footer.local.len > 0) {
-        ngx_uint_t last = (alcf->header.path.len == 0) ? 2 : 1;
+#endif /* NGX_HAVE_INOTIFY */
 
-        out[last-1].next = &out[last];
-        out[last].buf = ngx_calloc_buf(r->pool);
-        if (out[last].buf == NULL)
+
+/*
+ * 查找缓存的目录列表，命中时将条目复制到entries中并返回NGX_OK。
+ * 未命中时返回NGX_DECLINED，此时*mtime为读取前目录的修改时间，
+ * 无法获取时为-1（不应缓存读取结果）。启用fancyindex_scan_lock时，
+ * 如果其他请求正在读取该目录则返回NGX_BUSY，请求应稍后重试。
+ * 启用fancyindex_cache_use_stale时，过期的列表仍然返回NGX_OK，
+ * 同时由一个后台子请求重新读取目录。
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_get(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_str_t *path,
+        ngx_array_t *entries, time_t *mtime)
+{
+    size_t                                size;
+    time_t                                now;
+    uint32_t                              hash;
+    ngx_uint_t                            utf8, watched, timedout, refresh;
+    ngx_uint_t                            stale, lo, hi, mid, n;
+    ngx_file_info_t                       fi;
+    ngx_pool_cleanup_t                   *cln;
+    ngx_http_fancyindex_ctx_t            *ctx;
+    ngx_http_fancyindex_cache_t          *cache;
+    ngx_http_fancyindex_cache_node_t     *cn;
+    ngx_http_fancyindex_cache_cleanup_t  *ccln;
+
+    cache = alcf->cache_zone->data;
+    hash = ngx_crc32_long(path->data, path->len);
+    utf8 = ngx_http_fancyindex_is_utf8(r);
+
+    /* 等待读取锁时会多次调用，只注册一次清理函数 */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    ccln = ctx->cache_cln;
+
+    if (ccln == NULL) {
+        cln = ngx_pool_cleanup_add(r->pool,
+                                   sizeof(ngx_http_fancyindex_cache_cleanup_t));
+        if (cln == NULL)
             return NGX_ERROR;
 
-        out[last].buf->memory = 1;
-        if (alcf->footer.local.len > 0) {
-            out[last].buf->pos = alcf->footer.local.data;
-            out[last].buf->last = alcf->footer.local.data + alcf->footer.local.len;
-        } else {
-            out[last].buf->pos = (u_char*) t08_foot1;
-            out[last].buf->last = (u_char*) t08_foot1 + sizeof(t08_foot1) - 1;
-        }
+        ccln = cln->data;
+        ccln->cache = cache;
+        ccln->node = NULL;
+        ccln->lock = 0;
+        cln->handler = ngx_http_fancyindex_cache_cleanup;
+        ctx->cache_cln = ccln;
+    }
 
-        out[last-1].buf->last_in_chain = 0;
-        out[last].buf->last_in_chain   = 1;
-        out[last].buf->last_buf        = 1;
-        /* 一次性发送所有内容 :D */
-        return ngx_http_output_filter(r, &out[0]);
+    /*
+     * 本进程监视着该目录时，任何变化都已经使节点过期，不需要stat()。
+     * 否则先开始监视，再获取目录的修改时间，读取期间的变化不会被遗漏。
+     */
+    watched = 0;
+    *mtime = -1;
+
+#if (NGX_HAVE_INOTIFY)
+    if (ngx_http_fancyindex_watch_find(path) != NULL)
+        watched = 1;
+    else
+        (void) ngx_http_fancyindex_watch_add(path, r->connection->log);
+#endif
+
+    if (!watched && ngx_file_info(path->data, &fi) != NGX_FILE_ERROR)
+        *mtime = ngx_file_mtime(&fi);
+
+    timedout = 0;
+    refresh = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    now = ngx_time();
+    cn = ngx_http_fancyindex_cache_lookup_locked(cache, alcf, path, hash);
+
+    if (cn != NULL
+        && (cn->generation != cache->generation || cn->utf8 != utf8))
+    {
+        ngx_http_fancyindex_cache_delete_locked(cache, cn);
+        cn = NULL;
+    }
+
+    if (cn != NULL && cn->updating && cn->lock <= now) {
+        /* 持有读取锁的请求没有在超时时间内完成，视为已放弃 */
+        cn->updating = 0;
+
+        if (cn->pending) {
+            ngx_http_fancyindex_cache_delete_locked(cache, cn);
+            cn = NULL;
+        }
     }
 
+    if (cn != NULL && !cn->pending && !watched && cn->mtime != *mtime)
+        cn->expire = 0;
+
     /*
-     * 如果到达此处，说明需要发送自定义页脚。我们需要：
-     * 部分发送out[0]引用的内容，然后将页脚作为子请求发送。
-     * 如果子请求失败，我们也应发送标准页脚。
+     * 不能返回的过期列表保留到新的列表存入缓存时，用于找出被删除的条目。
+     * 启用fancyindex_scan_lock时由本请求持有该节点的读取锁。
      */
-    rc = ngx_http_output_filter(r, &out[0]);
+    stale = (cn != NULL && !cn->pending && cn->expire <= now
+             && !alcf->use_stale);
 
-    if (rc != NGX_OK && rc != NGX_AGAIN)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (cn != NULL && (cn->pending || (stale && cn->updating))) {
+        if (!ctx->waiting) {
+            ctx->waiting = 1;
+            ctx->wait_start = ngx_current_msec;
+        }
 
-    /* 已配置URI，让Nginx通过子请求处理。 */
-    sr_uri = &alcf->footer.path;
+        if ((ngx_msec_int_t) (ngx_current_msec - ctx->wait_start)
+            < (ngx_msec_int_t) alcf->scan_lock_timeout)
+        {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (*sr_uri->data != '/') {
-        /* 相对路径 */
-        rel_uri.len  = r->uri.len + alcf->footer.path.len;
-        rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
-        if (rel_uri.data == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http fancyindex: waiting for scan of \"%V\"",
+                           path);
+            return NGX_BUSY;
+        }
+
+        /* 等待超时：自行读取，但不接管读取锁 */
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "fancyindex scan lock timeout for \"%V\"", path);
+        cn = NULL;
+        timedout = 1;
+
+    } else if (cn != NULL && cn->expire <= now) {
+        if (stale) {
+            if (alcf->scan_lock) {
+                cn->updating = 1;
+                cn->lock = now + alcf->scan_lock_timeout / 1000 + 1;
+                cn->count++;
+                ccln->node = cn;
+                ccln->lock = 1;
+            }
+
+            cn = NULL;
+
+        } else if (!cn->updating) {
+            /* 返回旧的列表，由后台子请求持有读取锁并重新读取 */
+            cn->updating = 1;
+            cn->lock = now + alcf->scan_lock_timeout / 1000 + 1;
+            cn->count++;
+            refresh = 1;
         }
-        ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
-                alcf->footer.path.data, alcf->footer.path.len);
-        sr_uri = &rel_uri;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "http fancyindex: footer subrequest \"%V\"", sr_uri);
+    if (cn != NULL) {
+        cn->count++;
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+        ccln->node = cn;
 
-    rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
-    if (rc == NGX_ERROR || rc == NGX_DONE) {
+    } else if (alcf->scan_lock && !timedout && !stale) {
+        /*
+         * 获取读取锁：插入一个没有列表的节点，其他请求看到它时等待。
+         * 本请求持有该节点的引用，直到读取结束后释放。持有锁的请求
+         * 异常退出时，读取锁在等待超时后失效，由下一个请求重新获取。
+         */
+        size = offsetof(ngx_http_fancyindex_cache_node_t, path) + path->len;
+        cn = ngx_http_fancyindex_cache_alloc_locked(cache, size);
+
+        if (cn != NULL) {
+            ngx_memzero(cn, sizeof(ngx_http_fancyindex_cache_node_t));
+            cn->node.key = hash;
+            cn->conf = alcf;
+            cn->generation = cache->generation;
+            cn->expire = now + alcf->cache_valid;
+            cn->lock = now + alcf->scan_lock_timeout / 1000 + 1;
+            cn->count = 1;
+            cn->updating = 1;
+            cn->pending = 1;
+            cn->utf8 = utf8;
+            cn->len = path->len;
+            ngx_memcpy(cn->path, path->data, path->len);
+
+            ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+            ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+            ccln->node = cn;
+            ccln->lock = 1;
+            cn = NULL;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (cn == NULL) {
+        if (watched && ngx_file_info(path->data, &fi) != NGX_FILE_ERROR)
+            *mtime = ngx_file_mtime(&fi);
+
+        return NGX_DECLINED;
+    }
+
+    if (refresh) {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: footer subrequest for \"%V\" failed", sr_uri);
-        return rc;
+                       "http fancyindex: stale listing for \"%V\", "
+                       "refreshing in background", path);
+
+        (void) ngx_http_fancyindex_cache_refresh(r, alcf, cn);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "http fancyindex: header subrequest status = %i",
-            sr->headers_out.status);
+                   "http fancyindex: cached listing for \"%V\"", path);
+
+    ctx->time = cn->time;
+    n = cn->nelts;
+
+    if (ctx->filter.delta) {
+        /* 条目按修改时间降序排列，只复制不早于since修改的部分 */
+        lo = 0;
+        hi = n;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (cn->entries[mid].mtime >= ctx->filter.since)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        n = lo;
+    }
+
+    if (ngx_array_init(entries, r->pool, n ? n : 1,
+                       sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        return NGX_ERROR;
+
+    if (n) {
+        ngx_memcpy(entries->elts, cn->entries,
+                   n * sizeof(ngx_http_fancyindex_entry_t));
+    }
+    entries->nelts = n;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 为过期的节点cn启动后台子请求重新读取目录。调用者已为cn设置读取锁
+ * 并增加了引用计数，该引用在读取结束或子请求无法执行时释放。
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_refresh(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_http_fancyindex_cache_node_t *cn)
+{
+    ngx_pool_cleanup_t                   *cln;
+    ngx_http_request_t                   *sr;
+    ngx_http_fancyindex_ctx_t            *ctx;
+    ngx_http_fancyindex_cache_cleanup_t  *ccln, tmp;
+
+    cln = ngx_pool_cleanup_add(r->pool,
+                               sizeof(ngx_http_fancyindex_cache_cleanup_t));
+    if (cln == NULL) {
+        tmp.cache = alcf->cache_zone->data;
+        tmp.node = cn;
+        tmp.lock = 1;
+        ngx_http_fancyindex_cache_cleanup(&tmp);
+        return NGX_ERROR;
+    }
+
+    /* 此后读取锁最迟在请求结束时释放 */
+    ccln = cln->data;
+    ccln->cache = alcf->cache_zone->data;
+    ccln->node = cn;
+    ccln->lock = 1;
+    cln->handler = ngx_http_fancyindex_cache_cleanup;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_ctx_t));
+    if (ctx == NULL)
+        return NGX_ERROR;
+
+    ctx->cache_cln = ccln;
+    ctx->refresh = alcf;
+
+#if (NGX_HTTP_FANCYINDEX_BACKGROUND)
+    if (ngx_http_subrequest(r, &r->uri, NULL, &sr, NULL,
+                            NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK)
+        return NGX_ERROR;
+
+    sr->header_only = 1;
+    ngx_http_set_ctx(sr, ctx, ngx_http_fancyindex_module);
+
+    return NGX_OK;
+#else
+    (void) sr;
+    return NGX_DECLINED;
+#endif
+}
+
+
+/* 按文件名比较，用于在新的列表中查找旧的条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_names(const void *one, const void *two)
+{
+    ngx_str_t *first = *(ngx_str_t **) one;
+    ngx_str_t *second = *(ngx_str_t **) two;
+
+    return (int) ngx_memn2cmp(first->data, second->data,
+                              first->len, second->len);
+}
+
+
+/* 在按文件名排序的names中查找name */
+static ngx_uint_t
+ngx_http_fancyindex_find_name(ngx_str_t **names, ngx_uint_t n,
+        u_char *name, size_t len)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  lo, hi, mid;
+
+    lo = 0;
+    hi = n;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rc = ngx_memn2cmp(name, names[mid]->data, len, names[mid]->len);
+
+        if (rc == 0)
+            return 1;
+
+        if (rc < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 旧的列表old被新的列表替换时，找出在新的列表中不存在的条目，并合并old
+ * 中记录的被删除条目。names为新的列表中按文件名排序的文件名。共享内存
+ * 不足或者旧的节点没有列表时返回NULL，即无法确定哪些条目被删除。
+ */
+static ngx_http_fancyindex_cache_tombstones_t *
+ngx_http_fancyindex_cache_tombstones_locked(ngx_http_fancyindex_cache_t *cache,
+        ngx_http_fancyindex_cache_node_t *old, ngx_str_t **names, ngx_uint_t n)
+{
+    size_t                                   len, size, carried_size;
+    u_char                                  *p, *q;
+    ngx_uint_t                               i, nelts, carried;
+    ngx_http_fancyindex_cache_tombstones_t  *tb, *otb;
+
+    if (old == NULL || old->pending)
+        return NULL;
+
+    nelts = 0;
+    size = 0;
+
+    for (i = 0; i < old->nelts; i++) {
+        if (!ngx_http_fancyindex_find_name(names, n, old->entries[i].name.data,
+                                           old->entries[i].name.len))
+        {
+            nelts++;
+            size += old->entries[i].name.len + 1;
+        }
+    }
+
+    carried = 0;
+    carried_size = 0;
+    otb = old->tombstones;
+
+    if (otb != NULL) {
+        for (p = otb->names, i = 0; i < otb->nelts; i++, p += len + 1) {
+            len = ngx_strlen(p);
+
+            if (!ngx_http_fancyindex_find_name(names, n, p, len)) {
+                carried++;
+                carried_size += len + 1;
+            }
+        }
+
+        if (nelts + carried > NGX_HTTP_FANCYINDEX_TOMBSTONES)
+            otb = NULL;
+    }
+
+    if (otb != NULL) {
+        nelts += carried;
+        size += carried_size;
+    }
+
+    tb = ngx_slab_alloc_locked(cache->shpool,
+            offsetof(ngx_http_fancyindex_cache_tombstones_t, names)
+            + (size ? size : 1));
+    if (tb == NULL)
+        return NULL;
+
+    tb->since = otb ? otb->since : old->time;
+    tb->nelts = nelts;
+    tb->len = size;
+
+    q = tb->names;
+
+    for (i = 0; i < old->nelts; i++) {
+        if (!ngx_http_fancyindex_find_name(names, n, old->entries[i].name.data,
+                                           old->entries[i].name.len))
+        {
+            q = ngx_cpymem(q, old->entries[i].name.data,
+                           old->entries[i].name.len + 1);
+        }
+    }
+
+    if (otb != NULL) {
+        for (p = otb->names, i = 0; i < otb->nelts; i++, p += len + 1) {
+            len = ngx_strlen(p);
+
+            if (!ngx_http_fancyindex_find_name(names, n, p, len))
+                q = ngx_cpymem(q, p, len + 1);
+        }
+    }
+
+    return tb;
+}
+
+
+/*
+ * 将读取到的目录列表存入缓存，共享内存不足时不缓存。start为开始读取
+ * 目录的时间。ccln持有的引用（包括读取锁）被替换为对新节点的引用，
+ * 等待的请求随后从缓存中获得结果。
+ */
+static void
+ngx_http_fancyindex_cache_put(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_str_t *path, time_t mtime,
+        time_t start, ngx_array_t *entries,
+        ngx_http_fancyindex_cache_cleanup_t *ccln)
+{
+    size_t                                size;
+    u_char                               *p;
+    uint32_t                              hash;
+    ngx_str_t                           **names;
+    ngx_uint_t                            i;
+    ngx_http_fancyindex_entry_t          *entry, *ce;
+    ngx_http_fancyindex_cache_t          *cache;
+    ngx_http_fancyindex_cache_node_t     *cn;
+    ngx_http_fancyindex_cache_tombstones_t *tb;
+
+    cache = alcf->cache_zone->data;
+    hash = ngx_crc32_long(path->data, path->len);
+
+    entry = entries->elts;
+    size = entries->nelts * sizeof(ngx_http_fancyindex_entry_t);
+    for (i = 0; i < entries->nelts; i++)
+        size += entry[i].name.len + 1;
+
+    /*
+     * 缓存的条目按修改时间降序排列，"since"请求只需复制开头的一部分。
+     * 请求在生成列表前会重新排序。
+     */
+    if (entries->nelts > 1) {
+        ngx_qsort(entry, (size_t) entries->nelts,
+                  sizeof(ngx_http_fancyindex_entry_t),
+                  ngx_http_fancyindex_cmp_entries_mtime_desc);
+    }
+
+    /* 按文件名排序，在锁外完成 */
+    names = ngx_palloc(r->pool, (entries->nelts + 1) * sizeof(ngx_str_t *));
+    if (names != NULL) {
+        for (i = 0; i < entries->nelts; i++)
+            names[i] = &entry[i].name;
+
+        if (entries->nelts > 1) {
+            ngx_qsort(names, (size_t) entries->nelts, sizeof(ngx_str_t *),
+                      ngx_http_fancyindex_cmp_names);
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    tb = NULL;
+    cn = ngx_http_fancyindex_cache_lookup_locked(cache, alcf, path, hash);
+    if (cn != NULL) {
+        if (names != NULL)
+            tb = ngx_http_fancyindex_cache_tombstones_locked(cache, cn, names,
+                                                             entries->nelts);
+        ngx_http_fancyindex_cache_delete_locked(cache, cn);
+    }
+
+    (void) ngx_http_fancyindex_cache_expire_locked(cache, 0);
+
+    cn = ngx_http_fancyindex_cache_alloc_locked(cache,
+            offsetof(ngx_http_fancyindex_cache_node_t, path) + path->len);
+    if (cn == NULL)
+        goto failed;
+
+    ngx_memzero(cn, sizeof(ngx_http_fancyindex_cache_node_t));
+
+    if (entries->nelts) {
+        cn->entries = ngx_http_fancyindex_cache_alloc_locked(cache, size);
+        if (cn->entries == NULL) {
+            ngx_slab_free_locked(cache->shpool, cn);
+            goto failed;
+        }
+
+        ce = cn->entries;
+        p = (u_char *) (ce + entries->nelts);
 
-    /* 参见上面：ngx_http_subrequest返回NGX_OK (0)而不是NGX_HTTP_OK (200) */
-    if (sr->headers_out.status != NGX_OK) {
         /*
-         * XXX: 如果我们收到404以外的状态码，是否应该在错误日志中记录消息？
+         * 与从缓存中取得的列表一样，本请求的条目也改为指向节点中的文件名，
+         * 见ngx_http_fancyindex_perm_save()
          */
-        out[0].next = NULL;
-        out[0].buf = ngx_calloc_buf(r->pool);
-        if (out[0].buf == NULL)
-            return NGX_ERROR;
-        out[0].buf->memory = 1;
-        out[0].buf->pos = (u_char*) t08_foot1;
-        out[0].buf->last = (u_char*) t08_foot1 + sizeof(t08_foot1) - 1;
-        out[0].buf->last_in_chain = 1;
-        out[0].buf->last_buf = 1;
-        /* 直接发送内置页脚 */
-        return ngx_http_output_filter(r, &out[0]);
+        for (i = 0; i < entries->nelts; i++) {
+            ce[i] = entry[i];
+            ce[i].name.data = p;
+            ngx_str_null(&ce[i].key);
+            ce[i].sum = NULL;
+            p = ngx_cpymem(p, entry[i].name.data, entry[i].name.len);
+            *p++ = '\0';
+            entry[i].name.data = ce[i].name.data;
+        }
+    }
+
+    cn->node.key = hash;
+    cn->conf = alcf;
+    cn->generation = cache->generation;
+    cn->mtime = mtime;
+    cn->time = start;
+    cn->expire = ngx_time() + alcf->cache_valid;
+    cn->nelts = entries->nelts;
+    cn->tombstones = tb;
+    cn->utf8 = ngx_http_fancyindex_is_utf8(r);
+    cn->len = path->len;
+    ngx_memcpy(cn->path, path->data, path->len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_http_fancyindex_cache_release_locked(ccln);
+    cn->count++;
+    ccln->node = cn;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return;
+
+failed:
+
+    if (tb != NULL)
+        ngx_slab_free_locked(cache->shpool, tb);
+
+    ngx_http_fancyindex_cache_release_locked(ccln);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "fancyindex: listing of \"%V\" (%ui entries) does not fit "
+                  "into cache zone \"%V\"", path, entries->nelts,
+                  &alcf->cache_zone->shm.name);
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_fancyindex_cache_body_match(ngx_http_fancyindex_cache_body_t *body,
+        ngx_http_request_t *r, ngx_uint_t encoding)
+{
+    return body->encoding == encoding
+        && body->uri_len == r->uri.len
+        && body->args_len == r->args.len
+        && ngx_memcmp(body->data, r->uri.data, r->uri.len) == 0
+        && ngx_memcmp(body->data + r->uri.len, r->args.data, r->args.len) == 0;
+}
+
+
+/* 查找预先压缩的响应体。ccln持有节点的引用，响应体在请求结束前有效。 */
+static ngx_http_fancyindex_cache_body_t *
+ngx_http_fancyindex_cache_body_find(ngx_http_request_t *r,
+        ngx_http_fancyindex_cache_cleanup_t *ccln, ngx_uint_t encoding)
+{
+    ngx_http_fancyindex_cache_body_t  *body;
+
+    if (ccln == NULL || ccln->node == NULL || ccln->node->pending)
+        return NULL;
+
+    ngx_shmtx_lock(&ccln->cache->shpool->mutex);
+
+    for (body = ccln->node->bodies; body; body = body->next) {
+        if (ngx_http_fancyindex_cache_body_match(body, r, encoding))
+            break;
+    }
+
+    ngx_shmtx_unlock(&ccln->cache->shpool->mutex);
+
+    return (body && !body->pending) ? body : NULL;
+}
+
+
+/*
+ * 在节点中加入占位，由调用者压缩响应体。节点已失效、已有相同的响应体或
+ * 者其他请求正在压缩时返回NULL。
+ */
+static ngx_http_fancyindex_cache_body_t *
+ngx_http_fancyindex_cache_body_claim(ngx_http_request_t *r,
+        ngx_http_fancyindex_cache_cleanup_t *ccln, ngx_uint_t encoding)
+{
+    u_char                            *p;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+    ngx_http_fancyindex_cache_body_t  *body;
+
+    if (ccln == NULL || ccln->node == NULL || ccln->node->pending)
+        return NULL;
+
+    cache = ccln->cache;
+    cn = ccln->node;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    body = NULL;
+
+    if (cn->deleted)
+        goto done;
+
+    for (body = cn->bodies; body; body = body->next) {
+        if (ngx_http_fancyindex_cache_body_match(body, r, encoding)) {
+            body = NULL;
+            goto done;
+        }
+    }
+
+    body = ngx_http_fancyindex_cache_alloc_locked(cache,
+                offsetof(ngx_http_fancyindex_cache_body_t, data)
+                + r->uri.len + r->args.len);
+    if (body == NULL)
+        goto done;
+
+    body->encoding = encoding;
+    body->pending = 1;
+    body->uri_len = r->uri.len;
+    body->args_len = r->args.len;
+    body->len = 0;
+
+    p = ngx_cpymem(body->data, r->uri.data, r->uri.len);
+    ngx_memcpy(p, r->args.data, r->args.len);
+
+    body->next = cn->bodies;
+    cn->bodies = body;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return body;
+}
+
+
+/*
+ * 用压缩后的响应体替换占位。data为NULL（压缩失败）、节点已失效或共享
+ * 内存不足时只删除占位，共享内存不足时返回NGX_DECLINED。
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_body_fill_locked(ngx_http_fancyindex_cache_t *cache,
+        ngx_http_fancyindex_cache_node_t *cn,
+        ngx_http_fancyindex_cache_body_t *pending, ngx_str_t *data)
+{
+    size_t                             len;
+    ngx_int_t                          rc;
+    ngx_http_fancyindex_cache_body_t  *body, **pb;
+
+    for (pb = &cn->bodies; *pb != pending; pb = &(*pb)->next) {
+        /* void */
+    }
+
+    *pb = pending->next;
+
+    rc = NGX_OK;
+
+    if (data != NULL && !cn->deleted) {
+        len = pending->uri_len + pending->args_len;
+
+        body = ngx_http_fancyindex_cache_alloc_locked(cache,
+                    offsetof(ngx_http_fancyindex_cache_body_t, data)
+                    + len + data->len);
+        if (body == NULL) {
+            rc = NGX_DECLINED;
+
+        } else {
+            ngx_memcpy(body, pending,
+                       offsetof(ngx_http_fancyindex_cache_body_t, data) + len);
+            ngx_memcpy(body->data + len, data->data, data->len);
+            body->pending = 0;
+            body->len = data->len;
+
+            body->next = cn->bodies;
+            cn->bodies = body;
+        }
+    }
+
+    ngx_slab_free_locked(cache->shpool, pending);
+
+    return rc;
+}
+
+
+/* 比较函数是否比较排序键 */
+static ngx_inline ngx_uint_t
+ngx_http_fancyindex_keyed(ngx_http_fancyindex_cmp_pt cmp)
+{
+    return (cmp == ngx_http_fancyindex_cmp_entries_version_asc
+            || cmp == ngx_http_fancyindex_cmp_entries_version_desc
+            || cmp == ngx_http_fancyindex_cmp_entries_collate_asc
+            || cmp == ngx_http_fancyindex_cmp_entries_collate_desc);
+}
+
+
+/* 比较函数对应的缓存顺序，*desc为是否降序 */
+static ngx_uint_t
+ngx_http_fancyindex_perm_slot(ngx_http_fancyindex_cmp_pt cmp, ngx_uint_t *desc)
+{
+    *desc = (cmp == ngx_http_fancyindex_cmp_entries_name_cs_desc
+             || cmp == ngx_http_fancyindex_cmp_entries_name_ci_desc
+             || cmp == ngx_http_fancyindex_cmp_entries_collate_desc
+             || cmp == ngx_http_fancyindex_cmp_entries_size_desc
+             || cmp == ngx_http_fancyindex_cmp_entries_mtime_desc
+             || cmp == ngx_http_fancyindex_cmp_entries_version_desc);
+
+    if (cmp == ngx_http_fancyindex_cmp_entries_version_asc
+        || cmp == ngx_http_fancyindex_cmp_entries_version_desc)
+    {
+        return NGX_HTTP_FANCYINDEX_PERM_VERSION;
+    }
+
+    if (cmp == ngx_http_fancyindex_cmp_entries_size_asc
+        || cmp == ngx_http_fancyindex_cmp_entries_size_desc)
+    {
+        return NGX_HTTP_FANCYINDEX_PERM_SIZE;
+    }
+
+    if (cmp == ngx_http_fancyindex_cmp_entries_mtime_asc
+        || cmp == ngx_http_fancyindex_cmp_entries_mtime_desc)
+    {
+        return NGX_HTTP_FANCYINDEX_PERM_MTIME;
+    }
+
+    /* 节点属于一个location，名称的比较方式是确定的 */
+    return NGX_HTTP_FANCYINDEX_PERM_NAME;
+}
+
+
+/* 列表是缓存节点中完整的列表时返回该节点 */
+static ngx_http_fancyindex_cache_node_t *
+ngx_http_fancyindex_perm_node(ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    if (ctx->cache_cln == NULL || ctx->recent || ctx->filter.delta
+        || ctx->filter.query.len || ctx->entries.nelts < 2)
+    {
+        return NULL;
+    }
+
+    cn = ctx->cache_cln->node;
+
+    if (cn == NULL || cn->pending || cn->nelts != ctx->entries.nelts)
+        return NULL;
+
+    return cn;
+}
+
+
+/*
+ * 将perm[lo, hi)按相反的顺序写入out。比较结果相同的条目仍保持原来的顺序，
+ * 与稳定排序得到的相反顺序一致。排序键各不相同，cmp为NULL。
+ */
+static void
+ngx_http_fancyindex_perm_reverse(ngx_http_fancyindex_entry_t *out,
+        ngx_http_fancyindex_entry_t *ce, uint32_t *perm, ngx_uint_t lo,
+        ngx_uint_t hi, ngx_http_fancyindex_cmp_pt cmp)
+{
+    ngx_uint_t  i, j, k;
+
+    for (i = hi; i > lo; i = j) {
+        for (j = i - 1; j > lo && cmp; j--) {
+            if (cmp(&ce[perm[j - 1]], &ce[perm[j]]) != 0)
+                break;
+        }
+
+        for (k = j; k < i; k++)
+            *out++ = ce[perm[k]];
+    }
+}
+
+
+/*
+ * 缓存节点中已有该排序方式的顺序时按其重新排列条目，之后不需要排序。
+ * 降序时反向使用升序的顺序，反之亦然。
+ */
+static void
+ngx_http_fancyindex_perm_load(ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_cmp_pt cmp)
+{
+    uint32_t                          *perm;
+    ngx_uint_t                         i, n, d, slot, desc, pdesc;
+    ngx_http_fancyindex_entry_t       *entry, *ce;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    if ((cn = ngx_http_fancyindex_perm_node(ctx)) == NULL)
+        return;
+
+    slot = ngx_http_fancyindex_perm_slot(cmp, &desc);
+
+    /* 保存后不再改变，节点在请求结束前有效 */
+    ngx_shmtx_lock(&ctx->cache_cln->cache->shpool->mutex);
+    perm = cn->perms[slot];
+    pdesc = (cn->perm_desc >> slot) & 1;
+    ngx_shmtx_unlock(&ctx->cache_cln->cache->shpool->mutex);
+
+    if (perm == NULL)
+        return;
+
+    entry = ctx->entries.elts;
+    ce = cn->entries;
+    n = cn->nelts;
+
+    if (desc == pdesc) {
+        for (i = 0; i < n; i++)
+            entry[i] = ce[perm[i]];
+
+    } else {
+        /* 目录和文件分别反向 */
+        d = 0;
+        if (alcf->dirs_first) {
+            while (d < n && ce[perm[d]].dir)
+                d++;
+        }
+
+        /* 缓存中的条目没有排序键 */
+        if (ngx_http_fancyindex_keyed(cmp))
+            cmp = NULL;
+
+        ngx_http_fancyindex_perm_reverse(entry, ce, perm, 0, d, cmp);
+        ngx_http_fancyindex_perm_reverse(entry + d, ce, perm, d, n, cmp);
+    }
+
+    ctx->sorted = 1;
+}
+
+
+/*
+ * 将排序后的顺序保存到缓存节点中。条目的文件名指向节点中按条目顺序存放
+ * 的文件名，由其地址得到条目在节点中的位置。共享内存不足时不保存。
+ */
+static void
+ngx_http_fancyindex_perm_save(ngx_http_request_t *r,
+        ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_cmp_pt cmp)
+{
+    size_t                             size;
+    uint32_t                          *perm, *p;
+    ngx_uint_t                         i, n, lo, hi, mid, slot, desc;
+    ngx_http_fancyindex_entry_t       *entry, *ce;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    if ((cn = ngx_http_fancyindex_perm_node(ctx)) == NULL
+        || cn->nelts > NGX_MAX_UINT32_VALUE)
+    {
+        return;
+    }
+
+    cache = ctx->cache_cln->cache;
+    slot = ngx_http_fancyindex_perm_slot(cmp, &desc);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    p = cn->perms[slot];
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (p != NULL)
+        return;
+
+    entry = ctx->entries.elts;
+    ce = cn->entries;
+    n = cn->nelts;
+    size = n * sizeof(uint32_t);
+
+    if ((perm = ngx_palloc(r->pool, size)) == NULL)
+        return;
+
+    for (i = 0; i < n; i++) {
+        lo = 0;
+        hi = n;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (ce[mid].name.data < entry[i].name.data)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo == n || ce[lo].name.data != entry[i].name.data)
+            return;
+
+        perm[i] = (uint32_t) lo;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (!cn->deleted && cn->perms[slot] == NULL) {
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (p != NULL) {
+            ngx_memcpy(p, perm, size);
+            cn->perms[slot] = p;
+
+            if (desc)
+                cn->perm_desc |= 1 << slot;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_pfree(r->pool, perm);
+}
+
+
+/*
+ * 将请求的URI映射为目录路径，去掉结尾的'/'并以'\0'结尾。*allocated为
+ * path->data指向的缓冲区的大小。
+ */
+static ngx_int_t
+ngx_http_fancyindex_map_path(ngx_http_request_t *r, ngx_str_t *path,
+        size_t *allocated)
+{
+    size_t   root;
+    u_char  *last;
+
+    /*
+     * NGX_DIR_MASK_LEN 小于 NGX_HTTP_FANCYINDEX_PREALLOCATE
+     */
+    if ((last = ngx_http_map_uri_to_path(r, path, &root,
+                    NGX_HTTP_FANCYINDEX_PREALLOCATE)) == NULL)
+        return NGX_ERROR;
+
+    *allocated = path->len;
+    path->len = last - path->data;
+    if (path->len > 1) {
+        path->len--;
+    }
+    path->data[path->len] = '\0';
+
+    return NGX_OK;
+}
+
+
+/* 按名称排序时的比较函数，设置了排序规则时比较排序键 */
+static ngx_http_fancyindex_cmp_pt
+ngx_http_fancyindex_name_cmp(ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_uint_t desc)
+{
+    if (alcf->collation) {
+        return desc ? ngx_http_fancyindex_cmp_entries_collate_desc
+                    : ngx_http_fancyindex_cmp_entries_collate_asc;
+    }
+
+    if (alcf->case_sensitive) {
+        return desc ? ngx_http_fancyindex_cmp_entries_name_cs_desc
+                    : ngx_http_fancyindex_cmp_entries_name_cs_asc;
+    }
+
+    return desc ? ngx_http_fancyindex_cmp_entries_name_ci_desc
+                : ngx_http_fancyindex_cmp_entries_name_ci_asc;
+}
+
+
+/*
+ * 根据请求参数和fancyindex_default_sort确定排序函数。*sort_url_args为
+ * 列表中的链接需要附加的排序参数。
+ */
+static ngx_http_fancyindex_cmp_pt
+ngx_http_fancyindex_sort_func(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, const char **sort_url_args)
+{
+    ngx_http_fancyindex_cmp_pt  sort_cmp_func;
+
+    *sort_url_args = "";
+
+    /*
+     * 确定排序标准。URL参数格式如下：
+     *
+     *    C=x[&O=y]
+     *
+     * 其中x={M,S,N,V}表示排序依据(M:修改时间,S:大小,N:名称,V:版本号)，
+     * y={A,D}表示排序方向(A:升序,D:降序)
+     */
+    if ((r->args.len == 3 || (r->args.len == 7 && r->args.data[3] == '&')) &&
+        r->args.data[0] == 'C' && r->args.data[1] == '=')
+    {
+        /* 确定排序方向 */
+        ngx_int_t sort_descending = r->args.len == 7
+                                 && r->args.data[4] == 'O'
+                                 && r->args.data[5] == '='
+                                 && r->args.data[6] == 'D';
+
+        /* 选择排序标准 */
+        switch (r->args.data[2]) {
+            case 'M': /* 按修改时间排序 */
+                if (sort_descending) {
+                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC)
+                        *sort_url_args = "?C=M&amp;O=D";
+                }
+                else {
+                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE)
+                        *sort_url_args = "?C=M&amp;O=A";
+                }
+                break;
+            case 'S': /* 按大小排序 */
+                if (sort_descending) {
+                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC)
+                        *sort_url_args = "?C=S&amp;O=D";
+                }
+                else {
+                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
+                        if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE)
+                    *sort_url_args = "?C=S&amp;O=A";
+                }
+                break;
+            case 'N': /* 按名称排序 */
+            default:
+                if (sort_descending) {
+                    sort_cmp_func = ngx_http_fancyindex_name_cmp(alcf, 1);
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC)
+                        *sort_url_args = "?C=N&amp;O=D";
+                }
+                else {
+                    sort_cmp_func = ngx_http_fancyindex_name_cmp(alcf, 0);
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME)
+                        *sort_url_args = "?C=N&amp;O=A";
+                }
+                break;
+            case 'V': /* 按版本号排序 */
+                if (sort_descending) {
+                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_version_desc;
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION_DESC)
+                        *sort_url_args = "?C=V&amp;O=D";
+                }
+                else {
+                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_version_asc;
+                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION)
+                        *sort_url_args = "?C=V&amp;O=A";
+                }
+                break;
+        }
+    }
+    else {
+        switch (alcf->default_sort) {
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
+                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
+                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
+                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
+                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC:
+                sort_cmp_func = ngx_http_fancyindex_name_cmp(alcf, 1);
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION_DESC:
+                sort_cmp_func = ngx_http_fancyindex_cmp_entries_version_desc;
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_VERSION:
+                sort_cmp_func = ngx_http_fancyindex_cmp_entries_version_asc;
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME:
+            default:
+                sort_cmp_func = ngx_http_fancyindex_name_cmp(alcf, 0);
+                break;
+        }
+    }
+
+    return sort_cmp_func;
+}
+
+
+/*
+ * 生成按版本号排序的键：数字串去掉开头的'0'后写为'0'、两字节的长度和
+ * 数字，其他字符按原样（不区分大小写时转为小写），因此逐字节比较即为
+ * 按数字大小比较。最后是'\0'和原来的文件名，使键各不相同。dst至少有
+ * 5 * len + 1字节。
+ */
+static u_char *
+ngx_http_fancyindex_version_key(u_char *dst, u_char *name, size_t len,
+        ngx_uint_t fold)
+{
+    size_t   i, j;
+
+    for (i = 0; i < len; /* void */) {
+        if (name[i] < '0' || name[i] > '9') {
+            *dst++ = fold ? ngx_tolower(name[i]) : name[i];
+            i++;
+            continue;
+        }
+
+        while (i < len && name[i] == '0')
+            i++;
+
+        for (j = i; j < len && name[j] >= '0' && name[j] <= '9'; j++) {
+            /* void */
+        }
+
+        /* 其他字符都不是数字，与数字串比较时同样按'0'的位置 */
+        *dst++ = '0';
+        *dst++ = (u_char) ((j - i) >> 8);
+        *dst++ = (u_char) (j - i);
+        dst = ngx_cpymem(dst, name + i, j - i);
+        i = j;
+    }
+
+    *dst++ = '\0';
+
+    return ngx_cpymem(dst, name, len);
+}
+
+
+#if (NGX_HAVE_STRXFRM_L)
+
+/*
+ * 按排序规则生成名称的排序键：strxfrm_l()的结果、'\0'和原来的文件名。
+ * strxfrm_l()的结果逐字节比较与strcoll_l()一致，文件名都以'\0'结尾。
+ * 返回键的长度，大于size时dst中的键不完整，需要更大的缓冲区重新生成。
+ */
+static size_t
+ngx_http_fancyindex_collate_key(u_char *dst, size_t size, ngx_str_t *name,
+        locale_t locale)
+{
+    size_t  n;
+
+    n = strxfrm_l((char *) dst, (char *) name->data, size, locale);
+
+    if (n + 1 + name->len <= size) {
+        dst[n] = '\0';
+        ngx_memcpy(dst + n + 1, name->data, name->len);
+    }
+
+    return n + 1 + name->len;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_collate_keys(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    size_t                        n, size;
+    u_char                       *buf, *p;
+    ngx_uint_t                    i;
+    ngx_http_fancyindex_entry_t  *entry;
+
+    size = 1024;
+    if ((buf = ngx_alloc(size, r->connection->log)) == NULL)
+        return NGX_ERROR;
+
+    entry = ctx->entries.elts;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        n = ngx_http_fancyindex_collate_key(buf, size, &entry[i].name,
+                                            alcf->collation->locale);
+
+        if (n > size) {
+            ngx_free(buf);
+            size = n;
+
+            if ((buf = ngx_alloc(size, r->connection->log)) == NULL)
+                return NGX_ERROR;
+
+            (void) ngx_http_fancyindex_collate_key(buf, size, &entry[i].name,
+                                                   alcf->collation->locale);
+        }
+
+        if ((p = ngx_pnalloc(r->pool, n)) == NULL) {
+            ngx_free(buf);
+            return NGX_ERROR;
+        }
+
+        entry[i].key.data = p;
+        entry[i].key.len = n;
+        ngx_memcpy(p, buf, n);
+    }
+
+    ngx_free(buf);
+
+    return NGX_OK;
+}
+
+#endif
+
+
+/* 排序方式需要排序键时为每个条目生成一次，排序时只比较键 */
+static ngx_int_t
+ngx_http_fancyindex_sort_keys(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_cmp_pt cmp)
+{
+    size_t                        size;
+    u_char                       *p;
+    ngx_uint_t                    i;
+    ngx_http_fancyindex_entry_t  *entry;
+
+    if (!ngx_http_fancyindex_keyed(cmp))
+        return NGX_OK;
+
+#if (NGX_HAVE_STRXFRM_L)
+    if (cmp == ngx_http_fancyindex_cmp_entries_collate_asc
+        || cmp == ngx_http_fancyindex_cmp_entries_collate_desc)
+    {
+        return ngx_http_fancyindex_collate_keys(r, alcf, ctx);
+    }
+#endif
+
+    entry = ctx->entries.elts;
+    size = 0;
+
+    for (i = 0; i < ctx->entries.nelts; i++)
+        size += 5 * entry[i].name.len + 1;
+
+    if ((p = ngx_pnalloc(r->pool, size ? size : 1)) == NULL)
+        return NGX_ERROR;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        entry[i].key.data = p;
+        p = ngx_http_fancyindex_version_key(p, entry[i].name.data,
+                                            entry[i].name.len,
+                                            !alcf->case_sensitive);
+        entry[i].key.len = p - entry[i].key.data;
+    }
+
+    return NGX_OK;
+}
+
+
+/* 将目录移到文件前面，返回目录数 */
+static ngx_uint_t
+ngx_http_fancyindex_partition_dirs(ngx_http_fancyindex_entry_t *entry,
+        ngx_uint_t n)
+{
+    ngx_http_fancyindex_entry_t *l, *r;
+
+    l = entry;
+    r = entry + n - 1;
+    while (l < r)
+    {
+        while (l < r && l->dir)
+            l++;
+        while (l < r && !r->dir)
+            r--;
+        if (l < r) {
+            /* 现在l指向文件而r指向目录 */
+            ngx_http_fancyindex_entry_t tmp;
+            tmp = *l;
+            *l = *r;
+            *r = tmp;
+        }
+    }
+    if (r->dir)
+        r++;
+
+    return r - entry;
+}
+
+
+/*
+ * 排序条目。启用fancyindex_directories_first时先将目录移到前面，再分别
+ * 对目录和文件排序。
+ */
+static void
+ngx_http_fancyindex_sort_entries(ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_http_fancyindex_entry_t *entry, ngx_uint_t n,
+        ngx_http_fancyindex_cmp_pt sort_cmp_func)
+{
+    ngx_uint_t  d;
+
+    if (n > 1) {
+        if (alcf->dirs_first)
+        {
+            d = ngx_http_fancyindex_partition_dirs(entry, n);
+
+            if (d > 0)
+                /* 对目录进行排序 */
+                ngx_qsort(entry, (size_t) d,
+                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
+            if (d < n)
+                /* 对文件进行排序 */
+                ngx_qsort(entry + d, (size_t)(n - d),
+                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
+        } else {
+            ngx_qsort(entry, (size_t)n,
+                    sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
+        }
+    }
+}
+
+
+/* 排序列表并将顺序保存到缓存中，已经排序或者是最近的文件时不需要排序 */
+static void
+ngx_http_fancyindex_sort(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_cmp_pt sort_cmp_func)
+{
+    if (ctx->recent || ctx->sorted)
+        return;
+
+    ngx_http_fancyindex_sort_entries(alcf, ctx->entries.elts,
+                                     ctx->entries.nelts, sort_cmp_func);
+    ngx_http_fancyindex_perm_save(r, ctx, sort_cmp_func);
+    ctx->sorted = 1;
+}
+
+
+#if (NGX_THREADS)
+
+/* 并行排序时每个区间分成的段数 */
+#define NGX_HTTP_FANCYINDEX_SORT_PARTS  8
+
+/* 合并有序的a和b到dst，相等的条目中a的在前 */
+static void
+ngx_http_fancyindex_merge(ngx_http_fancyindex_entry_t *dst,
+        ngx_http_fancyindex_entry_t *a, ngx_uint_t na,
+        ngx_http_fancyindex_entry_t *b, ngx_uint_t nb,
+        ngx_http_fancyindex_cmp_pt cmp)
+{
+    ngx_http_fancyindex_entry_t  *ea = a + na, *eb = b + nb;
+
+    /* 两段已经有序，常见于按名称读取的目录 */
+    if (na && nb && cmp(ea - 1, b) > 0) {
+        while (a < ea && b < eb) {
+            if (cmp(b, a) < 0)
+                *dst++ = *b++;
+            else
+                *dst++ = *a++;
+        }
+    }
+
+    if (a < ea) {
+        ngx_memcpy(dst, a, (ea - a) * sizeof(ngx_http_fancyindex_entry_t));
+        dst += ea - a;
+    }
+
+    if (b < eb)
+        ngx_memcpy(dst, b, (eb - b) * sizeof(ngx_http_fancyindex_entry_t));
+}
+
+
+/* 稳定的归并排序，tmp至少有n个条目 */
+static void
+ngx_http_fancyindex_msort(ngx_http_fancyindex_entry_t *base,
+        ngx_http_fancyindex_entry_t *tmp, ngx_uint_t n,
+        ngx_http_fancyindex_cmp_pt cmp)
+{
+    ngx_uint_t                    i, j, h;
+    ngx_http_fancyindex_entry_t   e;
+
+    if (n <= 16) {
+        for (i = 1; i < n; i++) {
+            e = base[i];
+            for (j = i; j > 0 && cmp(&base[j - 1], &e) > 0; j--)
+                base[j] = base[j - 1];
+            base[j] = e;
+        }
+        return;
+    }
+
+    h = n / 2;
+    ngx_http_fancyindex_msort(base, tmp, h, cmp);
+    ngx_http_fancyindex_msort(base + h, tmp + h, n - h, cmp);
+
+    if (cmp(&base[h - 1], &base[h]) <= 0)
+        return;
+
+    ngx_http_fancyindex_merge(tmp, base, h, base + h, n - h, cmp);
+    ngx_memcpy(base, tmp, n * sizeof(ngx_http_fancyindex_entry_t));
+}
+
+
+/* 排序的一个区间，启用fancyindex_directories_first时目录和文件各一个 */
+typedef struct {
+    ngx_http_fancyindex_entry_t         *base;
+    ngx_http_fancyindex_entry_t         *tmp;        /* 与base同样长度 */
+    ngx_uint_t                           n;
+    ngx_uint_t                           width;      /* 有序的段的长度 */
+    unsigned                             in_tmp:1;   /* 有序的段在tmp中 */
+} ngx_http_fancyindex_psort_range_t;
+
+/* 在线程池中进行的排序，每一轮的任务都完成后再开始下一轮 */
+typedef struct {
+    ngx_http_fancyindex_psort_range_t    range[2];
+    ngx_uint_t                           nranges;
+    ngx_uint_t                           round;      /* 0为排序各段 */
+    ngx_uint_t                           pending;
+    ngx_http_fancyindex_cmp_pt           cmp;
+    ngx_http_request_t                  *r;
+    ngx_http_fancyindex_ctx_t           *ctx;
+    ngx_thread_task_t                   *tasks[2 * NGX_HTTP_FANCYINDEX_SORT_PARTS];
+    uint64_t                            *sort_time;  /* Server-Timing */
+    uint64_t                             start;
+} ngx_http_fancyindex_psort_t;
+
+/* 一个任务：排序src中的[lo, hi)，或者将其中的两段合并到dst */
+typedef struct {
+    ngx_http_fancyindex_psort_t         *ps;
+    ngx_http_fancyindex_entry_t         *src;
+    ngx_http_fancyindex_entry_t         *dst;        /* NULL时排序 */
+    ngx_http_fancyindex_entry_t         *tmp;
+    ngx_http_fancyindex_entry_t         *base;       /* 非NULL时复制回base */
+    ngx_uint_t                           lo, mid, hi;
+} ngx_http_fancyindex_psort_task_t;
+
+
+static void
+ngx_http_fancyindex_psort_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_psort_task_t  *pt = data;
+    ngx_http_fancyindex_cmp_pt         cmp = pt->ps->cmp;
+
+    if (pt->dst == NULL) {
+        ngx_http_fancyindex_msort(pt->src + pt->lo, pt->tmp + pt->lo,
+                                  pt->hi - pt->lo, cmp);
+        return;
+    }
+
+    ngx_http_fancyindex_merge(pt->dst + pt->lo, pt->src + pt->lo,
+                              pt->mid - pt->lo, pt->src + pt->mid,
+                              pt->hi - pt->mid, cmp);
+
+    if (pt->base) {
+        ngx_memcpy(pt->base + pt->lo, pt->dst + pt->lo,
+                   (pt->hi - pt->lo) * sizeof(ngx_http_fancyindex_entry_t));
+    }
+}
+
+
+static void ngx_http_fancyindex_psort_done(ngx_event_t *ev);
+
+
+/*
+ * 放入下一轮的任务。无法放入线程池的任务直接执行，整轮都已执行时继续
+ * 下一轮。全部完成后返回NGX_OK，否则返回NGX_DONE。
+ */
+static ngx_int_t
+ngx_http_fancyindex_psort_next(ngx_http_fancyindex_psort_t *ps)
+{
+    ngx_uint_t                          i, k, lo, w;
+    ngx_thread_task_t                  *task;
+    ngx_http_fancyindex_psort_task_t   *pt;
+    ngx_http_fancyindex_psort_range_t  *rg;
+    ngx_http_fancyindex_main_conf_t    *mcf;
+
+    mcf = ngx_http_get_module_main_conf(ps->r, ngx_http_fancyindex_module);
+
+    for ( ;; ) {
+        k = 0;
+
+        for (i = 0; i < ps->nranges; i++) {
+            rg = &ps->range[i];
+
+            if (ps->round > 0 && rg->width >= rg->n)
+                continue;
+
+            /* 第一轮的段长为width，之后每轮合并相邻的两段 */
+            w = (ps->round == 0) ? rg->width : 2 * rg->width;
+
+            for (lo = 0; lo < rg->n; lo += w) {
+                task = ps->tasks[k++];
+                pt = task->ctx;
+
+                pt->lo = lo;
+                pt->hi = ngx_min(lo + w, rg->n);
+                pt->base = NULL;
+
+                if (ps->round == 0) {
+                    /* 各段使用tmp中对应的位置，不会重叠 */
+                    pt->src = rg->base;
+                    pt->dst = NULL;
+                    pt->tmp = rg->tmp;
+                    continue;
+                }
+
+                pt->mid = ngx_min(lo + rg->width, rg->n);
+                pt->src = rg->in_tmp ? rg->tmp : rg->base;
+                pt->dst = rg->in_tmp ? rg->base : rg->tmp;
+
+                /* 最后一轮合并到tmp时复制回来 */
+                if (w >= rg->n && !rg->in_tmp)
+                    pt->base = rg->base;
+            }
+
+            if (ps->round > 0) {
+                rg->width = w;
+                rg->in_tmp = !rg->in_tmp;
+            }
+        }
+
+        if (k == 0)
+            return NGX_OK;
+
+        ps->round++;
+
+        for (i = 0; i < k; i++) {
+            task = ps->tasks[i];
+
+            if (ngx_thread_task_post(mcf->thread_pool, task) == NGX_OK) {
+                ps->pending++;
+                continue;
+            }
+
+            ngx_http_fancyindex_psort_thread(task->ctx, ps->r->connection->log);
+        }
+
+        if (ps->pending)
+            return NGX_DONE;
+    }
+}
+
+
+static void
+ngx_http_fancyindex_psort_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t                 *task = ev->data;
+    ngx_http_fancyindex_psort_task_t  *pt = task->ctx;
+    ngx_http_fancyindex_psort_t       *ps = pt->ps;
+    ngx_http_fancyindex_ctx_t         *ctx = ps->ctx;
+
+    if (--ps->pending || ngx_http_fancyindex_psort_next(ps) != NGX_OK)
+        return;
+
+    ps->r->main->blocked--;
+
+    if (ps->sort_time)
+        *ps->sort_time += ngx_fancyindex_usec() - ps->start;
+
+    ctx->sorted = 1;
+    ngx_post_event(&ctx->wait, &ngx_posted_events);
+}
+
+
+/*
+ * 在线程池中排序，结果与ngx_http_fancyindex_sort_entries()相同。需要等待
+ * 时返回NGX_DONE，完成后投递ctx->wait。
+ */
+static ngx_int_t
+ngx_http_fancyindex_psort(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_cmp_pt cmp, uint64_t *sort_time)
+{
+    ngx_uint_t                          i, d, n, parts;
+    ngx_http_fancyindex_entry_t        *entry, *tmp;
+    ngx_http_fancyindex_psort_t        *ps;
+    ngx_http_fancyindex_psort_task_t   *pt;
+    ngx_http_fancyindex_psort_range_t  *rg;
+
+    entry = ctx->entries.elts;
+    n = ctx->entries.nelts;
+
+    ps = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_psort_t));
+    tmp = ngx_palloc(r->pool, n * sizeof(ngx_http_fancyindex_entry_t));
+    if (ps == NULL || tmp == NULL)
+        return NGX_ERROR;
+
+    for (i = 0; i < 2 * NGX_HTTP_FANCYINDEX_SORT_PARTS; i++) {
+        ps->tasks[i] = ngx_thread_task_alloc(r->pool,
+                                   sizeof(ngx_http_fancyindex_psort_task_t));
+        if (ps->tasks[i] == NULL)
+            return NGX_ERROR;
+
+        pt = ps->tasks[i]->ctx;
+        pt->ps = ps;
+
+        ps->tasks[i]->handler = ngx_http_fancyindex_psort_thread;
+        ps->tasks[i]->event.handler = ngx_http_fancyindex_psort_done;
+        ps->tasks[i]->event.data = ps->tasks[i];
+        ps->tasks[i]->event.log = r->connection->log;
+    }
+
+    d = alcf->dirs_first ? ngx_http_fancyindex_partition_dirs(entry, n) : 0;
+
+    /* 目录和文件分别排序 */
+    for (i = 0; i < 2; i++) {
+        rg = &ps->range[ps->nranges];
+
+        rg->base = (i == 0) ? entry : entry + d;
+        rg->tmp = (i == 0) ? tmp : tmp + d;
+        rg->n = (i == 0) ? d : n - d;
+
+        if (rg->n < 2)
+            continue;
+
+        parts = ngx_min(rg->n, NGX_HTTP_FANCYINDEX_SORT_PARTS);
+        rg->width = (rg->n + parts - 1) / parts;
+        ps->nranges++;
+    }
+
+    ps->cmp = cmp;
+    ps->r = r;
+    ps->ctx = ctx;
+    ps->sort_time = sort_time;
+    ps->start = ngx_fancyindex_usec();
+
+    if (ngx_http_fancyindex_psort_next(ps) == NGX_OK) {
+        if (sort_time)
+            *sort_time += ngx_fancyindex_usec() - ps->start;
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: sorting %ui entries in %ui tasks",
+                   n, ps->pending);
+
+    /* 线程池中的任务使用请求的内存，完成前不能释放请求 */
+    r->main->blocked++;
+    ctx->sorting = 1;
+
+    return NGX_DONE;
+}
+
+#endif /* NGX_THREADS */
+/*
+ * 文件名是否匹配"q"参数，不区分ASCII大小写。包含通配符时整个文件名
+ * 需与之匹配，否则查找子串。name必须以'\0'结尾。
+ */
+static ngx_inline ngx_uint_t
+ngx_http_fancyindex_match_name(ngx_http_fancyindex_filter_t *filter,
+        u_char *name, size_t len)
+{
+    u_char     *p, *last;
+    ngx_str_t  *q = &filter->query;
+
+    if (filter->glob) {
+        /* 通配符之前的部分必须是文件名的前缀，不匹配时不调用fnmatch() */
+        if (filter->prefix
+            && (len < filter->prefix
+                || ngx_strncasecmp(name, q->data, filter->prefix) != 0))
+        {
+            return 0;
+        }
+
+        return fnmatch((char *) q->data, (char *) name, FNM_CASEFOLD) == 0;
+    }
+
+    if (len < q->len)
+        return 0;
+
+    if (!filter->exact) {
+        /* 先按首字符查找，再比较其余部分 */
+        return ngx_strlcasestrn(name, name + len, q->data, q->len - 1)
+               != NULL;
+    }
+
+    /* 没有字母时用memchr()查找首字节，再比较其余部分 */
+    last = name + len - q->len + 1;
+
+    for (p = name; p < last; p++) {
+        p = memchr(p, q->data[0], last - p);
+        if (p == NULL)
+            return 0;
+
+        if (ngx_memcmp(p + 1, q->data + 1, q->len - 1) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 确定自ctx->filter.since以来被删除的条目。客户端的列表不早于缓存中记录的
+ * 被删除条目的起始时间，或者不早于当前的列表时，被删除的条目是已知的。
+ */
+static void
+ngx_http_fancyindex_deleted(ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_cache_node_t        *cn;
+    ngx_http_fancyindex_cache_tombstones_t  *tb;
+
+    ctx->tombstones = NULL;
+    ctx->deleted = (ctx->filter.since >= ctx->time);
+
+    if (!alcf->cache_zone || ctx->cache_cln == NULL)
+        return;
+
+    /* 请求持有对节点的引用，被删除条目的列表不会改变 */
+    cn = ctx->cache_cln->node;
+    if (cn == NULL || cn->pending)
+        return;
+
+    tb = cn->tombstones;
+    if (tb != NULL && ctx->filter.since >= tb->since) {
+        ctx->tombstones = tb;
+        ctx->deleted = 1;
+    }
+}
+
+
+/* "since"列表在表格后附加的内容 */
+#define NGX_HTTP_FANCYINDEX_DELTA_START \
+    "<div class=\"delta\" data-time=\"%T\" data-since=\"%T\">" CRLF
+#define NGX_HTTP_FANCYINDEX_DELTA_DELETED  "<ul class=\"deleted\">" CRLF
+#define NGX_HTTP_FANCYINDEX_DELTA_UNKNOWN \
+    "<p class=\"deleted-unknown\">无法确定哪些条目已被删除，" \
+    "请重新获取完整的列表。</p>" CRLF
+#define NGX_HTTP_FANCYINDEX_DELTA_END      "</ul>" CRLF "</div>" CRLF
+
+
+static size_t
+ngx_http_fancyindex_delta_html_size(ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char                                  *p;
+    size_t                                   len, n;
+    ngx_uint_t                               i;
+    ngx_http_fancyindex_cache_tombstones_t  *tb = ctx->tombstones;
+
+    len = ngx_sizeof_ssz(NGX_HTTP_FANCYINDEX_DELTA_START) + 2 * NGX_TIME_T_LEN
+        + ngx_sizeof_ssz(NGX_HTTP_FANCYINDEX_DELTA_DELETED)
+        + ngx_sizeof_ssz(NGX_HTTP_FANCYINDEX_DELTA_UNKNOWN)
+        + ngx_sizeof_ssz(NGX_HTTP_FANCYINDEX_DELTA_END);
+
+    if (tb != NULL) {
+        for (p = tb->names, i = 0; i < tb->nelts; i++, p += n + 1) {
+            n = ngx_strlen(p);
+            len += ngx_sizeof_ssz("<li></li>" CRLF)
+                 + n + ngx_escape_html(NULL, p, n);
+        }
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_fancyindex_delta_html(u_char *last, ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char                                  *p;
+    size_t                                   n;
+    ngx_uint_t                               i;
+    ngx_http_fancyindex_cache_tombstones_t  *tb = ctx->tombstones;
+
+    last = ngx_sprintf(last, NGX_HTTP_FANCYINDEX_DELTA_START,
+                       ctx->time, ctx->filter.since);
+
+    if (!ctx->deleted) {
+        last = ngx_cpymem_ssz(last, NGX_HTTP_FANCYINDEX_DELTA_UNKNOWN);
+        return ngx_cpymem_ssz(last, "</div>" CRLF);
+    }
+
+    last = ngx_cpymem_ssz(last, NGX_HTTP_FANCYINDEX_DELTA_DELETED);
+
+    if (tb != NULL) {
+        for (p = tb->names, i = 0; i < tb->nelts; i++, p += n + 1) {
+            n = ngx_strlen(p);
+
+            if (ctx->filter.query.len
+                && !ngx_http_fancyindex_match_name(&ctx->filter, p, n))
+            {
+                continue;
+            }
+
+            last = ngx_cpymem_ssz(last, "<li>");
+            last = (u_char *) ngx_escape_html(last, p, n);
+            last = ngx_cpymem_ssz(last, "</li>" CRLF);
+        }
+    }
+
+    return ngx_cpymem_ssz(last, NGX_HTTP_FANCYINDEX_DELTA_END);
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * 在ctx->filename中生成条目的完整路径，以'\0'结尾，返回路径的长度。
+ * 分配内存失败时返回0。
+ */
+static size_t
+ngx_http_fancyindex_entry_path(ngx_http_request_t *r,
+        ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_entry_t *entry)
+{
+    size_t  len;
+
+    /* 1字节用于'/'，1字节用于终止符'\0' */
+    len = ctx->path.len + 1 + entry->name.len;
+
+    if (len + 1 > ctx->filename_size) {
+        ctx->filename_size = len + 1 + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+        ctx->filename = ngx_pnalloc(r->pool, ctx->filename_size);
+        if (ctx->filename == NULL) {
+            ctx->filename_size = 0;
+            return 0;
+        }
+
+        ngx_memcpy(ctx->filename, ctx->path.data, ctx->path.len);
+        ctx->filename[ctx->path.len] = '/';
+    }
+
+    ngx_memcpy(ctx->filename + ctx->path.len + 1, entry->name.data,
+               entry->name.len);
+    ctx->filename[len] = '\0';
+
+    return len;
+}
+
+#endif /* NGX_THREADS */
+
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+
+/*
+ * 文件的SHA-256保存在扩展属性中，值为文件的大小和修改时间（各8字节，
+ * 小端序）以及32字节的摘要。大小或修改时间与文件不一致时视为过期。
+ */
+#define NGX_HTTP_FANCYINDEX_XATTR        "user.fancyindex.sha256"
+#define NGX_HTTP_FANCYINDEX_XATTR_SIZE   48
+
+/* 每个worker进程同时计算的文件数，超过时在之后的请求中再计算 */
+#define NGX_HTTP_FANCYINDEX_HASH_TASKS   64
+
+/*
+ * 无法保存扩展属性时（只读或不支持扩展属性的文件系统），算出的SHA-256
+ * 保存在每个worker进程的内存中，按设备号和inode直接映射
+ */
+#define NGX_HTTP_FANCYINDEX_DIGESTS      4096
+
+/* 每个worker进程记录的无法保存扩展属性的设备数，只报告一次 */
+#define NGX_HTTP_FANCYINDEX_NOXATTR      16
+
+
+typedef struct {
+    uint64_t                        bytes;
+    uint32_t                        h[8];
+    u_char                          buffer[64];
+} ngx_http_fancyindex_sha256_t;
+
+
+/* 内存中的SHA-256，大小或修改时间与文件不一致时视为过期 */
+typedef struct {
+    dev_t                           dev;
+    ngx_file_uniq_t                 uniq;
+    off_t                           size;
+    time_t                          mtime;
+    u_char                          hash[32];
+} ngx_http_fancyindex_digest_t;
+
+
+/* 在线程池中计算的文件，按路径保存在ngx_http_fancyindex_hashing中 */
+typedef struct {
+    ngx_str_node_t                  sn;
+    ngx_err_t                       err;
+    const char                     *failed;   /* 失败的系统调用 */
+    ngx_http_fancyindex_digest_t    digest;
+    unsigned                        noxattr:1; /* 无法保存扩展属性 */
+} ngx_http_fancyindex_hash_t;
+
+
+static ngx_rbtree_t        ngx_http_fancyindex_hashing;
+static ngx_rbtree_node_t   ngx_http_fancyindex_hashing_sentinel;
+static ngx_uint_t          ngx_http_fancyindex_nhashing;
+
+static ngx_http_fancyindex_digest_t  *ngx_http_fancyindex_digests;
+static dev_t               ngx_http_fancyindex_noxattr[NGX_HTTP_FANCYINDEX_NOXATTR];
+static ngx_uint_t          ngx_http_fancyindex_nnoxattr;
+
+
+static const uint32_t  ngx_http_fancyindex_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+#define ngx_http_fancyindex_ror(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void
+ngx_http_fancyindex_sha256_block(ngx_http_fancyindex_sha256_t *ctx,
+        const u_char *p)
+{
+    uint32_t    a, b, c, d, e, f, g, h, s0, s1, t1, t2, w[64];
+    ngx_uint_t  i;
+
+    for (i = 0; i < 16; i++, p += 4) {
+        w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+             | ((uint32_t) p[2] << 8) | p[3];
+    }
+
+    for ( /* void */ ; i < 64; i++) {
+        s0 = ngx_http_fancyindex_ror(w[i - 15], 7)
+           ^ ngx_http_fancyindex_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        s1 = ngx_http_fancyindex_ror(w[i - 2], 17)
+           ^ ngx_http_fancyindex_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+    e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+
+    for (i = 0; i < 64; i++) {
+        s1 = ngx_http_fancyindex_ror(e, 6) ^ ngx_http_fancyindex_ror(e, 11)
+           ^ ngx_http_fancyindex_ror(e, 25);
+        t1 = h + s1 + ((e & f) ^ (~e & g)) + ngx_http_fancyindex_sha256_k[i]
+           + w[i];
+        s0 = ngx_http_fancyindex_ror(a, 2) ^ ngx_http_fancyindex_ror(a, 13)
+           ^ ngx_http_fancyindex_ror(a, 22);
+        t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+    ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+
+static void
+ngx_http_fancyindex_sha256_init(ngx_http_fancyindex_sha256_t *ctx)
+{
+    ctx->bytes = 0;
+    ctx->h[0] = 0x6a09e667;
+    ctx->h[1] = 0xbb67ae85;
+    ctx->h[2] = 0x3c6ef372;
+    ctx->h[3] = 0xa54ff53a;
+    ctx->h[4] = 0x510e527f;
+    ctx->h[5] = 0x9b05688c;
+    ctx->h[6] = 0x1f83d9ab;
+    ctx->h[7] = 0x5be0cd19;
+}
+
+
+static void
+ngx_http_fancyindex_sha256_update(ngx_http_fancyindex_sha256_t *ctx,
+        const u_char *p, size_t size)
+{
+    size_t  used, n;
+
+    used = (size_t) (ctx->bytes & 63);
+    ctx->bytes += size;
+
+    if (used) {
+        n = ngx_min(64 - used, size);
+        ngx_memcpy(&ctx->buffer[used], p, n);
+        p += n;
+        size -= n;
+
+        if (used + n < 64)
+            return;
+
+        ngx_http_fancyindex_sha256_block(ctx, ctx->buffer);
+    }
+
+    for ( /* void */ ; size >= 64; p += 64, size -= 64)
+        ngx_http_fancyindex_sha256_block(ctx, p);
+
+    ngx_memcpy(ctx->buffer, p, size);
+}
+
+
+static void
+ngx_http_fancyindex_sha256_final(u_char result[32],
+        ngx_http_fancyindex_sha256_t *ctx)
+{
+    size_t      used;
+    uint64_t    bits;
+    ngx_uint_t  i;
+
+    bits = ctx->bytes << 3;
+    used = (size_t) (ctx->bytes & 63);
+
+    ctx->buffer[used++] = 0x80;
+
+    if (used > 56) {
+        ngx_memzero(&ctx->buffer[used], 64 - used);
+        ngx_http_fancyindex_sha256_block(ctx, ctx->buffer);
+        used = 0;
+    }
+
+    ngx_memzero(&ctx->buffer[used], 56 - used);
+
+    for (i = 0; i < 8; i++)
+        ctx->buffer[63 - i] = (u_char) (bits >> (8 * i));
+
+    ngx_http_fancyindex_sha256_block(ctx, ctx->buffer);
+
+    for (i = 0; i < 32; i++)
+        result[i] = (u_char) (ctx->h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+
+/* 扩展属性的值 */
+static void
+ngx_http_fancyindex_xattr_value(u_char *p, off_t size, time_t mtime)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < 8; i++) {
+        p[i] = (u_char) ((uint64_t) size >> (8 * i));
+        p[8 + i] = (u_char) ((uint64_t) mtime >> (8 * i));
+    }
+}
+
+
+/*
+ * 在线程池中计算文件的SHA-256并保存到扩展属性中，无法保存时由完成事件
+ * 保存在内存中。读取期间文件发生变化时不保存，下次列出时重新计算。
+ */
+static void
+ngx_http_fancyindex_checksum_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_hash_t  *hc = data;
+
+    ssize_t                       n;
+    ngx_fd_t                      fd;
+    ngx_file_info_t               fi, fi2;
+    ngx_http_fancyindex_sha256_t  sha;
+    u_char                        value[NGX_HTTP_FANCYINDEX_XATTR_SIZE];
+    u_char                        buf[32768];
+
+    fd = ngx_open_file(hc->sn.str.data, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                       NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        hc->err = ngx_errno;
+        hc->failed = ngx_open_file_n;
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        hc->err = ngx_errno;
+        hc->failed = ngx_fd_info_n;
+        goto done;
+    }
+
+    if (!ngx_is_file(&fi))
+        goto done;
+
+    ngx_http_fancyindex_sha256_init(&sha);
+
+    while ((n = ngx_read_fd(fd, buf, sizeof(buf))) > 0)
+        ngx_http_fancyindex_sha256_update(&sha, buf, n);
+
+    if (n == -1) {
+        hc->err = ngx_errno;
+        hc->failed = ngx_read_fd_n;
+        goto done;
+    }
+
+    if (ngx_fd_info(fd, &fi2) == NGX_FILE_ERROR) {
+        hc->err = ngx_errno;
+        hc->failed = ngx_fd_info_n;
+        goto done;
+    }
+
+    if (ngx_file_size(&fi2) != ngx_file_size(&fi)
+        || ngx_file_mtime(&fi2) != ngx_file_mtime(&fi))
+    {
+        goto done;
+    }
+
+    ngx_http_fancyindex_xattr_value(value, ngx_file_size(&fi),
+                                    ngx_file_mtime(&fi));
+    ngx_http_fancyindex_sha256_final(value + 16, &sha);
+
+    if (fsetxattr(fd, NGX_HTTP_FANCYINDEX_XATTR, value, sizeof(value), 0)
+        == -1)
+    {
+        hc->err = ngx_errno;
+        hc->noxattr = 1;
+
+        hc->digest.dev = fi.st_dev;
+        hc->digest.uniq = ngx_file_uniq(&fi);
+        hc->digest.size = ngx_file_size(&fi);
+        hc->digest.mtime = ngx_file_mtime(&fi);
+        ngx_memcpy(hc->digest.hash, value + 16, 32);
+    }
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", hc->sn.str.data);
+    }
+}
+
+
+/* 内存中保存dev和uniq对应文件的SHA-256的位置 */
+static ngx_http_fancyindex_digest_t *
+ngx_http_fancyindex_digest_slot(dev_t dev, ngx_file_uniq_t uniq)
+{
+    uint64_t  key;
+
+    key = ((uint64_t) uniq * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) dev;
+
+    return &ngx_http_fancyindex_digests[(key >> 32)
+                                        % NGX_HTTP_FANCYINDEX_DIGESTS];
+}
+
+
+/*
+ * 在内存中保存无法写入扩展属性的SHA-256。每个设备第一次失败时以notice
+ * 级别报告，之后不再报告。
+ */
+static void
+ngx_http_fancyindex_digest_put(ngx_log_t *log, ngx_http_fancyindex_hash_t *hc)
+{
+    ngx_uint_t  i;
+
+    if (ngx_http_fancyindex_digests == NULL) {
+        ngx_http_fancyindex_digests = ngx_calloc(NGX_HTTP_FANCYINDEX_DIGESTS
+                                         * sizeof(ngx_http_fancyindex_digest_t),
+                                         log);
+        if (ngx_http_fancyindex_digests == NULL)
+            return;
+    }
+
+    *ngx_http_fancyindex_digest_slot(hc->digest.dev, hc->digest.uniq) =
+        hc->digest;
+
+    for (i = 0; i < ngx_http_fancyindex_nnoxattr; i++) {
+        if (ngx_http_fancyindex_noxattr[i] == hc->digest.dev)
+            return;
+    }
+
+    if (i == NGX_HTTP_FANCYINDEX_NOXATTR)
+        return;
+
+    ngx_http_fancyindex_noxattr[ngx_http_fancyindex_nnoxattr++] =
+        hc->digest.dev;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, hc->err,
+                  "fancyindex: fsetxattr() \"%s\" failed, checksums of files "
+                  "on this file system are kept in memory", hc->sn.str.data);
+}
+
+
+static void
+ngx_http_fancyindex_checksum_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t           *task = ev->data;
+    ngx_http_fancyindex_hash_t  *hc = task->ctx;
+
+    if (hc->noxattr) {
+        ngx_http_fancyindex_digest_put(ev->log, hc);
+
+    } else if (hc->failed) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, hc->err,
+                      "fancyindex: %s \"%s\" failed", hc->failed,
+                      hc->sn.str.data);
+    }
+
+    ngx_rbtree_delete(&ngx_http_fancyindex_hashing, &hc->sn.node);
+    ngx_http_fancyindex_nhashing--;
+
+    ngx_free(task);
+}
+
+
+/* 在线程池中计算文件的SHA-256，该文件已在计算中时什么都不做 */
+static void
+ngx_http_fancyindex_checksum_post(ngx_http_request_t *r, u_char *path,
+        size_t len)
+{
+    u_char                           *p;
+    uint32_t                          hash;
+    ngx_str_t                         str;
+    ngx_thread_task_t                *task;
+    ngx_http_fancyindex_hash_t       *hc;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+
+    if (ngx_http_fancyindex_nhashing >= NGX_HTTP_FANCYINDEX_HASH_TASKS)
+        return;
+
+    str.len = len;
+    str.data = path;
+    hash = ngx_crc32_long(path, len);
+
+    if (ngx_str_rbtree_lookup(&ngx_http_fancyindex_hashing, &str, hash))
+        return;
+
+    /* 任务在完成后释放，不能使用请求的内存池 */
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_fancyindex_hash_t) + len + 1,
+                      r->connection->log);
+    if (task == NULL)
+        return;
+
+    hc = (ngx_http_fancyindex_hash_t *) (task + 1);
+    p = (u_char *) (hc + 1);
+    ngx_memcpy(p, path, len);
+    p[len] = '\0';
+
+    hc->sn.node.key = hash;
+    hc->sn.str.len = len;
+    hc->sn.str.data = p;
+
+    task->ctx = hc;
+    task->handler = ngx_http_fancyindex_checksum_thread;
+    task->event.handler = ngx_http_fancyindex_checksum_done;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+    if (ngx_thread_task_post(mcf->thread_pool, task) != NGX_OK) {
+        ngx_free(task);
+        return;
+    }
+
+    ngx_rbtree_insert(&ngx_http_fancyindex_hashing, &hc->sn.node);
+    ngx_http_fancyindex_nhashing++;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: hashing \"%s\"", p);
+}
+
+
+/* 读取列表中文件的SHA-256的结果 */
+#define NGX_HTTP_FANCYINDEX_SUM_NONE     0   /* 目录、过大或无法打开 */
+#define NGX_HTTP_FANCYINDEX_SUM_KNOWN    1   /* 扩展属性中的SHA-256有效 */
+#define NGX_HTTP_FANCYINDEX_SUM_MISS     2   /* 需要查找内存或者计算 */
+
+typedef struct {
+    u_char                          hash[32];
+    dev_t                           dev;
+    ngx_file_uniq_t                 uniq;
+    ngx_uint_t                      state;
+} ngx_http_fancyindex_sum_t;
+
+/* 在线程池中读取列表中所有文件的扩展属性 */
+typedef struct {
+    ngx_http_request_t             *r;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    u_char                         *path;        /* 目录，以'\0'结尾 */
+    ngx_http_fancyindex_entry_t    *entries;
+    ngx_uint_t                      nelts;
+    ngx_http_fancyindex_sum_t      *sums;
+    off_t                           max_size;
+    ngx_err_t                       err;         /* 打开目录失败 */
+} ngx_http_fancyindex_sums_t;
+
+
+/*
+ * 在线程池中以O_PATH打开目录，相对于它打开每个文件并用fgetxattr()读取
+ * SHA-256。没有扩展属性或者已过期时记录设备号和inode，由完成事件查找
+ * 内存中的SHA-256或开始计算。
+ */
+static void
+ngx_http_fancyindex_sums_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_sums_t  *ss = data;
+
+    int                           dfd, fd;
+    ssize_t                       n;
+    ngx_uint_t                    i;
+    struct stat                   fi;
+    ngx_http_fancyindex_sum_t    *sum;
+    ngx_http_fancyindex_entry_t  *entry;
+    u_char                        value[NGX_HTTP_FANCYINDEX_XATTR_SIZE];
+
+    dfd = open((char *) ss->path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (dfd == -1) {
+        ss->err = ngx_errno;
+        return;
+    }
+
+    for (i = 0; i < ss->nelts; i++) {
+        entry = &ss->entries[i];
+        sum = &ss->sums[i];
+
+        if (entry->dir || (ss->max_size && entry->size > ss->max_size))
+            continue;
+
+        fd = openat(dfd, (char *) entry->name.data,
+                    O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+        if (fd == -1)
+            continue;
+
+        n = fgetxattr(fd, NGX_HTTP_FANCYINDEX_XATTR, value, sizeof(value));
+
+        if (n == sizeof(value)) {
+            ngx_http_fancyindex_xattr_value(sum->hash, entry->size,
+                                            entry->mtime);
+
+            if (ngx_memcmp(sum->hash, value, 16) == 0) {
+                ngx_memcpy(sum->hash, value + 16, 32);
+                sum->state = NGX_HTTP_FANCYINDEX_SUM_KNOWN;
+            }
+        }
+
+        if (sum->state == NGX_HTTP_FANCYINDEX_SUM_NONE
+            && (n != -1 || ngx_errno == ENODATA || ngx_errno == ENOTSUP)
+            && fstat(fd, &fi) != -1 && S_ISREG(fi.st_mode))
+        {
+            sum->dev = fi.st_dev;
+            sum->uniq = ngx_file_uniq(&fi);
+            sum->state = NGX_HTTP_FANCYINDEX_SUM_MISS;
+        }
+
+        if (close(fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "close() \"%s/%s\" failed", ss->path,
+                          entry->name.data);
+        }
+    }
+
+    if (close(dfd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "close() \"%s\" failed", ss->path);
+    }
+}
+
+
+/*
+ * 设置已知的SHA-256，其余的文件在内存中查找，都没有时在线程池中计算，
+ * ctx->hashing为计算中的文件数。
+ */
+static void
+ngx_http_fancyindex_sums_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t             *task = ev->data;
+    ngx_http_fancyindex_sums_t    *ss = task->ctx;
+    ngx_http_fancyindex_ctx_t     *ctx = ss->ctx;
+    ngx_http_request_t            *r = ss->r;
+
+    size_t                         len;
+    ngx_uint_t                     i;
+    ngx_http_fancyindex_sum_t     *sum;
+    ngx_http_fancyindex_entry_t   *entry;
+    ngx_http_fancyindex_digest_t  *dg;
+
+    r->main->blocked--;
+
+    if (ss->err) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ss->err,
+                      "open() \"%s\" failed", ss->path);
+    }
+
+    for (i = 0; i < ss->nelts; i++) {
+        entry = &ss->entries[i];
+        sum = &ss->sums[i];
+
+        if (sum->state == NGX_HTTP_FANCYINDEX_SUM_KNOWN) {
+            entry->sum = sum->hash;
+            continue;
+        }
+
+        if (sum->state != NGX_HTTP_FANCYINDEX_SUM_MISS)
+            continue;
+
+        if (ngx_http_fancyindex_digests != NULL) {
+            dg = ngx_http_fancyindex_digest_slot(sum->dev, sum->uniq);
+
+            if (dg->dev == sum->dev && dg->uniq == sum->uniq
+                && dg->size == entry->size && dg->mtime == entry->mtime)
+            {
+                ngx_memcpy(sum->hash, dg->hash, 32);
+                entry->sum = sum->hash;
+                continue;
+            }
+        }
+
+        if ((len = ngx_http_fancyindex_entry_path(r, ctx, entry)) == 0)
+            continue;
+
+        ngx_http_fancyindex_checksum_post(r, ctx->filename, len);
+        ctx->hashing++;
+    }
+
+    ngx_post_event(&ctx->wait, &ngx_posted_events);
+}
+
+
+/*
+ * 列表需要显示SHA-256时，在线程池中读取文件的扩展属性，结果保存在
+ * entry->sum中。需要等待时返回NGX_DONE，完成后投递ctx->wait。
+ */
+static ngx_int_t
+ngx_http_fancyindex_sums(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_uint_t                        i;
+    ngx_thread_task_t                *task;
+    ngx_http_fancyindex_sums_t       *ss;
+    ngx_http_fancyindex_entry_t      *entry;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+
+    if (!alcf->checksums)
+        return NGX_OK;
+
+    if (!ctx->sha256sum && !alcf->row_program->sha256
+#if (NGX_HTTP_FANCYINDEX_JSON)
+        && !ctx->json
+#endif
+       )
+    {
+        return NGX_OK;
+    }
+
+    entry = ctx->entries.elts;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        if (!entry[i].dir)
+            break;
+    }
+
+    if (i == ctx->entries.nelts)
+        return NGX_OK;
+
+    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_fancyindex_sums_t));
+    if (task == NULL)
+        return NGX_ERROR;
+
+    ss = task->ctx;
+    ss->r = r;
+    ss->ctx = ctx;
+    ss->entries = entry;
+    ss->nelts = ctx->entries.nelts;
+    ss->max_size = alcf->checksum_max_size;
+
+    ss->path = ngx_pnalloc(r->pool, ctx->path.len + 1);
+    ss->sums = ngx_pcalloc(r->pool,
+                           ss->nelts * sizeof(ngx_http_fancyindex_sum_t));
+    if (ss->path == NULL || ss->sums == NULL)
+        return NGX_ERROR;
+
+    ngx_cpystrn(ss->path, ctx->path.data, ctx->path.len + 1);
+
+    task->handler = ngx_http_fancyindex_sums_thread;
+    task->event.handler = ngx_http_fancyindex_sums_done;
+    task->event.data = task;
+    task->event.log = r->connection->log;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+    /* 线程池已满时不显示SHA-256 */
+    if (ngx_thread_task_post(mcf->thread_pool, task) != NGX_OK)
+        return NGX_OK;
+
+    /* 线程池中的任务使用请求的内存，完成前不能释放请求 */
+    r->main->blocked++;
+    ctx->summing = 1;
+
+    return NGX_DONE;
+}
+
+
+/*
+ * 以sha256sum(1)的格式生成列表，只包含已知SHA-256的文件：
+ *
+ *   e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855  a.txt
+ *
+ * 与sha256sum相同，包含'\'或换行符的文件名被转义，行首加'\'。还有文件
+ * 在计算中时以202响应，由Retry-After建议客户端稍后重新获取完整的列表。
+ */
+static ngx_buf_t *
+ngx_http_fancyindex_make_sha256sum(ngx_http_request_t *r,
+        ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char                       *p, *last;
+    size_t                        len;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    i, escape;
+    ngx_http_fancyindex_entry_t  *entry;
+
+    entry = ctx->entries.elts;
+
+    for (i = 0, len = 0; i < ctx->entries.nelts; i++) {
+        if (!entry[i].dir)
+            len += ngx_sizeof_ssz("\\  \n") + 64 + 2 * entry[i].name.len;
+    }
+
+    if ((b = ngx_create_temp_buf(r->pool, len + 1)) == NULL)
+        return NULL;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        if (entry[i].sum == NULL)
+            continue;
+
+        last = entry[i].name.data + entry[i].name.len;
+
+        escape = (ngx_strlchr(entry[i].name.data, last, '\\') != NULL
+                  || ngx_strlchr(entry[i].name.data, last, LF) != NULL);
+
+        if (escape)
+            *b->last++ = '\\';
+
+        b->last = ngx_hex_dump(b->last, entry[i].sum, 32);
+        *b->last++ = ' ';
+        *b->last++ = ' ';
+
+        for (p = entry[i].name.data; p < last; p++) {
+            if (escape && *p == '\\') {
+                *b->last++ = '\\';
+                *b->last++ = '\\';
+
+            } else if (*p == LF) {
+                *b->last++ = '\\';
+                *b->last++ = 'n';
+
+            } else {
+                *b->last++ = *p;
+            }
+        }
+
+        *b->last++ = LF;
+    }
+
+    return b;
+}
+
+#endif /* NGX_HTTP_FANCYINDEX_CHECKSUMS */
+
+
+#if (NGX_THREADS)
+
+/* 每个worker进程同时统计目录大小的任务数 */
+#define NGX_HTTP_FANCYINDEX_SIZE_TASKS  4
+
+/* 统计锁的有效时间（秒），统计失败时也在此之后才重试 */
+#define NGX_HTTP_FANCYINDEX_SIZE_LOCK   60
+
+
+/* 统计目录大小的任务 */
+typedef struct {
+    ngx_http_fancyindex_cache_t  *cache;
+    time_t                        valid;       /* fancyindex_cache_valid */
+    uint32_t                      hash;
+    ngx_str_t                     path;
+    time_t                        mtime;
+    off_t                         bytes;
+    uint64_t                      files;
+    ngx_err_t                     err;
+    const char                   *failed;      /* 失败的函数 */
+    unsigned                      done:1;
+} ngx_http_fancyindex_dir_size_task_t;
+
+
+static ngx_uint_t          ngx_http_fancyindex_nsizing;
+
+
+/*
+ * 在线程池中统计目录树中普通文件的数量和总大小。不跟随目录树中的符号链接，
+ * 无法读取的子目录不计入。
+ */
+static void
+ngx_http_fancyindex_dir_size_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_dir_size_task_t  *ds = data;
+
+    u_char                       *name;
+    size_t                        len, plen;
+    ngx_str_t                     str;
+    ngx_uint_t                    n, nalloc;
+    ngx_file_info_t               fi;
+    ngx_http_fancyindex_level_t  *levels, *lv;
+    u_char                        path[NGX_MAX_PATH];
+
+    if (ds->path.len + 1 > NGX_MAX_PATH) {
+        ds->err = NGX_ENAMETOOLONG;
+        ds->failed = ngx_open_dir_n;
+        return;
+    }
+
+    ngx_memcpy(path, ds->path.data, ds->path.len + 1);
+
+    /* 列表中的目录可能是指向目录的符号链接，与列表一样跟随 */
+    if (ngx_file_info(path, &fi) == NGX_FILE_ERROR) {
+        ds->err = ngx_errno;
+        ds->failed = ngx_file_info_n;
+        return;
+    }
+
+    ds->mtime = ngx_file_mtime(&fi);
+
+    nalloc = 16;
+
+    levels = ngx_alloc(nalloc * sizeof(ngx_http_fancyindex_level_t), log);
+    if (levels == NULL)
+        return;
+
+    str.len = ds->path.len;
+    str.data = path;
+
+    if (ngx_open_dir(&str, &levels[0].dir) == NGX_ERROR) {
+        ds->err = ngx_errno;
+        ds->failed = ngx_open_dir_n;
+        ngx_free(levels);
+        return;
+    }
+
+    levels[0].len = ds->path.len;
+    n = 1;
+
+    while (n) {
+        lv = &levels[n - 1];
+
+        ngx_set_errno(0);
+
+        /* 读取出错时，该目录中剩余的条目不计入 */
+        if (ngx_read_dir(&lv->dir) == NGX_ERROR) {
+            if (ngx_close_dir(&lv->dir) == NGX_ERROR) {
+                path[lv->len] = '\0';
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              ngx_close_dir_n " \"%s\" failed", path);
+            }
+
+            n--;
+            continue;
+        }
+
+        name = ngx_de_name(&lv->dir);
+        len = ngx_de_namelen(&lv->dir);
+
+        if (name[0] == '.'
+            && (len == 1 || (len == 2 && name[1] == '.')))
+        {
+            continue;
+        }
+
+        /* 1字节用于'/'，1字节用于终止符'\0' */
+        plen = lv->len + 1 + len;
+
+        if (plen + 1 > NGX_MAX_PATH)
+            continue;
+
+        path[lv->len] = '/';
+        ngx_memcpy(path + lv->len + 1, name, len);
+        path[plen] = '\0';
+
+        if (ngx_link_info(path, &fi) == NGX_FILE_ERROR)
+            continue;
+
+        if (ngx_is_file(&fi)) {
+            ds->bytes += ngx_file_size(&fi);
+            ds->files++;
+            continue;
+        }
+
+        if (!ngx_is_dir(&fi))
+            continue;
+
+        if (n == nalloc) {
+            lv = ngx_alloc(2 * nalloc * sizeof(ngx_http_fancyindex_level_t),
+                           log);
+            if (lv == NULL)
+                goto failed;
+
+            ngx_memcpy(lv, levels,
+                       nalloc * sizeof(ngx_http_fancyindex_level_t));
+            ngx_free(levels);
+
+            levels = lv;
+            nalloc *= 2;
+        }
+
+        str.len = plen;
+
+        if (ngx_open_dir(&str, &levels[n].dir) == NGX_ERROR)
+            continue;
+
+        levels[n].len = plen;
+        n++;
+    }
+
+    ds->done = 1;
+
+failed:
+
+    while (n) {
+        if (ngx_close_dir(&levels[--n].dir) == NGX_ERROR) {
+            path[levels[n].len] = '\0';
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_dir_n " \"%s\" failed", path);
+        }
+    }
+
+    ngx_free(levels);
+}
+
+
+static void
+ngx_http_fancyindex_dir_size_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t                    *task = ev->data;
+    ngx_http_fancyindex_dir_size_task_t  *ds = task->ctx;
+
+    ngx_str_node_t                    *sn;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_size_t  *cs;
+
+    if (ds->failed) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, ds->err,
+                      "fancyindex: %s \"%V\" failed", ds->failed, &ds->path);
+    }
+
+    /* 失败时保留统计锁，锁过期后才重试 */
+    if (ds->done) {
+        cache = ds->cache;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        /* 统计期间节点可能已被淘汰 */
+        sn = ngx_str_rbtree_lookup(&cache->sh->sizes, &ds->path, ds->hash);
+
+        if (sn != NULL) {
+            cs = (ngx_http_fancyindex_cache_size_t *) sn;
+            cs->known = 1;
+            cs->bytes = ds->bytes;
+            cs->files = ds->files;
+            cs->mtime = ds->mtime;
+            cs->expire = ngx_time() + ds->valid;
+            cs->lock = 0;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "http fancyindex: size of \"%V\": %O bytes, %uL files",
+                       &ds->path, ds->bytes, ds->files);
+    }
+
+    ngx_http_fancyindex_nsizing--;
+
+    ngx_free(task);
+}
+
+
+/* 在线程池中统计目录大小 */
+static ngx_int_t
+ngx_http_fancyindex_dir_size_post(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, u_char *path, size_t len,
+        uint32_t hash)
+{
+    u_char                               *p;
+    ngx_thread_task_t                    *task;
+    ngx_http_fancyindex_main_conf_t      *mcf;
+    ngx_http_fancyindex_dir_size_task_t  *ds;
+
+    /* 任务在完成后释放，不能使用请求的内存池 */
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_fancyindex_dir_size_task_t) + len + 1,
+                      r->connection->log);
+    if (task == NULL)
+        return NGX_ERROR;
+
+    ds = (ngx_http_fancyindex_dir_size_task_t *) (task + 1);
+    p = (u_char *) (ds + 1);
+    ngx_memcpy(p, path, len);
+    p[len] = '\0';
+
+    ds->cache = alcf->cache_zone->data;
+    ds->valid = alcf->cache_valid;
+    ds->hash = hash;
+    ds->path.len = len;
+    ds->path.data = p;
+
+    task->ctx = ds;
+    task->handler = ngx_http_fancyindex_dir_size_thread;
+    task->event.handler = ngx_http_fancyindex_dir_size_done;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+    if (ngx_thread_task_post(mcf->thread_pool, task) != NGX_OK) {
+        ngx_free(task);
+        return NGX_ERROR;
+    }
+
+    ngx_http_fancyindex_nsizing++;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: sizing \"%s\"", p);
+
+    return NGX_OK;
+}
+
+
+/*
+ * 取得目录的递归大小，还没有统计过时返回0。大小未知、已过期或者目录的
+ * 修改时间比统计时新时，在线程池中重新统计；统计完成前返回原来的大小，
+ * 从不等待统计完成。
+ */
+static ngx_uint_t
+ngx_http_fancyindex_dir_size(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_entry_t *entry, off_t *bytes, uint64_t *files)
+{
+    size_t                             len;
+    time_t                             now;
+    uint32_t                           hash;
+    ngx_str_t                          str;
+    ngx_uint_t                         known, post;
+    ngx_str_node_t                    *sn;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_size_t  *cs;
+
+    if (!entry->dir || alcf->cache_zone == NULL)
+        return 0;
+
+    if ((len = ngx_http_fancyindex_entry_path(r, ctx, entry)) == 0)
+        return 0;
+
+    str.len = len;
+    str.data = ctx->filename;
+    hash = ngx_crc32_long(str.data, str.len);
+
+    cache = alcf->cache_zone->data;
+    now = ngx_time();
+    known = 0;
+    post = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&cache->sh->sizes, &str, hash);
+
+    if (sn == NULL) {
+        cs = ngx_http_fancyindex_cache_size_alloc_locked(cache,
+                offsetof(ngx_http_fancyindex_cache_size_t, path) + len);
+        if (cs == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return 0;
+        }
+
+        ngx_memzero(cs, sizeof(ngx_http_fancyindex_cache_size_t));
+        ngx_memcpy(cs->path, str.data, len);
+
+        cs->sn.node.key = hash;
+        cs->sn.str.len = len;
+        cs->sn.str.data = cs->path;
+
+        ngx_rbtree_insert(&cache->sh->sizes, &cs->sn.node);
+
+    } else {
+        cs = (ngx_http_fancyindex_cache_size_t *) sn;
+        ngx_queue_remove(&cs->queue);
+    }
+
+    ngx_queue_insert_head(&cache->sh->sizes_queue, &cs->queue);
+
+    /*
+     * 缓存的列表中目录的修改时间可能比统计时旧，只有更新时才说明目录
+     * 的内容已改变。
+     */
+    if ((!cs->known || cs->mtime < entry->mtime || cs->expire <= now)
+        && cs->lock <= now
+        && ngx_http_fancyindex_nsizing < NGX_HTTP_FANCYINDEX_SIZE_TASKS)
+    {
+        cs->lock = now + NGX_HTTP_FANCYINDEX_SIZE_LOCK;
+        post = 1;
+    }
+
+    if (cs->known) {
+        *bytes = cs->bytes;
+        *files = cs->files;
+        known = 1;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (post
+        && ngx_http_fancyindex_dir_size_post(r, alcf, str.data, len, hash)
+           != NGX_OK)
+    {
+        /* 释放统计锁，以便之后的请求重试 */
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        sn = ngx_str_rbtree_lookup(&cache->sh->sizes, &str, hash);
+        if (sn != NULL)
+            ((ngx_http_fancyindex_cache_size_t *) sn)->lock = 0;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    return known;
+}
+
+#endif /* NGX_THREADS */
+
+
+/* 按行模板生成一行最多需要的长度，包括行尾的CRLF */
+static ngx_inline size_t
+ngx_http_fancyindex_row_size(ngx_http_fancyindex_row_program_t *prog,
+        const ngx_http_fancyindex_entry_t *entry)
+{
+    return prog->len
+         + prog->nhref * (entry->name.len + entry->escape)
+         + prog->nname * (entry->name.len + entry->escape_html)
+         + 2;
+}
+
+
+/*
+ * 返回p开始的UTF-8字符的字节数，不是有效的字符时返回0。按Unicode标准的
+ * 表3-7检查，过长的编码、代理项和大于U+10FFFF的码点都是无效的。
+ */
+static ngx_inline size_t
+ngx_http_fancyindex_utf8_char(u_char *p, u_char *last)
+{
+    u_char  c, lo, hi;
+    size_t  n, i;
+
+    c = *p;
+    lo = 0x80;
+    hi = 0xbf;
+
+    if (c < 0x80) {
+        return 1;
+
+    } else if (c < 0xc2) {
+        return 0;
+
+    } else if (c < 0xe0) {
+        n = 2;
+
+    } else if (c < 0xf0) {
+        n = 3;
+        if (c == 0xe0)
+            lo = 0xa0;
+        else if (c == 0xed)
+            hi = 0x9f;
+
+    } else if (c < 0xf5) {
+        n = 4;
+        if (c == 0xf0)
+            lo = 0x90;
+        else if (c == 0xf4)
+            hi = 0x8f;
+
+    } else {
+        return 0;
+    }
+
+    if ((size_t) (last - p) < n || p[1] < lo || p[1] > hi)
+        return 0;
+
+    for (i = 2; i < n; i++) {
+        if (p[i] < 0x80 || p[i] > 0xbf)
+            return 0;
+    }
+
+    return n;
+}
+
+
+/*
+ * 一次遍历检查文件名是否为有效的UTF-8并计算字符数。支持SSE2时每次检查
+ * 16字节，否则每次读取8字节，全部是ASCII时直接计数，否则逐个检查字符。
+ * 无效的字节各显示为一个U+FFFD，其数目存入*bad。
+ */
+static size_t
+ngx_http_fancyindex_utf8_count(u_char *p, size_t len, size_t *bad)
+{
+    u_char    *last;
+    size_t     n, count;
+    uint64_t   w;
+
+    last = p + len;
+    count = 0;
+    *bad = 0;
+
+    while (p < last) {
+#if defined(__SSE2__)
+        if (last - p >= 16
+            && _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p)) == 0)
+        {
+            p += 16;
+            count += 16;
+            continue;
+        }
+#endif
+
+        if (last - p >= 8) {
+            ngx_memcpy(&w, p, 8);
+            if ((w & 0x8080808080808080ULL) == 0) {
+                p += 8;
+                count += 8;
+                continue;
+            }
+        }
+
+        if (*p < 0x80) {
+            p++;
+
+        } else if ((n = ngx_http_fancyindex_utf8_char(p, last)) != 0) {
+            p += n;
+
+        } else {
+            p++;
+            (*bad)++;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+
+/* 根据entry->name设置转义字符数和显示长度 */
+static ngx_inline void
+ngx_http_fancyindex_set_name(ngx_http_fancyindex_entry_t *entry,
+        ngx_uint_t utf8)
+{
+    size_t  bad;
+
+    entry->escape = 2 * ngx_fancyindex_escape_filename(NULL,
+                                                       entry->name.data,
+                                                       entry->name.len);
+    entry->escape_html = ngx_escape_html(NULL,
+                                         entry->name.data,
+                                         entry->name.len);
+
+    entry->utf_len = entry->name.len;
+    entry->invalid = 0;
+
+    if (utf8) {
+        entry->utf_len = ngx_http_fancyindex_utf8_count(entry->name.data,
+                                                        entry->name.len,
+                                                        &bad);
+        if (bad) {
+            /* 每个无效的字节替换为3字节的U+FFFD */
+            entry->invalid = 1;
+            entry->escape_html += 2 * bad;
+        }
+    }
+}
+
+
+/* 在HTML中输出文件名，无效的UTF-8字节替换为U+FFFD */
+static u_char *
+ngx_http_fancyindex_escape_name(u_char *dst,
+        const ngx_http_fancyindex_entry_t *entry)
+{
+    u_char  *p, *start, *last;
+    size_t   n;
+
+    if (!entry->invalid) {
+        return (u_char *) ngx_escape_html(dst, entry->name.data,
+                                          entry->name.len);
+    }
+
+    start = entry->name.data;
+    last = start + entry->name.len;
+
+    for (p = start; p < last; /* void */) {
+        if ((n = ngx_http_fancyindex_utf8_char(p, last)) != 0) {
+            p += n;
+            continue;
+        }
+
+        dst = (u_char *) ngx_escape_html(dst, start, p - start);
+        dst = ngx_cpymem(dst, "\xef\xbf\xbd", 3);
+        start = ++p;
+    }
+
+    return (u_char *) ngx_escape_html(dst, start, p - start);
+}
+
+
+#if (NGX_HTTP_FANCYINDEX_JSON)
+
+/*
+ * 与ngx_escape_json()相同，但JSON必须是有效的UTF-8，无效的字节与HTML
+ * 列表中一样替换为U+FFFD。dst为NULL时返回增加的长度。
+ */
+static uintptr_t
+ngx_http_fancyindex_escape_json(u_char *dst, u_char *src, size_t size)
+{
+    u_char     *p, *start, *last;
+    size_t      n;
+    uintptr_t   len;
+
+    start = src;
+    last = src + size;
+    len = 0;
+
+    for (p = start; p < last; /* void */) {
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+
+        if ((n = ngx_http_fancyindex_utf8_char(p, last)) != 0) {
+            p += n;
+            continue;
+        }
+
+        if (dst == NULL) {
+            len += ngx_escape_json(NULL, start, p - start) + 2;
+
+        } else {
+            dst = (u_char *) ngx_escape_json(dst, start, p - start);
+            dst = ngx_cpymem(dst, "\xef\xbf\xbd", 3);
+        }
+
+        start = ++p;
+    }
+
+    if (dst == NULL)
+        return len + ngx_escape_json(NULL, start, p - start);
+
+    return ngx_escape_json(dst, start, p - start);
+}
+
+
+/*
+ * 以JSON格式生成列表，条目的顺序与HTML列表相同：
+ *
+ *   {"time":1700000000,"since":1690000000,"entries":[
+ *   {"name":"a.txt","type":"file","size":10,"mtime":1690000001}
+ *   ],"deleted":["b.txt"]}
+ *
+ * "time"为列表的读取时间，客户端下次请求时作为"since"参数。没有"since"
+ * 参数时不输出"since"和"deleted"；无法确定被删除的条目时"deleted"为null。
+ * 设置了fancyindex_checksums时，已知SHA-256的文件还包含"sha256"。设置了
+ * fancyindex_dir_sizes时，已统计过的目录的"size"为递归大小，并包含文件数
+ * "files"；否则目录的"size"为0。名称中无效的UTF-8字节替换为U+FFFD。
+ */
+static ngx_buf_t *
+ngx_http_fancyindex_make_json(ngx_http_request_t *r,
+        ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char                                  *p, *last;
+    size_t                                   len, n;
+    ngx_buf_t                               *b;
+    ngx_uint_t                               i;
+    ngx_http_fancyindex_entry_t             *entry;
+    ngx_http_fancyindex_cache_tombstones_t  *tb = ctx->tombstones;
+    ngx_http_fancyindex_loc_conf_t          *alcf;
+    off_t                                    size;
+#if (NGX_THREADS)
+    uint64_t                                 files;
+    ngx_uint_t                               known;
+#endif
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    entry = ctx->entries.elts;
+
+    len = ngx_sizeof_ssz("{\"time\":,\"since\":,\"entries\":[" CRLF
+                         "],\"deleted\":null}" CRLF)
+        + 2 * NGX_TIME_T_LEN;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        len += ngx_sizeof_ssz("{\"name\":\"\",\"type\":\"directory\","
+                              "\"size\":,\"mtime\":}," CRLF)
+             + entry[i].name.len
+             + ngx_http_fancyindex_escape_json(NULL, entry[i].name.data,
+                                               entry[i].name.len)
+             + NGX_OFF_T_LEN + NGX_TIME_T_LEN;
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+        if (alcf->checksums)
+            len += ngx_sizeof_ssz(",\"sha256\":\"\"") + 64;
+#endif
+
+        if (alcf->dir_sizes)
+            len += ngx_sizeof_ssz(",\"files\":") + NGX_INT64_LEN;
+    }
+
+    if (tb != NULL) {
+        for (p = tb->names, i = 0; i < tb->nelts; i++, p += n + 1) {
+            n = ngx_strlen(p);
+            len += ngx_sizeof_ssz("\"\",") + n
+                 + ngx_http_fancyindex_escape_json(NULL, p, n);
+        }
+    }
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NULL;
+
+    b->last = ngx_sprintf(b->last, "{\"time\":%T", ctx->time);
+
+    if (ctx->filter.delta)
+        b->last = ngx_sprintf(b->last, ",\"since\":%T", ctx->filter.since);
+
+    b->last = ngx_cpymem_ssz(b->last, ",\"entries\":[" CRLF);
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        if (i)
+            b->last = ngx_cpymem_ssz(b->last, "," CRLF);
+
+        b->last = ngx_cpymem_ssz(b->last, "{\"name\":\"");
+        b->last = (u_char *) ngx_http_fancyindex_escape_json(b->last,
+                                                     entry[i].name.data,
+                                                     entry[i].name.len);
+
+        size = entry[i].dir ? 0 : entry[i].size;
+#if (NGX_THREADS)
+        known = alcf->dir_sizes
+                && ngx_http_fancyindex_dir_size(r, alcf, ctx, &entry[i],
+                                                &size, &files);
+#endif
+
+        b->last = ngx_sprintf(b->last,
+                              "\",\"type\":\"%s\",\"size\":%O,\"mtime\":%T",
+                              entry[i].dir ? "directory" : "file",
+                              size, entry[i].mtime);
+
+#if (NGX_THREADS)
+        if (known)
+            b->last = ngx_sprintf(b->last, ",\"files\":%uL", files);
+#endif
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+        if (entry[i].sum) {
+            b->last = ngx_cpymem_ssz(b->last, ",\"sha256\":\"");
+            b->last = ngx_hex_dump(b->last, entry[i].sum, 32);
+            *b->last++ = '"';
+        }
+#endif
+
+        *b->last++ = '}';
+    }
+
+    if (ctx->entries.nelts)
+        b->last = ngx_cpymem_ssz(b->last, CRLF);
+
+    b->last = ngx_cpymem_ssz(b->last, "]");
+
+    if (ctx->filter.delta) {
+        if (!ctx->deleted) {
+            b->last = ngx_cpymem_ssz(b->last, ",\"deleted\":null");
+
+        } else {
+            b->last = ngx_cpymem_ssz(b->last, ",\"deleted\":[");
+            last = b->last;
+
+            if (tb != NULL) {
+                for (p = tb->names, i = 0; i < tb->nelts; i++, p += n + 1) {
+                    n = ngx_strlen(p);
+
+                    if (ctx->filter.query.len
+                        && !ngx_http_fancyindex_match_name(&ctx->filter, p, n))
+                    {
+                        continue;
+                    }
+
+                    if (b->last != last)
+                        *b->last++ = ',';
+
+                    *b->last++ = '"';
+                    b->last = (u_char *)
+                              ngx_http_fancyindex_escape_json(b->last, p, n);
+                    *b->last++ = '"';
+                }
+            }
+
+            *b->last++ = ']';
+        }
+    }
+
+    b->last = ngx_cpymem_ssz(b->last, "}" CRLF);
+
+    return b;
+}
+
+#endif /* NGX_HTTP_FANCYINDEX_JSON */
+
+
+/*
+ * 截断列表时名称缓冲区按32字节对齐分配，替换堆顶的条目时可以重用。每个
+ * 位置的缓冲区只会变大，因此被替换的条目浪费的内存也有上限。排序方式
+ * 需要排序键时，键紧跟在名称的'\0'后面。
+ */
+#define ngx_http_fancyindex_name_size(len)  ngx_align((len) + 1, 32)
+#define ngx_http_fancyindex_kept_size(e)                                     \
+    ngx_http_fancyindex_name_size((e)->name.len + (e)->key.len)
+
+
+/*
+ * 截断列表时堆中的条目按排序键比较，新条目的键生成在st->key中，保留
+ * 条目时与名称一起复制。
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_key(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_scan_t *st,
+        ngx_http_fancyindex_entry_t *entry)
+{
+    size_t      n;
+    ngx_uint_t  collate;
+
+    ngx_str_null(&entry->key);
+
+    if (!ngx_http_fancyindex_keyed(st->cmp))
+        return NGX_OK;
+
+    collate = 0;
+    n = 5 * entry->name.len + 1;
+
+#if (NGX_HAVE_STRXFRM_L)
+    if (st->cmp == ngx_http_fancyindex_cmp_entries_collate_asc
+        || st->cmp == ngx_http_fancyindex_cmp_entries_collate_desc)
+    {
+        collate = 1;
+        n = ngx_http_fancyindex_collate_key(st->key, st->key_size,
+                                            &entry->name,
+                                            alcf->collation->locale);
+    }
+#endif
+
+    if (n > st->key_size) {
+        /* 按倍数增长，被丢弃的缓冲区总大小不超过当前的大小 */
+        st->key_size = ngx_max(n, 2 * st->key_size);
+
+        if ((st->key = ngx_pnalloc(r->pool, st->key_size)) == NULL)
+            return NGX_ERROR;
+
+#if (NGX_HAVE_STRXFRM_L)
+        if (collate)
+            (void) ngx_http_fancyindex_collate_key(st->key, st->key_size,
+                                                   &entry->name,
+                                                   alcf->collation->locale);
+#endif
+    }
+
+    if (!collate) {
+        n = ngx_http_fancyindex_version_key(st->key, entry->name.data,
+                                            entry->name.len,
+                                            !alcf->case_sensitive)
+            - st->key;
+    }
+
+    entry->key.data = st->key;
+    entry->key.len = n;
+
+    return NGX_OK;
+}
+
+
+/* 将条目的名称和排序键复制到至少kept_size大小的缓冲区p中 */
+static void
+ngx_http_fancyindex_scan_keep(ngx_http_fancyindex_entry_t *dst,
+        ngx_http_fancyindex_entry_t *src, u_char *p)
+{
+    *dst = *src;
+
+    dst->name.data = p;
+    p = ngx_cpystrn(p, src->name.data, src->name.len + 1) + 1;
+
+    dst->key.data = p;
+    ngx_memcpy(p, src->key.data, src->key.len);
+}
+
+
+/* 按列表中的顺序比较两个条目 */
+static ngx_inline int
+ngx_http_fancyindex_cmp_listed(ngx_http_fancyindex_scan_t *st,
+        ngx_http_fancyindex_entry_t *one, ngx_http_fancyindex_entry_t *two)
+{
+    if (st->dirs_first && one->dir != two->dir)
+        return one->dir ? -1 : 1;
+
+    return st->cmp(one, two);
+}
+
+
+/* 大顶堆的下沉操作，堆顶是列表中最靠后的条目 */
+static void
+ngx_http_fancyindex_heap_down(ngx_http_fancyindex_scan_t *st,
+        ngx_http_fancyindex_entry_t *heap, ngx_uint_t n, ngx_uint_t i)
+{
+    ngx_uint_t                   c;
+    ngx_http_fancyindex_entry_t  tmp;
+
+    for ( ;; ) {
+        c = 2 * i + 1;
+        if (c >= n)
+            break;
+
+        if (c + 1 < n
+            && ngx_http_fancyindex_cmp_listed(st, &heap[c + 1], &heap[c]) > 0)
+        {
+            c++;
+        }
+
+        if (ngx_http_fancyindex_cmp_listed(st, &heap[c], &heap[i]) <= 0)
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[c];
+        heap[c] = tmp;
+        i = c;
+    }
+}
+
+
+/*
+ * 设置了fancyindex_max_entries或fancyindex_max_listing_memory时检查新的
+ * 条目。未达到上限时返回NGX_OK，由调用者添加条目。达到上限后entries
+ * 作为大顶堆，只保留排序后最靠前的条目，返回NGX_DECLINED。
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_limit(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_scan_t *st,
+        ngx_array_t *entries, ngx_http_fancyindex_entry_t *entry)
+{
+    size_t                        size, cost;
+    u_char                       *name;
+    ngx_uint_t                    i;
+    ngx_http_fancyindex_entry_t  *heap;
+
+    size = ngx_http_fancyindex_kept_size(entry);
+    heap = entries->elts;
+
+    if (!st->truncated) {
+        /* 条目数组按倍数增长，每个条目按两份计算 */
+        cost = 2 * sizeof(ngx_http_fancyindex_entry_t) + size
+             + ngx_http_fancyindex_row_size(alcf->row_program, entry);
+
+        if ((alcf->max_entries == 0 || entries->nelts < alcf->max_entries)
+            && (alcf->max_listing_memory == 0
+                || st->memory + cost <= alcf->max_listing_memory))
+        {
+            st->memory += cost;
+            return NGX_OK;
+        }
+
+        st->truncated = 1;
+
+        for (i = entries->nelts / 2; i-- > 0; /* void */)
+            ngx_http_fancyindex_heap_down(st, heap, entries->nelts, i);
+    }
+
+    if (entries->nelts == 0
+        || ngx_http_fancyindex_cmp_listed(st, entry, &heap[0]) >= 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* 替换堆顶的条目 */
+    name = heap[0].name.data;
+
+    if (ngx_http_fancyindex_kept_size(&heap[0]) < size) {
+        if ((name = ngx_palloc(r->pool, size)) == NULL)
+            return NGX_ERROR;
+        st->memory += size;
+    }
+
+    ngx_http_fancyindex_scan_keep(&heap[0], entry, name);
+
+    ngx_http_fancyindex_heap_down(st, heap, entries->nelts, 0);
+
+    return NGX_DECLINED;
+}
+
+
+/* 请求结束时关闭尚未读完的目录 */
+static void
+ngx_http_fancyindex_scan_cleanup(void *data)
+{
+    ngx_http_fancyindex_scan_t *st = data;
+
+    if (st->opened) {
+        st->opened = 0;
+        (void) ngx_close_dir(&st->dir);
+    }
+}
+
+
+static time_t      ngx_http_fancyindex_error_sec;
+static ngx_uint_t  ngx_http_fancyindex_error_logged;
+static ngx_uint_t  ngx_http_fancyindex_error_suppressed;
+
+
+/*
+ * 打开目录失败时记录错误并返回响应的状态码。目录不存在和无权访问的错误
+ * 在每个工作进程中每秒最多记录fancyindex_error_log_limit条，略过的条数
+ * 在之后记录的一条中给出。
+ */
+static ngx_int_t
+ngx_http_fancyindex_dir_error(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_err_t err,
+        const char *func, u_char *path)
+{
+    time_t     now;
+    ngx_int_t  rc;
+
+    if (err == NGX_ENOENT || err == NGX_ENOTDIR || err == NGX_ENAMETOOLONG) {
+        rc = NGX_HTTP_NOT_FOUND;  /* 文件不存在或不是目录或名称太长 */
+
+    } else if (err == NGX_EACCES) {
+        rc = NGX_HTTP_FORBIDDEN;  /* 权限不足 */
+
+    } else {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      "%s \"%s\" failed", func, path);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (alcf->error_log_limit) {
+        now = ngx_time();
+
+        if (now != ngx_http_fancyindex_error_sec) {
+            ngx_http_fancyindex_error_sec = now;
+            ngx_http_fancyindex_error_logged = 0;
+        }
+
+        if (ngx_http_fancyindex_error_logged >= alcf->error_log_limit) {
+            ngx_http_fancyindex_error_suppressed++;
+            return rc;
+        }
+
+        ngx_http_fancyindex_error_logged++;
+
+        if (ngx_http_fancyindex_error_suppressed) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
+                          "%s \"%s\" failed, %ui similar errors suppressed",
+                          func, path, ngx_http_fancyindex_error_suppressed);
+            ngx_http_fancyindex_error_suppressed = 0;
+            return rc;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
+                  "%s \"%s\" failed", func, path);
+
+    return rc;
+}
+
+
+/*
+ * 打开目录path并初始化entries，之后由ngx_http_fancyindex_scan_read()读取
+ * 条目。path->data指向的缓冲区大小为allocated，读取过程中会被用来拼接
+ * 条目的完整路径。
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_open(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_scan_t *st,
+        ngx_str_t *path, size_t allocated, ngx_array_t *entries)
+{
+    const char         *sort_url_args;
+    ngx_pool_cleanup_t *cln;
+
+    st->utf8 = ngx_http_fancyindex_is_utf8(r);
+    st->start = ngx_time();
+
+    if (alcf->max_entries || alcf->max_listing_memory) {
+        st->cmp = ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args);
+        st->dirs_first = alcf->dirs_first;
+    }
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (ngx_open_dir(path, &st->dir) == NGX_ERROR) {
+        return ngx_http_fancyindex_dir_error(r, alcf, ngx_errno,
+                                             ngx_open_dir_n, path->data);
+    }
+
+    st->opened = 1;
+    cln->handler = ngx_http_fancyindex_scan_cleanup;
+    cln->data = st;
+
+    if (ngx_array_init(entries, r->pool, 40,
+                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+    {
+        st->opened = 0;
+        return ngx_http_fancyindex_error(r, &st->dir, path);
+    }
+
+    st->allocated = allocated;
+    st->filename = path->data;
+    st->filename[path->len] = '/';
+    st->last = path->data + path->len + 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 读取目录中的条目及其信息，保存到entries中。limit不为0时最多读取limit个
+ * 条目，目录中还有条目时返回NGX_AGAIN；读完后关闭目录并返回NGX_OK。
+ * st->parallel不为0时在线程池中获取条目的信息，返回NGX_DONE，完成后投递
+ * st->wake，再次调用时返回结果。
+ */
+/* 名称是否匹配fancyindex_ignore，alcf->ignore不能为NULL */
+static ngx_uint_t
+ngx_http_fancyindex_ignored(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, u_char *name, size_t len)
+{
+#if NGX_PCRE
+    /* 使用PCRE正则表达式匹配忽略文件 */
+    ngx_str_t str;
+
+    str.len = len;
+    str.data = name;
+
+    return ngx_regex_exec_array(alcf->ignore, &str, r->connection->log)
+           != NGX_DECLINED;
+#else /* !NGX_PCRE */
+    /* 不使用PCRE，进行简单字符串匹配 */
+    ngx_uint_t i;
+    ngx_str_t *s = alcf->ignore->elts;
+
+    for (i = 0; i < alcf->ignore->nelts; i++, s++) {
+        if (s->len == len && ngx_strncmp(name, s->data, len) == 0)
+            return 1;
+    }
+
+    return 0;
+#endif /* NGX_PCRE */
+}
+
+
+/*
+ * 将条目加入列表：按修改时间过滤，达到上限时按排序结果截断。tmp中的名称
+ * 在返回后不再使用，需要时会被复制。
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_push(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_scan_t *st,
+        ngx_array_t *entries, ngx_http_fancyindex_entry_t *tmp)
+{
+    u_char                       *name;
+    ngx_int_t                     rc;
+    ngx_http_fancyindex_entry_t  *entry;
+
+    if (st->filter && st->filter->delta && tmp->mtime < st->filter->since)
+        return NGX_OK;
+
+    ngx_http_fancyindex_set_name(tmp, st->utf8);
+    ngx_str_null(&tmp->key);
+    tmp->sum = NULL;
+
+    st->total++;
+
+    if (st->cmp) {
+        if (ngx_http_fancyindex_scan_key(r, alcf, st, tmp) != NGX_OK)
+            return NGX_ERROR;
+
+        rc = ngx_http_fancyindex_scan_limit(r, alcf, st, entries, tmp);
+        if (rc != NGX_OK)
+            return (rc == NGX_DECLINED) ? NGX_OK : rc;
+    }
+
+    name = ngx_palloc(r->pool, st->cmp
+                               ? ngx_http_fancyindex_kept_size(tmp)
+                               : tmp->name.len + 1);
+    if (name == NULL)
+        return NGX_ERROR;
+
+    if ((entry = ngx_array_push(entries)) == NULL)
+        return NGX_ERROR;
+
+    ngx_http_fancyindex_scan_keep(entry, tmp, name);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+
+/* 并行获取条目信息时，每个任务每次取出的条目数 */
+#define NGX_HTTP_FANCYINDEX_STAT_CHUNK  64
+
+/* 需要获取信息的条目，名称保存在batch->names中 */
+typedef struct {
+    size_t                               name;       /* 名称的位置 */
+    size_t                               len;
+    off_t                                size;
+    time_t                               mtime;
+    ngx_err_t                            err;
+    u_char                               type;       /* 读取目录时得到的类型 */
+    unsigned                             dir:1;
+    unsigned                             failed:2;   /* 见下面的定义 */
+} ngx_http_fancyindex_stat_item_t;
+
+#define NGX_HTTP_FANCYINDEX_STAT_SKIP    1           /* stat()失败，跳过 */
+#define NGX_HTTP_FANCYINDEX_STAT_FAILED  2           /* lstat()也失败 */
+
+/*
+ * 所有任务共用的状态，不能使用请求的内存池：请求提前结束时任务仍在运行，
+ * 由最后完成的任务释放。
+ */
+struct ngx_http_fancyindex_stat_batch_s {
+    ngx_http_fancyindex_stat_item_t     *items;
+    ngx_uint_t                           nitems;
+    ngx_uint_t                           nalloc;
+    u_char                              *names;      /* 以'\0'结尾的名称 */
+    size_t                               names_len;
+    size_t                               names_alloc;
+    size_t                               max_len;    /* 最长的名称 */
+    ngx_atomic_t                         next;       /* 下一个未处理的条目 */
+    ngx_uint_t                           pending;    /* 尚未完成的任务或操作数 */
+    ngx_event_t                         *wake;       /* 请求已结束时为NULL */
+    uint64_t                            *stat_time;
+    uint64_t                             start;
+#if (NGX_HAVE_IO_URING)
+    ngx_fd_t                             fd;         /* 目录，statx()的dirfd */
+    ngx_queue_t                          queue;      /* 等待提交的队列 */
+    unsigned                             queued:1;
+#endif
+};
+
+typedef struct {
+    ngx_http_fancyindex_stat_batch_t    *batch;
+    u_char                              *filename;   /* 目录路径加'/' */
+    u_char                              *last;       /* 名称的位置 */
+} ngx_http_fancyindex_stat_task_t;
+
+
+static void
+ngx_http_fancyindex_stat_free(ngx_http_fancyindex_stat_batch_t *batch)
+{
+#if (NGX_HAVE_IO_URING)
+    if (batch->fd != NGX_INVALID_FILE)
+        (void) close(batch->fd);
+#endif
+
+    if (batch->items)
+        ngx_free(batch->items);
+    if (batch->names)
+        ngx_free(batch->names);
+    ngx_free(batch);
+}
+
+
+/* 请求结束时释放状态，任务仍在运行时由最后完成的任务释放 */
+static void
+ngx_http_fancyindex_stat_cleanup(void *data)
+{
+    ngx_http_fancyindex_scan_t *st = data;
+
+    if (st->batch == NULL)
+        return;
+
+#if (NGX_HAVE_IO_URING)
+    /* 不再提交剩余的条目 */
+    if (st->batch->queued) {
+        ngx_queue_remove(&st->batch->queue);
+        st->batch->queued = 0;
+    }
+#endif
+
+    if (st->batch->pending) {
+        st->batch->wake = NULL;
+        st->batch->stat_time = NULL;
+    } else {
+        ngx_http_fancyindex_stat_free(st->batch);
+    }
+
+    st->batch = NULL;
+}
+
+
+/* 记录需要获取信息的条目，目录读完后再统一获取 */
+static ngx_int_t
+ngx_http_fancyindex_stat_add(ngx_http_request_t *r,
+        ngx_http_fancyindex_scan_t *st, ngx_dir_t *dir, size_t len)
+{
+    size_t                             n;
+    u_char                            *names;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_fancyindex_stat_item_t   *items, *item;
+    ngx_http_fancyindex_stat_batch_t  *batch;
+
+    batch = st->batch;
+
+    if (batch == NULL) {
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NGX_ERROR;
+
+        batch = ngx_calloc(sizeof(ngx_http_fancyindex_stat_batch_t),
+                           r->connection->log);
+        if (batch == NULL)
+            return NGX_ERROR;
+
+#if (NGX_HAVE_IO_URING)
+        batch->fd = NGX_INVALID_FILE;
+#endif
+
+        st->batch = batch;
+        cln->handler = ngx_http_fancyindex_stat_cleanup;
+        cln->data = st;
+    }
+
+    if (batch->nitems == batch->nalloc) {
+        n = batch->nalloc ? 2 * batch->nalloc : 256;
+
+        items = ngx_alloc(n * sizeof(ngx_http_fancyindex_stat_item_t),
+                          r->connection->log);
+        if (items == NULL)
+            return NGX_ERROR;
+
+        if (batch->items) {
+            ngx_memcpy(items, batch->items,
+                       batch->nitems * sizeof(ngx_http_fancyindex_stat_item_t));
+            ngx_free(batch->items);
+        }
+
+        batch->items = items;
+        batch->nalloc = n;
+    }
+
+    if (batch->names_len + len + 1 > batch->names_alloc) {
+        n = ngx_max(2 * batch->names_alloc, batch->names_len + len + 1);
+        n = ngx_max(n, 4096);
+
+        if ((names = ngx_alloc(n, r->connection->log)) == NULL)
+            return NGX_ERROR;
+
+        if (batch->names) {
+            ngx_memcpy(names, batch->names, batch->names_len);
+            ngx_free(batch->names);
+        }
+
+        batch->names = names;
+        batch->names_alloc = n;
+    }
+
+    item = &batch->items[batch->nitems++];
+    ngx_memzero(item, sizeof(ngx_http_fancyindex_stat_item_t));
+
+    item->name = batch->names_len;
+    item->len = len;
+#if (NGX_HAVE_D_TYPE)
+    item->type = dir->type;
+#endif
+
+    ngx_memcpy(batch->names + batch->names_len, ngx_de_name(dir), len + 1);
+    batch->names_len += len + 1;
+
+    if (len > batch->max_len)
+        batch->max_len = len;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 获取条目的信息，与ngx_http_fancyindex_scan_read()中的顺序相同：stat()
+ * 返回ENOENT时（例如失效的符号链接）使用lstat()。
+ */
+static void
+ngx_http_fancyindex_stat_items(ngx_http_fancyindex_stat_task_t *sk)
+{
+    ngx_dir_t                          dir;
+    ngx_uint_t                         i, n;
+    ngx_http_fancyindex_stat_item_t   *item;
+    ngx_http_fancyindex_stat_batch_t  *batch = sk->batch;
+
+    for ( ;; ) {
+        i = ngx_atomic_fetch_add(&batch->next, NGX_HTTP_FANCYINDEX_STAT_CHUNK);
+        if (i >= batch->nitems)
+            break;
+
+        n = ngx_min(i + NGX_HTTP_FANCYINDEX_STAT_CHUNK, batch->nitems);
+
+        for (item = &batch->items[i]; i < n; i++, item++) {
+            ngx_memcpy(sk->last, batch->names + item->name, item->len + 1);
+
+            dir.valid_info = 0;
+#if (NGX_HAVE_D_TYPE)
+            dir.type = item->type;
+#endif
+
+            if (ngx_de_info(sk->filename, &dir) == NGX_FILE_ERROR) {
+                item->err = ngx_errno;
+
+                if (item->err != NGX_ENOENT) {
+                    item->failed = NGX_HTTP_FANCYINDEX_STAT_SKIP;
+                    continue;
+                }
+
+                if (ngx_de_link_info(sk->filename, &dir) == NGX_FILE_ERROR) {
+                    item->err = ngx_errno;
+                    item->failed = NGX_HTTP_FANCYINDEX_STAT_FAILED;
+                    continue;
+                }
+            }
+
+            item->dir = ngx_de_is_dir(&dir);
+            item->mtime = ngx_de_mtime(&dir);
+            item->size = ngx_de_size(&dir);
+        }
+    }
+}
+
+
+/* 一批条目的信息已全部获取，请求已经结束时释放状态 */
+static void
+ngx_http_fancyindex_stat_finish(ngx_http_fancyindex_stat_batch_t *batch)
+{
+    if (batch->wake == NULL) {
+        ngx_http_fancyindex_stat_free(batch);
+        return;
+    }
+
+    if (batch->stat_time)
+        *batch->stat_time += ngx_fancyindex_usec() - batch->start;
+
+    ngx_post_event(batch->wake, &ngx_posted_events);
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_fancyindex_stat_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_stat_items(data);
+}
+
+
+static void
+ngx_http_fancyindex_stat_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t                 *task = ev->data;
+    ngx_http_fancyindex_stat_task_t   *sk = task->ctx;
+    ngx_http_fancyindex_stat_batch_t  *batch = sk->batch;
+
+    ngx_free(task);
+
+    if (--batch->pending == 0)
+        ngx_http_fancyindex_stat_finish(batch);
+}
+
+
+/* 分配任务，filename为目录的路径加'/'，长度为len */
+static ngx_thread_task_t *
+ngx_http_fancyindex_stat_task(ngx_http_fancyindex_stat_batch_t *batch,
+        u_char *filename, size_t len, ngx_log_t *log)
+{
+    ngx_thread_task_t                *task;
+    ngx_http_fancyindex_stat_task_t  *sk;
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_fancyindex_stat_task_t)
+                      + len + batch->max_len + 1, log);
+    if (task == NULL)
+        return NULL;
+
+    sk = (ngx_http_fancyindex_stat_task_t *) (task + 1);
+    sk->batch = batch;
+    sk->filename = (u_char *) (sk + 1);
+    sk->last = ngx_cpymem(sk->filename, filename, len);
+
+    task->ctx = sk;
+    task->handler = ngx_http_fancyindex_stat_thread;
+    task->event.handler = ngx_http_fancyindex_stat_done;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    return task;
+}
+
+
+#endif /* NGX_THREADS */
+
+
+#if (NGX_HAVE_IO_URING)
+
+/* 每个工作进程中同时进行的statx()操作数 */
+#define NGX_HTTP_FANCYINDEX_URING_ENTRIES  256
+
+/* io_uring_submit()失败或者没有提交全部条目时，重试的间隔（毫秒） */
+#define NGX_HTTP_FANCYINDEX_URING_RETRY    10
+
+/* 进行中的statx()操作，结果写入stx */
+typedef struct {
+    ngx_http_fancyindex_stat_batch_t    *batch;
+    ngx_uint_t                           item;
+    ngx_uint_t                           nofollow;   /* 已改为lstat()的语义 */
+    struct statx                         stx;
+} ngx_http_fancyindex_uring_op_t;
+
+/* 每个工作进程的io_uring，完成事件通过eventfd通知事件循环 */
+typedef struct {
+    struct io_uring                      ring;
+    ngx_connection_t                    *conn;       /* eventfd */
+    ngx_event_t                          retry;      /* 重新提交 */
+    ngx_queue_t                          queue;      /* 还有条目未提交的批次 */
+    ngx_http_fancyindex_uring_op_t     **free;       /* 空闲的操作 */
+    ngx_uint_t                           nfree;
+} ngx_http_fancyindex_uring_t;
+
+static ngx_http_fancyindex_uring_t  *ngx_http_fancyindex_uring;
+
+
+static void
+ngx_http_fancyindex_uring_prep(ngx_http_fancyindex_uring_t *u,
+        struct io_uring_sqe *sqe, ngx_http_fancyindex_uring_op_t *op)
+{
+    ngx_http_fancyindex_stat_batch_t  *batch = op->batch;
+
+    io_uring_prep_statx(sqe, batch->fd,
+                        (char *) batch->names + batch->items[op->item].name,
+                        AT_STATX_SYNC_AS_STAT
+                        | (op->nofollow ? AT_SYMLINK_NOFOLLOW : 0),
+                        STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME,
+                        &op->stx);
+    io_uring_sqe_set_data(sqe, op);
+}
+
+
+/*
+ * 从等待的批次中提交条目，直到没有空闲的操作。已准备的条目在提交失败
+ * 后仍留在提交队列中，不会自行完成，因此设置定时器重新提交，否则等待
+ * 这些条目的请求不会再被唤醒。
+ */
+static void
+ngx_http_fancyindex_uring_fill(ngx_http_fancyindex_uring_t *u)
+{
+    int                                 rc;
+    ngx_uint_t                          level;
+    ngx_queue_t                        *q;
+    struct io_uring_sqe                *sqe;
+    ngx_http_fancyindex_uring_op_t     *op;
+    ngx_http_fancyindex_stat_batch_t   *batch;
+
+    while (u->nfree && !ngx_queue_empty(&u->queue)) {
+        q = ngx_queue_head(&u->queue);
+        batch = ngx_queue_data(q, ngx_http_fancyindex_stat_batch_t, queue);
+
+        if ((sqe = io_uring_get_sqe(&u->ring)) == NULL)
+            break;
+
+        op = u->free[--u->nfree];
+        op->batch = batch;
+        op->item = batch->next++;
+        op->nofollow = 0;
+
+        ngx_http_fancyindex_uring_prep(u, sqe, op);
+
+        batch->pending++;
+
+        if (batch->next == batch->nitems) {
+            ngx_queue_remove(&batch->queue);
+            batch->queued = 0;
+        }
+    }
+
+    if (io_uring_sq_ready(&u->ring) == 0)
+        return;
+
+    rc = io_uring_submit(&u->ring);
+
+    if (rc >= 0 && io_uring_sq_ready(&u->ring) == 0)
+        return;
+
+    if (u->retry.timer_set)
+        return;
+
+    if (rc < 0) {
+        level = (rc == -EAGAIN || rc == -EBUSY) ? NGX_LOG_WARN
+                                                : NGX_LOG_ALERT;
+        ngx_log_error(level, u->conn->log, -rc,
+                      "io_uring_submit() failed, retrying");
+    }
+
+    ngx_add_timer(&u->retry, NGX_HTTP_FANCYINDEX_URING_RETRY);
+}
+
+
+static void
+ngx_http_fancyindex_uring_retry(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_uring_fill(ev->data);
+}
+
+
+/* 处理完成的statx()操作 */
+static void
+ngx_http_fancyindex_uring_handler(ngx_event_t *ev)
+{
+    int                                 res;
+    uint64_t                            value;
+    ngx_connection_t                   *c;
+    struct io_uring_cqe                *cqe;
+    struct io_uring_sqe                *sqe;
+    ngx_http_fancyindex_uring_t        *u;
+    ngx_http_fancyindex_uring_op_t     *op;
+    ngx_http_fancyindex_stat_item_t    *item;
+    ngx_http_fancyindex_stat_batch_t   *batch;
+
+    c = ev->data;
+    u = ngx_http_fancyindex_uring;
+
+    while (read(c->fd, &value, sizeof(uint64_t)) == sizeof(uint64_t)) {
+        /* void */
+    }
+
+    while (io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+        op = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&u->ring, cqe);
+
+        batch = op->batch;
+        item = &batch->items[op->item];
+
+        /* 与stat()返回ENOENT后使用lstat()相同，例如失效的符号链接 */
+        if (res == -NGX_ENOENT && !op->nofollow && batch->wake) {
+            sqe = io_uring_get_sqe(&u->ring);
+
+            /* 在最后由ngx_http_fancyindex_uring_fill()提交 */
+            if (sqe != NULL) {
+                op->nofollow = 1;
+                ngx_http_fancyindex_uring_prep(u, sqe, op);
+                continue;
+            }
+        }
+
+        if (res < 0) {
+            item->err = -res;
+            item->failed = op->nofollow ? NGX_HTTP_FANCYINDEX_STAT_FAILED
+                                        : NGX_HTTP_FANCYINDEX_STAT_SKIP;
+        } else {
+            item->dir = item->type ? item->type == DT_DIR
+                                   : S_ISDIR(op->stx.stx_mode);
+            item->mtime = op->stx.stx_mtime.tv_sec;
+            item->size = op->stx.stx_size;
+        }
+
+        u->free[u->nfree++] = op;
+
+        if (--batch->pending == 0 && !batch->queued)
+            ngx_http_fancyindex_stat_finish(batch);
+    }
+
+    ngx_http_fancyindex_uring_fill(u);
+
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "fancyindex: failed to re-arm io_uring eventfd");
+    }
+}
+
+
+/* 打开目录并将批次加入提交队列，无法使用io_uring时返回NGX_DECLINED */
+static ngx_int_t
+ngx_http_fancyindex_uring_start(ngx_http_request_t *r,
+        ngx_http_fancyindex_scan_t *st, ngx_str_t *path)
+{
+    ngx_http_fancyindex_uring_t       *u = ngx_http_fancyindex_uring;
+    ngx_http_fancyindex_stat_batch_t  *batch = st->batch;
+
+    if (u == NULL)
+        return NGX_DECLINED;
+
+    /* path->data中目录的路径之后是'/' */
+    path->data[path->len] = '\0';
+    batch->fd = open((char *) path->data, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    path->data[path->len] = '/';
+
+    if (batch->fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      "open() \"%V\" for statx() failed", path);
+        return NGX_DECLINED;
+    }
+
+    batch->wake = st->wake;
+    batch->stat_time = st->stat_time;
+    batch->start = ngx_fancyindex_usec();
+
+    ngx_queue_insert_tail(&u->queue, &batch->queue);
+    batch->queued = 1;
+
+    ngx_http_fancyindex_uring_fill(u);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: statx of %ui entries in \"%V\" "
+                   "via io_uring", batch->nitems, path);
+
+    st->waiting = 1;
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_uring_init_process(ngx_cycle_t *cycle)
+{
+    int                                 fd, rc;
+    ngx_uint_t                          i;
+    ngx_connection_t                   *c;
+    ngx_http_fancyindex_uring_t        *u;
+    ngx_http_fancyindex_uring_op_t     *ops;
+    ngx_http_fancyindex_main_conf_t    *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_fancyindex_module);
+
+    if (mcf == NULL || !mcf->uring
+        || (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE))
+    {
+        return NGX_OK;
+    }
+
+    u = ngx_pcalloc(cycle->pool, sizeof(ngx_http_fancyindex_uring_t));
+    ops = ngx_pcalloc(cycle->pool, NGX_HTTP_FANCYINDEX_URING_ENTRIES
+                                   * sizeof(ngx_http_fancyindex_uring_op_t));
+    if (u == NULL || ops == NULL)
+        return NGX_ERROR;
+
+    u->free = ngx_palloc(cycle->pool, NGX_HTTP_FANCYINDEX_URING_ENTRIES
+                                      * sizeof(ngx_http_fancyindex_uring_op_t *));
+    if (u->free == NULL)
+        return NGX_ERROR;
+
+    for (i = 0; i < NGX_HTTP_FANCYINDEX_URING_ENTRIES; i++)
+        u->free[u->nfree++] = &ops[i];
+
+    ngx_queue_init(&u->queue);
+
+    /* 失败时退回到线程池或者直接获取 */
+    rc = io_uring_queue_init(NGX_HTTP_FANCYINDEX_URING_ENTRIES, &u->ring, 0);
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, -rc,
+                      "io_uring_queue_init() failed, "
+                      "\"fancyindex_stat_engine io_uring\" is ignored");
+        return NGX_OK;
+    }
+
+    fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd() failed, "
+                      "\"fancyindex_stat_engine io_uring\" is ignored");
+        io_uring_queue_exit(&u->ring);
+        return NGX_OK;
+    }
+
+    rc = io_uring_register_eventfd(&u->ring, fd);
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, -rc,
+                      "io_uring_register_eventfd() failed, "
+                      "\"fancyindex_stat_engine io_uring\" is ignored");
+        (void) close(fd);
+        io_uring_queue_exit(&u->ring);
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(fd, cycle->log);
+    if (c == NULL) {
+        (void) close(fd);
+        io_uring_queue_exit(&u->ring);
+        return NGX_OK;
+    }
+
+    c->log = cycle->log;
+    c->read->log = cycle->log;
+    c->read->handler = ngx_http_fancyindex_uring_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        io_uring_queue_exit(&u->ring);
+        return NGX_OK;
+    }
+
+    u->conn = c;
+    u->retry.handler = ngx_http_fancyindex_uring_retry;
+    u->retry.data = u;
+    u->retry.log = cycle->log;
+    u->retry.cancelable = 1;
+
+    ngx_http_fancyindex_uring = u;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_fancyindex_uring_exit_process(void)
+{
+    ngx_http_fancyindex_uring_t  *u = ngx_http_fancyindex_uring;
+
+    if (u == NULL)
+        return;
+
+    if (u->retry.timer_set)
+        ngx_del_timer(&u->retry);
+
+    ngx_close_connection(u->conn);
+    io_uring_queue_exit(&u->ring);
+    ngx_http_fancyindex_uring = NULL;
+}
+
+#endif /* NGX_HAVE_IO_URING */
+
+
+/*
+ * 目录读完后获取记录的条目的信息。st->uring时通过io_uring获取；否则条目
+ * 较多时分成st->parallel个任务放入线程池。这两种情况返回NGX_DONE，全部
+ * 完成后投递st->wake，由ngx_http_fancyindex_stat_collect()处理结果。
+ * 条目较少或者都无法使用时直接获取并返回NGX_OK。
+ */
+static ngx_int_t
+ngx_http_fancyindex_stat_start(ngx_http_request_t *r,
+        ngx_http_fancyindex_scan_t *st, ngx_str_t *path)
+{
+    ngx_http_fancyindex_stat_task_t    sk;
+    ngx_http_fancyindex_stat_batch_t  *batch = st->batch;
+#if (NGX_THREADS)
+    ngx_uint_t                         i;
+    ngx_thread_task_t                 *task;
+    ngx_http_fancyindex_main_conf_t   *mcf;
+#endif
+
+#if (NGX_HAVE_IO_URING)
+    if (st->uring && ngx_http_fancyindex_uring_start(r, st, path) == NGX_DONE)
+        return NGX_DONE;
+#endif
+
+#if (NGX_THREADS)
+    if (st->parallel && batch->nitems > NGX_HTTP_FANCYINDEX_STAT_CHUNK) {
+        mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+        batch->wake = st->wake;
+        batch->stat_time = st->stat_time;
+        batch->start = ngx_fancyindex_usec();
+
+        /* 每个任务处理的条目不少于一次取出的数量 */
+        for (i = 0; i < st->parallel; i++) {
+            if (i * NGX_HTTP_FANCYINDEX_STAT_CHUNK >= batch->nitems)
+                break;
+
+            task = ngx_http_fancyindex_stat_task(batch, path->data,
+                                                 path->len + 1,
+                                                 r->connection->log);
+            if (task == NULL)
+                break;
+
+            if (ngx_thread_task_post(mcf->thread_pool, task) != NGX_OK) {
+                ngx_free(task);
+                break;
+            }
+
+            batch->pending++;
+        }
+
+        /* 已放入线程池的任务会处理所有条目 */
+        if (batch->pending) {
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http fancyindex: stat of %ui entries in \"%V\" "
+                           "split into %ui tasks", batch->nitems, path,
+                           batch->pending);
+            st->waiting = 1;
+            return NGX_DONE;
+        }
+    }
+#endif
+
+    /* path->data中已经是目录的路径加'/' */
+    sk.batch = batch;
+    sk.filename = st->filename;
+    sk.last = st->last;
+
+    if (path->len + 1 + batch->max_len + 1 > st->allocated) {
+        sk.filename = ngx_pnalloc(r->pool,
+                                  path->len + 1 + batch->max_len + 1);
+        if (sk.filename == NULL)
+            return NGX_ERROR;
+
+        sk.last = ngx_cpymem(sk.filename, path->data, path->len + 1);
+    }
+
+    ngx_http_fancyindex_stat_items(&sk);
+
+    return NGX_OK;
+}
+
+
+/* 将获取了信息的条目加入列表，之后释放状态 */
+static ngx_int_t
+ngx_http_fancyindex_stat_collect(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_scan_t *st,
+        ngx_str_t *path, ngx_array_t *entries)
+{
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    ngx_http_fancyindex_entry_t        tmp;
+    ngx_http_fancyindex_stat_item_t   *item;
+    ngx_http_fancyindex_stat_batch_t  *batch = st->batch;
+
+    rc = NGX_OK;
+
+    for (i = 0, item = batch->items; i < batch->nitems; i++, item++) {
+        tmp.name.len = item->len;
+        tmp.name.data = batch->names + item->name;
+
+        if (item->failed == NGX_HTTP_FANCYINDEX_STAT_SKIP) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, item->err,
+                          ngx_de_info_n " \"%V/%s\" failed",
+                          path, tmp.name.data);
+            continue;
+        }
+
+        if (item->failed == NGX_HTTP_FANCYINDEX_STAT_FAILED) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, item->err,
+                          ngx_de_link_info_n " \"%V/%s\" failed",
+                          path, tmp.name.data);
+            rc = NGX_ERROR;
+            break;
+        }
+
+        tmp.dir = item->dir;
+        tmp.mtime = item->mtime;
+        tmp.size = item->size;
+
+        rc = ngx_http_fancyindex_scan_push(r, alcf, st, entries, &tmp);
+        if (rc != NGX_OK)
+            break;
+    }
+
+    ngx_http_fancyindex_stat_free(batch);
+    st->batch = NULL;
+
+    return rc;
+}
+
+#endif /* NGX_HTTP_FANCYINDEX_STAT_BATCH */
+
+
+static ngx_int_t
+ngx_http_fancyindex_scan_read(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_scan_t *st,
+        ngx_str_t *path, ngx_array_t *entries, ngx_uint_t limit,
+        ngx_http_fancyindex_timing_t *timing)
+{
+    ngx_http_fancyindex_entry_t tmp;
+    ngx_dir_t   *dir = &st->dir;
+    uint64_t     t1 = 0;
+    size_t       len;
+    ngx_uint_t   n;
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+    ngx_int_t    rc;
+#endif
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+    /* 线程池中的任务或者io_uring的操作已经完成 */
+    if (st->waiting) {
+        st->waiting = 0;
+
+        if (ngx_http_fancyindex_stat_collect(r, alcf, st, path, entries)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        goto done;
+    }
+#endif
+
+    /* 读取目录条目及其相关信息。 */
+    for (n = 0; ; n++) {
+        if (limit && n == limit)
+            return NGX_AGAIN;
+
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(dir) == NGX_ERROR) {
+            ngx_int_t err = ngx_errno;
+
+            /* 如果不是因为没有更多文件而失败，则记录错误并返回 */
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                        ngx_read_dir_n " \"%V\" failed", path);
+                goto failed;
+            }
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex file: \"%s\"", ngx_de_name(dir));
+
+        len = ngx_de_namelen(dir);
+
+        if (!alcf->show_dot_files && ngx_de_name(dir)[0] == '.')
+            continue;
+
+        if (alcf->hide_symlinks && ngx_de_is_link (dir))
+            continue;
+
+        if (alcf->ignore
+            && ngx_http_fancyindex_ignored(r, alcf, ngx_de_name(dir), len))
+        {
+            continue;  /* 匹配到忽略模式，跳过当前文件 */
+        }
+
+        /* 在stat()之前按名称过滤 */
+        if (st->filter && st->filter->query.len
+            && !ngx_http_fancyindex_match_name(st->filter, ngx_de_name(dir),
+                                               len))
+        {
+            continue;
+        }
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+        /* 读完目录后再统一获取信息 */
+        if ((st->parallel || st->uring) && !dir->valid_info) {
+            if (ngx_http_fancyindex_stat_add(r, st, dir, len) != NGX_OK)
+                goto failed;
+            continue;
+        }
+#endif
+
+        /* 目录条目信息无效，需要获取详细信息 */
+        if (!dir->valid_info) {
+            /* 1字节用于'/'，1字节用于终止符'\0' */
+            if (path->len + 1 + len + 1 > st->allocated) {
+                st->allocated = path->len + 1 + len + 1
+                              + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+                if ((st->filename = ngx_palloc(r->pool, st->allocated)) == NULL)
+                    goto failed;
+
+                st->last = ngx_cpystrn(st->filename, path->data, path->len + 1);
+                *st->last++ = '/';
+            }
+
+            ngx_cpystrn(st->last, ngx_de_name(dir), len + 1);
+
+            if (timing)
+                t1 = ngx_fancyindex_usec();
+
+            /* 获取文件信息 */
+            if (ngx_de_info(st->filename, dir) == NGX_FILE_ERROR) {
+                ngx_int_t err = ngx_errno;
+
+                /* 如果不是文件不存在的错误，则记录并跳过 */
+                if (err != NGX_ENOENT) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
+                            ngx_de_info_n " \"%s\" failed", st->filename);
+                    continue;
+                }
+
+                /* 尝试获取链接信息 */
+                if (ngx_de_link_info(st->filename, dir) == NGX_FILE_ERROR) {
+                    ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                            ngx_de_link_info_n " \"%s\" failed", st->filename);
+                    goto failed;
+                }
+            }
+
+            if (timing)
+                timing->stat += ngx_fancyindex_usec() - t1;
+        }
+
+        tmp.name.len  = len;
+        tmp.name.data = ngx_de_name(dir);
+        tmp.dir       = ngx_de_is_dir(dir);
+        tmp.mtime     = ngx_de_mtime(dir);
+        tmp.size      = ngx_de_size(dir);
+
+        if (ngx_http_fancyindex_scan_push(r, alcf, st, entries, &tmp)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+    }
+
+    st->opened = 0;
+
+    if (ngx_close_dir(dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                ngx_close_dir_n " \"%V\" failed", path);
+    }
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+    if (st->batch) {
+        rc = ngx_http_fancyindex_stat_start(r, st, path);
+
+        if (rc == NGX_DONE)
+            return NGX_DONE;
+
+        if (rc != NGX_OK
+            || ngx_http_fancyindex_stat_collect(r, alcf, st, path, entries)
+               != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+done:
+#endif
+
+    if (st->truncated) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "fancyindex: listing of \"%V\" truncated to %ui of "
+                      "%ui entries", path, entries->nelts, st->total);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    st->opened = 0;
+    return ngx_http_fancyindex_error(r, dir, path);
+}
+
+
+/*
+ * 后台子请求：重新读取目录，并用新的列表替换缓存中过期的列表。与前台的
+ * 请求一样按fancyindex_slice分片读取，并在线程池或io_uring中获取条目的
+ * 信息，未完成时设置ctx->yield并返回NGX_BUSY。
+ */
+static ngx_int_t
+ngx_http_fancyindex_refresh(ngx_http_request_t *r,
+        ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_int_t                       rc;
+    ngx_file_info_t                 fi;
+    ngx_http_fancyindex_scan_t     *st = &ctx->scan;
+    ngx_http_fancyindex_loc_conf_t *alcf = ctx->refresh;
+
+    if (ctx->state == NGX_HTTP_FANCYINDEX_STATE_START) {
+        if (ngx_http_fancyindex_map_path(r, &ctx->path, &ctx->allocated)
+            != NGX_OK)
+        {
+            ngx_http_fancyindex_cache_cleanup(ctx->cache_cln);
+            return NGX_ERROR;
+        }
+
+        ctx->mtime = (ngx_file_info(ctx->path.data, &fi) == NGX_FILE_ERROR)
+                     ? -1 : ngx_file_mtime(&fi);
+
+        rc = ngx_http_fancyindex_scan_open(r, alcf, st, &ctx->path,
+                                           ctx->allocated, &ctx->entries);
+        if (rc != NGX_OK)
+            goto done;
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+        st->parallel = alcf->parallel_stat;
+        st->uring = (alcf->stat_engine
+                     == NGX_HTTP_FANCYINDEX_STAT_ENGINE_IO_URING);
+        st->wake = &ctx->wait;
+#endif
+
+        ctx->state = NGX_HTTP_FANCYINDEX_STATE_SCAN;
+    }
+
+    rc = ngx_http_fancyindex_scan_read(r, alcf, st, &ctx->path, &ctx->entries,
+                                       alcf->slice, NULL);
+
+    /* NGX_DONE：等待线程池中的任务完成 */
+    if (rc == NGX_AGAIN || rc == NGX_DONE) {
+        ctx->yield = (rc == NGX_AGAIN);
+        return NGX_BUSY;
+    }
+
+    /* 截断的列表不缓存 */
+    if (rc == NGX_OK && ctx->mtime != -1 && !st->truncated) {
+        ngx_http_fancyindex_cache_put(r, alcf, &ctx->path, ctx->mtime,
+                                      st->start, &ctx->entries,
+                                      ctx->cache_cln);
+    }
+
+done:
+
+    ngx_http_fancyindex_cache_cleanup(ctx->cache_cln);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: refreshed \"%V\", rc:%i",
+                   &ctx->path, rc);
+
+    r->headers_out.status = NGX_HTTP_NO_CONTENT;
+    r->header_only = 1;
+
+    return ngx_http_send_header(r);
+}
+
+
+/*
+ * 创建HTTP响应的内容缓冲区。设置了fancyindex_slice时，每次调用最多读取或
+ * 生成slice个条目，未完成时设置ctx->yield并返回NGX_BUSY，再次调用时从
+ * ctx中保存的阶段继续。
+ */
+#if (NGX_THREADS)
+
+/* 比较索引中的两个路径，'/'小于其他任何字节 */
+static ngx_int_t
+ngx_http_fancyindex_index_cmp_path(u_char *one, size_t len1,
+        u_char *two, size_t len2)
+{
+    size_t  i, n;
+
+    n = ngx_min(len1, len2);
+
+    for (i = 0; i < n; i++) {
+        if (one[i] == two[i])
+            continue;
+
+        if (one[i] == '/')
+            return -1;
+
+        if (two[i] == '/')
+            return 1;
+
+        return (ngx_int_t) one[i] - (ngx_int_t) two[i];
+    }
+
+    return (len1 < len2) ? -1 : (len1 > len2);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_index_cmp_entries(const void *one, const void *two)
+{
+    const ngx_http_fancyindex_index_entry_t *first = one;
+    const ngx_http_fancyindex_index_entry_t *second = two;
+
+    return (int) ngx_http_fancyindex_index_cmp_path(first->path, first->len,
+                                                    second->path, second->len);
+}
+
+
+/* 将记录i放在最小堆的位置k，并向下调整 */
+static void
+ngx_http_fancyindex_index_heap_down(ngx_http_fancyindex_index_entry_t *e,
+        uint32_t *heap, ngx_uint_t n, ngx_uint_t k, uint32_t i)
+{
+    ngx_uint_t  child;
+
+    for ( ;; ) {
+        child = 2 * k + 1;
+
+        if (child >= n)
+            break;
+
+        if (child + 1 < n && e[heap[child + 1]].mtime < e[heap[child]].mtime)
+            child++;
+
+        if (e[i].mtime <= e[heap[child]].mtime)
+            break;
+
+        heap[k] = heap[child];
+        k = child;
+    }
+
+    heap[k] = i;
+}
+
+
+/* 在最小堆中保留最近修改的top个文件，堆顶是其中最早的 */
+static void
+ngx_http_fancyindex_index_heap_push(ngx_http_fancyindex_index_entry_t *e,
+        uint32_t *heap, ngx_uint_t *n, ngx_uint_t top, uint32_t i)
+{
+    ngx_uint_t  k, parent;
+
+    if (*n < top) {
+        for (k = (*n)++; k > 0; k = parent) {
+            parent = (k - 1) / 2;
+
+            if (e[heap[parent]].mtime <= e[i].mtime)
+                break;
+
+            heap[k] = heap[parent];
+        }
+
+        heap[k] = i;
+        return;
+    }
+
+    if (top && e[i].mtime > e[heap[0]].mtime)
+        ngx_http_fancyindex_index_heap_down(e, heap, *n, 0, i);
+}
+
+
+/* 在线程中记录监视描述符对应的目录 */
+static void
+ngx_http_fancyindex_index_watch(ngx_http_fancyindex_index_t *idx, int wd,
+        u_char *path, size_t len, ngx_log_t *log)
+{
+    ngx_rbtree_node_t                  *node, *sentinel;
+    ngx_http_fancyindex_index_watch_t  *w;
+
+    node = idx->watches.root;
+    sentinel = idx->watches.sentinel;
+
+    while (node != sentinel) {
+        if ((ngx_rbtree_key_t) wd == node->key)
+            break;
+
+        node = ((ngx_rbtree_key_t) wd < node->key) ? node->left : node->right;
+    }
+
+    /* 同一目录通过不同的路径监视，或者目录被移动 */
+    if (node != sentinel) {
+        w = (ngx_http_fancyindex_index_watch_t *) node;
+
+        if (w->path.len == len && ngx_memcmp(w->path.data, path, len) == 0)
+            return;
+
+        ngx_rbtree_delete(&idx->watches, node);
+        ngx_free(w);
+    }
+
+    w = ngx_alloc(sizeof(ngx_http_fancyindex_index_watch_t) + len, log);
+    if (w == NULL)
+        return;
+
+    w->node.key = (ngx_rbtree_key_t) wd;
+    w->path.len = len;
+    w->path.data = (u_char *) (w + 1);
+    ngx_memcpy(w->path.data, path, len);
+
+    ngx_rbtree_insert(&idx->watches, &w->node);
+}
+
+
+/* 目录已被删除或移动，不再记录其监视描述符 */
+static void
+ngx_http_fancyindex_index_unwatch(ngx_http_fancyindex_index_t *idx, int wd)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = idx->watches.root;
+    sentinel = idx->watches.sentinel;
+
+    while (node != sentinel) {
+        if ((ngx_rbtree_key_t) wd == node->key) {
+            ngx_rbtree_delete(&idx->watches, node);
+            ngx_free(node);
+            return;
+        }
+
+        node = ((ngx_rbtree_key_t) wd < node->key) ? node->left : node->right;
+    }
+}
+
+
+/* 监视描述符对应的目录，未知时返回NULL */
+static ngx_str_t *
+ngx_http_fancyindex_index_watched(ngx_http_fancyindex_index_t *idx, int wd)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = idx->watches.root;
+    sentinel = idx->watches.sentinel;
+
+    while (node != sentinel) {
+        if ((ngx_rbtree_key_t) wd == node->key)
+            return &((ngx_http_fancyindex_index_watch_t *) node)->path;
+
+        node = ((ngx_rbtree_key_t) wd < node->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* 条目的信息和类型，条目已被删除时返回NGX_DECLINED */
+static ngx_int_t
+ngx_http_fancyindex_index_stat(u_char *path, ngx_file_info_t *fi,
+        ngx_uint_t *flags, ngx_log_t *log)
+{
+    ngx_err_t  err;
+
+    if (ngx_link_info(path, fi) == NGX_FILE_ERROR) {
+        err = ngx_errno;
+
+        /* 读取期间被删除的条目 */
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_WARN, log, err,
+                          ngx_link_info_n " \"%s\" failed", path);
+        }
+        return NGX_DECLINED;
+    }
+
+    *flags = 0;
+
+    if (ngx_is_link(fi)) {
+        *flags = NGX_HTTP_FANCYINDEX_INDEX_LINK;
+
+        /* 无效的符号链接使用链接本身的信息 */
+        if (ngx_file_info(path, fi) == NGX_FILE_ERROR
+            && ngx_link_info(path, fi) == NGX_FILE_ERROR)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (ngx_is_dir(fi))
+        *flags |= NGX_HTTP_FANCYINDEX_INDEX_DIR;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 从记录first开始遍历目录树：读取其中的目录（不是符号链接）及其子目录，
+ * 新的记录加在entries的末尾。每个目录同时被监视，变化时重新读取该目录。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_walk(ngx_http_fancyindex_index_task_t *t,
+        ngx_pool_t *pool, ngx_array_t *entries, ngx_uint_t first,
+        ngx_log_t *log)
+{
+    u_char                             *path, *last, *p, *name, *parent;
+    size_t                              len, plen, allocated;
+    ngx_err_t                           err;
+    ngx_str_t                           dirname;
+    ngx_dir_t                           dir;
+    ngx_uint_t                          i, flags;
+    ngx_file_info_t                     fi;
+    ngx_http_fancyindex_index_t        *idx = t->index;
+    ngx_http_fancyindex_index_entry_t  *e;
+#if (NGX_HAVE_INOTIFY)
+    int                                 wd;
+#endif
+
+    allocated = idx->root.len + 2 + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+    if ((path = ngx_alloc(allocated, log)) == NULL)
+        return NGX_ERROR;
+
+    /* 广度优先：记录数组同时是待读取的目录的队列 */
+    for (i = first; i < entries->nelts; i++) {
+        e = (ngx_http_fancyindex_index_entry_t *) entries->elts + i;
+
+        if ((e->flags & (NGX_HTTP_FANCYINDEX_INDEX_DIR
+                         |NGX_HTTP_FANCYINDEX_INDEX_LINK))
+            != NGX_HTTP_FANCYINDEX_INDEX_DIR)
+        {
+            continue;  /* 不进入符号链接指向的目录，避免循环 */
+        }
+
+        parent = e->path;
+        plen = e->len;
+
+        /* 根目录 + '/' + 相对路径 + '/' + 名称 + '\0' */
+        len = idx->root.len + 1 + plen + 1 + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+        if (len > allocated) {
+            ngx_free(path);
+            allocated = len;
+            if ((path = ngx_alloc(allocated, log)) == NULL)
+                return NGX_ERROR;
+        }
+
+        last = ngx_cpymem(path, idx->root.data, idx->root.len);
+        if (plen) {
+            *last++ = '/';
+            last = ngx_cpymem(last, parent, plen);
+        }
+        if (last == path)
+            *last++ = '/';
+        *last = '\0';
+
+        dirname.len = last - path;
+        dirname.data = path;
+
+#if (NGX_HAVE_INOTIFY)
+        if (t->inotify != -1) {
+            wd = inotify_add_watch(t->inotify, (char *) path,
+                                   NGX_HTTP_FANCYINDEX_WATCH_MASK);
+
+            if (wd != -1) {
+                ngx_http_fancyindex_index_watch(idx, wd, parent, plen, log);
+
+            } else {
+                if (!t->unwatched) {
+                    ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                                  "inotify_add_watch(\"%s\") failed, index "
+                                  "\"%V\" will be rebuilt periodically",
+                                  path, &idx->file);
+                }
+                t->unwatched = 1;
+            }
+        }
+#endif
+
+        if (ngx_open_dir(&dirname, &dir) == NGX_ERROR) {
+            err = ngx_errno;
+
+            /* 无法读取根目录时保留旧的索引 */
+            if (i == 0) {
+                ngx_log_error(NGX_LOG_CRIT, log, err,
+                              ngx_open_dir_n " \"%s\" failed", path);
+                goto failed;
+            }
+
+            ngx_log_error(NGX_LOG_WARN, log, err,
+                          ngx_open_dir_n " \"%s\" failed", path);
+            continue;
+        }
+
+        if (last[-1] != '/')
+            *last++ = '/';
+
+        for ( ;; ) {
+            ngx_set_errno(0);
+
+            if (ngx_read_dir(&dir) == NGX_ERROR) {
+                err = ngx_errno;
+
+                if (err != NGX_ENOMOREFILES) {
+                    ngx_log_error(NGX_LOG_CRIT, log, err,
+                                  ngx_read_dir_n " \"%V\" failed", &dirname);
+                }
+                break;
+            }
+
+            name = ngx_de_name(&dir);
+            len = ngx_de_namelen(&dir);
+
+            if (name[0] == '.'
+                && (len == 1 || (len == 2 && name[1] == '.')))
+            {
+                continue;
+            }
+
+            if ((size_t) (last - path) + len + 1 > allocated) {
+                allocated = (last - path) + len + 1
+                          + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+                if ((p = ngx_alloc(allocated, log)) == NULL) {
+                    (void) ngx_close_dir(&dir);
+                    goto failed;
+                }
+
+                last = ngx_cpymem(p, path, last - path);
+                ngx_free(path);
+                path = p;
+                dirname.data = path;
+            }
+
+            ngx_cpystrn(last, name, len + 1);
+
+            if (ngx_http_fancyindex_index_stat(path, &fi, &flags, log)
+                != NGX_OK)
+            {
+                continue;
+            }
+
+            if ((e = ngx_array_push(entries)) == NULL) {
+                (void) ngx_close_dir(&dir);
+                goto failed;
+            }
+
+            e->len = plen ? plen + 1 + len : len;
+            if ((e->path = ngx_pnalloc(pool, e->len)) == NULL) {
+                (void) ngx_close_dir(&dir);
+                goto failed;
+            }
+
+            p = e->path;
+            if (plen) {
+                p = ngx_cpymem(p, parent, plen);
+                *p++ = '/';
+            }
+            ngx_memcpy(p, name, len);
+
+            e->flags = flags;
+            e->size = ngx_file_size(&fi);
+            e->mtime = ngx_file_mtime(&fi);
+            e->end = 0;
+            e->recent = 0;
+            e->nrecent = 0;
+        }
+
+        if (ngx_close_dir(&dir) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_dir_n " \"%V\" failed", &dirname);
+        }
+
+        if (entries->nelts >= NGX_MAX_UINT32_VALUE) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "too many entries for index \"%V\"", &idx->file);
+            goto failed;
+        }
+    }
+
+    ngx_free(path);
+    return NGX_OK;
+
+failed:
+
+    ngx_free(path);
+    return NGX_ERROR;
+}
+
+
+/* 一层尚未结束的目录及其子树中最近修改的文件 */
+typedef struct {
+    ngx_uint_t                    dir;
+    uint32_t                     *heap;
+    ngx_uint_t                    n;
+} ngx_http_fancyindex_index_level_t;
+
+
+/*
+ * 确定每个目录的子树范围和子树中最近修改的文件。记录已排序，子树结束时
+ * 其中最近修改的文件按时间降序追加到recent中。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_summarize(ngx_http_fancyindex_index_t *idx,
+        ngx_pool_t *pool, ngx_array_t *entries, ngx_array_t *recent)
+{
+    uint32_t                           *p, tmp;
+    ngx_uint_t                          i, k, m, n, depth;
+    ngx_array_t                         levels;
+    ngx_http_fancyindex_index_entry_t  *e, *d;
+    ngx_http_fancyindex_index_level_t  *lv;
+
+    if (ngx_array_init(&levels, pool, 16,
+                       sizeof(ngx_http_fancyindex_index_level_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    e = entries->elts;
+    n = entries->nelts;
+    depth = 0;
+
+    for (i = 0; i <= n; i++) {
+
+        /* 结束不包含记录i的目录 */
+        while (depth > 0) {
+            lv = (ngx_http_fancyindex_index_level_t *) levels.elts + depth - 1;
+            d = &e[lv->dir];
+
+            if (i < n
+                && (d->len == 0
+                    || (e[i].len > d->len && e[i].path[d->len] == '/'
+                        && ngx_memcmp(e[i].path, d->path, d->len) == 0)))
+            {
+                break;
+            }
+
+            /* 堆排序，堆顶依次移到末尾，结果按修改时间降序排列 */
+            for (m = lv->n; m > 1; m--) {
+                tmp = lv->heap[0];
+                ngx_http_fancyindex_index_heap_down(e, lv->heap, m - 1, 0,
+                                                    lv->heap[m - 1]);
+                lv->heap[m - 1] = tmp;
+            }
+
+            d->end = i;
+            d->recent = recent->nelts;
+            d->nrecent = lv->n;
+
+            if (lv->n) {
+                if ((p = ngx_array_push_n(recent, lv->n)) == NULL)
+                    return NGX_ERROR;
+                ngx_memcpy(p, lv->heap, lv->n * sizeof(uint32_t));
+            }
+
+            depth--;
+        }
+
+        if (i == n)
+            break;
+
+        if (!(e[i].flags & NGX_HTTP_FANCYINDEX_INDEX_DIR)) {
+            lv = levels.elts;
+            for (k = 0; k < depth; k++) {
+                ngx_http_fancyindex_index_heap_push(e, lv[k].heap, &lv[k].n,
+                                                    idx->top, (uint32_t) i);
+            }
+            continue;
+        }
+
+        /* 每一层的堆在之后的同层目录中重用 */
+        if (depth == levels.nelts) {
+            if ((lv = ngx_array_push(&levels)) == NULL)
+                return NGX_ERROR;
+
+            lv->heap = ngx_palloc(pool, (idx->top + 1) * sizeof(uint32_t));
+            if (lv->heap == NULL)
+                return NGX_ERROR;
+        }
+
+        lv = (ngx_http_fancyindex_index_level_t *) levels.elts + depth++;
+        lv->dir = i;
+        lv->n = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+/* 写入临时文件，再原子地替换索引文件，正在映射旧文件的进程不受影响 */
+static ngx_int_t
+ngx_http_fancyindex_index_write(ngx_http_fancyindex_index_t *idx,
+        ngx_pool_t *pool, ngx_array_t *entries, ngx_array_t *recent,
+        time_t start, ngx_log_t *log)
+{
+    u_char                              *buf, *p, *s, *tmp;
+    size_t                               size, strings;
+    ssize_t                              n;
+    ngx_fd_t                             fd;
+    ngx_uint_t                           i;
+    ngx_http_fancyindex_index_entry_t   *e;
+    ngx_http_fancyindex_index_header_t  *h;
+    ngx_http_fancyindex_index_record_t  *rec;
+
+    e = entries->elts;
+
+    /* 路径以'\0'结尾 */
+    strings = 0;
+    for (i = 0; i < entries->nelts; i++)
+        strings += e[i].len + 1;
+
+    size = sizeof(ngx_http_fancyindex_index_header_t)
+         + entries->nelts * sizeof(ngx_http_fancyindex_index_record_t)
+         + recent->nelts * sizeof(uint32_t)
+         + strings;
+
+    if ((buf = ngx_alloc(size, log)) == NULL)
+        return NGX_ERROR;
+
+    h = (ngx_http_fancyindex_index_header_t *) buf;
+    h->magic = NGX_HTTP_FANCYINDEX_INDEX_MAGIC;
+    h->top = (uint32_t) idx->top;
+    h->nrecords = entries->nelts;
+    h->recent = sizeof(ngx_http_fancyindex_index_header_t)
+              + entries->nelts * sizeof(ngx_http_fancyindex_index_record_t);
+    h->strings = h->recent + recent->nelts * sizeof(uint32_t);
+    h->size = size;
+    h->time = start;
+
+    rec = (ngx_http_fancyindex_index_record_t *) (h + 1);
+    s = p = buf + h->strings;
+
+    for (i = 0; i < entries->nelts; i++) {
+        rec[i].path = p - s;
+        rec[i].len = (uint32_t) e[i].len;
+        rec[i].flags = (uint32_t) e[i].flags;
+        rec[i].size = e[i].size;
+        rec[i].mtime = e[i].mtime;
+        rec[i].end = e[i].end;
+        rec[i].recent = e[i].recent;
+        rec[i].nrecent = e[i].nrecent;
+
+        p = ngx_cpymem(p, e[i].path, e[i].len);
+        *p++ = '\0';
+    }
+
+    if (recent->nelts) {
+        ngx_memcpy(buf + h->recent, recent->elts,
+                   recent->nelts * sizeof(uint32_t));
+    }
+
+    if ((tmp = ngx_pnalloc(pool, idx->file.len + sizeof(".tmp"))) == NULL) {
+        ngx_free(buf);
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(tmp, "%V.tmp%Z", &idx->file);
+
+    fd = ngx_open_file(tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", tmp);
+        ngx_free(buf);
+        return NGX_ERROR;
+    }
+
+    for (p = buf; p < buf + size; p += n) {
+        n = ngx_write_fd(fd, p, buf + size - p);
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                n = 0;
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_write_fd_n " \"%s\" failed", tmp);
+            break;
+        }
+    }
+
+    ngx_free(buf);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", tmp);
+    }
+
+    if (p < buf + size
+        || ngx_rename_file(tmp, idx->file.data) == NGX_FILE_ERROR)
+    {
+        if (p >= buf + size) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                          tmp, &idx->file);
+        }
+
+        (void) ngx_delete_file(tmp);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* 检查映射的索引文件，确保查询时不会越界 */
+static ngx_uint_t
+ngx_http_fancyindex_index_valid(u_char *map, size_t size)
+{
+    uint32_t                            *recent;
+    uint64_t                             i, n, nrecent, len;
+    ngx_http_fancyindex_index_header_t  *h;
+    ngx_http_fancyindex_index_record_t  *rec;
+
+    h = (ngx_http_fancyindex_index_header_t *) map;
+
+    if (size < sizeof(ngx_http_fancyindex_index_header_t)
+        || h->magic != NGX_HTTP_FANCYINDEX_INDEX_MAGIC
+        || h->size != size || h->nrecords == 0
+        || h->nrecords > (size - sizeof(ngx_http_fancyindex_index_header_t))
+                         / sizeof(ngx_http_fancyindex_index_record_t))
+    {
+        return 0;
+    }
+
+    n = h->nrecords;
+
+    if (h->recent != sizeof(ngx_http_fancyindex_index_header_t)
+                     + n * sizeof(ngx_http_fancyindex_index_record_t)
+        || h->strings < h->recent || h->strings > size
+        || (h->strings - h->recent) % sizeof(uint32_t))
+    {
+        return 0;
+    }
+
+    rec = (ngx_http_fancyindex_index_record_t *) (h + 1);
+    recent = (uint32_t *) (map + h->recent);
+    nrecent = (h->strings - h->recent) / sizeof(uint32_t);
+    len = size - h->strings;
+
+    for (i = 0; i < n; i++) {
+        if (rec[i].path >= len || rec[i].len >= len - rec[i].path
+            || map[h->strings + rec[i].path + rec[i].len] != '\0')
+        {
+            return 0;
+        }
+
+        if ((rec[i].flags & NGX_HTTP_FANCYINDEX_INDEX_DIR)
+            && (rec[i].end <= i || rec[i].end > n
+                || rec[i].recent > nrecent
+                || rec[i].nrecent > nrecent - rec[i].recent))
+        {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < nrecent; i++) {
+        if (recent[i] >= n)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/* 重新读取的目录中的一个条目 */
+typedef struct {
+    u_char                       *name;
+    size_t                        len;
+    ngx_uint_t                    flags;
+    off_t                         size;
+    time_t                        mtime;
+} ngx_http_fancyindex_index_child_t;
+
+
+/* 有变化的目录 */
+typedef struct {
+    ngx_str_t                     path;
+    int                           wd;
+} ngx_http_fancyindex_index_changed_t;
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_index_cmp_children(const void *one, const void *two)
+{
+    const ngx_http_fancyindex_index_child_t *first = one;
+    const ngx_http_fancyindex_index_child_t *second = two;
+
+    return (int) ngx_http_fancyindex_index_cmp_path(first->name, first->len,
+                                                    second->name, second->len);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_index_cmp_changed(const void *one, const void *two)
+{
+    const ngx_http_fancyindex_index_changed_t *first = one;
+    const ngx_http_fancyindex_index_changed_t *second = two;
+
+    return (int) ngx_http_fancyindex_index_cmp_path(first->path.data,
+                                                    first->path.len,
+                                                    second->path.data,
+                                                    second->path.len);
+}
+
+
+/*
+ * 重新读取相对于根目录的目录rel，条目按名称排序后放入children，目录本身
+ * 的信息放入fi。目录已不存在或无法读取时返回NGX_DECLINED。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_rescan(ngx_http_fancyindex_index_t *idx,
+        ngx_pool_t *pool, ngx_str_t *rel, ngx_array_t *children,
+        ngx_file_info_t *fi, ngx_log_t *log)
+{
+    u_char                             *path, *last, *p, *name;
+    size_t                              len, allocated;
+    ngx_err_t                           err;
+    ngx_str_t                           dirname;
+    ngx_dir_t                           dir;
+    ngx_uint_t                          flags;
+    ngx_file_info_t                     cfi;
+    ngx_http_fancyindex_index_child_t  *c;
+
+    children->nelts = 0;
+
+    allocated = idx->root.len + 1 + rel->len + 1
+                + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+    if ((path = ngx_pnalloc(pool, allocated)) == NULL)
+        return NGX_ERROR;
+
+    last = ngx_cpymem(path, idx->root.data, idx->root.len);
+    if (rel->len) {
+        *last++ = '/';
+        last = ngx_cpymem(last, rel->data, rel->len);
+    }
+    if (last == path)
+        *last++ = '/';
+    *last = '\0';
+
+    dirname.len = last - path;
+    dirname.data = path;
+
+    if (ngx_open_dir(&dirname, &dir) == NGX_ERROR) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT && err != NGX_ENOTDIR) {
+            ngx_log_error(NGX_LOG_WARN, log, err,
+                          ngx_open_dir_n " \"%s\" failed", path);
+        }
+        return NGX_DECLINED;
+    }
+
+    if (ngx_file_info(path, fi) == NGX_FILE_ERROR) {
+        (void) ngx_close_dir(&dir);
+        return NGX_DECLINED;
+    }
+
+    if (last[-1] != '/')
+        *last++ = '/';
+
+    for ( ;; ) {
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(&dir) == NGX_ERROR) {
+            err = ngx_errno;
+
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, log, err,
+                              ngx_read_dir_n " \"%V\" failed", &dirname);
+            }
+            break;
+        }
+
+        name = ngx_de_name(&dir);
+        len = ngx_de_namelen(&dir);
+
+        if (name[0] == '.'
+            && (len == 1 || (len == 2 && name[1] == '.')))
+        {
+            continue;
+        }
+
+        if ((size_t) (last - path) + len + 1 > allocated) {
+            allocated = (last - path) + len + 1
+                      + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+            if ((p = ngx_pnalloc(pool, allocated)) == NULL)
+                goto failed;
+
+            last = ngx_cpymem(p, path, last - path);
+            path = p;
+            dirname.data = path;
+        }
+
+        ngx_cpystrn(last, name, len + 1);
+
+        if (ngx_http_fancyindex_index_stat(path, &cfi, &flags, log) != NGX_OK)
+            continue;
+
+        if ((c = ngx_array_push(children)) == NULL)
+            goto failed;
+
+        if ((c->name = ngx_pnalloc(pool, len)) == NULL)
+            goto failed;
+
+        ngx_memcpy(c->name, name, len);
+        c->len = len;
+        c->flags = flags;
+        c->size = ngx_file_size(&cfi);
+        c->mtime = ngx_file_mtime(&cfi);
+    }
+
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", &dirname);
+    }
+
+    ngx_qsort(children->elts, children->nelts,
+              sizeof(ngx_http_fancyindex_index_child_t),
+              ngx_http_fancyindex_index_cmp_children);
+
+    return NGX_OK;
+
+failed:
+
+    (void) ngx_close_dir(&dir);
+    return NGX_ERROR;
+}
+
+
+/*
+ * 只重新读取有变化的目录，与现有的索引文件合并。记录从映射的索引文件中
+ * 复制到entries（路径指向映射的内存，*map在写入新的索引后才能解除映射），
+ * 被删除的条目连同其子树一起移除，新的条目加在末尾，其中的目录由
+ * ngx_http_fancyindex_index_walk()从*first开始遍历。没有可用的索引文件时
+ * 返回NGX_DECLINED，需要完整重建。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_update(ngx_http_fancyindex_index_task_t *t,
+        ngx_pool_t *pool, ngx_array_t *entries, ngx_uint_t *first,
+        u_char **map, size_t *size, ngx_log_t *log)
+{
+    int                                  *wd;
+    u_char                               *m, *p, *strings, *drop, *name;
+    size_t                                len, skip;
+    ngx_fd_t                              fd;
+    ngx_str_t                            *str;
+    ngx_int_t                             rc, d;
+    ngx_uint_t                            i, j, k, n, lo, hi, mid, next;
+    ngx_uint_t                            nchanged, ci;
+    ngx_array_t                           children, added;
+    ngx_file_info_t                       fi;
+    ngx_http_fancyindex_index_t          *idx = t->index;
+    ngx_http_fancyindex_index_header_t   *h;
+    ngx_http_fancyindex_index_record_t   *rec;
+    ngx_http_fancyindex_index_entry_t    *e, *ne;
+    ngx_http_fancyindex_index_child_t    *c;
+    ngx_http_fancyindex_index_changed_t  *changed;
+
+    /* 映射现有的索引文件 */
+    fd = ngx_open_file(idx->file.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE)
+        return NGX_DECLINED;
+
+    m = NULL;
+
+    if (ngx_fd_info(fd, &fi) != NGX_FILE_ERROR
+        && (size_t) ngx_file_size(&fi)
+           >= sizeof(ngx_http_fancyindex_index_header_t))
+    {
+        *size = (size_t) ngx_file_size(&fi);
+        m = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+            m = NULL;
+    }
+
+    (void) ngx_close_file(fd);
+
+    if (m == NULL)
+        return NGX_DECLINED;
+
+    *map = m;
+
+    if (!ngx_http_fancyindex_index_valid(m, *size)
+        || ((ngx_http_fancyindex_index_header_t *) m)->top != idx->top)
+    {
+        return NGX_DECLINED;
+    }
+
+    h = (ngx_http_fancyindex_index_header_t *) m;
+    rec = (ngx_http_fancyindex_index_record_t *) (h + 1);
+    strings = m + h->strings;
+    n = (ngx_uint_t) h->nrecords;
+
+    /* 有变化的目录按路径排序，父目录在前 */
+    changed = ngx_palloc(pool, (t->changed.nelts + 1)
+                               * sizeof(ngx_http_fancyindex_index_changed_t));
+    if (changed == NULL)
+        return NGX_ERROR;
+
+    wd = t->changed.elts;
+    nchanged = 0;
+
+    for (i = 0; i < t->changed.nelts; i++) {
+        str = ngx_http_fancyindex_index_watched(idx, wd[i]);
+        if (str == NULL)
+            continue;
+
+        changed[nchanged].path.len = str->len;
+        changed[nchanged].path.data = ngx_pnalloc(pool, str->len + 1);
+        if (changed[nchanged].path.data == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(changed[nchanged].path.data, str->data, str->len);
+        changed[nchanged].wd = wd[i];
+        nchanged++;
+    }
+
+    ngx_qsort(changed, nchanged, sizeof(ngx_http_fancyindex_index_changed_t),
+              ngx_http_fancyindex_index_cmp_changed);
+
+    if ((e = ngx_array_push_n(entries, n)) == NULL)
+        return NGX_ERROR;
+
+    for (i = 0; i < n; i++) {
+        e[i].path = strings + rec[i].path;
+        e[i].len = rec[i].len;
+        e[i].flags = rec[i].flags;
+        e[i].size = rec[i].size;
+        e[i].mtime = rec[i].mtime;
+        e[i].end = 0;
+        e[i].recent = 0;
+        e[i].nrecent = 0;
+    }
+
+    if ((drop = ngx_pcalloc(pool, n)) == NULL)
+        return NGX_ERROR;
+
+    if (ngx_array_init(&children, pool, 64,
+                       sizeof(ngx_http_fancyindex_index_child_t)) != NGX_OK
+        || ngx_array_init(&added, pool, 64,
+                          sizeof(ngx_http_fancyindex_index_entry_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (k = 0; k < nchanged; k++) {
+        str = &changed[k].path;
+
+        if (k > 0 && str->len == changed[k - 1].path.len
+            && ngx_memcmp(str->data, changed[k - 1].path.data, str->len) == 0)
+        {
+            continue;
+        }
+
+        /* 目录在索引中的记录 */
+        lo = 0;
+        hi = n;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (ngx_http_fancyindex_index_cmp_path(strings + rec[mid].path,
+                                                   rec[mid].len,
+                                                   str->data, str->len) < 0)
+            {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        i = lo;
+
+        /*
+         * 已被删除或移动的目录。移动后的目录在新的父目录中作为新的目录
+         * 重新遍历，同时重新记录其监视描述符。
+         */
+        if (i == n || rec[i].len != str->len
+            || ngx_memcmp(strings + rec[i].path, str->data, str->len) != 0
+            || drop[i]
+            || (rec[i].flags & (NGX_HTTP_FANCYINDEX_INDEX_DIR
+                                |NGX_HTTP_FANCYINDEX_INDEX_LINK))
+               != NGX_HTTP_FANCYINDEX_INDEX_DIR)
+        {
+            ngx_http_fancyindex_index_unwatch(idx, changed[k].wd);
+            continue;
+        }
+
+        rc = ngx_http_fancyindex_index_rescan(idx, pool, str, &children, &fi,
+                                              log);
+        if (rc == NGX_ERROR)
+            return NGX_ERROR;
+
+        if (rc == NGX_DECLINED) {
+            ngx_http_fancyindex_index_unwatch(idx, changed[k].wd);
+            continue;
+        }
+
+        t->rescanned++;
+
+        e[i].size = ngx_file_size(&fi);
+        e[i].mtime = ngx_file_mtime(&fi);
+
+        /*
+         * 合并子树中的直接子条目和重新读取的条目，两者都按名称排序。子目录
+         * 的子树在其记录之后，跳过。
+         */
+        c = children.elts;
+        skip = str->len ? str->len + 1 : 0;
+        j = i + 1;
+        ci = 0;
+
+        while (j < rec[i].end || ci < children.nelts) {
+            next = j;
+
+            if (j < rec[i].end) {
+                name = strings + rec[j].path + skip;
+                len = rec[j].len - skip;
+                next = (rec[j].flags & NGX_HTTP_FANCYINDEX_INDEX_DIR)
+                       ? (ngx_uint_t) rec[j].end : j + 1;
+
+                d = (ci < children.nelts)
+                    ? ngx_http_fancyindex_index_cmp_path(name, len,
+                                                         c[ci].name, c[ci].len)
+                    : -1;
+            } else {
+                d = 1;
+            }
+
+            if (d == 0 && (rec[j].flags & (NGX_HTTP_FANCYINDEX_INDEX_DIR
+                                           |NGX_HTTP_FANCYINDEX_INDEX_LINK))
+                          == (c[ci].flags & (NGX_HTTP_FANCYINDEX_INDEX_DIR
+                                             |NGX_HTTP_FANCYINDEX_INDEX_LINK)))
+            {
+                e[j].flags = c[ci].flags;
+                e[j].size = c[ci].size;
+                e[j].mtime = c[ci].mtime;
+                j = next;
+                ci++;
+                continue;
+            }
+
+            /* 被删除的条目或者类型改变的条目，连同其子树 */
+            if (d <= 0) {
+                ngx_memset(drop + j, 1, next - j);
+                j = next;
+
+                if (d < 0)
+                    continue;
+            }
+
+            /* 新的条目 */
+            if ((ne = ngx_array_push(&added)) == NULL)
+                return NGX_ERROR;
+
+            ne->len = skip + c[ci].len;
+            if ((ne->path = ngx_pnalloc(pool, ne->len)) == NULL)
+                return NGX_ERROR;
+
+            p = ne->path;
+            if (skip) {
+                p = ngx_cpymem(p, str->data, str->len);
+                *p++ = '/';
+            }
+            ngx_memcpy(p, c[ci].name, c[ci].len);
+
+            ne->flags = c[ci].flags;
+            ne->size = c[ci].size;
+            ne->mtime = c[ci].mtime;
+            ne->end = 0;
+            ne->recent = 0;
+            ne->nrecent = 0;
+            ci++;
+        }
+    }
+
+    for (i = 0, j = 0; i < n; i++) {
+        if (!drop[i])
+            e[j++] = e[i];
+    }
+
+    entries->nelts = j;
+    *first = j;
+
+    if (added.nelts) {
+        if ((ne = ngx_array_push_n(entries, added.nelts)) == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(ne, added.elts,
+                   added.nelts * sizeof(ngx_http_fancyindex_index_entry_t));
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * 在线程池中更新索引：只重新读取有变化的目录，没有可用的索引文件或者
+ * 需要完整重建时遍历整个目录树
+ */
+static void
+ngx_http_fancyindex_index_thread(void *data, ngx_log_t *log)
+{
+    u_char                             *map;
+    size_t                              size;
+    time_t                              start;
+    ngx_int_t                           rc;
+    ngx_uint_t                          first;
+    ngx_pool_t                         *pool;
+    ngx_array_t                         entries, recent;
+    ngx_http_fancyindex_index_entry_t  *e;
+    ngx_http_fancyindex_index_task_t   *t = data;
+
+    t->rc = NGX_ERROR;
+    t->nrecords = 0;
+    t->rescanned = 0;
+
+    if ((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log)) == NULL)
+        return;
+
+    start = ngx_time();
+    map = NULL;
+    size = 0;
+    first = 0;
+
+    if (ngx_array_init(&entries, pool, 1024,
+                       sizeof(ngx_http_fancyindex_index_entry_t)) != NGX_OK
+        || ngx_array_init(&recent, pool, 1024, sizeof(uint32_t)) != NGX_OK)
+    {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    rc = t->full ? NGX_DECLINED
+                 : ngx_http_fancyindex_index_update(t, pool, &entries, &first,
+                                                    &map, &size, log);
+
+    if (rc == NGX_DECLINED) {
+        t->full = 1;
+        entries.nelts = 0;
+        first = 0;
+
+        if ((e = ngx_array_push(&entries)) == NULL) {
+            rc = NGX_ERROR;
+
+        } else {
+            ngx_memzero(e, sizeof(ngx_http_fancyindex_index_entry_t));
+            e->path = (u_char *) "";
+            e->flags = NGX_HTTP_FANCYINDEX_INDEX_DIR;
+            rc = NGX_OK;
+        }
+    }
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_index_walk(t, pool, &entries, first, log);
+
+    if (rc == NGX_OK) {
+        ngx_qsort(entries.elts, entries.nelts,
+                  sizeof(ngx_http_fancyindex_index_entry_t),
+                  ngx_http_fancyindex_index_cmp_entries);
+
+        rc = ngx_http_fancyindex_index_summarize(t->index, pool, &entries,
+                                                 &recent);
+    }
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_fancyindex_index_write(t->index, pool, &entries,
+                                             &recent, start, log);
+    }
+
+    t->rc = rc;
+    t->nrecords = entries.nelts;
+
+    if (map)
+        (void) munmap(map, size);
+
+    ngx_destroy_pool(pool);
+}
+
+
+/*
+ * 映射索引文件，文件被替换后重新映射。没有可用的索引时返回NGX_DECLINED。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_map(ngx_http_fancyindex_index_t *idx,
+        ngx_log_t *log)
+{
+    u_char           *map;
+    size_t            size;
+    ngx_fd_t          fd;
+    ngx_err_t         err;
+    ngx_file_info_t   fi;
+
+    if (ngx_file_info(idx->file.data, &fi) == NGX_FILE_ERROR) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_file_info_n " \"%V\" failed", &idx->file);
+        }
+
+        return idx->map ? NGX_OK : NGX_DECLINED;
+    }
+
+    if (ngx_file_uniq(&fi) == idx->uniq && ngx_file_mtime(&fi) == idx->mtime
+        && (size_t) ngx_file_size(&fi) == idx->size)
+    {
+        return idx->map ? NGX_OK : NGX_DECLINED;
+    }
+
+    fd = ngx_open_file(idx->file.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &idx->file);
+        return idx->map ? NGX_OK : NGX_DECLINED;
+    }
+
+    map = NULL;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &idx->file);
+        (void) ngx_close_file(fd);
+        return idx->map ? NGX_OK : NGX_DECLINED;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size >= sizeof(ngx_http_fancyindex_index_header_t)) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          "mmap(\"%V\") failed", &idx->file);
+            (void) ngx_close_file(fd);
+            return idx->map ? NGX_OK : NGX_DECLINED;
+        }
+    }
+
+    (void) ngx_close_file(fd);
+
+    if (map != NULL && !ngx_http_fancyindex_index_valid(map, size)) {
+        (void) munmap(map, size);
+        map = NULL;
+    }
+
+    if (map == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "fancyindex: invalid index file \"%V\"", &idx->file);
+    }
+
+    /* 旧的文件已被替换，无效的新文件也不再使用旧的映射 */
+    if (idx->map)
+        (void) munmap(idx->map, idx->size);
+
+    idx->map = map;
+    idx->size = size;
+    idx->uniq = ngx_file_uniq(&fi);
+    idx->mtime = ngx_file_mtime(&fi);
+
+    return map ? NGX_OK : NGX_DECLINED;
+}
+
+
+/*
+ * 安排下一次更新。只重新读取有变化的目录时等待INDEX_DELAY，完整重建
+ * 与上一次完整重建至少间隔interval。
+ */
+static void
+ngx_http_fancyindex_index_schedule(ngx_http_fancyindex_index_t *idx)
+{
+    ngx_msec_int_t  delay;
+
+    if (idx->building || idx->timer.timer_set || ngx_exiting)
+        return;
+
+    delay = NGX_HTTP_FANCYINDEX_INDEX_DELAY;
+
+    if (idx->full) {
+        delay = (ngx_msec_int_t) (idx->built + idx->interval
+                                  - ngx_current_msec);
+        if (delay < NGX_HTTP_FANCYINDEX_INDEX_DELAY)
+            delay = NGX_HTTP_FANCYINDEX_INDEX_DELAY;
+    }
+
+    ngx_add_timer(&idx->timer, (ngx_msec_t) delay);
+}
+
+
+static void
+ngx_http_fancyindex_index_timer(ngx_event_t *ev)
+{
+    ngx_array_t                        changed;
+    ngx_http_fancyindex_index_t       *idx = ev->data;
+    ngx_http_fancyindex_index_task_t  *t;
+
+    t = idx->task->ctx;
+    t->index = idx;
+    t->inotify = idx->inotify ? idx->inotify->fd : -1;
+    t->unwatched = 0;
+    t->full = idx->full;
+
+    /* 有变化的目录交给线程，从现在起的变化由下一次更新处理 */
+    changed = t->changed;
+    t->changed = idx->changed;
+    idx->changed = changed;
+    idx->changed.nelts = 0;
+
+    idx->dirty = 0;
+    idx->full = 0;
+
+    if (ngx_thread_task_post(idx->thread_pool, idx->task) != NGX_OK) {
+        idx->built = ngx_current_msec;
+        idx->full = 1;
+        ngx_http_fancyindex_index_schedule(idx);
+        return;
+    }
+
+    idx->building = 1;
+}
+
+
+/* 重建完成，映射新的索引文件 */
+static void
+ngx_http_fancyindex_index_done(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_index_t       *idx = ev->data;
+    ngx_http_fancyindex_index_task_t  *t;
+
+    t = idx->task->ctx;
+
+    idx->building = 0;
+    t->changed.nelts = 0;
+
+    if (t->full)
+        idx->built = ngx_current_msec;
+
+    if (t->rc == NGX_OK) {
+        if (t->full) {
+            ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                          "fancyindex: rebuilt index \"%V\", %ui entries",
+                          &idx->file, t->nrecords);
+        } else {
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                           "http fancyindex: updated index \"%V\", "
+                           "%ui directories rescanned, %ui entries",
+                           &idx->file, t->rescanned, t->nrecords);
+        }
+
+        (void) ngx_http_fancyindex_index_map(idx, ev->log);
+    }
+
+    /* 无法监视全部目录时定期完整重建 */
+    if (idx->inotify == NULL || t->unwatched || t->rc != NGX_OK)
+        idx->full = 1;
+
+    if (idx->dirty || idx->full)
+        ngx_http_fancyindex_index_schedule(idx);
+}
+
+
+#if (NGX_HAVE_INOTIFY)
+
+/*
+ * 记录有变化的目录的监视描述符，并安排一次更新。丢失了事件或者变化的
+ * 目录过多时完整重建。
+ */
+static void
+ngx_http_fancyindex_index_inotify_handler(ngx_event_t *ev)
+{
+    int                          *wd;
+    ssize_t                       n;
+    u_char                       *p;
+    ngx_err_t                     err;
+    ngx_uint_t                    changed;
+    ngx_connection_t             *c;
+    struct inotify_event         *ie;
+    ngx_http_fancyindex_index_t  *idx;
+    union {
+        struct inotify_event      ie;
+        u_char                    buf[4096];
+    } u;
+
+    c = ev->data;
+    idx = c->data;
+    changed = 0;
+
+    for ( ;; ) {
+        n = read(c->fd, u.buf, sizeof(u.buf));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR)
+                continue;
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "read() from inotify failed");
+            }
+            break;
+        }
+
+        if (n == 0)
+            break;
+
+        changed = 1;
+
+        for (p = u.buf; p < u.buf + n; p += sizeof(struct inotify_event) + ie->len) {
+            ie = (struct inotify_event *) p;
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+                ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                              "inotify queue overflow, index \"%V\" will "
+                              "be rebuilt", &idx->file);
+                idx->full = 1;
+                continue;
+            }
+
+            if (idx->full || (ie->mask & IN_IGNORED))
+                continue;
+
+            /* 同一目录的连续事件只记录一次 */
+            wd = idx->changed.elts;
+            if (idx->changed.nelts && wd[idx->changed.nelts - 1] == ie->wd)
+                continue;
+
+            if (idx->changed.nelts >= NGX_HTTP_FANCYINDEX_INDEX_CHANGES
+                || (wd = ngx_array_push(&idx->changed)) == NULL)
+            {
+                idx->full = 1;
+                continue;
+            }
+
+            *wd = ie->wd;
+        }
+    }
+
+    if (changed) {
+        idx->dirty = 1;
+        ngx_http_fancyindex_index_schedule(idx);
+    }
+
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "fancyindex: cannot handle inotify events");
+    }
+}
+
+#endif /* NGX_HAVE_INOTIFY */
+
+
+/*
+ * 将索引中的记录加入列表。条目名称是相对于请求的目录的路径，其中的每一级
+ * 都遵循fancyindex_show_dotfiles和fancyindex_ignore。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_add(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_index_record_t *rec, u_char *path, size_t skip)
+{
+    u_char                       *p, *last, *name;
+    ngx_http_fancyindex_entry_t  *entry;
+
+    if (ctx->filter.delta && rec->mtime < ctx->filter.since)
+        return NGX_DECLINED;
+
+    if (alcf->hide_symlinks && (rec->flags & NGX_HTTP_FANCYINDEX_INDEX_LINK))
+        return NGX_DECLINED;
+
+    last = path + rec->len;
+
+    for (name = p = path + skip; p <= last; p++) {
+        if (p < last && *p != '/')
+            continue;
+
+        if (!alcf->show_dot_files && *name == '.')
+            return NGX_DECLINED;
+
+        if (alcf->ignore
+            && ngx_http_fancyindex_ignored(r, alcf, name, p - name))
+        {
+            return NGX_DECLINED;
+        }
+
+        name = p + 1;
+    }
+
+    ctx->scan.total++;
+
+    if (alcf->max_entries && ctx->entries.nelts >= alcf->max_entries) {
+        ctx->scan.truncated = 1;
+        return NGX_DECLINED;
+    }
+
+    if ((entry = ngx_array_push(&ctx->entries)) == NULL)
+        return NGX_ERROR;
+
+    entry->name.len = rec->len - skip;
+    entry->name.data = ngx_pnalloc(r->pool, entry->name.len + 1);
+    if (entry->name.data == NULL)
+        return NGX_ERROR;
+
+    ngx_cpystrn(entry->name.data, path + skip, entry->name.len + 1);
+    ngx_http_fancyindex_set_name(entry, ctx->scan.utf8);
+
+    entry->dir = (rec->flags & NGX_HTTP_FANCYINDEX_INDEX_DIR) ? 1 : 0;
+    entry->mtime = (time_t) rec->mtime;
+    entry->size = (off_t) rec->size;
+    entry->sum = NULL;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 用索引回答"search"和"recent"参数。请求的目录不在索引的目录树中时
+ * 返回NGX_DECLINED，按普通的列表处理。
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_query(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char                              *strings, *path, *name;
+    size_t                               skip;
+    uint32_t                            *recent;
+    ngx_int_t                            rc;
+    ngx_str_t                            rel;
+    ngx_uint_t                           i, lo, hi, mid, found;
+    ngx_http_fancyindex_index_t         *idx = alcf->index;
+    ngx_http_fancyindex_index_header_t  *h;
+    ngx_http_fancyindex_index_record_t  *rec, *d;
+
+    if (ctx->path.len < idx->root.len
+        || ngx_strncmp(ctx->path.data, idx->root.data, idx->root.len) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ctx->path.len == idx->root.len) {
+        rel.len = 0;
+        rel.data = ctx->path.data;
+
+    } else if (ctx->path.data[idx->root.len] == '/') {
+        rel.len = ctx->path.len - idx->root.len - 1;
+        rel.data = ctx->path.data + idx->root.len + 1;
+
+    } else {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_fancyindex_index_map(idx, r->connection->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "fancyindex: index \"%V\" is not available yet",
+                      &idx->file);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (ngx_array_init(&ctx->entries, r->pool, 40,
+                       sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h = (ngx_http_fancyindex_index_header_t *) idx->map;
+    rec = (ngx_http_fancyindex_index_record_t *) (h + 1);
+    recent = (uint32_t *) (idx->map + h->recent);
+    strings = idx->map + h->strings;
+
+    /* 条目已在此过滤 */
+    ctx->scan.filter = &ctx->filter;
+    ctx->scan.utf8 = ngx_http_fancyindex_is_utf8(r);
+    ctx->time = (time_t) h->time;
+
+    /* 二分查找请求的目录 */
+    lo = 0;
+    hi = h->nrecords;
+    mid = 0;
+    found = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rc = ngx_http_fancyindex_index_cmp_path(strings + rec[mid].path,
+                                                rec[mid].len,
+                                                rel.data, rel.len);
+        if (rc == 0) {
+            found = 1;
+            break;
+        }
+
+        if (rc < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* 建立索引之后才出现的目录，列表为空 */
+    if (!found || (rec[mid].flags & (NGX_HTTP_FANCYINDEX_INDEX_DIR
+                                     |NGX_HTTP_FANCYINDEX_INDEX_LINK))
+                  != NGX_HTTP_FANCYINDEX_INDEX_DIR)
+    {
+        return NGX_OK;
+    }
+
+    d = &rec[mid];
+    skip = rel.len ? rel.len + 1 : 0;
+
+    if (!ctx->filter.search) {
+        ctx->recent = 1;
+
+        for (i = 0; i < d->nrecent
+                    && ctx->entries.nelts < ctx->filter.recent; i++)
+        {
+            path = strings + rec[recent[d->recent + i]].path;
+
+            if (ngx_http_fancyindex_index_add(r, alcf, ctx,
+                                              &rec[recent[d->recent + i]],
+                                              path, skip)
+                == NGX_ERROR)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    /* 子树是紧随其后的连续记录，先按文件名匹配 */
+    for (i = mid + 1; i < d->end; i++) {
+        path = strings + rec[i].path;
+
+        for (name = path + rec[i].len; name > path && name[-1] != '/'; name--)
+            /* void */ ;
+
+        if (!ngx_http_fancyindex_match_name(&ctx->filter, name,
+                                            path + rec[i].len - name))
+        {
+            continue;
+        }
+
+        if (ngx_http_fancyindex_index_add(r, alcf, ctx, &rec[i], path, skip)
+            == NGX_ERROR)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#endif /* NGX_THREADS */
+
+
+/* t06_list1中表头最后的"</tr>"的位置 */
+static size_t
+ngx_http_fancyindex_list1_split(ngx_str_t *list1)
+{
+    size_t  n;
+
+    if (list1->len < ngx_sizeof_ssz("</tr>"))
+        return list1->len;
+
+    for (n = list1->len - ngx_sizeof_ssz("</tr>"); n; n--) {
+        if (ngx_strncmp(list1->data + n, "</tr>", ngx_sizeof_ssz("</tr>")) == 0)
+            return n;
+    }
+
+    return list1->len;
+}
+
+
+/*
+ * 输出文件大小，exact为0时以1024为单位，最多保留一位小数。最多需要
+ * NGX_HTTP_FANCYINDEX_SIZE_LEN字节。
+ */
+#define NGX_HTTP_FANCYINDEX_SIZE_LEN  20
+
+static u_char *
+ngx_http_fancyindex_format_size(u_char *p, off_t length, ngx_flag_t exact)
+{
+    ngx_uint_t  j;
+    int64_t     multiplier;
+
+    static const char    *sizes[]  = { "EiB", "PiB", "TiB", "GiB", "MiB", "KiB", "B" };
+    static const int64_t  exbibyte = 1024LL * 1024LL * 1024LL *
+                                     1024LL * 1024LL * 1024LL;
+
+    if (exact)
+        return ngx_sprintf(p, "%19O", length);
+
+    multiplier = exbibyte;
+
+    for (j = 0; j < DIM(sizes) - 1 && length < multiplier; j++)
+        multiplier /= 1024;
+
+    /* 如果以字节显示文件大小，则不显示小数 */
+    if (j == DIM(sizes) - 1)
+        return ngx_sprintf(p, "%O %s", length, sizes[j]);
+
+    return ngx_sprintf(p, "%.1f %s", (float) length / multiplier, sizes[j]);
+}
+
+
+static ngx_str_t  ngx_http_fancyindex_row_names[] = {
+    ngx_null_string,
+    ngx_string("href"),
+    ngx_string("name"),
+    ngx_string("size"),
+    ngx_string("mtime"),
+    ngx_string("type"),
+    ngx_string("sha256"),
+    ngx_string("title"),
+    ngx_string("files"),
+};
+
+
+/*
+ * 内置的表格行，多余的空白已被去除。启用fancyindex_checksums时加上
+ * SHA-256列。
+ */
+#define NGX_HTTP_FANCYINDEX_ROW_DEFAULT                                       \
+    "<tr><td colspan=\"2\" class=\"link\">"                                  \
+    "<a href=\"{href}\" title=\"{title}\">{name}</a></td>"                   \
+    "<td class=\"size\"{files}>{size}</td><td class=\"date\">{mtime}</td>"
+
+static ngx_str_t  ngx_http_fancyindex_row_default[] = {
+    ngx_string(NGX_HTTP_FANCYINDEX_ROW_DEFAULT "</tr>"),
+    ngx_string(NGX_HTTP_FANCYINDEX_ROW_DEFAULT
+               "<td class=\"sha256\">{sha256}</td></tr>")
+};
+
+
+/*
+ * 编译行模板。"{"后跟小写字母和"}"时为占位符，未知的占位符是错误；
+ * 其他的"{"作为普通文本。只有内置的模板（builtin）可以使用{title}和
+ * {files}。
+ */
+static char *
+ngx_http_fancyindex_row_compile(ngx_conf_t *cf,
+        ngx_http_fancyindex_loc_conf_t *conf, ngx_str_t *tpl,
+        ngx_uint_t builtin)
+{
+    u_char                             *p, *q, *start, *last;
+    size_t                              time_len;
+    ngx_uint_t                          i, n;
+    ngx_array_t                         ops;
+    ngx_http_fancyindex_row_op_t       *op;
+    ngx_http_fancyindex_row_program_t  *prog;
+
+    prog = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_row_program_t));
+    if (prog == NULL)
+        return NGX_CONF_ERROR;
+
+    if (ngx_array_init(&ops, cf->pool, 8,
+                       sizeof(ngx_http_fancyindex_row_op_t)) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    time_len = ngx_fancyindex_timefmt_calc_size(&conf->time_format);
+
+    n = builtin ? DIM(ngx_http_fancyindex_row_names)
+                : NGX_HTTP_FANCYINDEX_ROW_SHA256 + 1;
+
+    p = tpl->data;
+    last = p + tpl->len;
+    start = p;
+
+    while (p < last) {
+        if (*p != '{') {
+            p++;
+            continue;
+        }
+
+        for (q = p + 1; q < last && *q >= 'a' && *q <= 'z'; q++) { /* void */ }
+
+        if (q == p + 1 || q == last || *q != '}') {
+            p++;
+            continue;
+        }
+
+        for (i = 1; i < n; i++) {
+            if ((size_t) (q - p - 1) == ngx_http_fancyindex_row_names[i].len
+                && ngx_strncmp(p + 1, ngx_http_fancyindex_row_names[i].data,
+                               q - p - 1) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == n) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown placeholder \"%*s\" in "
+                               "\"fancyindex_row_template\"",
+                               q - p + 1, p);
+            return NGX_CONF_ERROR;
+        }
+
+        if (p > start) {
+            if ((op = ngx_array_push(&ops)) == NULL)
+                return NGX_CONF_ERROR;
+
+            op->op = NGX_HTTP_FANCYINDEX_ROW_TEXT;
+            op->text.len = p - start;
+            op->text.data = start;
+            prog->len += p - start;
+        }
+
+        if ((op = ngx_array_push(&ops)) == NULL)
+            return NGX_CONF_ERROR;
+
+        op->op = i;
+        ngx_str_null(&op->text);
+
+        switch (i) {
+        case NGX_HTTP_FANCYINDEX_ROW_HREF:
+            prog->len += 1 + ngx_sizeof_ssz("?C=x&amp;O=y");
+            prog->nhref++;
+            break;
+        case NGX_HTTP_FANCYINDEX_ROW_NAME:
+            prog->len += 1;
+            prog->nname++;
+            break;
+        case NGX_HTTP_FANCYINDEX_ROW_SIZE:
+            prog->len += NGX_HTTP_FANCYINDEX_SIZE_LEN;
+            break;
+        case NGX_HTTP_FANCYINDEX_ROW_MTIME:
+            prog->len += time_len;
+            break;
+        case NGX_HTTP_FANCYINDEX_ROW_TYPE:
+            prog->len += ngx_sizeof_ssz("directory");
+            break;
+        case NGX_HTTP_FANCYINDEX_ROW_SHA256:
+            if (conf->checksums)
+                prog->len += 64;
+            prog->sha256 = 1;
+            break;
+        case NGX_HTTP_FANCYINDEX_ROW_TITLE:
+            prog->nname++;
+            break;
+        default: /* NGX_HTTP_FANCYINDEX_ROW_FILES */
+            if (conf->dir_sizes)
+                prog->len += ngx_sizeof_ssz(" title=\" files\"")
+                           + NGX_INT64_LEN;
+        }
+
+        p = q + 1;
+        start = p;
+    }
+
+    if (last > start) {
+        if ((op = ngx_array_push(&ops)) == NULL)
+            return NGX_CONF_ERROR;
+
+        op->op = NGX_HTTP_FANCYINDEX_ROW_TEXT;
+        op->text.len = last - start;
+        op->text.data = start;
+        prog->len += last - start;
+    }
+
+    prog->ops = ops.elts;
+    prog->nops = ops.nelts;
+    conf->row_program = prog;
+
+    return NGX_CONF_OK;
+}
+
+
+/* 按行模板生成一行 */
+static u_char *
+ngx_http_fancyindex_row_program_run(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_entry_t *entry, const char *sort_url_args,
+        u_char *p)
+{
+    off_t                          length;
+    uint64_t                       files;
+    ngx_tm_t                       tm;
+    ngx_uint_t                     i, known, sized;
+    ngx_http_fancyindex_row_op_t  *op;
+
+    op = alcf->row_program->ops;
+    sized = 0;
+    length = 0;
+    files = 0;
+    known = 0;
+
+    for (i = 0; i < alcf->row_program->nops; i++, op++) {
+        switch (op->op) {
+
+        case NGX_HTTP_FANCYINDEX_ROW_TEXT:
+            p = ngx_cpymem_str(p, op->text);
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_HREF:
+            if (entry->escape) {
+                ngx_fancyindex_escape_filename(p, entry->name.data,
+                                               entry->name.len);
+                p += entry->name.len + entry->escape;
+            } else {
+                p = ngx_cpymem_str(p, entry->name);
+            }
+
+            if (entry->dir) {
+                *p++ = '/';
+                if (*sort_url_args) {
+                    p = ngx_cpymem(p, sort_url_args,
+                                   ngx_sizeof_ssz("?C=x&amp;O=y"));
+                }
+            }
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_NAME:
+            p = ngx_http_fancyindex_escape_name(p, entry);
+            if (entry->dir)
+                *p++ = '/';
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_TITLE:
+            p = ngx_http_fancyindex_escape_name(p, entry);
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_SIZE:
+        case NGX_HTTP_FANCYINDEX_ROW_FILES:
+            /* 目录的大小每行只查询一次 */
+            if (!sized) {
+                length = entry->size;
+                known = !entry->dir;
+#if (NGX_THREADS)
+                if (alcf->dir_sizes
+                    && ngx_http_fancyindex_dir_size(r, alcf, ctx, entry,
+                                                    &length, &files))
+                {
+                    known = 2;
+                }
+#endif
+                sized = 1;
+            }
+
+            if (op->op == NGX_HTTP_FANCYINDEX_ROW_FILES) {
+                if (known == 2)
+                    p = ngx_sprintf(p, " title=\"%uL files\"", files);
+
+            } else if (known) {
+                p = ngx_http_fancyindex_format_size(p, length,
+                                                    alcf->exact_size);
+            } else {
+                *p++ = '-';
+            }
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_MTIME:
+            ngx_gmtime(entry->mtime
+                       + ngx_timeofday()->gmtoff * 60 * alcf->localtime, &tm);
+            p = ngx_fancyindex_timefmt(p, &alcf->time_format, &tm);
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_TYPE:
+            if (entry->dir) {
+                p = ngx_cpymem_ssz(p, "directory");
+            } else {
+                p = ngx_cpymem_ssz(p, "file");
+            }
+            break;
+
+        case NGX_HTTP_FANCYINDEX_ROW_SHA256:
+            if (entry->sum)
+                p = ngx_hex_dump(p, entry->sum, 32);
+            break;
+        }
+    }
+
+    return p;
+}
+
+
+/*
+ * 输出表格之前的部分：路径（如有需要）、表头和"上级目录"条目。返回最多
+ * 需要的长度。
+ */
+static ngx_inline size_t
+ngx_http_fancyindex_list_head_size(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    return (alcf->show_path
+            ? r->uri.len + ngx_escape_html(NULL, r->uri.data, r->uri.len)
+              + alcf->tpl->body2.len
+            : 0)
+         + alcf->tpl->list1.len
+         + ngx_sizeof_ssz("<tr><td colspan=\"2\" class=\"link\"><a href=\"../"
+                          "?C=N&amp;O=A\">上级目录</a></td>"
+                          "<td class=\"size\">-</td>"
+                          "<td class=\"link\"><a href=\"/\" >返回首页</a>"
+                          "</tr>" CRLF)
+         + (alcf->row_program->sha256
+            ? ngx_sizeof_ssz("<th>SHA-256</th>")
+              + ngx_sizeof_ssz("<td class=\"sha256\"></td>")
+            : 0);
+}
+
+
+static u_char *
+ngx_http_fancyindex_list_head(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, u_char *p,
+        const char *sort_url_args)
+{
+    size_t  n;
+
+    /* 如有需要，显示路径 */
+    if (alcf->show_path){
+        p = (u_char *) ngx_escape_html(p, r->uri.data, r->uri.len);
+        p = ngx_cpymem_str(p, alcf->tpl->body2);
+    }
+
+    /* 打开<table>标签，行模板有SHA-256列时加在表头的最后 */
+    if (alcf->row_program->sha256) {
+        n = ngx_http_fancyindex_list1_split(&alcf->tpl->list1);
+        p = ngx_cpymem(p, alcf->tpl->list1.data, n);
+        p = ngx_cpymem_ssz(p, "<th>SHA-256</th>");
+        p = ngx_cpymem(p, alcf->tpl->list1.data + n, alcf->tpl->list1.len - n);
+    } else {
+        p = ngx_cpymem_str(p, alcf->tpl->list1);
+    }
+
+    /* "上级目录"条目，如果显示则始终位于首位 */
+    if (r->uri.len > 1 && alcf->hide_parent == 0) {
+        p = ngx_cpymem_ssz(p,
+                           "<tr>"
+                           "<td colspan=\"2\" class=\"link\"><a href=\"../");
+        if (*sort_url_args) {
+            p = ngx_cpymem(p, sort_url_args, ngx_sizeof_ssz("?C=N&amp;O=A"));
+        }
+        p = ngx_cpymem_ssz(p,
+                           "\">上级目录</a></td>"
+                           "<td class=\"size\">-</td>"
+                           "<td class=\"link\"><a href=\"/\" >返回首页</a>");
+        if (alcf->row_program->sha256)
+            p = ngx_cpymem_ssz(p, "<td class=\"sha256\"></td>");
+        p = ngx_cpymem_ssz(p, "</tr>" CRLF);
+    }
+
+    return p;
+}
+
+
+/*
+ * 浏览器渲染（fancyindex_render client）时的页面：只有表头、"上级目录"
+ * 条目和渲染脚本，不读取目录。脚本以相同的请求参数获取JSON格式的列表，
+ * 在浏览器中生成表格行。页面与目录的内容无关，可以长期缓存。
+ */
+static ngx_int_t
+ngx_http_fancyindex_make_shell(ngx_http_request_t *r, ngx_buf_t **pb,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    size_t            len;
+    ngx_buf_t        *b;
+    ngx_err_t         err;
+    ngx_file_info_t   fi;
+    const char       *sort_url_args;
+
+    if (ngx_http_fancyindex_map_path(r, &ctx->path, &ctx->allocated)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* 与读取目录时的错误一致 */
+    if (ngx_file_info(ctx->path.data, &fi) == NGX_FILE_ERROR) {
+        err = ngx_errno;
+    } else {
+        err = ngx_is_dir(&fi) ? 0 : NGX_ENOTDIR;
+    }
+
+    if (err) {
+        return ngx_http_fancyindex_dir_error(r, alcf, err, ngx_file_info_n,
+                                             ctx->path.data);
+    }
+
+    (void) ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args);
+
+    len = ngx_http_fancyindex_list_head_size(r, alcf)
+        + alcf->tpl->list2.len
+        + alcf->tpl->render1.len
+        + alcf->render_attrs.len
+        + alcf->tpl->render2.len;
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    b->last = ngx_http_fancyindex_list_head(r, alcf, b->last, sort_url_args);
+    b->last = ngx_cpymem_str(b->last, alcf->tpl->list2);
+    b->last = ngx_cpymem_str(b->last, alcf->tpl->render1);
+    b->last = ngx_cpymem_str(b->last, alcf->render_attrs);
+    b->last = ngx_cpymem_str(b->last, alcf->tpl->render2);
+
+    *pb = b;
+    return NGX_OK;
+}
+
+
+/* 释放读取名额并离开等待队列。重新加载配置后计数已清零，不再修改 */
+static void
+ngx_http_fancyindex_scan_release(void *data)
+{
+    ngx_http_fancyindex_ctx_t  *ctx = data;
+
+    if (ctx->scans_sh == NULL || ctx->scans_sh->generation != ctx->scans_gen) {
+        ctx->scanning = 0;
+        ctx->queued = 0;
+        return;
+    }
+
+    if (ctx->scanning) {
+        (void) ngx_atomic_fetch_add(&ctx->scans_slot->scans, -1);
+        ctx->scanning = 0;
+    }
+
+    if (ctx->queued) {
+        (void) ngx_atomic_fetch_add(&ctx->scans_slot->queued, -1);
+        ctx->queued = 0;
+    }
+}
+
+
+/* 占用一个计数，已达到上限max时返回0 */
+static ngx_inline ngx_uint_t
+ngx_http_fancyindex_scan_inc(ngx_atomic_t *counter, ngx_uint_t max)
+{
+    ngx_atomic_uint_t  n;
+
+    for ( ;; ) {
+        n = *counter;
+
+        if (n >= max)
+            return 0;
+
+        if (ngx_atomic_cmp_set(counter, n, n + 1))
+            return 1;
+    }
+}
+
+
+/* 添加"Retry-After: 1"响应头，建议客户端稍后重试 */
+static ngx_int_t
+ngx_http_fancyindex_set_retry_after(ngx_http_request_t *r)
+{
+    ngx_table_elt_t *h;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Retry-After");
+    ngx_str_set(&h->value, "1");
+
+    return NGX_OK;
+}
+
+
+/*
+ * 读取目录前获取读取名额（fancyindex_max_concurrent_scans）。名额已满时
+ * 排队定时重试并返回NGX_BUSY；队列已满或等待超时时返回503，并通过
+ * Retry-After建议客户端稍后重试。
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_acquire(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t               *cln;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+
+    if (ctx->scans_sh == NULL) {
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+        ctx->scans_sh = mcf->scans_zone->data;
+        ctx->scans_slot = &ctx->scans_sh->slots[alcf->scan_slot];
+        ctx->scans_gen = ctx->scans_sh->generation;
+
+        cln->handler = ngx_http_fancyindex_scan_release;
+        cln->data = ctx;
+    }
+
+    if (ngx_http_fancyindex_scan_inc(&ctx->scans_slot->scans, alcf->max_scans))
+    {
+        if (ctx->queued) {
+            (void) ngx_atomic_fetch_add(&ctx->scans_slot->queued, -1);
+            ctx->queued = 0;
+        }
+
+        ctx->scanning = 1;
+        return NGX_OK;
+    }
+
+    if (!ctx->queued) {
+        if (ngx_http_fancyindex_scan_inc(&ctx->scans_slot->queued,
+                                         alcf->scan_queue))
+        {
+            ctx->queued = 1;
+            ctx->queue_start = ngx_current_msec;
+            return NGX_BUSY;
+        }
+
+    } else if ((ngx_msec_int_t) (ngx_current_msec - ctx->queue_start)
+               < (ngx_msec_int_t) alcf->scan_queue_timeout)
+    {
+        return NGX_BUSY;
+    }
+
+    ngx_http_fancyindex_scan_release(ctx);
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "fancyindex: too many concurrent scans, %ui in flight",
+                  (ngx_uint_t) ctx->scans_slot->scans);
+
+    if (ngx_http_fancyindex_set_retry_after(r) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+
+static ngx_inline ngx_int_t
+make_content_buf(
+        ngx_http_request_t *r, ngx_buf_t **pb,
+        ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_entry_t *entry;
+    ngx_http_fancyindex_timing_t *timing = NULL;
+    ngx_http_fancyindex_ctx_t    *ctx;
+
+    ngx_http_fancyindex_cmp_pt    sort_cmp_func;
+    const char  *sort_url_args = "";
+    uint64_t     t0 = 0, t1, stat0 = 0;
+
+    size_t       len;
+    ngx_uint_t   i, j, n;
+    ngx_int_t    rc;
+    ngx_buf_t   *b;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    if (alcf->server_timing) {
+        timing = &ctx->timing;
+        t0 = ngx_fancyindex_usec();
+        stat0 = timing->stat;
+    }
+
+    if (ctx->state == NGX_HTTP_FANCYINDEX_STATE_START) {
+        if (ngx_http_fancyindex_map_path(r, &ctx->path, &ctx->allocated)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: \"%s\"", ctx->path.data);
+
+        if (alcf->cache_zone && alcf->cache_errors) {
+            rc = ngx_http_fancyindex_cache_error_get(alcf, &ctx->path);
+            if (rc != NGX_DECLINED) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http fancyindex cached error: %i", rc);
+                return rc;
+            }
+        }
+
+        rc = NGX_DECLINED;
+        ctx->mtime = -1;
+
+#if (NGX_THREADS)
+        if (alcf->index && (ctx->filter.search || ctx->filter.recent)) {
+            rc = ngx_http_fancyindex_index_query(r, alcf, ctx);
+            if (rc != NGX_OK && rc != NGX_DECLINED)
+                return rc;
+        }
+#endif
+
+        if (rc == NGX_DECLINED && alcf->cache_zone) {
+            rc = ngx_http_fancyindex_cache_get(r, alcf, &ctx->path,
+                                               &ctx->entries, &ctx->mtime);
+            if (rc == NGX_ERROR)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            if (rc == NGX_BUSY)
+                return NGX_BUSY;
+        }
+
+        if (rc == NGX_DECLINED && alcf->max_scans) {
+            rc = ngx_http_fancyindex_scan_acquire(r, alcf, ctx);
+            if (rc != NGX_OK) {
+                /* 释放读取锁，重试时重新查找缓存 */
+                if (alcf->cache_zone)
+                    ngx_http_fancyindex_cache_cleanup(ctx->cache_cln);
+                return rc;
+            }
+
+            rc = NGX_DECLINED;
+        }
+
+        if (rc == NGX_DECLINED) {
+            /* 缓存的列表必须完整，存入缓存后再过滤 */
+            if ((ctx->filter.delta || ctx->filter.query.len)
+                && !alcf->cache_zone)
+            {
+                ctx->scan.filter = &ctx->filter;
+            }
+
+            rc = ngx_http_fancyindex_scan_open(r, alcf, &ctx->scan,
+                                               &ctx->path, ctx->allocated,
+                                               &ctx->entries);
+            if (rc != NGX_OK) {
+                ngx_http_fancyindex_scan_release(ctx);
+
+                if (alcf->cache_zone) {
+                    /* 释放读取锁 */
+                    ngx_http_fancyindex_cache_cleanup(ctx->cache_cln);
+
+                    if (alcf->cache_errors && (rc == NGX_HTTP_NOT_FOUND
+                                               || rc == NGX_HTTP_FORBIDDEN))
+                    {
+                        ngx_http_fancyindex_cache_error_put(alcf, &ctx->path,
+                                                            rc);
+                    }
+                }
+                return rc;
+            }
+
+#if (NGX_HTTP_FANCYINDEX_STAT_BATCH)
+            ctx->scan.parallel = alcf->parallel_stat;
+            ctx->scan.uring = (alcf->stat_engine
+                               == NGX_HTTP_FANCYINDEX_STAT_ENGINE_IO_URING);
+            ctx->scan.wake = &ctx->wait;
+            ctx->scan.stat_time = timing ? &timing->stat : NULL;
+#endif
+
+            ctx->time = ctx->scan.start;
+            ctx->state = NGX_HTTP_FANCYINDEX_STATE_SCAN;
+
+        } else {
+            /* 等待期间其他请求已读取并缓存了该目录 */
+            ngx_http_fancyindex_scan_release(ctx);
+            ctx->state = NGX_HTTP_FANCYINDEX_STATE_SORT;
+        }
+    }
+
+    if (ctx->state == NGX_HTTP_FANCYINDEX_STATE_SCAN) {
+        rc = ngx_http_fancyindex_scan_read(r, alcf, &ctx->scan, &ctx->path,
+                                           &ctx->entries, alcf->slice, timing);
+
+        /* NGX_DONE：等待线程池中的任务完成 */
+        if (rc == NGX_AGAIN || rc == NGX_DONE) {
+            if (timing)
+                timing->scan += ngx_fancyindex_usec() - t0
+                              - (timing->stat - stat0);
+            ctx->yield = (rc == NGX_AGAIN);
+            return NGX_BUSY;
+        }
+
+        ngx_http_fancyindex_scan_release(ctx);
+
+        if (alcf->cache_zone) {
+            /* 截断的列表不缓存 */
+            if (rc == NGX_OK && ctx->mtime != -1 && !ctx->scan.truncated) {
+                ngx_http_fancyindex_cache_put(r, alcf, &ctx->path, ctx->mtime,
+                                              ctx->scan.start, &ctx->entries,
+                                              ctx->cache_cln);
+            } else {
+                /* 释放读取锁 */
+                ngx_http_fancyindex_cache_cleanup(ctx->cache_cln);
+            }
+        }
+
+        if (rc != NGX_OK)
+            return rc;
+
+        ctx->state = NGX_HTTP_FANCYINDEX_STATE_SORT;
+    }
+
+    entry = ctx->entries.elts;
+
+    if (ctx->state == NGX_HTTP_FANCYINDEX_STATE_RENDER) {
+        b = ctx->b;
+        sort_url_args = ctx->sort_url_args;
+        goto render;
+    }
+
+#if (NGX_THREADS)
+    /* 线程池中的排序已经完成 */
+    if (ctx->sorting) {
+        ctx->sorting = 0;
+        ngx_http_fancyindex_perm_save(r, ctx,
+                ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args));
+        goto sorted;
+    }
+#endif
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    /* 已经在线程池中读取了SHA-256 */
+    if (ctx->summing) {
+        ctx->summing = 0;
+        goto summed;
+    }
+#endif
+
+    /* 缓存中的列表是完整的，在此过滤 */
+    if ((ctx->filter.delta || ctx->filter.query.len) && !ctx->scan.filter) {
+        for (i = 0, j = 0; i < ctx->entries.nelts; i++) {
+            if (ctx->filter.delta && entry[i].mtime < ctx->filter.since)
+                continue;
+
+            if (ctx->filter.query.len
+                && !ngx_http_fancyindex_match_name(&ctx->filter,
+                                                   entry[i].name.data,
+                                                   entry[i].name.len))
+            {
+                continue;
+            }
+
+            entry[j++] = entry[i];
+        }
+
+        ctx->entries.nelts = j;
+    }
+
+    if (timing) {
+        t1 = ngx_fancyindex_usec();
+        timing->scan += t1 - t0 - (timing->stat - stat0);
+        t0 = t1;
+    }
+
+    /* 已有预先压缩的响应体时不需要生成列表 */
+    if (ctx->encoding) {
+        ctx->body = ngx_http_fancyindex_cache_body_find(r, ctx->cache_cln,
+                                                        ctx->encoding);
+        if (ctx->body) {
+            *pb = NULL;
+            return NGX_OK;
+        }
+    }
+
+    if (ctx->filter.delta)
+        ngx_http_fancyindex_deleted(alcf, ctx);
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    rc = ngx_http_fancyindex_sums(r, alcf, ctx);
+    if (rc == NGX_ERROR)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (rc == NGX_DONE) {
+        ctx->yield = 0;
+        return NGX_BUSY;
+    }
+
+summed:
+#endif
+
+    sort_cmp_func = ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args);
+
+    /* 缓存中已有该排序方式的顺序 */
+    if (!ctx->recent) {
+        if (timing)
+            t1 = ngx_fancyindex_usec();
+
+        ngx_http_fancyindex_perm_load(alcf, ctx, sort_cmp_func);
+
+        if (timing) {
+            t0 = ngx_fancyindex_usec();
+            timing->sort += t0 - t1;
+        }
+    }
+
+    if (!ctx->recent && !ctx->sorted
+        && ngx_http_fancyindex_sort_keys(r, alcf, ctx, sort_cmp_func)
+           != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+#if (NGX_THREADS)
+    /* 条目很多时在线程池中排序，完成后再次进入 */
+    if (alcf->parallel_sort && !ctx->recent && !ctx->sorted
+        && ctx->entries.nelts >= alcf->parallel_sort)
+    {
+        rc = ngx_http_fancyindex_psort(r, alcf, ctx, sort_cmp_func,
+                                       timing ? &timing->sort : NULL);
+        if (rc == NGX_ERROR)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        if (rc == NGX_DONE) {
+            ctx->yield = 0;
+            return NGX_BUSY;
+        }
+
+        ngx_http_fancyindex_perm_save(r, ctx, sort_cmp_func);
+        ctx->sorted = 1;
+    }
+
+sorted:
+#endif
+
+#if (NGX_HTTP_FANCYINDEX_JSON)
+    if (ctx->json) {
+        if (timing)
+            t1 = ngx_fancyindex_usec();
+
+        /* 最近的文件已按修改时间降序排列 */
+        ngx_http_fancyindex_sort(r, alcf, ctx,
+                ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args));
+
+        if (timing) {
+            t0 = ngx_fancyindex_usec();
+            timing->sort += t0 - t1;
+        }
+
+        if ((*pb = ngx_http_fancyindex_make_json(r, ctx)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        if (timing)
+            timing->render = ngx_fancyindex_usec() - t0;
+
+        return NGX_OK;
+    }
+#endif
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    if (ctx->sha256sum) {
+        ngx_http_fancyindex_sort(r, alcf, ctx,
+                ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args));
+
+        if ((*pb = ngx_http_fancyindex_make_sha256sum(r, ctx)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        return NGX_OK;
+    }
+#endif
+
+    /*
+     * 计算生成目录列表所需的缓冲区长度。
+     * 包括URI、HTML标签、文件名、修改时间等内容。
+     */
+
+    len = ngx_http_fancyindex_list_head_size(r, alcf)
+        + alcf->tpl->list2.len;
+
+    for (i = 0; i < ctx->entries.nelts; i++)
+        len += ngx_http_fancyindex_row_size(alcf->row_program, &entry[i]);
+
+    if (ctx->scan.truncated)
+        len += ngx_sizeof_ssz(NGX_HTTP_FANCYINDEX_TRUNCATED)
+             + 2 * NGX_INT_T_LEN;
+
+    if (ctx->filter.delta)
+        len += ngx_http_fancyindex_delta_html_size(ctx);
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    sort_cmp_func = ngx_http_fancyindex_sort_func(r, alcf, &sort_url_args);
+
+    /* 如有需要，对条目进行排序 */
+    if (timing)
+        t1 = ngx_fancyindex_usec();
+
+    ngx_http_fancyindex_sort(r, alcf, ctx, sort_cmp_func);
+
+    if (timing) {
+        timing->sort += ngx_fancyindex_usec() - t1;
+        timing->render = t1 - t0;
+        t0 = ngx_fancyindex_usec();
+    }
+
+    ctx->b = b;
+    ctx->sort_url_args = sort_url_args;
+
+    b->last = ngx_http_fancyindex_list_head(r, alcf, b->last, sort_url_args);
+
+    ctx->row = 0;
+    ctx->state = NGX_HTTP_FANCYINDEX_STATE_RENDER;
+
+render:
+
+    /* 目录和文件条目，每次最多生成slice行 */
+    n = ctx->entries.nelts;
+    if (alcf->slice && n - ctx->row > alcf->slice)
+        n = ctx->row + alcf->slice;
+
+    for (i = ctx->row; i < n; i++) {
+        b->last = ngx_http_fancyindex_row_program_run(r, alcf, ctx, &entry[i],
+                                                      sort_url_args, b->last);
+        *b->last++ = CR;
+        *b->last++ = LF;
+    }
+
+    ctx->row = n;
+
+    if (timing)
+        timing->render += ngx_fancyindex_usec() - t0;
+
+    if (ctx->row < ctx->entries.nelts) {
+        ctx->yield = 1;
+        return NGX_BUSY;
+    }
+
+    /* 输出表格底部 */
+    b->last = ngx_cpymem_str(b->last, alcf->tpl->list2);
+
+    if (ctx->scan.truncated)
+        b->last = ngx_sprintf(b->last, NGX_HTTP_FANCYINDEX_TRUNCATED,
+                              ctx->scan.total, ctx->entries.nelts);
+
+    if (ctx->filter.delta)
+        b->last = ngx_http_fancyindex_delta_html(b->last, ctx);
+
+    *pb = b;
+    return NGX_OK;
+}
+
+
+
+/* 添加Server-Timing响应头，各阶段耗时以毫秒表示 */
+static ngx_int_t
+ngx_http_fancyindex_set_server_timing(ngx_http_request_t *r,
+        const ngx_http_fancyindex_timing_t *timing)
+{
+    ngx_table_elt_t *h;
+    u_char          *p;
+    size_t           len;
+
+    len = ngx_sizeof_ssz("scan;dur=, stat;dur=, sort;dur=, render;dur=")
+        + 4 * (NGX_INT64_LEN + ngx_sizeof_ssz(".000"));
+
+    if ((p = ngx_pnalloc(r->pool, len)) == NULL)
+        return NGX_ERROR;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Server-Timing");
+    h->value.data = p;
+    h->value.len = ngx_sprintf(p, "scan;dur=%.3f, stat;dur=%.3f, "
+                                  "sort;dur=%.3f, render;dur=%.3f",
+                               (double) timing->scan / 1000,
+                               (double) timing->stat / 1000,
+                               (double) timing->sort / 1000,
+                               (double) timing->render / 1000)
+                 - p;
+
+    return NGX_OK;
+}
+
+
+/* Accept-Encoding中是否接受编码name，"q=0"表示不接受 */
+static ngx_uint_t
+ngx_http_fancyindex_accept_encoding(ngx_str_t *ae, char *name, size_t len)
+{
+    u_char  *p, *start, *last;
+
+    start = ae->data;
+    last = ae->data + ae->len;
+
+    for ( ;; ) {
+        p = ngx_strlcasestrn(start, last, (u_char *) name, len - 1);
+        if (p == NULL)
+            return 0;
+
+        start = p + len;
+
+        /* 只匹配完整的编码名称 */
+        if ((p > ae->data && p[-1] != ',' && p[-1] != ' ' && p[-1] != '\t')
+            || (start < last && *start != ',' && *start != ';'
+                && *start != ' ' && *start != '\t'))
+        {
+            continue;
+        }
+
+        for (p = start; p < last && (*p == ' ' || *p == '\t'); p++)
+            /* void */ ;
+
+        if (p == last || *p != ';')
+            return 1;
+
+        for (p++; p < last && (*p == ' ' || *p == '\t'); p++)
+            /* void */ ;
+
+        if (last - p < 3 || (*p != 'q' && *p != 'Q') || p[1] != '='
+            || p[2] != '0')
+        {
+            return 1;
+        }
+
+        /* q=0、q=0.0、q=0.00、q=0.000 */
+        p += 3;
+        if (p < last && *p == '.') {
+            for (p++; p < last && *p == '0'; p++)
+                /* void */ ;
+        }
+
+        return (p < last && *p >= '1' && *p <= '9');
+    }
+}
+
+
+/*
+ * 确定发送预先压缩的响应体时使用的编码，不发送时返回0。只有整个响应体
+ * 由本模块生成（页眉和页脚不是子请求）、且参数为空或只有排序参数时才
+ * 压缩，后者限制了每个目录需要缓存的响应体的数量。此时响应总是包含
+ * "Vary: Accept-Encoding"。
+ */
+static ngx_uint_t
+ngx_http_fancyindex_precompress_encoding(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char  *p;
+
+    if (alcf->cache_zone == NULL || alcf->checksums || alcf->dir_sizes
+        || alcf->render == NGX_HTTP_FANCYINDEX_RENDER_CLIENT
+        || (alcf->precompress & NGX_HTTP_FANCYINDEX_PRECOMPRESS_OFF)
+        || (alcf->header.path.len > 0 && alcf->header.local.len == 0)
+        || (alcf->footer.path.len > 0 && alcf->footer.local.len == 0))
+    {
+        return 0;
+    }
+
+    p = r->args.data;
+
+    if (r->args.len != 0
+        && !((r->args.len == 3
+              || (r->args.len == 7 && ngx_strncmp(p + 3, "&O=", 3) == 0
+                  && (p[6] == 'A' || p[6] == 'D')))
+             && p[0] == 'C' && p[1] == '='
+             && (p[2] == 'N' || p[2] == 'M' || p[2] == 'S' || p[2] == 'V')))
+    {
+        return 0;
+    }
+
+    ctx->vary = 1;
+
+#if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS)
+    if (r->headers_in.accept_encoding == NULL)
+        return 0;
+
+    if ((alcf->precompress & NGX_HTTP_FANCYINDEX_BROTLI)
+        && ngx_http_fancyindex_accept_encoding(
+               &r->headers_in.accept_encoding->value, "br", 2))
+    {
+        return NGX_HTTP_FANCYINDEX_BROTLI;
+    }
+
+    if ((alcf->precompress & NGX_HTTP_FANCYINDEX_GZIP)
+        && ngx_http_fancyindex_accept_encoding(
+               &r->headers_in.accept_encoding->value, "gzip", 4))
+    {
+        return NGX_HTTP_FANCYINDEX_GZIP;
+    }
+#endif
+
+    return 0;
+}
+
+
+#if (NGX_ZLIB)
+
+static ngx_int_t
+ngx_http_fancyindex_gzip(ngx_pool_t *pool, ngx_str_t *in, ngx_str_t *out,
+        ngx_uint_t fast)
+{
+    int       rc;
+    z_stream  zs;
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    /* windowBits加16表示生成gzip格式 */
+    if (deflateInit2(&zs, fast ? NGX_HTTP_FANCYINDEX_GZIP_INLINE
+                                  : NGX_HTTP_FANCYINDEX_GZIP_LEVEL,
+                     Z_DEFLATED,
+                     MAX_WBITS + 16, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY)
+        != Z_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    out->len = deflateBound(&zs, in->len);
+    out->data = ngx_pnalloc(pool, out->len);
+    if (out->data == NULL) {
+        (void) deflateEnd(&zs);
+        return NGX_ERROR;
+    }
+
+    zs.next_in = in->data;
+    zs.avail_in = in->len;
+    zs.next_out = out->data;
+    zs.avail_out = out->len;
+
+    rc = deflate(&zs, Z_FINISH);
+    out->len = zs.total_out;
+
+    (void) deflateEnd(&zs);
+
+    return (rc == Z_STREAM_END) ? NGX_OK : NGX_ERROR;
+}
+
+#endif /* NGX_ZLIB */
+
+
+#if (NGX_HAVE_BROTLI_ENC)
+
+static ngx_int_t
+ngx_http_fancyindex_brotli(ngx_pool_t *pool, ngx_str_t *in, ngx_str_t *out,
+        ngx_uint_t fast)
+{
+    out->len = BrotliEncoderMaxCompressedSize(in->len);
+    if (out->len == 0)
+        return NGX_ERROR;
+
+    out->data = ngx_pnalloc(pool, out->len);
+    if (out->data == NULL)
+        return NGX_ERROR;
+
+    if (!BrotliEncoderCompress(fast ? NGX_HTTP_FANCYINDEX_BROTLI_INLINE
+                                       : NGX_HTTP_FANCYINDEX_BROTLI_QUALITY,
+                               BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               in->len, in->data, &out->len, out->data))
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif /* NGX_HAVE_BROTLI_ENC */
+
+
+static ngx_int_t
+ngx_http_fancyindex_compress(ngx_pool_t *pool, ngx_uint_t encoding,
+        ngx_str_t *in, ngx_str_t *out, ngx_uint_t fast)
+{
+    switch (encoding) {
+#if (NGX_HAVE_BROTLI_ENC)
+    case NGX_HTTP_FANCYINDEX_BROTLI:
+        return ngx_http_fancyindex_brotli(pool, in, out, fast);
+#endif
+#if (NGX_ZLIB)
+    case NGX_HTTP_FANCYINDEX_GZIP:
+        return ngx_http_fancyindex_gzip(pool, in, out, fast);
+#endif
+    default:
+        return NGX_ERROR;
+    }
+}
+
+
+/* 拼接页眉、列表和页脚，分配在pool中 */
+static ngx_int_t
+ngx_http_fancyindex_precompress_input(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_buf_t *content,
+        ngx_pool_t *pool, ngx_str_t *in)
+{
+    u_char     *p;
+    ngx_buf_t  *header;
+
+    if (alcf->header.local.len > 0) {
+        in->len = alcf->header.local.len;
+        header = NULL;
+    } else {
+        if ((header = make_header_buf(r, alcf->tpl, alcf->css_href)) == NULL)
+            return NGX_ERROR;
+        in->len = header->last - header->pos;
+    }
+
+    in->len += content->last - content->pos;
+    in->len += (alcf->footer.local.len > 0) ? alcf->footer.local.len
+                                            : alcf->tpl->foot1.len;
+
+    if ((in->data = ngx_pnalloc(pool, in->len)) == NULL)
+        return NGX_ERROR;
+
+    p = header ? ngx_cpymem(in->data, header->pos, header->last - header->pos)
+               : ngx_cpymem_str(in->data, alcf->header.local);
+    p = ngx_cpymem(p, content->pos, content->last - content->pos);
+
+    if (alcf->footer.local.len > 0)
+        p = ngx_cpymem_str(p, alcf->footer.local);
+    else
+        p = ngx_cpymem_str(p, alcf->tpl->foot1);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/* 在线程池中压缩的响应体，任务和数据都在自己的内存池中 */
+typedef struct {
+    ngx_http_fancyindex_cache_cleanup_t  ccln;      /* 对缓存节点的引用 */
+    ngx_http_fancyindex_cache_body_t    *body;      /* 占位 */
+    ngx_pool_t                          *pool;
+    ngx_uint_t                           encoding;
+    ngx_str_t                            in;
+    ngx_str_t                            out;
+    ngx_int_t                            rc;
+} ngx_http_fancyindex_compress_t;
+
+
+static void
+ngx_http_fancyindex_compress_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_compress_t  *cp = data;
+
+    cp->rc = ngx_http_fancyindex_compress(cp->pool, cp->encoding, &cp->in,
+                                          &cp->out, 0);
+}
+
+
+static void
+ngx_http_fancyindex_compress_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t               *task = ev->data;
+    ngx_http_fancyindex_compress_t  *cp = task->ctx;
+
+    ngx_int_t                     rc;
+    ngx_http_fancyindex_cache_t  *cache = cp->ccln.cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    rc = ngx_http_fancyindex_cache_body_fill_locked(cache, cp->ccln.node,
+                                        cp->body,
+                                        (cp->rc == NGX_OK) ? &cp->out : NULL);
+    ngx_http_fancyindex_cache_release_locked(&cp->ccln);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (cp->rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "fancyindex: compressing cached listing failed");
+
+    } else if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "fancyindex: compressed listing (%uz bytes) does not "
+                      "fit into cache zone \"%V\"", cp->out.len,
+                      &cache->shm_zone->shm.name);
+    }
+
+    ngx_destroy_pool(cp->pool);
+}
+
+
+/*
+ * 在线程池中压缩响应体，完成后替换占位body。没有线程池时返回
+ * NGX_DECLINED，由调用者直接压缩。
+ */
+static ngx_int_t
+ngx_http_fancyindex_compress_post(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_buf_t *content, ngx_http_fancyindex_cache_body_t *body)
+{
+    ngx_pool_t                       *pool;
+    ngx_thread_task_t                *task;
+    ngx_http_fancyindex_compress_t   *cp;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+    if (mcf->thread_pool == NULL)
+        return NGX_DECLINED;
+
+    /* 请求可能先于任务结束，不能使用请求的内存池 */
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL)
+        return NGX_ERROR;
+
+    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_fancyindex_compress_t));
+    if (task == NULL)
+        goto failed;
+
+    cp = task->ctx;
+    cp->pool = pool;
+    cp->body = body;
+    cp->encoding = ctx->encoding;
+
+    if (ngx_http_fancyindex_precompress_input(r, alcf, content, pool, &cp->in)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    task->handler = ngx_http_fancyindex_compress_thread;
+    task->event.handler = ngx_http_fancyindex_compress_done;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    if (ngx_thread_task_post(mcf->thread_pool, task) != NGX_OK)
+        goto failed;
+
+    /* 任务持有节点的引用，完成前节点不会被释放 */
+    cp->ccln.cache = ctx->cache_cln->cache;
+    cp->ccln.node = ctx->cache_cln->node;
+
+    ngx_shmtx_lock(&cp->ccln.cache->shpool->mutex);
+    cp->ccln.node->count++;
+    ngx_shmtx_unlock(&cp->ccln.cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: compressing \"%V\" in thread pool",
+                   &r->uri);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+}
+
+#endif /* NGX_THREADS */
+
+
+/*
+ * 发送压缩后的响应体。缓存中没有时加入占位，在线程池中拼接页眉、列表和
+ * 页脚并压缩，完成后保存到缓存节点中，本次请求和压缩期间的其他请求发送
+ * 未压缩的响应体，此时返回NGX_DECLINED。没有线程池时在请求中以较低的级别
+ * 压缩。
+ */
+static ngx_int_t
+ngx_http_fancyindex_send_precompressed(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_buf_t *content)
+{
+    ngx_int_t                          rc, fill;
+    ngx_str_t                          in, data;
+    ngx_buf_t                         *b;
+    ngx_chain_t                        out;
+    ngx_table_elt_t                   *h;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_body_t  *body;
+
+    if (ctx->body) {
+        data.data = ctx->body->data + ctx->body->uri_len + ctx->body->args_len;
+        data.len = ctx->body->len;
+
+    } else {
+        body = ngx_http_fancyindex_cache_body_claim(r, ctx->cache_cln,
+                                                    ctx->encoding);
+        if (body == NULL)
+            return NGX_DECLINED;
+
+        cache = ctx->cache_cln->cache;
+
+#if (NGX_THREADS)
+        rc = ngx_http_fancyindex_compress_post(r, alcf, ctx, content, body);
+
+        if (rc == NGX_OK)
+            return NGX_DECLINED;
+#else
+        rc = NGX_DECLINED;
+#endif
+
+        if (rc == NGX_DECLINED) {
+            rc = ngx_http_fancyindex_precompress_input(r, alcf, content,
+                                                       r->pool, &in);
+            if (rc == NGX_OK)
+                rc = ngx_http_fancyindex_compress(r->pool, ctx->encoding,
+                                                  &in, &data, 1);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fill = ngx_http_fancyindex_cache_body_fill_locked(cache,
+                        ctx->cache_cln->node, body,
+                        (rc == NGX_OK) ? &data : NULL);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "fancyindex: compressing listing of \"%V\" failed",
+                          &r->uri);
+            return NGX_DECLINED;
+        }
+
+        if (fill == NGX_DECLINED) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "fancyindex: compressed listing of \"%V\" (%uz "
+                          "bytes) does not fit into cache zone \"%V\"",
+                          &r->uri, data.len, &cache->shm_zone->shm.name);
+        }
+    }
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Content-Encoding");
+    if (ctx->encoding == NGX_HTTP_FANCYINDEX_BROTLI) {
+        ngx_str_set(&h->value, "br");
+    } else {
+        ngx_str_set(&h->value, "gzip");
+    }
+    r->headers_out.content_encoding = h;
+
+    r->headers_out.content_length_n = data.len;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    if ((b = ngx_calloc_buf(r->pool)) == NULL)
+        return NGX_ERROR;
+
+    b->memory = 1;
+    b->pos = data.data;
+    b->last = data.data + data.len;
+    b->last_in_chain = 1;
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/* 添加"Vary: Accept-Encoding"响应头 */
+static ngx_int_t
+ngx_http_fancyindex_set_vary(ngx_http_request_t *r)
+{
+    ngx_table_elt_t *h;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Vary");
+    ngx_str_set(&h->value, "Accept-Encoding");
+
+    return NGX_OK;
+}
+
+
+/*
+ * 浏览器渲染的页面只取决于URI和配置：添加ETag和Cache-Control响应头。
+ * 页眉或页脚为子请求时内容可能随时变化，不添加。
+ */
+static ngx_int_t
+ngx_http_fancyindex_set_render_cache(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    u_char           *p;
+    ngx_table_elt_t  *h;
+
+    if ((alcf->header.path.len > 0 && alcf->header.local.len == 0)
+        || (alcf->footer.path.len > 0 && alcf->footer.local.len == 0))
+    {
+        return NGX_OK;
+    }
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "ETag");
+    h->value = alcf->render_etag;
+    r->headers_out.etag = h;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    p = ngx_pnalloc(r->pool, ngx_sizeof_ssz("max-age=") + NGX_TIME_T_LEN);
+    if (p == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Cache-Control");
+    h->value.data = p;
+    h->value.len = ngx_sprintf(p, "max-age=%T", alcf->render_max_age) - p;
+
+    return NGX_OK;
+}
+
+
+/* 请求结束时关闭所有目录和文件 */
+static void
+ngx_http_fancyindex_download_cleanup(void *data)
+{
+    ngx_http_fancyindex_download_t       *dl = data;
+    ngx_http_fancyindex_download_slot_t  *s;
+    ngx_http_fancyindex_level_t          *lv;
+
+    lv = dl->levels.elts;
+
+    while (dl->levels.nelts) {
+        (void) ngx_close_dir(&lv[--dl->levels.nelts].dir);
+    }
+
+    if (dl->stream && dl->stream->file.fd != NGX_INVALID_FILE) {
+        (void) ngx_close_file(dl->stream->file.fd);
+        dl->stream->file.fd = NGX_INVALID_FILE;
+    }
+
+    for (s = dl->busy; s; s = s->next) {
+        if (s->file.fd != NGX_INVALID_FILE) {
+            (void) ngx_close_file(s->file.fd);
+            s->file.fd = NGX_INVALID_FILE;
+        }
+    }
+}
+
+
+/* 关闭已发送完的条目的文件，并重用这些条目 */
+static void
+ngx_http_fancyindex_download_update(ngx_http_fancyindex_download_t *dl)
+{
+    ngx_http_fancyindex_download_slot_t  *s;
+
+    while ((s = dl->busy) != NULL) {
+        if (ngx_buf_size(&s->hdr) || ngx_buf_size(&s->data)
+            || ngx_buf_size(&s->pad))
+        {
+            break;
+        }
+
+        if (s->file.fd != NGX_INVALID_FILE) {
+            if (ngx_close_file(s->file.fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, s->file.log, ngx_errno,
+                              ngx_close_file_n " \"%V\" failed",
+                              &s->file.name);
+            }
+
+            s->file.fd = NGX_INVALID_FILE;
+            dl->nopen--;
+        }
+
+        dl->busy = s->next;
+        s->next = dl->free;
+        dl->free = s;
+    }
+
+    if (dl->busy == NULL)
+        dl->last_busy = &dl->busy;
+}
+
+
+/*
+ * 取得一个空闲的条目，复制当前的路径，并预留hsize字节的头部。头部的
+ * 内存只会变大，重用时不需要重新分配。
+ */
+static ngx_http_fancyindex_download_slot_t *
+ngx_http_fancyindex_download_slot(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl, size_t len, size_t hsize)
+{
+    ngx_http_fancyindex_download_slot_t  *s;
+
+    s = dl->free;
+
+    if (s != NULL) {
+        dl->free = s->next;
+
+    } else {
+        s = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_download_slot_t));
+        if (s == NULL)
+            return NULL;
+    }
+
+    s->next = NULL;
+
+    if (len + 1 + hsize > s->size) {
+        s->size = ngx_align(len + 1 + hsize, 512);
+        if ((s->mem = ngx_pnalloc(r->pool, s->size)) == NULL)
+            return NULL;
+    }
+
+    ngx_memcpy(s->mem, dl->path, len);
+    s->mem[len] = '\0';
+
+    ngx_memzero(&s->file, sizeof(ngx_file_t));
+    s->file.fd = NGX_INVALID_FILE;
+    s->file.name.len = len;
+    s->file.name.data = s->mem;
+    s->file.log = r->connection->log;
+
+    ngx_memzero(&s->hdr, sizeof(ngx_buf_t));
+    s->hdr.start = s->mem + len + 1;
+    s->hdr.pos = s->hdr.start;
+    s->hdr.last = s->hdr.start;
+    s->hdr.end = s->mem + s->size;
+    s->hdr.temporary = 1;
+
+    ngx_memzero(&s->data, sizeof(ngx_buf_t));
+    ngx_memzero(&s->pad, sizeof(ngx_buf_t));
+    s->pad.memory = 1;
+
+    return s;
+}
+
+
+/* 将条目的非空部分加入输出链，并计入归档长度 */
+static ngx_int_t
+ngx_http_fancyindex_download_link(ngx_http_fancyindex_download_t *dl,
+        ngx_http_fancyindex_download_slot_t *s, ngx_chain_t ***ll)
+{
+    ngx_uint_t   i, n;
+    ngx_buf_t   *b[3];
+
+    b[0] = &s->hdr;
+    b[1] = &s->data;
+    b[2] = &s->pad;
+
+    for (i = 0, n = 0; i < 3; i++) {
+        if (ngx_buf_size(b[i]) == 0)
+            continue;
+
+        dl->offset += ngx_buf_size(b[i]);
+
+        s->cl[n].buf = b[i];
+        s->cl[n].next = NULL;
+        **ll = &s->cl[n];
+        *ll = &s->cl[n].next;
+        n++;
+    }
+
+    *dl->last_busy = s;
+    dl->last_busy = &s->next;
+
+    if (s->file.fd != NGX_INVALID_FILE)
+        dl->nopen++;
+
+    return NGX_OK;
+}
+
+
+/* 写入n-1位八进制数和'\0' */
+static void
+ngx_http_fancyindex_tar_octal(u_char *p, size_t n, uint64_t v)
+{
+    p[--n] = '\0';
+
+    while (n--) {
+        p[n] = (u_char) ('0' + (v & 7));
+        v >>= 3;
+    }
+}
+
+
+/* 填写一个512字节的ustar头部，name不能超过100字节 */
+static void
+ngx_http_fancyindex_tar_block(u_char *h, u_char type, u_char *prefix,
+        size_t plen, u_char *name, size_t len, ngx_uint_t mode, off_t size,
+        time_t mtime)
+{
+    ngx_uint_t  i, sum;
+
+    ngx_memzero(h, 512);
+
+    ngx_memcpy(h, name, len);
+    ngx_http_fancyindex_tar_octal(h + 100, 8, mode);
+    ngx_http_fancyindex_tar_octal(h + 108, 8, 0);
+    ngx_http_fancyindex_tar_octal(h + 116, 8, 0);
+
+    /* 超过11位八进制数的大小使用GNU的base-256编码 */
+    if ((uint64_t) size > 077777777777ULL) {
+        h[124] = 0x80;
+        for (i = 0; i < 8; i++)
+            h[135 - i] = (u_char) ((uint64_t) size >> (8 * i));
+    } else {
+        ngx_http_fancyindex_tar_octal(h + 124, 12, (uint64_t) size);
+    }
+
+    ngx_http_fancyindex_tar_octal(h + 136, 12,
+                                  mtime > 0 ? (uint64_t) mtime : 0);
+    h[156] = type;
+    ngx_memcpy(h + 257, "ustar", 6);
+    ngx_memcpy(h + 263, "00", 2);
+    ngx_memcpy(h + 345, prefix, plen);
+
+    /* 计算校验和时校验和字段视为空格 */
+    ngx_memset(h + 148, ' ', 8);
+
+    for (i = 0, sum = 0; i < 512; i++)
+        sum += h[i];
+
+    ngx_http_fancyindex_tar_octal(h + 148, 7, sum);
+}
+
+
+/* 生成tar的条目头部。名称过长时使用GNU的长名称扩展。 */
+static void
+ngx_http_fancyindex_tar_header(ngx_buf_t *b, u_char *name, size_t len,
+        ngx_uint_t dir, ngx_uint_t mode, off_t size, time_t mtime)
+{
+    u_char  *p;
+    u_char   type = dir ? '5' : '0';
+
+    if (len <= 100) {
+        ngx_http_fancyindex_tar_block(b->last, type, NULL, 0, name, len,
+                                      mode, size, mtime);
+        b->last += 512;
+        return;
+    }
+
+    /* ustar：在'/'处分为最多155字节的前缀和最多100字节的名称 */
+    for (p = name + ngx_min(len - 1, 155); p > name; p--) {
+        if (*p != '/')
+            continue;
+
+        if (len - (p - name) - 1 > 100)
+            break;
+
+        if (len - (p - name) - 1 > 0) {
+            ngx_http_fancyindex_tar_block(b->last, type, name, p - name,
+                                          p + 1, len - (p - name) - 1,
+                                          mode, size, mtime);
+            b->last += 512;
+            return;
+        }
+    }
+
+    ngx_http_fancyindex_tar_block(b->last, 'L', NULL, 0,
+                                  (u_char *) "././@LongLink", 13, 0644,
+                                  len + 1, 0);
+    b->last += 512;
+
+    ngx_memzero(b->last, ngx_align(len + 1, 512));
+    ngx_memcpy(b->last, name, len);
+    b->last += ngx_align(len + 1, 512);
+
+    ngx_http_fancyindex_tar_block(b->last, type, NULL, 0, name, 100,
+                                  mode, size, mtime);
+    b->last += 512;
+}
+
+
+#define ngx_http_fancyindex_le16(p, v)                                        \
+    ((p)[0] = (u_char) (v), (p)[1] = (u_char) ((v) >> 8), (p) + 2)
+
+static ngx_inline u_char *
+ngx_http_fancyindex_le32(u_char *p, uint32_t v)
+{
+    p[0] = (u_char) v;
+    p[1] = (u_char) (v >> 8);
+    p[2] = (u_char) (v >> 16);
+    p[3] = (u_char) (v >> 24);
+    return p + 4;
+}
+
+static ngx_inline u_char *
+ngx_http_fancyindex_le64(u_char *p, uint64_t v)
+{
+    p = ngx_http_fancyindex_le32(p, (uint32_t) v);
+    return ngx_http_fancyindex_le32(p, (uint32_t) (v >> 32));
+}
+
+
+/* MS-DOS格式的修改时间，高16位为日期 */
+static uint32_t
+ngx_http_fancyindex_dos_time(time_t t)
+{
+    ngx_tm_t  tm;
+
+    ngx_gmtime(t, &tm);
+
+    if (tm.ngx_tm_year < 1980)
+        return (1 << 21) | (1 << 16);
+
+    return ((uint32_t) (tm.ngx_tm_year - 1980) << 25)
+         | ((uint32_t) tm.ngx_tm_mon << 21)
+         | ((uint32_t) tm.ngx_tm_mday << 16)
+         | ((uint32_t) tm.ngx_tm_hour << 11)
+         | ((uint32_t) tm.ngx_tm_min << 5)
+         | ((uint32_t) tm.ngx_tm_sec >> 1);
+}
+
+
+/* zip的本地文件头和中央目录都需要的数量 */
+#define NGX_HTTP_FANCYINDEX_ZIP_LOCAL    30
+#define NGX_HTTP_FANCYINDEX_ZIP_CENTRAL  46
+#define NGX_HTTP_FANCYINDEX_ZIP64        0xffffffffULL
+
+
+/* 将中央目录的缓冲区写入临时文件 */
+static ngx_int_t
+ngx_http_fancyindex_zip_flush(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl)
+{
+    ngx_buf_t                 *b = dl->cd;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (b->last == b->pos)
+        return NGX_OK;
+
+    if (dl->cd_file.fd == NGX_INVALID_FILE) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        dl->cd_file.log = r->connection->log;
+
+        if (ngx_create_temp_file(&dl->cd_file, clcf->client_body_temp_path,
+                                 r->pool, 0, 1, NGX_FILE_OWNER_ACCESS)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_write_file(&dl->cd_file, b->pos, b->last - b->pos, dl->cd_size)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    dl->cd_size += b->last - b->pos;
+    b->last = b->pos;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 在中央目录中加入条目的记录，offset为本地文件头的偏移。超过4GB的大小和
+ * 偏移使用zip64扩展字段。
+ */
+static ngx_int_t
+ngx_http_fancyindex_zip_central(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl, u_char *name, size_t len,
+        ngx_uint_t dir, ngx_uint_t mode, off_t size, time_t mtime,
+        uint32_t crc, off_t local, ngx_uint_t flags)
+{
+    u_char    *p;
+    uint32_t   dos;
+    uint64_t   usize, offset;
+    ngx_uint_t big, far, version, extra;
+
+    dos = ngx_http_fancyindex_dos_time(mtime);
+    usize = (uint64_t) size;
+    offset = (uint64_t) local;
+    big = (usize >= NGX_HTTP_FANCYINDEX_ZIP64);
+    far = (offset >= NGX_HTTP_FANCYINDEX_ZIP64);
+    version = (big || far) ? 45 : ((dir || (flags & 0x0008)) ? 20 : 10);
+    extra = (big ? 16 : 0) + (far ? 8 : 0);
+
+    if ((size_t) (dl->cd->end - dl->cd->last)
+        < NGX_HTTP_FANCYINDEX_ZIP_CENTRAL + len + 4 + extra
+        && ngx_http_fancyindex_zip_flush(r, dl) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    p = dl->cd->last;
+    p = ngx_http_fancyindex_le32(p, 0x02014b50);
+    p = ngx_http_fancyindex_le16(p, (3 << 8) | 45); /* Unix */
+    p = ngx_http_fancyindex_le16(p, version);
+    p = ngx_http_fancyindex_le16(p, flags);
+    p = ngx_http_fancyindex_le16(p, 0);
+    p = ngx_http_fancyindex_le16(p, dos);
+    p = ngx_http_fancyindex_le16(p, dos >> 16);
+    p = ngx_http_fancyindex_le32(p, crc);
+    p = ngx_http_fancyindex_le32(p, big ? 0xffffffff : (uint32_t) usize);
+    p = ngx_http_fancyindex_le32(p, big ? 0xffffffff : (uint32_t) usize);
+    p = ngx_http_fancyindex_le16(p, len);
+    p = ngx_http_fancyindex_le16(p, extra ? extra + 4 : 0);
+    p = ngx_http_fancyindex_le16(p, 0);             /* 注释 */
+    p = ngx_http_fancyindex_le16(p, 0);             /* 磁盘 */
+    p = ngx_http_fancyindex_le16(p, 0);             /* 内部属性 */
+    p = ngx_http_fancyindex_le32(p, ((uint32_t) (mode | (dir ? 0040000
+                                                                : 0100000))
+                                     << 16) | (dir ? 0x10 : 0));
+    p = ngx_http_fancyindex_le32(p, far ? 0xffffffff : (uint32_t) offset);
+    p = ngx_cpymem(p, name, len);
+
+    if (extra) {
+        p = ngx_http_fancyindex_le16(p, 0x0001);
+        p = ngx_http_fancyindex_le16(p, extra);
+        if (big) {
+            p = ngx_http_fancyindex_le64(p, usize);
+            p = ngx_http_fancyindex_le64(p, usize);
+        }
+        if (far)
+            p = ngx_http_fancyindex_le64(p, offset);
+    }
+
+    dl->cd->last = p;
+    dl->entries++;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 生成zip（store模式）的本地文件头。stream时大小和CRC-32在内容之后的
+ * 数据描述符中，本地文件头中为0；其他条目（目录和空文件）同时在中央目录
+ * 中加入对应的记录。
+ */
+static ngx_int_t
+ngx_http_fancyindex_zip_header(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl, ngx_buf_t *b, u_char *name,
+        size_t len, ngx_uint_t dir, ngx_uint_t mode, off_t size, time_t mtime,
+        uint32_t crc, ngx_uint_t stream)
+{
+    u_char    *p;
+    uint32_t   dos;
+    uint64_t   usize;
+    ngx_uint_t big, far, version, flags;
+
+    dos = ngx_http_fancyindex_dos_time(mtime);
+    usize = stream ? 0 : (uint64_t) size;
+    big = ((uint64_t) size >= NGX_HTTP_FANCYINDEX_ZIP64);
+    far = ((uint64_t) dl->offset >= NGX_HTTP_FANCYINDEX_ZIP64);
+    version = (big || far) ? 45 : ((dir || stream) ? 20 : 10);
+    flags = stream ? 0x0808 : 0x0800;               /* 名称为UTF-8 */
+
+    p = b->last;
+    p = ngx_http_fancyindex_le32(p, 0x04034b50);
+    p = ngx_http_fancyindex_le16(p, version);
+    p = ngx_http_fancyindex_le16(p, flags);
+    p = ngx_http_fancyindex_le16(p, 0);             /* store */
+    p = ngx_http_fancyindex_le16(p, dos);
+    p = ngx_http_fancyindex_le16(p, dos >> 16);
+    p = ngx_http_fancyindex_le32(p, crc);
+    p = ngx_http_fancyindex_le32(p, big ? 0xffffffff : (uint32_t) usize);
+    p = ngx_http_fancyindex_le32(p, big ? 0xffffffff : (uint32_t) usize);
+    p = ngx_http_fancyindex_le16(p, len);
+    p = ngx_http_fancyindex_le16(p, big ? 20 : 0);
+    p = ngx_cpymem(p, name, len);
+
+    if (big) {
+        p = ngx_http_fancyindex_le16(p, 0x0001);
+        p = ngx_http_fancyindex_le16(p, 16);
+        p = ngx_http_fancyindex_le64(p, usize);
+        p = ngx_http_fancyindex_le64(p, usize);
+    }
+
+    b->last = p;
+
+    if (stream)
+        return NGX_OK;
+
+    return ngx_http_fancyindex_zip_central(r, dl, name, len, dir, mode, size,
+                                           mtime, crc, dl->offset, flags);
+}
+
+
+/* 归档的结尾：tar为两个空的块，zip为中央目录和目录结束记录 */
+static ngx_int_t
+ngx_http_fancyindex_download_trailer(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl, ngx_chain_t ***ll)
+{
+    u_char       *p;
+    uint64_t      cd_offset, cd_size;
+    ngx_buf_t    *b, *f;
+    ngx_chain_t  *cl;
+
+    if ((b = ngx_calloc_buf(r->pool)) == NULL)
+        return NGX_ERROR;
+
+    b->last_buf = (r == r->main);
+    b->last_in_chain = 1;
+
+    if (dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR) {
+        b->pos = ngx_http_fancyindex_zeros;
+        b->last = ngx_http_fancyindex_zeros + 1024;
+        b->memory = 1;
+        goto last;
+    }
+
+    cd_offset = (uint64_t) dl->offset;
+
+    if (dl->cd_file.fd != NGX_INVALID_FILE) {
+        if (ngx_http_fancyindex_zip_flush(r, dl) != NGX_OK)
+            return NGX_ERROR;
+
+        if ((f = ngx_calloc_buf(r->pool)) == NULL)
+            return NGX_ERROR;
+
+        f->in_file = 1;
+        f->file = &dl->cd_file;
+        f->file_pos = 0;
+        f->file_last = dl->cd_size;
+
+    } else {
+        f = dl->cd;
+        dl->cd_size = f->last - f->pos;
+    }
+
+    cd_size = (uint64_t) dl->cd_size;
+
+    if (cd_size) {
+        if ((cl = ngx_alloc_chain_link(r->pool)) == NULL)
+            return NGX_ERROR;
+
+        cl->buf = f;
+        cl->next = NULL;
+        **ll = cl;
+        *ll = &cl->next;
+    }
+
+    /* zip64目录结束记录(56)和定位器(20)，目录结束记录(22) */
+    if ((b->start = ngx_palloc(r->pool, 56 + 20 + 22)) == NULL)
+        return NGX_ERROR;
+
+    p = b->start;
+
+    if (dl->entries >= 0xffff || cd_size >= NGX_HTTP_FANCYINDEX_ZIP64
+        || cd_offset >= NGX_HTTP_FANCYINDEX_ZIP64)
+    {
+        p = ngx_http_fancyindex_le32(p, 0x06064b50);
+        p = ngx_http_fancyindex_le64(p, 44);
+        p = ngx_http_fancyindex_le16(p, (3 << 8) | 45);
+        p = ngx_http_fancyindex_le16(p, 45);
+        p = ngx_http_fancyindex_le32(p, 0);
+        p = ngx_http_fancyindex_le32(p, 0);
+        p = ngx_http_fancyindex_le64(p, dl->entries);
+        p = ngx_http_fancyindex_le64(p, dl->entries);
+        p = ngx_http_fancyindex_le64(p, cd_size);
+        p = ngx_http_fancyindex_le64(p, cd_offset);
+
+        p = ngx_http_fancyindex_le32(p, 0x07064b50);
+        p = ngx_http_fancyindex_le32(p, 0);
+        p = ngx_http_fancyindex_le64(p, cd_offset + cd_size);
+        p = ngx_http_fancyindex_le32(p, 1);
+    }
+
+    p = ngx_http_fancyindex_le32(p, 0x06054b50);
+    p = ngx_http_fancyindex_le16(p, 0);
+    p = ngx_http_fancyindex_le16(p, 0);
+    p = ngx_http_fancyindex_le16(p, ngx_min(dl->entries, 0xffff));
+    p = ngx_http_fancyindex_le16(p, ngx_min(dl->entries, 0xffff));
+    p = ngx_http_fancyindex_le32(p, (uint32_t) ngx_min(cd_size, 0xffffffff));
+    p = ngx_http_fancyindex_le32(p, (uint32_t) ngx_min(cd_offset, 0xffffffff));
+    p = ngx_http_fancyindex_le16(p, 0);
+
+    b->pos = b->start;
+    b->last = p;
+    b->end = b->start + 56 + 20 + 22;
+    b->temporary = 1;
+
+last:
+
+    if ((cl = ngx_alloc_chain_link(r->pool)) == NULL)
+        return NGX_ERROR;
+
+    cl->buf = b;
+    cl->next = NULL;
+    **ll = cl;
+    *ll = &cl->next;
+
+    dl->done = 1;
+
+    return NGX_OK;
+}
+
+
+/* 生成一个条目的头部，文件条目的文件已经打开 */
+static ngx_int_t
+ngx_http_fancyindex_download_entry(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl,
+        ngx_http_fancyindex_download_slot_t *s, ngx_file_info_t *fi,
+        ngx_uint_t dir, ngx_chain_t ***ll)
+{
+    u_char      *name;
+    size_t       len, n;
+    off_t        size;
+    ngx_uint_t   mode;
+
+    /* 归档中的名称，目录以'/'结尾 */
+    name = s->mem + dl->prefix;
+    len = s->file.name.len - dl->prefix;
+    mode = ngx_file_access(fi);
+    size = dir ? 0 : ngx_file_size(fi);
+
+    if (dir)
+        name[len++] = '/';
+
+    if (dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR) {
+        ngx_http_fancyindex_tar_header(&s->hdr, name, len, dir, mode, size,
+                                       ngx_file_mtime(fi));
+    } else if (ngx_http_fancyindex_zip_header(r, dl, &s->hdr, name, len, dir,
+                                              mode, size, ngx_file_mtime(fi),
+                                              0, 0)
+               != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (dir)
+        name[--len] = '\0';
+
+    if (size) {
+        s->data.in_file = 1;
+        s->data.file = &s->file;
+        s->data.file_pos = 0;
+        s->data.file_last = size;
+
+        /* tar的数据按512字节对齐 */
+        n = (size_t) (size & 511);
+        if (dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR && n) {
+            s->pad.pos = ngx_http_fancyindex_zeros;
+            s->pad.last = ngx_http_fancyindex_zeros + 512 - n;
+        }
+    }
+
+    return ngx_http_fancyindex_download_link(dl, s, ll);
+}
+
+
+
+#if (NGX_THREADS)
+
+/*
+ * zip：在线程池中将文件的下一部分读入dl->chunk中的块，并更新CRC-32。
+ * 读到文件的结尾（或者文件被截短）时设置stream_eof。
+ */
+static void
+ngx_http_fancyindex_download_read_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_download_t  *dl = data;
+
+    off_t                                 size;
+    ssize_t                               n;
+    ngx_uint_t                            i;
+    ngx_http_fancyindex_download_slot_t  *s = dl->stream, *c;
+
+    size = ngx_file_size(&s->info);
+
+    for (i = 0; i < dl->nchunks; i++) {
+        c = dl->chunk[i];
+
+        n = pread(s->file.fd, c->hdr.last,
+                  (size_t) ngx_min(size - dl->stream_offset,
+                                   NGX_HTTP_FANCYINDEX_DOWNLOAD_BUFFER),
+                  dl->stream_offset);
+
+        if (n == -1) {
+            dl->read_err = ngx_errno;
+            return;
+        }
+
+        ngx_crc32_update(&s->crc, c->hdr.last, n);
+        c->hdr.last += n;
+        dl->stream_offset += n;
+        dl->nread = i + 1;
+
+        if (n == 0 || dl->stream_offset >= size) {
+            dl->stream_eof = 1;
+            return;
+        }
+    }
+}
+
+
+/* 读取完成，与ngx_http_upstream_thread_event_handler()一样继续发送 */
+static void
+ngx_http_fancyindex_download_read_done(ngx_event_t *ev)
+{
+    ngx_http_request_t  *r = ev->data;
+    ngx_connection_t    *c = r->connection;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * zip：在线程池中读取文件的下一部分，最多DOWNLOAD_CHUNKS块。第一块之前
+ * 是本地文件头。读取期间返回NGX_AGAIN，r->aio为1，完成后再次调用写事件
+ * 处理函数。
+ */
+static ngx_int_t
+ngx_http_fancyindex_download_read(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl)
+{
+    u_char                               *name;
+    size_t                                len;
+    off_t                                 size;
+    ngx_uint_t                            i, n;
+    ngx_http_fancyindex_download_slot_t  *s = dl->stream, *c;
+    ngx_http_fancyindex_main_conf_t      *mcf;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+    size = ngx_file_size(&s->info);
+    name = s->mem + dl->prefix;
+    len = s->file.name.len - dl->prefix;
+
+    if (dl->task == NULL) {
+        dl->task = ngx_thread_task_alloc(r->pool, 0);
+        if (dl->task == NULL)
+            return NGX_ERROR;
+
+        dl->task->ctx = dl;
+        dl->task->handler = ngx_http_fancyindex_download_read_thread;
+        dl->task->event.handler = ngx_http_fancyindex_download_read_done;
+        dl->task->event.data = r;
+        dl->task->event.log = r->connection->log;
+    }
+
+    n = (ngx_uint_t) ((size - dl->stream_offset
+                       + NGX_HTTP_FANCYINDEX_DOWNLOAD_BUFFER - 1)
+                      / NGX_HTTP_FANCYINDEX_DOWNLOAD_BUFFER);
+    n = ngx_max(1, ngx_min(n, NGX_HTTP_FANCYINDEX_DOWNLOAD_CHUNKS));
+
+    /* 每块之后预留数据描述符的空间 */
+    for (i = 0; i < n; i++) {
+        c = ngx_http_fancyindex_download_slot(r, dl, 0,
+                NGX_HTTP_FANCYINDEX_ZIP_LOCAL + len + 20
+                + NGX_HTTP_FANCYINDEX_DOWNLOAD_BUFFER + 24);
+        if (c == NULL)
+            return NGX_ERROR;
+
+        dl->chunk[i] = c;
+    }
+
+    if (dl->stream_offset == 0) {
+        dl->stream_local = dl->offset;
+
+        if (ngx_http_fancyindex_zip_header(r, dl, &dl->chunk[0]->hdr, name,
+                                           len, 0, 0, size,
+                                           ngx_file_mtime(&s->info), 0, 1)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    dl->nchunks = n;
+    dl->nread = 0;
+    dl->read_err = 0;
+
+    if (ngx_thread_task_post(mcf->thread_pool, dl->task) != NGX_OK)
+        return NGX_ERROR;
+
+    /* 线程使用请求的内存，完成前不能释放请求 */
+    r->main->blocked++;
+    r->aio = 1;
+    dl->reading = 1;
+
+    return NGX_AGAIN;
+}
+
+#endif /* NGX_THREADS */
+
+
+/*
+ * zip：发送在线程池中读取的块，CRC-32已在读取时计算。文件读完后在最后
+ * 一块之后加入数据描述符，其中的大小和CRC-32与发送的内容一致，因此读取
+ * 期间文件发生变化时归档仍然有效。文件未读完时返回NGX_AGAIN。
+ */
+static ngx_int_t
+ngx_http_fancyindex_download_stream(ngx_http_request_t *r,
+        ngx_http_fancyindex_download_t *dl, ngx_chain_t ***ll)
+{
+#if (NGX_THREADS)
+    u_char                               *name, *p;
+    size_t                                len;
+    off_t                                 size;
+    ngx_uint_t                            i, big;
+    ngx_http_fancyindex_download_slot_t  *s = dl->stream, *c;
+
+    if (!dl->reading)
+        return ngx_http_fancyindex_download_read(r, dl);
+
+    dl->reading = 0;
+
+    if (dl->read_err) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, dl->read_err,
+                      "pread() \"%V\" failed", &s->file.name);
+        return NGX_ERROR;
+    }
+
+    /* 未使用的块 */
+    for (i = dl->nread; i < dl->nchunks; i++) {
+        dl->chunk[i]->next = dl->free;
+        dl->free = dl->chunk[i];
+    }
+
+    for (i = 0; i + 1 < dl->nread; i++) {
+        if (ngx_http_fancyindex_download_link(dl, dl->chunk[i], ll) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    c = dl->chunk[dl->nread - 1];
+
+    if (!dl->stream_eof)
+        return ngx_http_fancyindex_download_link(dl, c, ll) == NGX_OK
+               ? NGX_AGAIN : NGX_ERROR;
+
+    size = ngx_file_size(&s->info);
+    name = s->mem + dl->prefix;
+    len = s->file.name.len - dl->prefix;
+    big = ((uint64_t) size >= NGX_HTTP_FANCYINDEX_ZIP64);
+
+    if (dl->stream_offset < size) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "fancyindex: \"%V\" was truncated while reading",
+                      &s->file.name);
+    }
+
+    /* 数据描述符，本地文件头中有zip64扩展字段时大小为8字节 */
+    ngx_crc32_final(s->crc);
+
+    p = c->hdr.last;
+    p = ngx_http_fancyindex_le32(p, 0x08074b50);
+    p = ngx_http_fancyindex_le32(p, s->crc);
+
+    if (big) {
+        p = ngx_http_fancyindex_le64(p, (uint64_t) dl->stream_offset);
+        p = ngx_http_fancyindex_le64(p, (uint64_t) dl->stream_offset);
+    } else {
+        p = ngx_http_fancyindex_le32(p, (uint32_t) dl->stream_offset);
+        p = ngx_http_fancyindex_le32(p, (uint32_t) dl->stream_offset);
+    }
+
+    c->hdr.last = p;
+
+    if (ngx_http_fancyindex_zip_central(r, dl, name, len, 0,
+                                        ngx_file_access(&s->info),
+                                        dl->stream_offset,
+                                        ngx_file_mtime(&s->info), s->crc,
+                                        dl->stream_local, 0x0808)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_close_file(s->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &s->file.name);
+    }
+
+    s->file.fd = NGX_INVALID_FILE;
+    s->next = dl->free;
+    dl->free = s;
+    dl->stream = NULL;
+    dl->stream_eof = 0;
+
+    return ngx_http_fancyindex_download_link(dl, c, ll);
+#else
+    /* "fancyindex_download zip"需要线程池 */
+    return NGX_ERROR;
+#endif
+}
+
+
+/*
+ * 生成下一批条目，加入*out。打开的文件达到DOWNLOAD_FILES个时停止，等待
+ * 这些文件发送完。所有目录读完后加入归档的结尾。
+ */
+static ngx_int_t
+ngx_http_fancyindex_download_next(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf,
+        ngx_http_fancyindex_download_t *dl, ngx_chain_t **out)
+{
+    u_char                               *name, *p;
+    size_t                                len, plen;
+    ngx_int_t                             rc;
+    ngx_err_t                             err;
+    ngx_str_t                             path;
+    ngx_uint_t                            n, link;
+    ngx_chain_t                         **ll;
+    ngx_http_fancyindex_download_slot_t  *s;
+    ngx_http_fancyindex_level_t          *lv;
+
+    ll = out;
+
+    /* 下载的目录本身，下载根目录时归档中的名称为相对路径 */
+    if (!dl->started) {
+        dl->started = 1;
+        lv = dl->levels.elts;
+
+        if (dl->prefix < lv->len) {
+            s = ngx_http_fancyindex_download_slot(r, dl, lv->len,
+                    1024 + ngx_align(lv->len - dl->prefix + 2, 512));
+            if (s == NULL)
+                return NGX_ERROR;
+
+            s->info = dl->info;
+            s->crc = 0;
+
+            if (ngx_http_fancyindex_download_entry(r, dl, s, &s->info, 1, &ll)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    for (n = 0; n < NGX_HTTP_FANCYINDEX_DOWNLOAD_ENTRIES; n++) {
+        if (dl->stream) {
+            rc = ngx_http_fancyindex_download_stream(r, dl, &ll);
+            if (rc == NGX_AGAIN)
+                break;
+            if (rc == NGX_ERROR)
+                return NGX_ERROR;
+            continue;
+        }
+
+        if (dl->nopen >= NGX_HTTP_FANCYINDEX_DOWNLOAD_FILES)
+            break;
+
+        if (dl->levels.nelts == 0)
+            return ngx_http_fancyindex_download_trailer(r, dl, &ll);
+
+        lv = (ngx_http_fancyindex_level_t *) dl->levels.elts
+             + dl->levels.nelts - 1;
+
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(&lv->dir) == NGX_ERROR) {
+            err = ngx_errno;
+            dl->path[lv->len] = '\0';
+
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                              ngx_read_dir_n " \"%s\" failed", dl->path);
+                return NGX_ERROR;
+            }
+
+            if (ngx_close_dir(&lv->dir) == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                              ngx_close_dir_n " \"%s\" failed", dl->path);
+            }
+
+            dl->levels.nelts--;
+            continue;
+        }
+
+        name = ngx_de_name(&lv->dir);
+        len = ngx_de_namelen(&lv->dir);
+
+        if (name[0] == '.'
+            && (len == 1 || (len == 2 && name[1] == '.')))
+        {
+            continue;
+        }
+
+        /* 与目录列表使用相同的过滤条件 */
+        if (!alcf->show_dot_files && name[0] == '.')
+            continue;
+
+        if (alcf->ignore && ngx_http_fancyindex_ignored(r, alcf, name, len))
+            continue;
+
+        /* 1字节用于'/'，1字节用于终止符'\0' */
+        plen = lv->len + 1 + len;
+
+        if (plen + 1 > dl->allocated) {
+            dl->allocated = plen + 1 + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+            if ((p = ngx_pnalloc(r->pool, dl->allocated)) == NULL)
+                return NGX_ERROR;
+
+            ngx_memcpy(p, dl->path, lv->len);
+            dl->path = p;
+        }
+
+        dl->path[lv->len] = '/';
+        ngx_memcpy(dl->path + lv->len + 1, name, len);
+        dl->path[plen] = '\0';
+
+        /*
+         * 文件系统不提供条目的类型时，ngx_de_is_link()使用的是lv->dir.info，
+         * 需要先通过lstat()获取
+         */
+        if (!lv->dir.type
+            && ngx_de_link_info(dl->path, &lv->dir) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                          ngx_de_link_info_n " \"%s\" failed", dl->path);
+            continue;
+        }
+
+        link = ngx_de_is_link(&lv->dir);
+
+        if (alcf->hide_symlinks && link)
+            continue;
+
+        /* 符号链接使用目标的信息，失效的链接被跳过 */
+        if (ngx_de_info(dl->path, &lv->dir) == NGX_FILE_ERROR) {
+            err = ngx_errno;
+
+            if (err != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
+                              ngx_de_info_n " \"%s\" failed", dl->path);
+            }
+            continue;
+        }
+
+        if (!ngx_is_dir(&lv->dir.info) && !ngx_is_file(&lv->dir.info))
+            continue;
+
+        s = ngx_http_fancyindex_download_slot(r, dl, plen,
+                1024 + ngx_align(plen - dl->prefix + 2, 512));
+        if (s == NULL)
+            return NGX_ERROR;
+
+        s->info = lv->dir.info;
+        s->crc = 0;
+
+        if (ngx_is_dir(&s->info)) {
+            if (ngx_http_fancyindex_download_entry(r, dl, s, &s->info, 1, &ll)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            /* 不进入指向目录的符号链接，避免循环 */
+            if (link)
+                continue;
+
+            if (dl->levels.nelts >= NGX_HTTP_FANCYINDEX_DOWNLOAD_DEPTH) {
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                              "fancyindex: \"%s\" is nested too deeply, "
+                              "its contents are not archived", dl->path);
+                continue;
+            }
+
+            if ((lv = ngx_array_push(&dl->levels)) == NULL)
+                return NGX_ERROR;
+
+            path.len = plen;
+            path.data = dl->path;
+
+            if (ngx_open_dir(&path, &lv->dir) == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                              ngx_open_dir_n " \"%s\" failed", dl->path);
+                dl->levels.nelts--;
+                continue;
+            }
+
+            lv->len = plen;
+            continue;
+        }
+
+        if (ngx_file_size(&s->info) > 0) {
+            s->file.fd = ngx_open_file(s->mem, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                                       NGX_FILE_OPEN, 0);
+
+            if (s->file.fd == NGX_INVALID_FILE) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                              ngx_open_file_n " \"%s\" failed", s->mem);
+                s->next = dl->free;
+                dl->free = s;
+                continue;
+            }
+
+            if (dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_ZIP) {
+                ngx_crc32_init(s->crc);
+                dl->stream = s;
+                dl->stream_offset = 0;
+                continue;
+            }
+        }
+
+        if (ngx_http_fancyindex_download_entry(r, dl, s, &s->info, 0, &ll)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * 写事件处理函数，与ngx_http_writer()类似：上一批数据发送完后才生成下一
+ * 批，因此内存和打开的文件数有上限。
+ */
+static void
+ngx_http_fancyindex_download_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                        rc;
+    ngx_event_t                     *wev;
+    ngx_chain_t                     *out;
+    ngx_connection_t                *c;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_fancyindex_ctx_t       *ctx;
+    ngx_http_fancyindex_download_t  *dl;
+
+    c = r->connection;
+    wev = c->write;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    dl = ctx->archive;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed || r->aio) {
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+            ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    out = NULL;
+
+    if (!dl->done
+        && ngx_http_fancyindex_download_next(r,
+               ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module),
+               dl, &out) != NGX_OK)
+    {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    rc = ngx_http_output_filter(r, out);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    ngx_http_fancyindex_download_update(dl);
+
+    if (r->buffered || r->postponed || (r == r->main && c->buffered)) {
+        if (!wev->delayed)
+            ngx_add_timer(wev, clcf->send_timeout);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+            ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (wev->timer_set)
+        ngx_del_timer(wev);
+
+    if (dl->done) {
+        r->write_event_handler = ngx_http_request_empty_handler;
+        ngx_http_finalize_request(r, NGX_OK);
+        return;
+    }
+
+    /* 线程池中的读取完成后继续 */
+    if (r->aio)
+        return;
+
+    /* 已全部发送，让出事件循环后继续 */
+#if defined(nginx_version) && (nginx_version >= 1017005)
+    ngx_post_event(wev, &ngx_posted_next_events);
+#else
+    ngx_post_event(wev, &ngx_posted_events);
+#endif
+}
+
+
+/* "download"参数：以tar或zip格式发送整个目录 */
+static ngx_int_t
+ngx_http_fancyindex_download(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    u_char                               *p, *base;
+    size_t                                len;
+    ngx_int_t                             rc;
+    ngx_err_t                             err;
+    ngx_str_t                             path;
+    ngx_table_elt_t                      *h;
+    ngx_pool_cleanup_t                   *cln;
+    ngx_http_fancyindex_download_t       *dl;
+    ngx_http_fancyindex_level_t          *lv;
+
+    if (ngx_http_discard_request_body(r) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    dl = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_download_t));
+    if (dl == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    dl->format = ctx->download;
+    dl->last_busy = &dl->busy;
+    dl->cd_file.fd = NGX_INVALID_FILE;
+    ctx->archive = dl;
+
+    if (ngx_http_fancyindex_map_path(r, &path, &dl->allocated) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    dl->path = path.data;
+
+    if (ngx_array_init(&dl->levels, r->pool, 8,
+                       sizeof(ngx_http_fancyindex_level_t)) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    cln->handler = ngx_http_fancyindex_download_cleanup;
+    cln->data = dl;
+
+    lv = ngx_array_push(&dl->levels);
+
+    if (ngx_open_dir(&path, &lv->dir) == NGX_ERROR) {
+        err = ngx_errno;
+        dl->levels.nelts = 0;
+
+        return ngx_http_fancyindex_dir_error(r, alcf, err, ngx_open_dir_n,
+                                             path.data);
+    }
+
+    lv->len = path.len;
+
+    if (ngx_file_info(path.data, &dl->info) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_file_info_n " \"%s\" failed", path.data);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* 归档中的名称以目录名开头，根目录中的条目直接放在归档的顶层 */
+    if (r->uri.len == 1) {
+        dl->prefix = path.len + 1;
+        base = (u_char *) "download";
+        len = ngx_sizeof_ssz("download");
+
+    } else {
+        for (p = path.data + path.len; p > path.data && p[-1] != '/'; p--)
+            /* void */ ;
+
+        dl->prefix = p - path.data;
+        base = p;
+        len = path.data + path.len - p;
+    }
+
+    if (dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_ZIP) {
+        dl->cd = ngx_create_temp_buf(r->pool,
+                                     NGX_HTTP_FANCYINDEX_DOWNLOAD_BUFFER);
+        if (dl->cd == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+
+    if (dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR) {
+        r->headers_out.content_type_len  = ngx_sizeof_ssz("application/x-tar");
+        r->headers_out.content_type.len  = ngx_sizeof_ssz("application/x-tar");
+        r->headers_out.content_type.data = (u_char *) "application/x-tar";
+    } else {
+        r->headers_out.content_type_len  = ngx_sizeof_ssz("application/zip");
+        r->headers_out.content_type.len  = ngx_sizeof_ssz("application/zip");
+        r->headers_out.content_type.data = (u_char *) "application/zip";
+    }
+
+    /* 文件名按RFC 6266编码 */
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    h->value.data = ngx_pnalloc(r->pool,
+            ngx_sizeof_ssz("attachment; filename*=UTF-8''.tar")
+            + len + 2 * ngx_fancyindex_escape_filename(NULL, base, len));
+    if (h->value.data == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    p = ngx_cpymem(h->value.data, "attachment; filename*=UTF-8''",
+                   ngx_sizeof_ssz("attachment; filename*=UTF-8''"));
+    p = (u_char *) ngx_fancyindex_escape_filename(p, base, len);
+    p = ngx_cpymem(p, dl->format == NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR
+                      ? ".tar" : ".zip", 4);
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Content-Disposition");
+    h->value.len = p - h->value.data;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_fancyindex_download_handler;
+
+    ngx_http_fancyindex_download_handler(r);
+
+    return NGX_DONE;
+}
+
+
+/* 解码并转为小写文件名的匹配条件 */
+static void
+ngx_http_fancyindex_parse_query(ngx_http_request_t *r, ngx_str_t *value,
+        ngx_http_fancyindex_filter_t *filter)
+{
+    u_char     *p;
+    ngx_str_t  *q;
+
+    q = &filter->query;
+
+    if ((q->data = ngx_pnalloc(r->pool, value->len + 1)) == NULL)
+        return;
+
+    p = q->data;
+    ngx_unescape_uri(&p, &value->data, value->len, NGX_UNESCAPE_URI);
+    *p = '\0';
+
+    q->len = p - q->data;
+    ngx_strlow(q->data, q->data, q->len);
+
+    filter->glob = (ngx_strlchr(q->data, p, '*') != NULL
+                    || ngx_strlchr(q->data, p, '?') != NULL
+                    || ngx_strlchr(q->data, p, '[') != NULL);
+
+    /* 第一个通配符或转义符之前的部分按字面匹配 */
+    filter->prefix = q->len;
+    filter->exact = 1;
+
+    for (p = q->data; p < q->data + q->len; p++) {
+        if (filter->prefix == q->len
+            && (*p == '*' || *p == '?' || *p == '[' || *p == '\\'))
+        {
+            filter->prefix = p - q->data;
+        }
+
+        if (*p >= 'a' && *p <= 'z')
+            filter->exact = 0;
+    }
+}
+
+
+/*
+ * 解析"since"、"q"、"search"、"recent"、"format"和"download"参数，无效的
+ * 值被忽略。"format=sha256sum"只在设置了fancyindex_checksums时有效，
+ * "download"只接受fancyindex_download允许的格式。
+ */
+static void
+ngx_http_fancyindex_parse_args(ngx_http_request_t *r,
+        ngx_http_fancyindex_ctx_t *ctx)
+{
+    time_t     since;
+    ngx_int_t  n;
+    ngx_str_t  value;
+    ngx_http_fancyindex_loc_conf_t  *alcf;
+
+    if (r->args.len == 0)
+        return;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (ngx_http_arg(r, (u_char *) "since", 5, &value) == NGX_OK) {
+        since = ngx_atotm(value.data, value.len);
+
+        if (since != NGX_ERROR) {
+            ctx->filter.since = since;
+            ctx->filter.delta = 1;
+        }
+    }
+
+    /* "search"在整个子树中查找，没有索引时与"q"相同 */
+    if (ngx_http_arg(r, (u_char *) "search", 6, &value) == NGX_OK
+        && value.len)
+    {
+        ngx_http_fancyindex_parse_query(r, &value, &ctx->filter);
+        ctx->filter.search = (ctx->filter.query.len != 0);
+
+    } else if (ngx_http_arg(r, (u_char *) "q", 1, &value) == NGX_OK
+               && value.len)
+    {
+        ngx_http_fancyindex_parse_query(r, &value, &ctx->filter);
+    }
+
+    if (ngx_http_arg(r, (u_char *) "recent", 6, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n > 0)
+            ctx->filter.recent = n;
+    }
+
+#if (NGX_HTTP_FANCYINDEX_JSON)
+    if (ngx_http_arg(r, (u_char *) "format", 6, &value) == NGX_OK
+        && value.len == 4 && ngx_strncmp(value.data, "json", 4) == 0)
+    {
+        ctx->json = 1;
+    }
+#endif
+
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    if (alcf->checksums
+        && ngx_http_arg(r, (u_char *) "format", 6, &value) == NGX_OK
+        && value.len == 9 && ngx_strncmp(value.data, "sha256sum", 9) == 0)
+    {
+        ctx->sha256sum = 1;
+    }
+#endif
+
+    if (ngx_http_arg(r, (u_char *) "download", 8, &value) == NGX_OK
+        && value.len == 3)
+    {
+        if (ngx_strncmp(value.data, "tar", 3) == 0)
+            n = NGX_HTTP_FANCYINDEX_DOWNLOAD_TAR;
+        else if (ngx_strncmp(value.data, "zip", 3) == 0)
+            n = NGX_HTTP_FANCYINDEX_DOWNLOAD_ZIP;
+        else
+            n = 0;
+
+        if (n && (alcf->download & ngx_http_fancyindex_download_mask(n)))
+            ctx->download = n;
+    }
+}
+
+
+/* 等待期间请求结束时删除定时器和尚未处理的事件 */
+static void
+ngx_http_fancyindex_wait_cleanup(void *data)
+{
+    ngx_event_t  *ev = data;
+
+    if (ev->timer_set)
+        ngx_del_timer(ev);
+
+    if (ev->posted)
+        ngx_delete_posted_event(ev);
+}
+
+
+/*
+ * 安排再次调用ngx_http_fancyindex_wait_handler()：分片生成列表时让出事件
+ * 循环后尽快继续，等待读取锁时定时重试。并行获取条目信息时由最后完成的
+ * 任务投递事件。
+ */
+static void
+ngx_http_fancyindex_wait(ngx_http_fancyindex_ctx_t *ctx)
+{
+    if (ctx->scan.waiting || ctx->sorting || ctx->summing)
+        return;
+
+    if (!ctx->yield) {
+        ngx_add_timer(&ctx->wait, NGX_HTTP_FANCYINDEX_LOCK_WAIT);
+        return;
+    }
+
+    ctx->yield = 0;
+
+#if defined(nginx_version) && (nginx_version >= 1017005)
+    /* 放入下一轮事件循环，先处理已就绪的其他连接 */
+    ngx_post_event(&ctx->wait, &ngx_posted_next_events);
+#else
+    ngx_add_timer(&ctx->wait, 1);
+#endif
+}
+
+
+/* 重新尝试生成目录列表，其他请求仍在读取该目录时继续等待 */
+static void
+ngx_http_fancyindex_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                       rc;
+    ngx_connection_t               *c;
+    ngx_http_request_t             *r;
+    ngx_http_fancyindex_ctx_t      *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx->refresh) {
+        rc = ngx_http_fancyindex_refresh(r, ctx);
+
+    } else {
+        rc = ngx_http_fancyindex_send(r,
+                ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module),
+                ctx);
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_http_fancyindex_wait(ctx);
+        return;
+    }
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+
+
+    if (r->uri.data[r->uri.len - 1] != '/') {
+        return NGX_DECLINED;
+    }
+
+    /* TODO: Windows平台支持 */
+#if defined(nginx_version) \
+    && ((nginx_version < 7066) \
+        || ((nginx_version > 8000) && (nginx_version < 8038)))
+    /* 检查URI中是否包含空字符 */
+    if (r->zero_in_uri) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    /* 只处理GET和HEAD请求 */
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_DECLINED;
+    }
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    /* 检查模块是否启用 */
+    if (!alcf->enable) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx != NULL && ctx->refresh) {
+        rc = ngx_http_fancyindex_refresh(r, ctx);
+        if (rc != NGX_BUSY)
+            return rc;
+
+    } else {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_ctx_t));
+        if (ctx == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        ngx_http_set_ctx(r, ctx, ngx_http_fancyindex_module);
+
+        ngx_http_fancyindex_parse_args(r, ctx);
+
+        if (ctx->download)
+            return ngx_http_fancyindex_download(r, alcf, ctx);
+
+        rc = ngx_http_fancyindex_send(r, alcf, ctx);
+        if (rc != NGX_BUSY)
+            return rc;
+    }
+
+    /*
+     * 其他请求正在读取该目录：定时重试，直到结果存入缓存或等待超时。
+     * 与proxy_cache_lock类似，等待期间检测客户端是否关闭连接。分片生成
+     * 列表时同样在此让出事件循环，之后继续处理下一批条目，后台子请求读取
+     * 目录时也是如此。
+     */
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    cln->handler = ngx_http_fancyindex_wait_cleanup;
+    cln->data = &ctx->wait;
+
+    ctx->wait.handler = ngx_http_fancyindex_wait_handler;
+    ctx->wait.data = r;
+    ctx->wait.log = r->connection->log;
+
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ngx_http_fancyindex_wait(ctx);
+
+    return NGX_DONE;
+}
+
+
+/*
+ * 生成并发送目录列表。其他请求正在读取该目录，或者本次分片已处理完时
+ * 返回NGX_BUSY，此时尚未发送任何内容。
+ */
+static ngx_int_t
+ngx_http_fancyindex_send(ngx_http_request_t *r,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_request_t             *sr;
+    ngx_str_t                      *sr_uri;
+    ngx_str_t                       rel_uri;
+    ngx_int_t                       rc;
+    ngx_chain_t                     out[3] = {
+        { NULL, NULL }, { NULL, NULL}, { NULL, NULL }};
+
+    ctx->encoding = ngx_http_fancyindex_precompress_encoding(r, alcf, ctx);
+
+    if (alcf->render == NGX_HTTP_FANCYINDEX_RENDER_CLIENT
+        && !ctx->json && !ctx->sha256sum)
+    {
+        rc = ngx_http_fancyindex_make_shell(r, &out[0].buf, alcf, ctx);
+        if (rc != NGX_OK)
+            return rc;
+
+        if (ngx_http_fancyindex_set_render_cache(r, alcf) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    } else if ((rc = make_content_buf(r, &out[0].buf, alcf)) != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/html");
+    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/html");
+    r->headers_out.content_type.data = (u_char *) "text/html";
+
+    if (alcf->server_timing
+        && ngx_http_fancyindex_set_server_timing(r, &ctx->timing) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (ctx->vary && ngx_http_fancyindex_set_vary(r) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (ctx->json || ctx->sha256sum) {
+        /* JSON列表和sha256sum列表不包含页眉和页脚 */
+        if (ctx->json) {
+            r->headers_out.content_type_len  = ngx_sizeof_ssz("application/json");
+            r->headers_out.content_type.len  = ngx_sizeof_ssz("application/json");
+            r->headers_out.content_type.data = (u_char *) "application/json";
+        } else {
+            r->headers_out.content_type_len  = ngx_sizeof_ssz("text/plain");
+            r->headers_out.content_type.len  = ngx_sizeof_ssz("text/plain");
+            r->headers_out.content_type.data = (u_char *) "text/plain";
+        }
+        r->headers_out.content_length_n = out[0].buf->last - out[0].buf->pos;
+
+        if (ctx->sha256sum && ctx->hashing) {
+            /* 列表还不完整 */
+            r->headers_out.status = NGX_HTTP_ACCEPTED;
+
+            if (ngx_http_fancyindex_set_retry_after(r) != NGX_OK)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        out[0].buf->last_buf = 1;
+        out[0].buf->last_in_chain = 1;
+
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+            return rc;
+
+        return ngx_http_output_filter(r, &out[0]);
+    }
+
+    if (ctx->encoding) {
+        rc = ngx_http_fancyindex_send_precompressed(r, alcf, ctx, out[0].buf);
+        if (rc != NGX_DECLINED)
+            return rc;
+    }
+
+    out[0].buf->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    if (alcf->header.path.len > 0 && alcf->header.local.len == 0) {
+        /* 已配置URI，让Nginx通过子请求处理。 */
+        sr_uri = &alcf->header.path;
+
+        if (*sr_uri->data != '/') {
+            /* 相对路径 */
+            rel_uri.len  = r->uri.len + alcf->header.path.len;
+            rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
+            if (rel_uri.data == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
+                    alcf->header.path.data, alcf->header.path.len);
+            sr_uri = &rel_uri;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: header subrequest \"%V\"", sr_uri);
+
+        rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
+        if (rc == NGX_ERROR || rc == NGX_DONE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "http fancyindex: header subrequest for \"%V\" failed", sr_uri);
+            return rc;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: header subrequest status = %i",
+                sr->headers_out.status);
+        /* ngx_http_subrequest returns NGX_OK(0), not NGX_HTTP_OK(200) */
+        if (sr->headers_out.status != NGX_OK) {
+            /*
+             * XXX: 如果我们收到404以外的状态码，是否应该在错误日志中记录消息？
+             */
+            goto add_builtin_header;
+        }
+    }
+    else {
+add_builtin_header:
+        /* 在此之前创建空间 */
+        out[1].next = out[0].next;
+        out[1].buf  = out[0].buf;
+        /* 链接页眉缓冲区 */
+        out[0].next = &out[1];
+        if (alcf->header.local.len > 0) {
+            /* 页眉缓冲区为本地，创建指向数据的缓冲区。 */
+            out[0].buf = ngx_calloc_buf(r->pool);
+            if (out[0].buf == NULL)
+                return NGX_ERROR;
+            out[0].buf->memory = 1;
+            out[0].buf->pos = alcf->header.local.data;
+            out[0].buf->last = alcf->header.local.data + alcf->header.local.len;
+        } else {
+            /* 准备包含内置页眉内容的缓冲区。 */
+            out[0].buf = make_header_buf(r, alcf->tpl, alcf->css_href);
+        }
+    }
+
+    /* 如果页脚已禁用，链接页脚缓冲区。 */
+    if (alcf->footer.path.len == 0 || alcf->footer.local.len > 0) {
+        ngx_uint_t last = (alcf->header.path.len == 0) ? 2 : 1;
+
+        out[last-1].next = &out[last];
+        out[last].buf = ngx_calloc_buf(r->pool);
+        if (out[last].buf == NULL)
+            return NGX_ERROR;
+
+        out[last].buf->memory = 1;
+        if (alcf->footer.local.len > 0) {
+            out[last].buf->pos = alcf->footer.local.data;
+            out[last].buf->last = alcf->footer.local.data + alcf->footer.local.len;
+        } else {
+            out[last].buf->pos = alcf->tpl->foot1.data;
+            out[last].buf->last = alcf->tpl->foot1.data + alcf->tpl->foot1.len;
+        }
+
+        out[last-1].buf->last_in_chain = 0;
+        out[last].buf->last_in_chain   = 1;
+        out[last].buf->last_buf        = 1;
+        /* 一次性发送所有内容 :D */
+        return ngx_http_output_filter(r, &out[0]);
+    }
+
+    /*
+     * 如果到达此处，说明需要发送自定义页脚。我们需要：
+     * 部分发送out[0]引用的内容，然后将页脚作为子请求发送。
+     * 如果子请求失败，我们也应发送标准页脚。
+     */
+    rc = ngx_http_output_filter(r, &out[0]);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    /* 已配置URI，让Nginx通过子请求处理。 */
+    sr_uri = &alcf->footer.path;
+
+    if (*sr_uri->data != '/') {
+        /* 相对路径 */
+        rel_uri.len  = r->uri.len + alcf->footer.path.len;
+        rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
+        if (rel_uri.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
+                alcf->footer.path.data, alcf->footer.path.len);
+        sr_uri = &rel_uri;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "http fancyindex: footer subrequest \"%V\"", sr_uri);
+
+    rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
+    if (rc == NGX_ERROR || rc == NGX_DONE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: footer subrequest for \"%V\" failed", sr_uri);
+        return rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "http fancyindex: header subrequest status = %i",
+            sr->headers_out.status);
+
+    /* 参见上面：ngx_http_subrequest返回NGX_OK (0)而不是NGX_HTTP_OK (200) */
+    if (sr->headers_out.status != NGX_OK) {
+        /*
+         * XXX: 如果我们收到404以外的状态码，是否应该在错误日志中记录消息？
+         */
+        out[0].next = NULL;
+        out[0].buf = ngx_calloc_buf(r->pool);
+        if (out[0].buf == NULL)
+            return NGX_ERROR;
+        out[0].buf->memory = 1;
+        out[0].buf->pos = alcf->tpl->foot1.data;
+        out[0].buf->last = alcf->tpl->foot1.data + alcf->tpl->foot1.len;
+        out[0].buf->last_in_chain = 1;
+        out[0].buf->last_buf = 1;
+        /* 直接发送内置页脚 */
+        return ngx_http_output_filter(r, &out[0]);
+    }
+
+    return (r != r->main) ? rc : ngx_http_send_special(r, NGX_HTTP_LAST);
+}
+
+
+/*
+ * 大小或修改时间相同的条目按名称升序排列。ngx_qsort()不是稳定的排序，
+ * 这样串行和并行排序（以及截断列表时保留的条目）的结果总是相同。
+ */
+static ngx_inline int
+ngx_http_fancyindex_cmp_tie(int rc, ngx_http_fancyindex_entry_t *first,
+        ngx_http_fancyindex_entry_t *second)
+{
+    if (rc != 0)
+        return rc;
+
+    return (int) ngx_strcmp(first->name.data, second->name.data);
+}
+
+
+/* 按名称降序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_cs_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcmp(second->name.data, first->name.data);
+}
+
+
+/* 按大小降序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_ci_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcasecmp(second->name.data, first->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_size_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_tie((first->size < second->size)
+                                       - (first->size > second->size),
+                                       first, second);
+}
+
+
+/* 按修改时间降序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_mtime_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_tie((first->mtime < second->mtime)
+                                       - (first->mtime > second->mtime),
+                                       first, second);
+}
+
+
+/* 按名称升序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_cs_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcmp(first->name.data, second->name.data);
+}
+
+
+/* 按大小升序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_ci_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcasecmp(first->name.data, second->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_tie((first->size > second->size)
+                                       - (first->size < second->size),
+                                       first, second);
+}
+
+
+/* 按修改时间升序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_tie((first->mtime > second->mtime)
+                                       - (first->mtime < second->mtime),
+                                       first, second);
+}
+
+
+static ngx_inline int
+ngx_http_fancyindex_cmp_keys(ngx_str_t *one, ngx_str_t *two)
+{
+    int  rc;
+
+    rc = ngx_memcmp(one->data, two->data, ngx_min(one->len, two->len));
+    if (rc != 0)
+        return rc;
+
+    return (one->len > two->len) - (one->len < two->len);
+}
+
+
+/* 按版本号升序比较目录条目，比较排序键 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_version_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_keys(&first->key, &second->key);
+}
+
+
+/* 按版本号降序比较目录条目 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_version_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_keys(&second->key, &first->key);
+}
+
+
+/* 按排序规则升序比较名称，排序键由strxfrm_l()生成 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_collate_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_keys(&first->key, &second->key);
+}
+
+
+/* 按排序规则降序比较名称 */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_collate_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_keys(&second->key, &first->key);
+}
+
+
+/* 处理目录索引错误 */
+static ngx_int_t
+ngx_http_fancyindex_error(ngx_http_request_t *r, ngx_dir_t *dir, ngx_str_t *name)
+{
+    if (ngx_close_dir(dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", name);
+    }
+
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+
+/* 创建主配置 */
+static void *
+ngx_http_fancyindex_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_fancyindex_main_conf_t  *mcf;
+
+    mcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_main_conf_t));
+    if (mcf == NULL)
+        return NULL;
+
+    if (ngx_array_init(&mcf->indexes, cf->pool, 1,
+                       sizeof(ngx_http_fancyindex_index_t *)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return mcf;
+}
+
+
+/* 创建位置配置 */
+static void *
+ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_fancyindex_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_loc_conf_t));
+    if (conf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * 由ngx_pcalloc设置：
+     *    conf->header.*.len     = 0
+     *    conf->header.*.data    = NULL
+     *    conf->footer.*.len     = 0
+     *    conf->footer.*.data    = NULL
+     *    conf->css_href.len     = 0
+     *    conf->css_href.data    = NULL
+     *    conf->precompress      = 0
+     *    conf->download         = 0
+     *    conf->time_format.len  = 0
+     *    conf->time_format.data = NULL
+     *    conf->render_attrs     = { 0, NULL }
+     *    conf->render_etag      = { 0, NULL }
+     *    conf->row_template     = { 0, NULL }
+     *    conf->row_program      = NULL
+     */
+    conf->enable         = NGX_CONF_UNSET;
+    conf->default_sort   = NGX_CONF_UNSET_UINT;
+    conf->case_sensitive = NGX_CONF_UNSET;
+    conf->collation      = NGX_CONF_UNSET_PTR;
+    conf->dirs_first     = NGX_CONF_UNSET;
+    conf->localtime      = NGX_CONF_UNSET;
+    conf->exact_size     = NGX_CONF_UNSET;
+    conf->ignore         = NGX_CONF_UNSET_PTR;
+    conf->hide_symlinks  = NGX_CONF_UNSET;
+    conf->show_path      = NGX_CONF_UNSET;
+    conf->hide_parent    = NGX_CONF_UNSET;
+    conf->show_dot_files = NGX_CONF_UNSET;
+    conf->server_timing  = NGX_CONF_UNSET;
+    conf->cache_zone     = NGX_CONF_UNSET_PTR;
+    conf->cache_valid    = NGX_CONF_UNSET;
+    conf->cache_errors   = NGX_CONF_UNSET;
+    conf->error_log_limit = NGX_CONF_UNSET_UINT;
+    conf->scan_lock      = NGX_CONF_UNSET;
+    conf->scan_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->max_scans      = NGX_CONF_UNSET_UINT;
+    conf->use_stale      = NGX_CONF_UNSET_UINT;
+    conf->slice          = NGX_CONF_UNSET_UINT;
+    conf->max_entries    = NGX_CONF_UNSET_UINT;
+    conf->max_listing_memory = NGX_CONF_UNSET_SIZE;
+    conf->index          = NGX_CONF_UNSET_PTR;
+    conf->checksums      = NGX_CONF_UNSET;
+    conf->checksum_max_size = NGX_CONF_UNSET;
+    conf->dir_sizes      = NGX_CONF_UNSET;
+    conf->parallel_stat  = NGX_CONF_UNSET_UINT;
+    conf->stat_engine    = NGX_CONF_UNSET_UINT;
+    conf->parallel_sort  = NGX_CONF_UNSET_UINT;
+    conf->render         = NGX_CONF_UNSET_UINT;
+    conf->render_max_age = NGX_CONF_UNSET;
+    conf->tpl            = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+
+/* 合并位置配置 */
+static char *
+ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_fancyindex_loc_conf_t *prev = parent;
+    ngx_http_fancyindex_loc_conf_t *conf = child;
+#if (NGX_THREADS)
+    ngx_http_fancyindex_main_conf_t *mcf;
+#endif
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_uint_value(conf->default_sort, prev->default_sort, NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME);
+    ngx_conf_merge_value(conf->case_sensitive, prev->case_sensitive, 1);
+    ngx_conf_merge_ptr_value(conf->collation, prev->collation, NULL);
+    ngx_conf_merge_value(conf->dirs_first, prev->dirs_first, 1);
+    ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
+    ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
+    ngx_conf_merge_value(conf->show_path, prev->show_path, 1);
+    ngx_conf_merge_value(conf->show_dot_files, prev->show_dot_files, 0);
+    ngx_conf_merge_value(conf->server_timing, prev->server_timing, 0);
+
+    ngx_conf_merge_str_value(conf->header.path, prev->header.path, "");
+    ngx_conf_merge_str_value(conf->header.path, prev->header.local, "");
+    ngx_conf_merge_str_value(conf->footer.path, prev->footer.path, "");
+    ngx_conf_merge_str_value(conf->footer.path, prev->footer.local, "");
+
+    ngx_conf_merge_str_value(conf->css_href, prev->css_href, "");
+    ngx_conf_merge_str_value(conf->time_format, prev->time_format, "%Y-%m-%d %H:%M");
+
+    ngx_conf_merge_ptr_value(conf->ignore, prev->ignore, NULL);
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 600);
+    ngx_conf_merge_sec_value(conf->cache_errors, prev->cache_errors, 0);
+    ngx_conf_merge_uint_value(conf->error_log_limit, prev->error_log_limit, 0);
+    ngx_conf_merge_value(conf->scan_lock, prev->scan_lock, 0);
+    ngx_conf_merge_msec_value(conf->scan_lock_timeout,
+                              prev->scan_lock_timeout, 5000);
+
+    /* 继承时共用上级配置的计数 */
+    if (conf->max_scans == NGX_CONF_UNSET_UINT) {
+        conf->max_scans = (prev->max_scans == NGX_CONF_UNSET_UINT)
+                          ? 0 : prev->max_scans;
+        conf->scan_queue = prev->scan_queue;
+        conf->scan_queue_timeout = prev->scan_queue_timeout;
+        conf->scan_slot = prev->scan_slot;
+    }
+    ngx_conf_merge_uint_value(conf->use_stale, prev->use_stale, 0);
+    ngx_conf_merge_uint_value(conf->slice, prev->slice, 0);
+    ngx_conf_merge_uint_value(conf->max_entries, prev->max_entries, 0);
+    ngx_conf_merge_size_value(conf->max_listing_memory,
+                              prev->max_listing_memory, 0);
+    ngx_conf_merge_ptr_value(conf->index, prev->index, NULL);
+    ngx_conf_merge_value(conf->checksums, prev->checksums, 0);
+    ngx_conf_merge_off_value(conf->checksum_max_size,
+                             prev->checksum_max_size, 256 * 1024 * 1024);
+    ngx_conf_merge_value(conf->dir_sizes, prev->dir_sizes, 0);
+    ngx_conf_merge_uint_value(conf->parallel_stat, prev->parallel_stat, 0);
+    ngx_conf_merge_uint_value(conf->stat_engine, prev->stat_engine,
+                              NGX_HTTP_FANCYINDEX_STAT_ENGINE_DEFAULT);
+    ngx_conf_merge_uint_value(conf->parallel_sort, prev->parallel_sort, 0);
+    ngx_conf_merge_uint_value(conf->render, prev->render,
+                              NGX_HTTP_FANCYINDEX_RENDER_SERVER);
+    ngx_conf_merge_sec_value(conf->render_max_age, prev->render_max_age,
+                             86400);
+    ngx_conf_merge_ptr_value(conf->tpl, prev->tpl,
+                             &ngx_http_fancyindex_default_template);
+    ngx_conf_merge_bitmask_value(conf->download, prev->download,
+                                 (NGX_CONF_BITMASK_SET
+                                  |NGX_HTTP_FANCYINDEX_DOWNLOAD_OFF));
+    ngx_conf_merge_bitmask_value(conf->precompress, prev->precompress,
+                                 (NGX_CONF_BITMASK_SET
+                                  |NGX_HTTP_FANCYINDEX_PRECOMPRESS_OFF));
+
+    if (conf->precompress & NGX_HTTP_FANCYINDEX_PRECOMPRESS_OFF) {
+        conf->precompress = NGX_CONF_BITMASK_SET
+                            |NGX_HTTP_FANCYINDEX_PRECOMPRESS_OFF;
+    }
+
+#if (NGX_THREADS)
+    /* 在线程池中压缩缓存的响应体 */
+    if (conf->precompress & (NGX_HTTP_FANCYINDEX_GZIP
+                             |NGX_HTTP_FANCYINDEX_BROTLI))
+    {
+        mcf = ngx_http_conf_get_module_main_conf(cf,
+                                                 ngx_http_fancyindex_module);
+
+        if (mcf->thread_pool == NULL) {
+            mcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+            if (mcf->thread_pool == NULL)
+                return NGX_CONF_ERROR;
+        }
+    }
+#endif
+    ngx_conf_merge_value(conf->hide_symlinks, prev->hide_symlinks, 0);
+    ngx_conf_merge_value(conf->hide_parent, prev->hide_parent, 0);
+
+    /* 确保在未提供自定义页眉的情况下没有禁用show_path指令 */
+    if (conf->show_path == 0 && conf->header.path.len == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "FancyIndex : cannot set show_path to off without providing a custom header !");
+        return NGX_CONF_ERROR;
+    }
+
+#if !(NGX_ZLIB)
+    if (conf->precompress & NGX_HTTP_FANCYINDEX_GZIP) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_cache_precompress gzip\" requires "
+                           "nginx built with zlib");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+#if !(NGX_HAVE_BROTLI_ENC)
+    if (conf->precompress & NGX_HTTP_FANCYINDEX_BROTLI) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_cache_precompress brotli\" requires "
+                           "the brotli encoder library");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+#if !(NGX_HTTP_FANCYINDEX_BACKGROUND)
+    if (conf->use_stale) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_cache_use_stale updating\" requires "
+                           "nginx 1.11.10 or newer");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    if (conf->render == NGX_HTTP_FANCYINDEX_RENDER_CLIENT
+        && ngx_http_fancyindex_render_init(cf, conf) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_str_value(conf->row_template, prev->row_template, "");
+
+    if (conf->row_template.len)
+        return ngx_http_fancyindex_row_compile(cf, conf, &conf->row_template,
+                                               0);
+
+    return ngx_http_fancyindex_row_compile(cf, conf,
+                   &ngx_http_fancyindex_row_default[conf->checksums ? 1 : 0],
+                   1);
+}
+
+
+/* 设置忽略文件配置 */
+static char*
+ngx_http_fancyindex_ignore(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value;
+
+    (void) cmd; /* 未使用 */
+
+#if (NGX_PCRE)
+    ngx_uint_t          i;
+    ngx_regex_elt_t    *re;
+    ngx_regex_compile_t rc;
+    u_char              errstr[NGX_MAX_CONF_ERRSTR];
+
+    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
+        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
+        if (alcf->ignore == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.err.data = errstr;
+    rc.err.len  = NGX_MAX_CONF_ERRSTR;
+    rc.pool     = cf->pool;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        re = ngx_array_push(alcf->ignore);
+        if (re == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rc.pattern = value[i];
+        rc.options = NGX_REGEX_CASELESS;
+
+        if (ngx_regex_compile(&rc) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+            return NGX_CONF_ERROR;
+        }
+
+        re->name  = value[i].data;
+        re->regex = rc.regex;
+    }
+
+    return NGX_CONF_OK;
+#else /* !NGX_PCRE */
+    ngx_uint_t i;
+    ngx_str_t *str;
+
+    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
+        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
+        if (alcf->ignore == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        str = ngx_array_push(alcf->ignore);
+        if (str == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        str->data = value[i].data;
+        str->len  = value[i].len;
+    }
+
+    return NGX_CONF_OK;
+#endif /* NGX_PCRE */
+
+}
+
+
+/* 定义目录列表缓存区：fancyindex_cache_zone name:size */
+static char *
+ngx_http_fancyindex_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                       *p;
+    ssize_t                       size;
+    ngx_str_t                    *value, name, s;
+    ngx_shm_zone_t               *shm_zone;
+    ngx_http_fancyindex_cache_t  *cache;
+
+    (void) cmd; /* 未使用 */
+    (void) conf; /* 未使用 */
+
+    value = cf->args->elts;
+
+    p = (u_char *) ngx_strchr(value[1].data, ':');
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_cache_t));
+    if (cache == NULL)
+        return NGX_CONF_ERROR;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_fancyindex_module);
+    if (shm_zone == NULL)
+        return NGX_CONF_ERROR;
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_fancyindex_cache_init_zone;
+    shm_zone->data = cache;
+    cache->shm_zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+
+/* 设置location使用的目录列表缓存区：fancyindex_cache name | off */
+static char *
+ngx_http_fancyindex_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value;
+
+    (void) cmd; /* 未使用 */
+
+    if (alcf->cache_zone != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    /* 大小为0：引用fancyindex_cache_zone定义的缓存区 */
+    alcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                             &ngx_http_fancyindex_module);
+    if (alcf->cache_zone == NULL)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ *    fancyindex_max_concurrent_scans number [queue=number] [timeout=time]
+ *
+ * 计数在所有工作进程共用的共享内存区中，该区在第一次使用指令时创建。
+ */
+static char *
+ngx_http_fancyindex_max_scans(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+
+    ngx_int_t                         n, queue;
+    ngx_str_t                        *value, s, name;
+    ngx_uint_t                        i;
+    ngx_msec_t                        timeout;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+
+    if (alcf->max_scans != NGX_CONF_UNSET_UINT)
+        return "is duplicate";
+
+    value = cf->args->elts;
+
+    i = 1;
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR)
+        goto invalid;
+
+    queue = 0;
+    timeout = 5000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            queue = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (queue == NGX_ERROR)
+                goto invalid;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR)
+                goto invalid;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    alcf->max_scans = n;
+    alcf->scan_queue = queue;
+    alcf->scan_queue_timeout = timeout;
+
+    if (n == 0)
+        return NGX_CONF_OK;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (mcf->nscans == NGX_HTTP_FANCYINDEX_SCAN_SLOTS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many \"%V\" directives", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->scans_zone == NULL) {
+        ngx_str_set(&name, "fancyindex_scans");
+
+        mcf->scans_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+                                                &ngx_http_fancyindex_module);
+        if (mcf->scans_zone == NULL)
+            return NGX_CONF_ERROR;
+
+        mcf->scans_zone->init = ngx_http_fancyindex_scans_init_zone;
+    }
+
+    alcf->scan_slot = mcf->nscans++;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_scans_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_fancyindex_scans_sh_t  *sh = data;
+
+    if (sh != NULL) {
+        /* 重新加载配置：计数的位置可能已经改变 */
+        ngx_memzero(sh->slots, sizeof(sh->slots));
+        (void) ngx_atomic_fetch_add(&sh->generation, 1);
+        shm_zone->data = sh;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_http_fancyindex_scans_sh_t));
+    if (sh == NULL)
+        return NGX_ERROR;
+
+    ngx_memzero(sh, sizeof(ngx_http_fancyindex_scans_sh_t));
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+/*
+ * 设置location使用的目录树索引：
+ *
+ *    fancyindex_index root file [interval=time] [top=number] | off
+ */
+static char *
+ngx_http_fancyindex_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value;
+#if (NGX_THREADS)
+    ngx_str_t                         root, file, s;
+    ngx_int_t                         top;
+    ngx_msec_t                        interval;
+    ngx_uint_t                        i;
+    ngx_http_fancyindex_index_t      *idx, **pidx;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+#endif
+
+    if (alcf->index != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->index = NULL;
+        return NGX_CONF_OK;
+    }
+
+#if !(NGX_THREADS)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires nginx built with thread pools "
+                       "(--with-threads)", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    if (cf->args->nelts < 3) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"%V\" directive",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    root = value[1];
+    file = value[2];
+
+    if (ngx_conf_full_name(cf->cycle, &root, 0) != NGX_OK
+        || ngx_conf_full_name(cf->cycle, &file, 0) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* 与映射请求得到的路径一致，不以'/'结尾 */
+    while (root.len && root.data[root.len - 1] == '/')
+        root.len--;
+
+    interval = 60000;
+    top = 100;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            interval = ngx_parse_time(&s, 0);
+            if (interval == (ngx_msec_t) NGX_ERROR)
+                goto invalid;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "top=", 4) == 0) {
+            top = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (top == NGX_ERROR)
+                goto invalid;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+    pidx = mcf->indexes.elts;
+
+    for (i = 0; i < mcf->indexes.nelts; i++) {
+        idx = pidx[i];
+
+        if (idx->file.len != file.len
+            || ngx_strncmp(idx->file.data, file.data, file.len) != 0)
+        {
+            continue;
+        }
+
+        if (idx->root.len != root.len
+            || ngx_strncmp(idx->root.data, root.data, root.len) != 0
+            || idx->interval != interval || idx->top != (ngx_uint_t) top)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "index file \"%V\" is already used with "
+                               "different parameters", &file);
+            return NGX_CONF_ERROR;
+        }
+
+        alcf->index = idx;
+        return NGX_CONF_OK;
+    }
+
+    idx = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_index_t));
+    if (idx == NULL)
+        return NGX_CONF_ERROR;
+
+    idx->root = root;
+    idx->file = file;
+    idx->interval = interval;
+    idx->top = top;
+
+    idx->thread_pool = ngx_thread_pool_add(cf, NULL);
+    if (idx->thread_pool == NULL)
+        return NGX_CONF_ERROR;
+
+    if ((pidx = ngx_array_push(&mcf->indexes)) == NULL)
+        return NGX_CONF_ERROR;
+
+    *pidx = idx;
+    alcf->index = idx;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+#endif
+}
+
+
+/*
+ *    fancyindex_download [tar] [zip] | off
+ *
+ * zip的文件内容在线程池中读取，以便计算CRC-32。
+ */
+static char *
+ngx_http_fancyindex_download_formats(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    char *rv;
+#if (NGX_THREADS)
+    ngx_http_fancyindex_main_conf_t  *mcf;
+#endif
+
+    rv = ngx_conf_set_bitmask_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK)
+        return rv;
+
+    if ((alcf->download & NGX_HTTP_FANCYINDEX_DOWNLOAD_OFF)
+        && cf->args->nelts > 2)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"off\" cannot be combined with other "
+                           "parameters of \"%V\"", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (!(alcf->download
+          & ngx_http_fancyindex_download_mask(NGX_HTTP_FANCYINDEX_DOWNLOAD_ZIP)))
+    {
+        return NGX_CONF_OK;
+    }
+
+#if !(NGX_THREADS)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V zip\" requires nginx built with thread pools "
+                       "(--with-threads)", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (mcf->thread_pool == NULL) {
+        mcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        if (mcf->thread_pool == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#endif
+}
+
+
+/*
+ *    fancyindex_checksums on | off
+ */
+static char *
+ngx_http_fancyindex_checksums(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    char *rv;
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    ngx_http_fancyindex_main_conf_t  *mcf;
+#endif
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK || !alcf->checksums)
+        return rv;
+
+#if !(NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires nginx built with thread pools "
+                       "(--with-threads) on Linux", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (mcf->thread_pool == NULL) {
+        mcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        if (mcf->thread_pool == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#endif
+}
+
+
+/*
+ *    fancyindex_dir_sizes on | off
+ */
+static char *
+ngx_http_fancyindex_dir_sizes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    char *rv;
+#if (NGX_THREADS)
+    ngx_http_fancyindex_main_conf_t  *mcf;
+#endif
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK || !alcf->dir_sizes)
+        return rv;
+
+#if !(NGX_THREADS)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires nginx built with thread pools "
+                       "(--with-threads)", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (mcf->thread_pool == NULL) {
+        mcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        if (mcf->thread_pool == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#endif
+}
+
+
+static char *
+ngx_http_fancyindex_thread_num(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    char *rv;
+#if (NGX_THREADS)
+    ngx_http_fancyindex_main_conf_t  *mcf;
+#endif
+
+    rv = ngx_conf_set_num_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK
+        || *(ngx_uint_t *) ((char *) conf + cmd->offset) == 0)
+    {
+        return rv;
+    }
+
+#if !(NGX_THREADS)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires nginx built with thread pools "
+                       "(--with-threads)", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (mcf->thread_pool == NULL) {
+        mcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        if (mcf->thread_pool == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#endif
+}
+
+
+static char *
+ngx_http_fancyindex_stat_engine(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    char *rv;
+#if (NGX_HAVE_IO_URING)
+    ngx_http_fancyindex_main_conf_t  *mcf;
+#endif
+
+    rv = ngx_conf_set_enum_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK
+        || alcf->stat_engine != NGX_HTTP_FANCYINDEX_STAT_ENGINE_IO_URING)
+    {
+        return rv;
+    }
+
+#if !(NGX_HAVE_IO_URING)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V io_uring\" requires liburing", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+    mcf->uring = 1;
+
+    return NGX_CONF_OK;
+#endif
+}
+
+
+#if (NGX_HAVE_STRXFRM_L)
+
+static void
+ngx_http_fancyindex_collation_cleanup(void *data)
+{
+    ngx_http_fancyindex_collation_t *coll = data;
+
+    freelocale(coll->locale);
+}
+
+#endif
+
+
+/*
+ *    fancyindex_collation locale | off
+ *
+ * 区域设置在加载配置时创建，之后只用于strxfrm_l()。
+ */
+static char *
+ngx_http_fancyindex_collation(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+
+    ngx_str_t                        *value;
+#if (NGX_HAVE_STRXFRM_L)
+    ngx_pool_cleanup_t               *cln;
+    ngx_http_fancyindex_collation_t  *coll;
+#endif
+
+    if (alcf->collation != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->collation = NULL;
+        return NGX_CONF_OK;
+    }
+
+#if !(NGX_HAVE_STRXFRM_L)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V\" requires strxfrm_l()", &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    coll = ngx_palloc(cf->pool, sizeof(ngx_http_fancyindex_collation_t));
+    if (coll == NULL)
+        return NGX_CONF_ERROR;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL)
+        return NGX_CONF_ERROR;
+
+    coll->name = value[1];
+    coll->locale = newlocale(LC_COLLATE_MASK, (char *) value[1].data,
+                             (locale_t) 0);
+
+    if (coll->locale == (locale_t) 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "newlocale(\"%V\") failed", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_fancyindex_collation_cleanup;
+    cln->data = coll;
+
+    alcf->collation = coll;
+
+    return NGX_CONF_OK;
+#endif
+}
+
+
+/* 模板文件中的片段名称，顺序与ngx_http_fancyindex_template_t的成员一致 */
+typedef struct {
+    ngx_str_t  name;
+    size_t     offset;
+} ngx_http_fancyindex_template_var_t;
+
+#define ngx_http_fancyindex_template_var(_n, _f) \
+    { ngx_string(_n), offsetof(ngx_http_fancyindex_template_t, _f) }
+
+static ngx_http_fancyindex_template_var_t  ngx_http_fancyindex_template_vars[] = {
+    ngx_http_fancyindex_template_var("t01_head1", head1),
+    ngx_http_fancyindex_template_var("t02_head2", head2),
+    ngx_http_fancyindex_template_var("t03_head3", head3),
+    ngx_http_fancyindex_template_var("t04_body1", body1),
+    ngx_http_fancyindex_template_var("t05_body2", body2),
+    ngx_http_fancyindex_template_var("t06_list1", list1),
+    ngx_http_fancyindex_template_var("t_parentdir_entry", parentdir_entry),
+    ngx_http_fancyindex_template_var("t07_list2", list2),
+    ngx_http_fancyindex_template_var("t_render1", render1),
+    ngx_http_fancyindex_template_var("t_render2", render2),
+    ngx_http_fancyindex_template_var("t08_foot1", foot1),
+};
+
+
+#define ngx_http_fancyindex_template_space(c)  ((c) == ' ' || (c) == '\t')
+
+/* 一行是否为"<!-- var 名称 -->"，是则返回名称 */
+static ngx_uint_t
+ngx_http_fancyindex_template_marker(ngx_str_t *line, ngx_str_t *name)
+{
+    u_char  *p, *last;
+
+    if (line->len < ngx_sizeof_ssz("<!--var x-->")
+        || ngx_strncmp(line->data, "<!--", 4) != 0
+        || ngx_strncmp(line->data + line->len - 3, "-->", 3) != 0)
+    {
+        return 0;
+    }
+
+    p = line->data + 4;
+    last = line->data + line->len - 3;
+
+    while (p < last && ngx_http_fancyindex_template_space(*p))
+        p++;
+
+    if (last - p < 4 || ngx_strncmp(p, "var", 3) != 0 || !ngx_http_fancyindex_template_space(p[3]))
+        return 0;
+
+    for (p += 4; p < last && ngx_http_fancyindex_template_space(*p); p++) { /* void */ }
+
+    name->data = p;
+
+    while (p < last && !ngx_http_fancyindex_template_space(*p))
+        p++;
+
+    name->len = p - name->data;
+
+    while (p < last && ngx_http_fancyindex_template_space(*p))
+        p++;
+
+    return name->len && p == last;
+}
+
+
+/*
+ *    fancyindex_template file
+ *
+ * 按照template.awk的规则在加载配置时解析模板：以"<!-- var 名称 -->"开始
+ * 一个片段，"<!-- var NONE -->"结束当前片段；空行为换行符，其余的行去掉
+ * 制表符等空白控制字符后直接连接。文件中没有的片段使用内置模板的内容。
+ */
+static char *
+ngx_http_fancyindex_template(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+
+    u_char      *p, *q, *eol, *last, *out;
+    ngx_str_t   *value, file, content, line, name, *seg;
+    ngx_uint_t   i, seen;
+    ngx_http_fancyindex_template_t  *tpl;
+
+    (void) cmd; /* 未使用 */
+
+    if (alcf->tpl != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    value = cf->args->elts;
+    file = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    if (ngx_http_fancyindex_read_file(cf, &file, &content) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    tpl = ngx_palloc(cf->pool, sizeof(ngx_http_fancyindex_template_t));
+    if (tpl == NULL)
+        return NGX_CONF_ERROR;
+
+    *tpl = ngx_http_fancyindex_default_template;
+
+    /* 生成的片段不会比原来的行更长，直接写在读取的内容中 */
+    out = content.data;
+    seg = NULL;
+    seen = 0;
+
+    for (p = content.data, last = p + content.len; p < last; p = eol + 1) {
+        if ((eol = ngx_strlchr(p, last, '\n')) == NULL)
+            eol = last;
+
+        line.data = p;
+        line.len = eol - p;
+
+        if (line.len && line.data[line.len - 1] == '\r')
+            line.len--;
+
+        if (ngx_http_fancyindex_template_marker(&line, &name)) {
+            if (name.len == 4 && ngx_strncmp(name.data, "NONE", 4) == 0) {
+                seg = NULL;
+                continue;
+            }
+
+            for (i = 0; i < DIM(ngx_http_fancyindex_template_vars); i++) {
+                if (name.len == ngx_http_fancyindex_template_vars[i].name.len
+                    && ngx_strncmp(name.data,
+                                   ngx_http_fancyindex_template_vars[i].name.data,
+                                   name.len) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (i == DIM(ngx_http_fancyindex_template_vars)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unknown variable \"%V\" in template \"%V\"",
+                                   &name, &file);
+                return NGX_CONF_ERROR;
+            }
+
+            if (seen & (1 << i)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate variable \"%V\" in template \"%V\"",
+                                   &name, &file);
+                return NGX_CONF_ERROR;
+            }
+
+            seen |= 1 << i;
+
+            seg = (ngx_str_t *) ((u_char *) tpl
+                                 + ngx_http_fancyindex_template_vars[i].offset);
+            seg->data = out;
+            seg->len = 0;
+            continue;
+        }
+
+        if (seg == NULL)
+            continue;
+
+        if (line.len == 0) {
+            *out++ = '\n';
+            seg->len++;
+            continue;
+        }
+
+        for (q = line.data; q < line.data + line.len; q++) {
+            switch (*q) {
+            case '\t': case '\v': case '\r': case '\f':
+                break;
+            default:
+                *out++ = *q;
+                seg->len++;
+            }
+        }
+    }
+
+    if (seen == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no \"<!-- var ... -->\" markers in template \"%V\"",
+                           &file);
+        return NGX_CONF_ERROR;
+    }
+
+    alcf->tpl = tpl;
+    return NGX_CONF_OK;
+}
+
+
+/*
+ *    fancyindex_render server | client [max_age=time]
+ */
+static char *
+ngx_http_fancyindex_render(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t  *value, s;
+    ngx_uint_t  i;
+
+    if (alcf->render != NGX_CONF_UNSET_UINT)
+        return "is duplicate";
+
+    value = cf->args->elts;
+    i = 1;
+
+    if (ngx_strcmp(value[1].data, "server") == 0) {
+        if (cf->args->nelts > 2) {
+            i = 2;
+            goto invalid;
+        }
+
+        alcf->render = NGX_HTTP_FANCYINDEX_RENDER_SERVER;
+        return NGX_CONF_OK;
     }
 
-    return (r != r->main) ? rc : ngx_http_send_special(r, NGX_HTTP_LAST);
-}
+    if (ngx_strcmp(value[1].data, "client") != 0)
+        goto invalid;
 
+#if !(NGX_HTTP_FANCYINDEX_JSON)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V client\" requires nginx 1.11.8 or newer",
+                       &cmd->name);
+    return NGX_CONF_ERROR;
+#else
+    alcf->render = NGX_HTTP_FANCYINDEX_RENDER_CLIENT;
 
-/* 按名称降序比较目录条目 */
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_cs_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "max_age=", 8) != 0)
+            goto invalid;
 
-    return (int) ngx_strcmp(second->name.data, first->name.data);
-}
+        s.len = value[i].len - 8;
+        s.data = value[i].data + 8;
 
+        alcf->render_max_age = ngx_parse_time(&s, 1);
+        if (alcf->render_max_age == (time_t) NGX_ERROR)
+            goto invalid;
+    }
 
-/* 按大小降序比较目录条目 */
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_ci_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    return NGX_CONF_OK;
+#endif
 
-    return (int) ngx_strcasecmp(second->name.data, first->name.data);
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_size_desc(const void *one, const void *two)
+/*
+ * 生成渲染脚本的data属性，以及页面的ETag。页面除URI外只取决于配置和
+ * 模板，ETag为它们的CRC32。
+ */
+static ngx_int_t
+ngx_http_fancyindex_render_init(ngx_conf_t *cf,
+        ngx_http_fancyindex_loc_conf_t *conf)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    size_t       len;
+    u_char      *p;
+    uint32_t     crc;
+    u_char       flags[4];
+    ngx_str_t   *seg;
+    ngx_uint_t   i;
+
+    len = ngx_sizeof_ssz(" data-exact-size=\"0\" data-localtime=\"0\""
+                         " data-checksums=\"0\" data-time-format=\"\"")
+        + conf->time_format.len
+        + ngx_escape_html(NULL, conf->time_format.data, conf->time_format.len);
+
+    if ((p = ngx_pnalloc(cf->pool, len)) == NULL)
+        return NGX_ERROR;
 
-    return (first->size < second->size) - (first->size > second->size);
-}
+    conf->render_attrs.data = p;
+
+    p = ngx_sprintf(p, " data-exact-size=\"%d\" data-localtime=\"%d\""
+                    " data-checksums=\"%d\" data-time-format=\"",
+                    conf->exact_size ? 1 : 0, conf->localtime ? 1 : 0,
+                    conf->checksums ? 1 : 0);
+    p = (u_char *) ngx_escape_html(p, conf->time_format.data,
+                                   conf->time_format.len);
+    *p++ = '"';
+
+    conf->render_attrs.len = p - conf->render_attrs.data;
+
+    flags[0] = conf->show_path ? 1 : 0;
+    flags[1] = conf->hide_parent ? 1 : 0;
+    flags[2] = conf->checksums ? 1 : 0;
+    flags[3] = 0;
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, flags, sizeof(flags));
+    ngx_crc32_update(&crc, conf->render_attrs.data, conf->render_attrs.len);
+    ngx_crc32_update(&crc, conf->css_href.data, conf->css_href.len);
+    ngx_crc32_update(&crc, conf->header.local.data, conf->header.local.len);
+    ngx_crc32_update(&crc, conf->footer.local.data, conf->footer.local.len);
+    for (i = 0; i < DIM(ngx_http_fancyindex_template_vars); i++) {
+        seg = (ngx_str_t *) ((u_char *) conf->tpl
+                             + ngx_http_fancyindex_template_vars[i].offset);
+        ngx_crc32_update(&crc, seg->data, seg->len);
+    }
+    ngx_crc32_final(crc);
 
+    if ((p = ngx_pnalloc(cf->pool, ngx_sizeof_ssz("\"00000000\""))) == NULL)
+        return NGX_ERROR;
 
-/* 按修改时间降序比较目录条目 */
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_mtime_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    conf->render_etag.data = p;
+    conf->render_etag.len = ngx_sprintf(p, "\"%08xD\"", crc) - p;
 
-    return (int) (second->mtime - first->mtime);
+    return NGX_OK;
 }
 
 
-/* 按名称升序比较目录条目 */
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_cs_asc(const void *one, const void *two)
+static ngx_int_t
+ngx_http_fancyindex_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_http_fancyindex_cache_t  *ocache = data;
+    ngx_http_fancyindex_cache_t  *cache;
+    size_t                        len;
 
-    return (int) ngx_strcmp(first->name.data, second->name.data);
-}
+    cache = shm_zone->data;
 
+    if (ocache) {
+        /*
+         * 重新加载配置：保留缓存的内容，但新配置的节点与旧节点互不匹配，
+         * 即使location配置恰好分配在相同的地址上。
+         */
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        cache->errors_max = ocache->errors_max;
 
-/* 按大小升序比较目录条目 */
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_ci_asc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        cache->generation = ++cache->sh->generation;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    return (int) ngx_strcasecmp(first->name.data, second->name.data);
-}
+        return NGX_OK;
+    }
 
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    cache->errors_max = shm_zone->shm.size / NGX_HTTP_FANCYINDEX_ERRORS_SHARE;
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        cache->generation = cache->sh->generation;
+        return NGX_OK;
+    }
 
-    return (first->size > second->size) - (first->size < second->size);
-}
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_fancyindex_cache_sh_t));
+    if (cache->sh == NULL)
+        return NGX_ERROR;
 
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_fancyindex_cache_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+    ngx_rbtree_init(&cache->sh->sizes, &cache->sh->sizes_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->sizes_queue);
+    ngx_rbtree_init(&cache->sh->errors, &cache->sh->errors_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->errors_queue);
+    cache->sh->errors_size = 0;
+    cache->sh->generation = 0;
+    cache->generation = 0;
+
+    len = sizeof(" in fancyindex cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL)
+        return NGX_ERROR;
 
-/* 按修改时间升序比较目录条目 */
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_sprintf(cache->shpool->log_ctx, " in fancyindex cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* 空间不足时淘汰旧的节点，不必记录错误 */
+    cache->shpool->log_nomem = 0;
 
-    return (int) (first->mtime - second->mtime);
+    return NGX_OK;
 }
 
 
-/* 处理目录索引错误 */
 static ngx_int_t
-ngx_http_fancyindex_error(ngx_http_request_t *r, ngx_dir_t *dir, ngx_str_t *name)
+ngx_http_fancyindex_init(ngx_conf_t *cf)
 {
-    if (ngx_close_dir(dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_dir_n " \"%V\" failed", name);
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
     }
 
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    *h = ngx_http_fancyindex_handler;
+
+    return NGX_OK;
 }
 
 
-/* 创建位置配置 */
-static void *
-ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf)
+
+#if (NGX_THREADS)
+
+/* 第一个worker进程负责重建索引，其他进程在查询时映射索引文件 */
+static ngx_int_t
+ngx_http_fancyindex_index_init_process(ngx_cycle_t *cycle)
 {
-    ngx_http_fancyindex_loc_conf_t  *conf;
+    ngx_uint_t                        i;
+    ngx_thread_task_t                *task;
+    ngx_http_fancyindex_index_t     **pidx, *idx;
+    ngx_http_fancyindex_main_conf_t  *mcf;
+    ngx_http_fancyindex_index_task_t *t;
+#if (NGX_HAVE_INOTIFY)
+    int                               fd;
+    ngx_connection_t                 *c;
+#endif
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_loc_conf_t));
-    if (conf == NULL) {
-        return NGX_CONF_ERROR;
-    }
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+        return NGX_OK;
 
-    /*
-     * 由ngx_pcalloc设置：
-     *    conf->header.*.len     = 0
-     *    conf->header.*.data    = NULL
-     *    conf->footer.*.len     = 0
-     *    conf->footer.*.data    = NULL
-     *    conf->css_href.len     = 0
-     *    conf->css_href.data    = NULL
-     *    conf->time_format.len  = 0
-     *    conf->time_format.data = NULL
-     */
-    conf->enable         = NGX_CONF_UNSET;
-    conf->default_sort   = NGX_CONF_UNSET_UINT;
-    conf->case_sensitive = NGX_CONF_UNSET;
-    conf->dirs_first     = NGX_CONF_UNSET;
-    conf->localtime      = NGX_CONF_UNSET;
-    conf->exact_size     = NGX_CONF_UNSET;
-    conf->ignore         = NGX_CONF_UNSET_PTR;
-    conf->hide_symlinks  = NGX_CONF_UNSET;
-    conf->show_path      = NGX_CONF_UNSET;
-    conf->hide_parent    = NGX_CONF_UNSET;
-    conf->show_dot_files = NGX_CONF_UNSET;
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_fancyindex_module);
+    if (mcf == NULL || ngx_worker != 0)
+        return NGX_OK;
 
-    return conf;
-}
+    pidx = mcf->indexes.elts;
 
+    for (i = 0; i < mcf->indexes.nelts; i++) {
+        idx = pidx[i];
 
-/* 合并位置配置 */
-static char *
-ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
-{
-    ngx_http_fancyindex_loc_conf_t *prev = parent;
-    ngx_http_fancyindex_loc_conf_t *conf = child;
+        task = ngx_thread_task_alloc(cycle->pool,
+                                     sizeof(ngx_http_fancyindex_index_task_t));
+        if (task == NULL)
+            return NGX_ERROR;
 
-    (void) cf; /* 未使用 */
+        task->handler = ngx_http_fancyindex_index_thread;
+        task->event.handler = ngx_http_fancyindex_index_done;
+        task->event.data = idx;
+        task->event.log = cycle->log;
+        idx->task = task;
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 0);
-    ngx_conf_merge_uint_value(conf->default_sort, prev->default_sort, NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME);
-    ngx_conf_merge_value(conf->case_sensitive, prev->case_sensitive, 1);
-    ngx_conf_merge_value(conf->dirs_first, prev->dirs_first, 1);
-    ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
-    ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
-    ngx_conf_merge_value(conf->show_path, prev->show_path, 1);
-    ngx_conf_merge_value(conf->show_dot_files, prev->show_dot_files, 0);
+        t = task->ctx;
 
-    ngx_conf_merge_str_value(conf->header.path, prev->header.path, "");
-    ngx_conf_merge_str_value(conf->header.path, prev->header.local, "");
-    ngx_conf_merge_str_value(conf->footer.path, prev->footer.path, "");
-    ngx_conf_merge_str_value(conf->footer.path, prev->footer.local, "");
+        if (ngx_array_init(&t->changed, cycle->pool, 64, sizeof(int))
+            != NGX_OK
+            || ngx_array_init(&idx->changed, cycle->pool, 64, sizeof(int))
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
 
-    ngx_conf_merge_str_value(conf->css_href, prev->css_href, "");
-    ngx_conf_merge_str_value(conf->time_format, prev->time_format, "%Y-%m-%d %H:%M");
+        ngx_rbtree_init(&idx->watches, &idx->watches_sentinel,
+                        ngx_rbtree_insert_value);
+        idx->full = 1;
 
-    ngx_conf_merge_ptr_value(conf->ignore, prev->ignore, NULL);
-    ngx_conf_merge_value(conf->hide_symlinks, prev->hide_symlinks, 0);
-    ngx_conf_merge_value(conf->hide_parent, prev->hide_parent, 0);
+        idx->timer.handler = ngx_http_fancyindex_index_timer;
+        idx->timer.data = idx;
+        idx->timer.log = cycle->log;
+        idx->timer.cancelable = 1;
 
-    /* 确保在未提供自定义页眉的情况下没有禁用show_path指令 */
-    if (conf->show_path == 0 && conf->header.path.len == 0)
-    {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "FancyIndex : cannot set show_path to off without providing a custom header !");
-        return NGX_CONF_ERROR;
+#if (NGX_HAVE_INOTIFY)
+        fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if (fd == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "inotify_init1() failed, index \"%V\" will be "
+                          "rebuilt periodically", &idx->file);
+
+        } else if ((c = ngx_get_connection(fd, cycle->log)) == NULL) {
+            (void) close(fd);
+
+        } else {
+            c->data = idx;
+            c->log = cycle->log;
+            c->read->log = cycle->log;
+            c->read->handler = ngx_http_fancyindex_index_inotify_handler;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+                ngx_close_connection(c);
+            else
+                idx->inotify = c;
+        }
+#endif
+
+        /* 已有的索引文件立即可用，同时重建以反映停止期间的变化 */
+        ngx_add_timer(&idx->timer, 1);
     }
 
-    return NGX_CONF_OK;
+    return NGX_OK;
 }
 
 
-/* 设置忽略文件配置 */
-static char*
-ngx_http_fancyindex_ignore(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+ngx_http_fancyindex_index_exit_process(ngx_cycle_t *cycle)
 {
-    ngx_http_fancyindex_loc_conf_t *alcf = conf;
-    ngx_str_t *value;
+    ngx_uint_t                        i;
+    ngx_http_fancyindex_index_t     **pidx;
+    ngx_http_fancyindex_main_conf_t  *mcf;
 
-    (void) cmd; /* 未使用 */
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                              ngx_http_fancyindex_module);
+    if (mcf == NULL)
+        return;
 
-#if (NGX_PCRE)
-    ngx_uint_t          i;
-    ngx_regex_elt_t    *re;
-    ngx_regex_compile_t rc;
-    u_char              errstr[NGX_MAX_CONF_ERRSTR];
+    pidx = mcf->indexes.elts;
 
-    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
-        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
-        if (alcf->ignore == NULL) {
-            return NGX_CONF_ERROR;
+    for (i = 0; i < mcf->indexes.nelts; i++) {
+        if (pidx[i]->inotify != NULL) {
+            ngx_close_connection(pidx[i]->inotify);
+            pidx[i]->inotify = NULL;
+        }
+
+        if (pidx[i]->map != NULL) {
+            (void) munmap(pidx[i]->map, pidx[i]->size);
+            pidx[i]->map = NULL;
         }
     }
+}
 
-    value = cf->args->elts;
+#endif /* NGX_THREADS */
 
-    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
 
-    rc.err.data = errstr;
-    rc.err.len  = NGX_MAX_CONF_ERRSTR;
-    rc.pool     = cf->pool;
+static ngx_int_t
+ngx_http_fancyindex_init_process(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_INOTIFY)
+    int                fd;
+    ngx_uint_t         i;
+    ngx_shm_zone_t    *shm_zone;
+    ngx_list_part_t   *part;
+    ngx_connection_t  *c;
+#endif
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        re = ngx_array_push(alcf->ignore);
-        if (re == NULL) {
-            return NGX_CONF_ERROR;
-        }
+#if (NGX_THREADS)
+    if (ngx_http_fancyindex_index_init_process(cycle) != NGX_OK)
+        return NGX_ERROR;
+#endif
 
-        rc.pattern = value[i];
-        rc.options = NGX_REGEX_CASELESS;
+#if (NGX_HAVE_IO_URING)
+    if (ngx_http_fancyindex_uring_init_process(cycle) != NGX_OK)
+        return NGX_ERROR;
+#endif
 
-        if (ngx_regex_compile(&rc) != NGX_OK) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
-            return NGX_CONF_ERROR;
-        }
+#if (NGX_HTTP_FANCYINDEX_CHECKSUMS)
+    ngx_rbtree_init(&ngx_http_fancyindex_hashing,
+                    &ngx_http_fancyindex_hashing_sentinel,
+                    ngx_str_rbtree_insert_value);
+#endif
 
-        re->name  = value[i].data;
-        re->regex = rc.regex;
-    }
+#if (NGX_HAVE_INOTIFY)
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+        return NGX_OK;
 
-    return NGX_CONF_OK;
-#else /* !NGX_PCRE */
-    ngx_uint_t i;
-    ngx_str_t *str;
+    /* 只有配置了缓存区时才需要监视目录 */
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
 
-    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
-        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
-        if (alcf->ignore == NULL) {
-            return NGX_CONF_ERROR;
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                return NGX_OK;
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
         }
+
+        if (shm_zone[i].init == ngx_http_fancyindex_cache_init_zone)
+            break;
     }
 
-    value = cf->args->elts;
+    ngx_rbtree_init(&ngx_http_fancyindex_watch_wds,
+                    &ngx_http_fancyindex_watch_wds_sentinel,
+                    ngx_rbtree_insert_value);
+    ngx_rbtree_init(&ngx_http_fancyindex_watch_paths,
+                    &ngx_http_fancyindex_watch_paths_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&ngx_http_fancyindex_watch_queue);
+
+    fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "inotify_init1() failed, cached listings will be "
+                      "revalidated with " ngx_file_info_n);
+        return NGX_OK;
+    }
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        str = ngx_array_push(alcf->ignore);
-        if (str == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    c = ngx_get_connection(fd, cycle->log);
+    if (c == NULL) {
+        (void) close(fd);
+        return NGX_OK;
+    }
 
-        str->data = value[i].data;
-        str->len  = value[i].len;
+    c->log = cycle->log;
+    c->read->log = cycle->log;
+    c->read->handler = ngx_http_fancyindex_inotify_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_OK;
     }
 
-    return NGX_CONF_OK;
-#endif /* NGX_PCRE */
+    ngx_http_fancyindex_inotify = c;
+#else
+    (void) cycle; /* 未使用 */
+#endif
 
+    return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_fancyindex_init(ngx_conf_t *cf)
+static void
+ngx_http_fancyindex_exit_process(ngx_cycle_t *cycle)
 {
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
+    (void) cycle; /* 未使用 */
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
-
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
-    }
+#if (NGX_THREADS)
+    ngx_http_fancyindex_index_exit_process(cycle);
+#endif
 
-    *h = ngx_http_fancyindex_handler;
+#if (NGX_HAVE_IO_URING)
+    ngx_http_fancyindex_uring_exit_process();
+#endif
 
-    return NGX_OK;
+#if (NGX_HAVE_INOTIFY)
+    /* 关闭描述符时内核会移除所有监视 */
+    if (ngx_http_fancyindex_inotify != NULL) {
+        ngx_close_connection(ngx_http_fancyindex_inotify);
+        ngx_http_fancyindex_inotify = NULL;
+    }
+#endif
 }
 
 /* vim:et:sw=4:ts=4:
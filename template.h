@@ -87,6 +87,130 @@ static const u_char t07_list2[] = ""
 "</tbody>"
 "</table>"
 ;
+static const u_char t_render1[] = ""
+"<script id=\"fancyindex-render\""
+;
+static const u_char t_render2[] = ""
+">"
+"(function () {"
+"var s = document.getElementById(\"fancyindex-render\"),"
+"exact = s.getAttribute(\"data-exact-size\") == \"1\","
+"local = s.getAttribute(\"data-localtime\") == \"1\","
+"sha = s.getAttribute(\"data-checksums\") == \"1\","
+"fmt = s.getAttribute(\"data-time-format\"),"
+"tbody = document.getElementById(\"list\").tBodies[0],"
+"q = location.search.slice(1),"
+"c = /(?:^|&)C=([A-Z])/.exec(q),"
+"o = /(?:^|&)O=([AD])/.exec(q),"
+"sort = c ? \"?C=\" + c[1] + \"&O=\" + (o ? o[1] : \"A\") : \"\","
+"units = [\"EiB\", \"PiB\", \"TiB\", \"GiB\", \"MiB\", \"KiB\", \"B\"],"
+"sw = [\"周一\", \"周二\", \"周三\", \"周四\", \"周五\", \"周六\", \"周日\"],"
+"lw = [\"星期一\", \"星期二\", \"星期三\", \"星期四\", \"星期五\", \"星期六\", \"星期日\"],"
+"mn = [\"一月\", \"二月\", \"三月\", \"四月\", \"五月\", \"六月\","
+"  \"七月\", \"八月\", \"九月\", \"十月\", \"十一月\", \"十二月\"],"
+"x = new XMLHttpRequest();"
+"\n"
+"function td(cls, text) {"
+"var e = document.createElement(\"td\");"
+"if (cls) e.className = cls;"
+"if (text !== null) e.appendChild(document.createTextNode(text));"
+"return e;"
+"}"
+"\n"
+"function size(n) {"
+"var j = 0, m = Math.pow(2, 60);"
+"if (exact) return String(n);"
+"while (j < units.length - 1 && n < m) { m /= 1024; j++; }"
+"return j == units.length - 1 ? n + \" B\" : (n / m).toFixed(1) + \" \" + units[j];"
+"}"
+"\n"
+"function p(n, w, f) {"
+"n = String(n);"
+"while (n.length < w) n = f + n;"
+"return n;"
+"}"
+"\n"
+"function date(t) {"
+"var d = new Date(t * 1000), g = local ? \"get\" : \"getUTC\","
+"Y = d[g + \"FullYear\"](), m = d[g + \"Month\"]() + 1, D = d[g + \"Date\"](),"
+"H = d[g + \"Hours\"](), M = d[g + \"Minutes\"](), S = d[g + \"Seconds\"](),"
+"w = (d[g + \"Day\"]() + 6) % 7, h = H % 12 + 1, ap = H < 12 ? \"上午\" : \"下午\";"
+"\n"
+"return fmt.replace(/%(.?)/g, function (a, k) {"
+"switch (k) {"
+"case \"a\": return sw[w];"
+"case \"A\": return lw[w];"
+"case \"b\": case \"B\": return mn[m - 1];"
+"case \"d\": return p(D, 2, \"0\");"
+"case \"e\": return p(D, 2, \" \");"
+"case \"F\": return Y + \"-\" + p(m, 2, \"0\") + \"-\" + p(D, 2, \"0\");"
+"case \"H\": return p(H, 2, \"0\");"
+"case \"I\": return p(h, 2, \"0\");"
+"case \"k\": return p(H, 2, \" \");"
+"case \"l\": return p(h, 2, \" \");"
+"case \"m\": return p(m, 2, \"0\");"
+"case \"M\": return p(M, 2, \"0\");"
+"case \"p\": case \"P\": return ap;"
+"case \"r\": return p(h, 2, \"0\") + \":\" + p(M, 2, \"0\") + \":\" + p(S, 2, \"0\") + \" \" + ap;"
+"case \"R\": return p(H, 2, \"0\") + \":\" + p(M, 2, \"0\");"
+"case \"S\": return p(S, 2, \"0\");"
+"case \"T\": return p(H, 2, \"0\") + \":\" + p(M, 2, \"0\") + \":\" + p(S, 2, \"0\");"
+"case \"u\": return String(w + 1);"
+"case \"w\": return String(w);"
+"case \"y\": return p(Y % 100, 2, \"0\");"
+"case \"Y\": return p(Y, 4, \"0\");"
+"default: return k || \"%\";"
+"}"
+"});"
+"}"
+"\n"
+"function render(list) {"
+"var f = document.createDocumentFragment(), i, e, tr, a, n, t, dir;"
+"\n"
+"for (i = 0; i < list.length; i++) {"
+"e = list[i];"
+"dir = e.type == \"directory\";"
+"n = e.name + (dir ? \"/\" : \"\");"
+"\n"
+"a = document.createElement(\"a\");"
+"a.href = encodeURIComponent(e.name) + (dir ? \"/\" + sort : \"\");"
+"a.title = e.name;"
+"a.appendChild(document.createTextNode(n));"
+"\n"
+"t = td(\"link\", null);"
+"t.colSpan = 2;"
+"t.appendChild(a);"
+"\n"
+"tr = document.createElement(\"tr\");"
+"tr.appendChild(t);"
+"\n"
+"t = td(\"size\", dir && e.files === undefined ? \"-\" : size(e.size));"
+"if (e.files !== undefined) t.title = e.files + \" files\";"
+"tr.appendChild(t);"
+"\n"
+"tr.appendChild(td(\"date\", date(e.mtime)));"
+"if (sha) tr.appendChild(td(\"sha256\", e.sha256 || \"\"));"
+"\n"
+"f.appendChild(tr);"
+"}"
+"\n"
+"tbody.appendChild(f);"
+"}"
+"\n"
+"x.onload = function () {"
+"if (x.status == 200) {"
+"render(JSON.parse(x.responseText).entries);"
+"} else {"
+"tbody.appendChild(document.createElement(\"tr\"))"
+" .appendChild(td(null, x.status + \" \" + x.statusText)).colSpan = 4;"
+"}"
+"};"
+"\n"
+"x.open(\"GET\", \"?\" + (q ? q + \"&\" : \"\") + \"format=json\");"
+"x.send();"
+"})();"
+"</script>"
+;
 static const u_char t08_foot1[] = ""
 "</body>"
 "</html>"
@@ -100,5 +224,7 @@ static const u_char t08_foot1[] = ""
 	+ nfi_sizeof_ssz(t06_list1) \
 	+ nfi_sizeof_ssz(t_parentdir_entry) \
 	+ nfi_sizeof_ssz(t07_list2) \
+	+ nfi_sizeof_ssz(t_render1) \
+	+ nfi_sizeof_ssz(t_render2) \
 	+ nfi_sizeof_ssz(t08_foot1) \
 	)